@@ -49,15 +49,33 @@
 #define PLY_BLITTLE		2
 #define PLY_BBIG		3
 
+// Allocation of the vertices and faces of the model
+#define MODEL_NEW		0	/* new[] */
+#define MODEL_MALLOC	1	/* MyMalloc */
+#define MODEL_CALLER	2	/* owned by the caller */
+#define MODEL_ARENA		3	/* in the arena of the job */
+
+// Implicit grid flags
+#define GRID_NODATA		1	/* the point has no data */
+#define GRID_DIAG		2	/* the cell is split by the diagonal from its top-right point */
+
 //Mathematical Constants
 #define FLT_MAX         3.402823466e+38F
 #define FLT_EPSILON     1.192092896e-07F
+#define PI              3.14159265358979323846
 
 // New type definitions
 typedef float FVECTOR3[3];
 typedef int NVECTOR3[3];
 typedef int NVECTOR2[2];
 
+// Compressed ring list: the neighbours of element i are stored in
+// pnIndex[pnStart[i]] ... pnIndex[pnStart[i+1]-1]
+struct RingList {
+    int* pnStart;   /* offsets into pnIndex, one per element plus one */
+    int* pnIndex;   /* neighbour indices of all elements */
+};
+
 // Macros Definitions
 #define FMAX(x,y) ((x)>(y) ? (x) : (y))
 #define VEC3_ZERO(vec) { (vec)[0]=(vec)[1]=(vec)[2]=0; }
@@ -83,6 +101,7 @@ typedef int NVECTOR2[2];
 				  (a)[2] = (b)[2] op1 (c)[2] op2 (d)[2]; }
 #define VEC3_ASN_OP(a,op,b)      {a[0] op b[0]; a[1] op b[1]; a[2] op b[2];}
 #define DOTPROD3(a, b)		 ((a)[0]*(b)[0] + (a)[1]*(b)[1] + (a)[2]*(b)[2])
+#define RING_SIZE(ring,i)       ((ring).pnStart[(i)+1]-(ring).pnStart[i])
 #define CROSSPROD3(a,b,c)       {(a)[0]=(b)[1]*(c)[2]-(b)[2]*(c)[1]; \
                                  (a)[1]=(b)[2]*(c)[0]-(b)[0]*(c)[2]; \
                                  (a)[2]=(b)[0]*(c)[1]-(b)[1]*(c)[0];}
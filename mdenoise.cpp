@@ -30,10 +30,76 @@
  *      -o char[]  Output file
  *      -a         Adds edges and vertices to generate high-quality triangle mesh.
  *                 Only function when the input is .xyz file.
+ *      -y int     Tiles per side: .xyz points are triangulated as int x int tiles in parallel,
+ *                 each with a border of neighbouring points (Default: 1, in one piece)
  *      -z         Only z-direction position is updated.
+ *      -c float   Normal updating stops when no face normal turns by more than this many
+ *                 degrees in an iteration (Default: all iterations are run)
+ *      -d float   Vertex updating stops when no vertex moves by more than this distance
+ *                 in an iteration (Default: all iterations are run)
+ *      -w a[,d]   Worklist mode: a face normal is filtered again only while a neighbour
+ *                 turns by more than a degrees, and a vertex is moved again only while a
+ *                 neighbour moves by more than d (Default: all elements, every iteration)
+ *      -m int     Multiresolution: the normals are first filtered on int coarser models,
+ *                 each clustering the vertices of the last in cubes of twice its mean
+ *                 edge length; a finer level runs a quarter of the n1 passes from the
+ *                 normals of the coarser one (Default: 0, the model only)
+ *      -l char[]  Previous output: incremental mode, only the vertices within n1+n2+2 rings
+ *                 of the changed ones are computed again. Changed are the vertices in the
+ *                 -k box and, for .asc files, the points whose nodata state differs
+ *      -k list    Box of the changed vertices, xmin,ymin,xmax,ymax[,zmin,zmax]; map
+ *                 coordinates of the cell centres for .asc files
+ *      -u         Vertices are updated simultaneously (Jacobi), which gives the same
+ *                 result for any number of threads (Default: in place, Gauss-Seidel)
+ *      -s         Structure-of-arrays layout with SIMD kernels chosen for the CPU
+ *                 (AVX2, NEON); vertex updating uses them together with -u
+ *      -r         Reorders vertices and faces along a Morton curve for cache locality;
+ *                 the output keeps the input order
+ *      -b int     Rows per band: .asc grids are read, denoised and written band by
+ *                 band, each with a halo of n1+n2+2 rows; the next band is read
+ *                 and the last written while one is denoised (Default: whole grid)
+ *      -g         Implicit grid engine for .asc files: only heights, nodata flags and
+ *                 cell diagonals are stored, neighbourhoods follow from (row, col)
+ *      -q         Compact storage for the grid engine, implies -g: face normals are kept
+ *                 in a 2x16-bit octahedral encoding, a third of their float size
+ *      -x         GPU backend (builds with MDENOISE_OPENCL): all normal and vertex passes
+ *                 run on the device, the vertices updated simultaneously as with -u
+ *      -h         Huge pages for the vertex, face, normal and ring buffers of a job,
+ *                 which are carved from one block sized from the model (Default: off)
+ *      -j int     Number of worker threads, Default value: 1
+ *      -p int     Decimals of the output coordinates, Default value: 6; a negative value
+ *                 writes the shortest decimals that read back to the same number
+ *      -f char[]  Output format, ascii or binary (little-endian .ply, .stl). Default: binary
+ *                 for .stl files, ascii for the others
+ *      --cache    Binary cache: the scaled model, its normals and neighbourhoods are saved as
+ *                 <input>.mdc and mapped by later runs on the same input and options
+ *      --cache-dir char[]
+ *                 Directory of the cache files, implies --cache (Default: next to the input)
+ *      --stats char[]
+ *                 Run report: wall and CPU seconds and peak memory of each phase, mesh
+ *                 counts, ring sizes, iterations and bytes read and written, as JSON
+ *      --mosaic files
+ *                 Mosaic of .asc tiles, given as with --batch: each grid is denoised
+ *                 with a halo of n1+n2+2 cells read from the tiles around it, and its
+ *                 own cells written, so that the tiles match along their edges up to
+ *                 the rounding of their own scaling
+ *      --batch files
+ *                 Batch mode: the files, the files matching a quoted pattern such as
+ *                 "*.asc", or the files listed one per line in @list are denoised
+ *                 once each; one tile is read while the last is filtered and the one
+ *                 before it written. Output names are as without -o; a pattern skips
+ *                 files named as outputs, such as <name>_V_0.40_20_50.asc
+ *      --out-dir char[]
+ *                 Directory of the batch outputs (Default: next to each input)
+ *      --bench list
+ *                 Benchmark: synthetic noisy meshes and grids of about this many faces are
+ *                 written, read, denoised and saved, timing each phase on the wall clock
+ *                 with its faces per second; no input file is needed
+ *      Lists of up to 16 values such as -t 0.3,0.4 -n 5,10,20 run a parameter sweep: the model
+ *      is read once and each combination is saved as <output>_V_0.40_20_50 and so on
  *
  * Supported input type: .gts, .obj, .off, .ply, .ply2, .smf, .stl, .wrl, .xyz, and .asc
- * Supported output type: .obj, .off, .ply, .ply2, .xyz, and .asc
+ * Supported output type: .obj, .off, .ply, .ply2, .stl, .xyz, and .asc
  * Default file extension: .off
  *
  * Examples:
@@ -43,6 +109,10 @@
  * Mdenoise -i FandiskNI02-05 -o FandiskDN.ply
  * Mdenoise -i -i Terrain.xyz -o TerrainP -z -n 1
  * Mdenoise -i my_dem_utm.asc -o my_dem_utmP -n 4
+ * Mdenoise -i FandiskNI02-05 -t 0.3,0.5 -n 5,10,20 -o FandiskDN
+ * Mdenoise --batch "*.asc" --out-dir denoised -n 4 -j 8
+ * Mdenoise -i my_dem_utm.asc -o my_dem_utmP -n 20 -m 2 -u
+ * Mdenoise --bench 1000000,10000000 -j 8
  *
  * Note: For the .asc file, the program always sets the switch -z on, whether you have 
  * put it on the command line or not. If there is a .prj file with the same name as the 
@@ -70,7 +140,12 @@
  * }
  *
  * to compile on unix platforms:
- *     g++ -o mdenoise mdenoise.cpp triangle.c
+ *     g++ -O2 -pthread -o mdenoise mdenoise.cpp triangle.c
+ * and with the OpenCL backend:
+ *     g++ -O2 -pthread -DMDENOISE_OPENCL -o mdenoise mdenoise.cpp triangle.c -lOpenCL
+ * and with MPI, where the processes split an .asc grid into bands of rows:
+ *     mpic++ -O2 -pthread -DMDENOISE_MPI -o mdenoise mdenoise.cpp triangle.c
+ *     mpirun -np 16 mdenoise -i big_dem.asc -u -o big_dem_d.asc
  * also lines 66 & 112 of mdenoise.cpp should be commented out on unix platforms
  */
 
@@ -79,6 +154,41 @@
 #include "mdenoise.h"
 #include "triangle.h"
 #include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <glob.h>
+#endif
+#ifdef MDENOISE_MPI
+#define OMPI_SKIP_MPICXX 1  // the C interface only
+#define MPICH_SKIP_MPICXX 1
+#include <mpi.h>
+#endif
+#ifdef MDENOISE_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MDENOISE_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define MDENOISE_NEON 1
+#include <arm_neon.h>
+#endif
 //#include <new.h> // This line should be commented out on unix
 
 //functions deal with memory allocation errors.
@@ -109,6 +219,71 @@ void *MyRealloc(void *memblock, size_t size)
 	return(memblock);
 }
 
+// Sets up an arena of nSize bytes. With bHuge the block is mapped with huge
+// pages: reserved ones if the system has them, else transparent ones.
+void ArenaInit(struct Arena* arena, size_t nSize, bool bHuge)
+{
+    arena->nUsed = 0;
+    arena->bMapped = FALSE;
+#ifdef __linux__
+    if (bHuge)
+    {
+        void *p;
+        size_t nMap = (nSize+ARENA_HUGE_PAGE-1)/ARENA_HUGE_PAGE*ARENA_HUGE_PAGE;
+
+        p = mmap(NULL, nMap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            p = mmap(NULL, nMap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED)
+                madvise(p, nMap, MADV_HUGEPAGE);
+        }
+        if (p != MAP_FAILED)
+        {
+            arena->pBase = (char *)p;
+            arena->nSize = nMap;
+            arena->bMapped = TRUE;
+            return;
+        }
+    }
+#else
+    (void)bHuge;
+#endif
+    arena->pBase = (char *)MyMalloc(nSize+ARENA_ALIGN);
+    arena->nSize = nSize+ARENA_ALIGN;
+}
+
+void* ArenaAlloc(struct Arena* arena, size_t nSize)
+{
+    size_t nStart;
+
+    if (arena->pBase == NULL)
+        return MyMalloc(nSize);
+    nStart = (((size_t)arena->pBase+arena->nUsed+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))-(size_t)arena->pBase;
+    if (nStart+nSize > arena->nSize)
+        return MyMalloc(nSize);
+    arena->nUsed = nStart+nSize;
+    return arena->pBase+nStart;
+}
+
+void ArenaFree(struct Arena* arena, void* p)
+{
+    if ((arena->pBase != NULL) && ((char *)p >= arena->pBase) && ((char *)p < arena->pBase+arena->nSize))
+        return;
+    free(p);
+}
+
+void ArenaRelease(struct Arena* arena)
+{
+#ifdef __linux__
+    if (arena->bMapped)
+        munmap(arena->pBase, arena->nSize);
+    else
+#endif
+        free(arena->pBase);
+    memset(arena, 0, sizeof(struct Arena));
+}
+
 // Define a function to be called if new fails to allocate memory.
 int MyNewHandler( size_t size ) // This function can be comment out on unix
 {
@@ -117,2012 +292,7852 @@ int MyNewHandler( size_t size ) // This function can be comment out on unix
 	exit(1);
 }
 
-int main(int argc, char* argv[])
+// Pool of worker threads used by RunParallel. The range is split into one
+// contiguous part per thread, so every element is always handled by the
+// same code path whatever the number of threads. A pool serves one caller
+// at a time.
+class CThreadPool
 {
-    clock_t start, finish;
-    double  duration;
-    int filename_i=0;
-    int filename_o=0;
-	struct ESRIHeader eheader;
-   
-    //Initialisation;
-    //_set_new_handler( MyNewHandler );//** This line should be commented out on unix
-    m_bNeighbourCV = TRUE;
-    m_fSigma = 0.4;
-    m_nIterations = 20;
-    m_nVIterations = 50;
-    m_bAddVertices = FALSE;
-	m_bZOnly = FALSE;
-
-    /* parse command line */
-    for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
-            switch(argv[i][1]) {
-                case 'e':
-                case 'E':
-                    m_bNeighbourCV = FALSE;
-                    break;
-                case 't':
-                case 'T':
-                    i++;
-                    sscanf(argv[i],"%f",&m_fSigma);
-                    if ((m_fSigma<0)||(m_fSigma>1))
-                    {
-                        printf("Warning:\nThe threshold must be within (0,1)!\n");
-                        printf("The default value [0.4] is used in the following computation!\n");
-                        m_fSigma = 0.4;
-                    }
-                    break;
-                case 'n':
-                case 'N':
-                    i++;
-                    sscanf(argv[i],"%d",&m_nIterations);
-                    if (m_nIterations<1)
-                    {
-                        printf("Warning:\nThe number of iteration for normal updating must be greater than 1!\n");
-                        printf("The default value 20 is used in the following computation!\n");
-                        m_nIterations = 20;
-                    }
-                    break;
-                case 'v':
-                case 'V':
-                    i++;
-                    sscanf(argv[i],"%d",&m_nVIterations);
-                    if (m_nVIterations<1)
-                    {
-                        printf("Warning:\nThe number of iteration for vertex updating must be greater than 1!\n");
-                        printf("The default value 50 is used in the following computation!\n");
-                        m_nVIterations = 50;
-                    }
-                    break;
-                case 'i':
-                case 'I':
-                    i++;
-                    filename_i = i;
-                    break;
-                case 'o':
-                case 'O':
-                    i++;
-                    filename_o = i;
-                    break;
-                case 'a':
-                case 'A':
-                    m_bAddVertices = TRUE;
-                    break;
-                case 'z':
-                case 'Z':
-                    m_bZOnly = TRUE;
-                    break;
-                default:
-                    printf("unknown option %s\n",argv[i]);
-                    options(argv[0]);
-            }
-        }
-        else {
-            printf("unknown option %s\n",argv[i]);
-            options(argv[0]);
-        }
-    }
-
-	
-	/////////////////////////////////////////////////////////////////////////////////
-//	filename_i = 2;
-///////////////////////////////////////////////////////////////////////////////////
-    if (filename_i == 0) {
-        printf("Error: input filename required\n");
-        options(argv[0]);
-    }
-	/////////////////////////////////////////////////////////////////////
-
-    //Read file
-    int fileext_i;
-    int fileext_o;
-    char filename[201];
-    char pathname[206];
-    char pathname_i[206];  // Only for copy prj file of .acs file
-    char pathname_o[206];  // Only for copy prj file of .acs file
-    int filelen = strlen(argv[filename_i]);
-    strcpy(pathname,argv[filename_i]);
-//    int filelen = 14;
-//	strcpy(pathname,"m1_dem_utm.asc");
-//	strcpy(pathname,"localities.xyz");
-    pathname[filelen]='\0';
-    fileext_i = FindInputExt(pathname);
-    fileext_o = fileext_i;
-    if (fileext_i==FILE_PLY2)
-    {
-        strncpy(filename,pathname,filelen-5);
-        filename[filelen-5]='\0';
-    }
-    else
+public:
+    CThreadPool() : m_pFunc(NULL), m_nGeneration(0), m_nPending(0), m_bQuit(FALSE) {}
+    ~CThreadPool();
+    void Run(int nParts, int nBegin, int nEnd, const std::function<void(int, int)>& func);
+
+private:
+    void Worker(int nPart);
+    void RunPart(int nPart);
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cvStart;
+    std::condition_variable m_cvDone;
+    const std::function<void(int, int)>* m_pFunc;
+    int m_nBegin, m_nEnd, m_nParts;
+    int m_nGeneration;
+    int m_nPending;
+    bool m_bQuit;
+};
+
+// The pools not in use. A caller takes one, or makes one when all are busy,
+// so that denoisers on several threads run their parallel parts side by side.
+static struct ThreadPools {
+    std::mutex mutex;
+    std::vector<CThreadPool*> vFree;
+
+    ~ThreadPools()
     {
-        strncpy(filename,pathname,filelen-4);
-        filename[filelen-4]='\0';
+        for (size_t i=0; i<vFree.size(); i++)
+            delete vFree[i];
     }
+} g_ThreadPools;
+static thread_local bool g_bInWorker = FALSE;
 
-    if (fileext_i==FILE_ESRI)
+CThreadPool::~CThreadPool()
+{
     {
-		strcpy(pathname_i,filename);
-		strcat(pathname_i,".prj");
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bQuit = TRUE;
     }
+    m_cvStart.notify_all();
+    for (size_t i=0; i<m_threads.size(); i++)
+        m_threads[i].join();
+}
 
-    printf("Input File: %s\n",pathname);
-    FILE *fp = fopen(pathname, "rb");
-    if (!fp) {
-        printf("Can't open file to load!\n");
-        return 0;
-    }
-    else
+void CThreadPool::RunPart(int nPart)
+{
+    long long n = m_nEnd - m_nBegin;
+    int nFrom = m_nBegin + (int)(n*nPart/m_nParts);
+    int nTo = m_nBegin + (int)(n*(nPart+1)/m_nParts);
+    if (nFrom<nTo)
+        (*m_pFunc)(nFrom, nTo);
+}
+
+void CThreadPool::Worker(int nPart)
+{
+    int nGeneration = 0;
+
+    g_bInWorker = TRUE;
+    while (TRUE)
     {
-        if (m_bNeighbourCV)
         {
-            printf("Neighbourhood: Common Vertex\n");
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cvStart.wait(lock, [&]{ return m_bQuit || m_nGeneration != nGeneration; });
+            if (m_bQuit)
+                return;
+            nGeneration = m_nGeneration;
+            if (nPart >= m_nParts)
+                continue;
         }
-        else
+        RunPart(nPart);
         {
-            printf("Neighbourhood: Common Edge\n");
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_nPending == 0)
+                m_cvDone.notify_one();
         }
-        printf("Threshold: %f\n",m_fSigma);
-        printf("n1: %d\n",m_nIterations);
-        printf("n2: %d\n",m_nVIterations);
+    }
+}
 
-        start = clock();
-        printf("Read Model...");
-        m_nNumFace = ReadData(fp, fileext_i,&eheader);
-        finish = clock();
-        duration = (double)(finish - start) / CLOCKS_PER_SEC;
-        printf( "%10.3f seconds\n", duration );
+void CThreadPool::Run(int nParts, int nBegin, int nEnd, const std::function<void(int, int)>& func)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while ((int)m_threads.size() < nParts-1)
+            m_threads.push_back(std::thread(&CThreadPool::Worker, this, (int)m_threads.size()+1));
+        m_pFunc = &func;
+        m_nBegin = nBegin;
+        m_nEnd = nEnd;
+        m_nParts = nParts;
+        m_nPending = nParts-1;
+        m_nGeneration++;
     }
-    fclose(fp);
+    m_cvStart.notify_all();
+    RunPart(0);
 
-    //Denoising Model...
-    start = clock();
-    printf("Denoising Model...");
-    MeshDenoise(m_bNeighbourCV, m_fSigma, m_nIterations, m_nVIterations);
-    finish = clock();
-    duration = (double)(finish - start) / CLOCKS_PER_SEC;
-    printf( "%10.3f seconds\n", duration );
+    // barrier: wait until every part has finished
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cvDone.wait(lock, [&]{ return m_nPending == 0; });
+}
 
-    //Saving Model...
-    start = clock();
-    printf("Saving Model...");
+// Calls func(from, to) on consecutive parts of [nBegin, nEnd) using nThreads
+// threads, and returns when all parts are done. Calls from several threads
+// run at the same time, each on a pool of its own.
+void RunParallel(int nThreads, int nBegin, int nEnd, const std::function<void(int, int)>& func)
+{
+    int nParts = nThreads;
 
-    char szFileName[206];
-    if (filename_o == 0)
+    if (nParts > nEnd-nBegin)
+        nParts = nEnd-nBegin;
+    if ((nParts <= 1) || g_bInWorker)
     {
-        strcpy(pathname,filename);   
-        if (m_bNeighbourCV)
-            strcat(pathname,"_V_");
-        else
-            strcat(pathname,"_E_");
-        sprintf(szFileName,"%4.2f_",m_fSigma);
-        strcat(pathname,szFileName);
-        sprintf(szFileName,"%d_",m_nIterations);
-        strcat(pathname,szFileName);
-        sprintf(szFileName,"%d",m_nVIterations);
-        strcat(pathname,szFileName);
-
-        switch (fileext_i)
+        if (nBegin<nEnd)
+            func(nBegin, nEnd);
+        return;
+    }
+    CThreadPool* pPool = NULL;
+    {
+        std::lock_guard<std::mutex> lock(g_ThreadPools.mutex);
+        if (!g_ThreadPools.vFree.empty())
         {
-/*        case FILE_GTS:
-            strcat(pathname,".gts");
-            break;
-
-*/        case FILE_OBJ:
-            strcat(pathname,".obj");
-            break;
+            pPool = g_ThreadPools.vFree.back();
+            g_ThreadPools.vFree.pop_back();
+        }
+    }
+    if (pPool == NULL)
+        pPool = new CThreadPool;
+    pPool->Run(nParts, nBegin, nEnd, func);
+    std::lock_guard<std::mutex> lock(g_ThreadPools.mutex);
+    g_ThreadPools.vFree.push_back(pPool);
+}
 
-        case FILE_OFF:
-            strcat(pathname,".off");
-            break;
+void CDenoiser::ParallelFor(int nBegin, int nEnd, const std::function<void(int, int)>& func)
+{
+    RunParallel(m_nThreads, nBegin, nEnd, func);
+}
 
-        case FILE_PLY:
-            strcat(pathname,".ply");
-            break;
+// The largest of the values that func returns for the parts of [nBegin, nEnd).
+float CDenoiser::ParallelMax(int nBegin, int nEnd, const std::function<float(int, int)>& func)
+{
+    std::mutex mutexMax;
+    float fMax = 0;
+
+    ParallelFor(nBegin, nEnd, [&](int nFrom, int nTo) {
+        float f = func(nFrom, nTo);
+        std::lock_guard<std::mutex> lock(mutexMax);
+        if (f > fMax)
+            fMax = f;
+    });
+    return fMax;
+}
 
-        case FILE_PLY2:
-            strcat(pathname,".ply2");
-            break;
+CDenoiser::CDenoiser()
+{
+    m_nNumVertex = m_nNumFace = 0;
+    m_pf3Vertex = m_pf3FaceNormal = m_pf3VertexNormal = NULL;
+    m_pn3Face = NULL;
+    memset(&m_VRing1V, 0, sizeof(RingList));
+    memset(&m_VRing1T, 0, sizeof(RingList));
+    memset(&m_TRing1TCV, 0, sizeof(RingList));
+    memset(&m_TRing1TCE, 0, sizeof(RingList));
+    m_nNumEdge = m_nNumBoundaryEdge = m_nNumNonManifoldEdge = 0;
+    m_pnEdgeVertex = NULL;
+    m_pn3FaceEdge = NULL;
+    memset(&m_EdgeT, 0, sizeof(RingList));
+    m_nModelAlloc = MODEL_NEW;
+    m_fScale = 1.0;
+    m_f3Centre[0] = m_f3Centre[1] = m_f3Centre[2] = 0.0;
+    m_nNumVertexP = m_nNumFaceP = 0;
+    m_pf3VertexP = m_pf3FaceNormalP = m_pf3VertexNormalP = NULL;
+    m_pn3FaceP = NULL;
+    m_pnVertexOrder = m_pnFaceOrder = NULL;
+    memset(&m_Grid, 0, sizeof(m_Grid));
 
-/*        case FILE_SMF:
-            strcat(pathname,".smf");
-            break;
+    m_bNeighbourCV = TRUE;
+    m_fSigma = 0.4;
+    m_nIterations = 20;
+    m_nVIterations = 50;
+    m_bAddVertices = FALSE;
+    m_nTiles = 1;
+	m_bZOnly = FALSE;
+    m_bJacobi = FALSE;
+    m_bSoA = FALSE;
+    m_bReorder = FALSE;
+    m_nBandRows = 0;
+    m_nMosaicHalo = 0;
+    memset(&m_Mosaic, 0, sizeof(m_Mosaic));
+    m_nMosaicTiles = 0;
+    m_nDomainFirst = m_nDomainLast = m_nDomainWin = 0;
+    memset(&m_Domain, 0, sizeof(m_Domain));
+    m_bGrid = FALSE;
+    m_bCompact = FALSE;
+    m_nThreads = 1;
+    m_bGpu = FALSE;
+    m_pGpu = NULL;
+    memset(&m_Arena, 0, sizeof(m_Arena));
+    m_bHugePages = FALSE;
+    m_bKeepArena = FALSE;
+    m_nCacheSections = 0;
+    m_nPrecision = 6;
+    m_nOutFormat = 0;
+    m_bKeepNormals = FALSE;
+    m_pf3KeptNormal = NULL;
+    m_nKeptIterations = -1;
+    m_bKeptConverged = FALSE;
+    m_fNormalTol = m_fVertexTol = -1;
+    m_nNormalPasses = m_nVertexPasses = 0;
+    m_bNormalConverged = FALSE;
+    m_fWorkNormalTol = m_fWorkVertexTol = -1;
+    m_nLevels = 0;
+    m_bCoarseModel = FALSE;
+    m_nNormalUpdates = m_nVertexUpdates = 0;
+    m_dRingTime = m_dNormalTime = m_dVertexTime = 0;
+}
 
-        case FILE_STL:
-            strcat(pathname,".stl");
-            break;
+CDenoiser::~CDenoiser()
+{
+    m_bKeepArena = FALSE;
+    FreeModel();
+    FreeGrid();
+    for (size_t n=0; n<m_vMosaic.size(); n++)
+        free(m_vMosaic[n]);
+#ifdef MDENOISE_OPENCL
+    GpuClose(m_pGpu);
+#endif
+}
 
-        case FILE_WRL:
-            strcat(pathname,".wrl");
-            break;
-*/
-        case FILE_XYZ:
-            strcat(pathname,".xyz");
-            break;
+void CDenoiser::SetParams(const DenoiseParams& params)
+{
+    m_bNeighbourCV = params.bNeighbourCV;
+    m_fSigma = params.fSigma;
+    m_nIterations = params.nIterations;
+    m_nVIterations = params.nVIterations;
+    m_bZOnly = params.bZOnly;
+    m_bJacobi = params.bJacobi;
+    m_bSoA = params.bSoA;
+    m_nThreads = params.nThreads;
+    m_fNormalTol = params.fNormalTol;
+    m_fVertexTol = params.fVertexTol;
+    m_fWorkNormalTol = params.fWorkNormalTol;
+    m_fWorkVertexTol = params.fWorkVertexTol;
+    m_bHugePages = params.bHugePages;
+    m_bCompact = params.bCompact;
+    m_bGpu = params.bGpu;
+    m_nLevels = params.nLevels;
+}
 
-		case FILE_ESRI:
-			strcpy(pathname_o,pathname);
-			strcat(pathname_o,".prj");
-			strcat(pathname,".asc");
-            break;
+// Denoises the mesh in the caller's arrays, which are not copied: the
+// vertices are scaled in place while the job runs and then overwritten with
+// the denoised positions. Returns the number of faces.
+int CDenoiser::Denoise(FVECTOR3* pf3Vertex, int nNumVertex, NVECTOR3* pn3Face, int nNumFace, const DenoiseParams& params)
+{
+    FreeModel();
+    SetParams(params);
+    m_bGrid = FALSE;
+    m_nModelAlloc = MODEL_CALLER;
+    m_pf3Vertex = pf3Vertex;
+    m_nNumVertex = nNumVertex;
+    m_pn3Face = pn3Face;
+    m_nNumFace = nNumFace;
+    if ((m_nNumVertex==0)||(m_nNumFace==0))
+        return 0;
 
-		default:
-            fileext_o = FILE_OFF;
-            strcat(pathname,".off");
-        }
+    InitModel();
+    MeshDenoise(m_bNeighbourCV, m_fSigma, m_nIterations, m_nVIterations);
+    for (int i=0;i<m_nNumVertexP;i++)
+    {
+        VEC3_V_OP_V_OP_S(pf3Vertex[i],m_f3Centre,+, m_pf3VertexP[i],*, m_fScale);
     }
-    else
-    {   
-        strcpy(szFileName,argv[filename_o]);
-        filelen = strlen(argv[filename_o]);
-        szFileName[filelen]='\0';
-        fileext_o = FindOutputExt(szFileName);
-        if (fileext_o==FILE_DFLT)
-        {
-            fileext_o = fileext_i;
-            switch (fileext_i)
-            {
-    /*        case FILE_GTS:
-                strcat(szFileName,".gts");
-                break;
+    return m_nNumFace;
+}
 
-*/            case FILE_OBJ:
-                strcat(szFileName,".obj");
-                break;
+// Denoises the header->nrows by header->ncols heights in pdValue in place with
+// the implicit grid engine; nodata values are left alone. Returns the number
+// of faces.
+int CDenoiser::DenoiseGrid(double* pdValue, struct ESRIHeader* header, const DenoiseParams& params)
+{
+    int k, nTotal = header->nrows*header->ncols;
 
-            case FILE_OFF:
-                strcat(szFileName,".off");
-                break;
-
-            case FILE_PLY:
-                strcat(szFileName,".ply");
-                break;
-   
-            case FILE_PLY2:
-                strcat(szFileName,".ply2");
-                break;
+    FreeGrid();
+    SetParams(params);
+    m_bGrid = TRUE;
+    BuildGrid(header, pdValue, 0);
+    MeshDenoise(m_bNeighbourCV, m_fSigma, m_nIterations, m_nVIterations);
+    for (k=0; k<nTotal; k++)
+    {
+        if (!(m_Grid.pnFlag[k] & GRID_NODATA))
+            pdValue[k] = m_f3Centre[2]+m_Grid.pfZ[k]*m_fScale;
+    }
+    return m_nNumFace;
+}
 
-    /*        case FILE_SMF:
-                strcat(szFileName,".smf");
-                break;
+// Benchmark. The synthetic surface is a ridge with a step and a round hill
+// on the unit square, and the noise comes from a fixed generator, so that a
+// size gives the same model on every run and machine.
+double WallClock(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-            case FILE_STL:
-                strcat(szFileName,".stl");
-                break;
+static double BenchHeight(double x, double y)
+{
+    double z = 0.3*(0.5-fabs(x-0.5));
+    if (y>0.6)
+        z += 0.1;
+    z += 0.15*exp(-((x-0.3)*(x-0.3)+(y-0.3)*(y-0.3))/0.01);
+    return z;
+}
 
-            case FILE_WRL:
-                strcat(szFileName,".wrl");
-                break;
-    */
-            case FILE_XYZ:
-                strcat(szFileName,".xyz");
-                break;
+// uniform in [-1, 1)
+static double BenchNoise(unsigned long long* pnState)
+{
+    *pnState = *pnState*6364136223846793005ULL+1442695040888963407ULL;
+    return (double)(*pnState>>11)/(double)(1ULL<<52)-1;
+}
 
-			case FILE_ESRI:
-				strcpy(pathname_o,szFileName);
-				strcat(pathname_o,".prj");
-	            strcat(szFileName,".asc");
-		        break;
+// Writes an .off file of the noisy surface sampled at nSide x nSide points,
+// with noise of a third of the spacing in all three coordinates.
+static void BenchWriteMesh(FILE* fp, int nSide)
+{
+    int i, j;
+    double h = 1.0/(nSide-1);
+    unsigned long long nState = 1;
+    FVECTOR3 v;
+    NVECTOR3 f;
+    struct OutBuffer ob;
 
-			default:
-				fileext_o = FILE_OFF;
-				strcat(szFileName,".off");
-			}
-		} else if (fileext_o ==FILE_ESRI){
-			strcpy(pathname_o,szFileName);
-			pathname_o[filelen-4]='\0';
-			strcat(pathname_o,".prj");
-		}
+    fprintf(fp,"OFF\n");
+    fprintf(fp,"%d %d %d\n",nSide*nSide,2*(nSide-1)*(nSide-1),0);
+    OutOpen(&ob, fp, 6);
+    for (i=0; i<nSide; i++)
+        for (j=0; j<nSide; j++)
+        {
+            v[0] = (float)(j*h+h/3*BenchNoise(&nState));
+            v[1] = (float)(i*h+h/3*BenchNoise(&nState));
+            v[2] = (float)(BenchHeight(j*h, i*h)+h/3*BenchNoise(&nState));
+            OutVertex(&ob, v);
+        }
+    for (i=0; i<nSide-1; i++)
+        for (j=0; j<nSide-1; j++)
+        {
+            f[0] = i*nSide+j;
+            f[1] = f[0]+1;
+            f[2] = f[0]+nSide+1;
+            OutFace(&ob, "3 ", f, 0);
+            f[1] = f[2];
+            f[2] = f[0]+nSide;
+            OutFace(&ob, "3 ", f, 0);
+        }
+    OutClose(&ob);
+}
 
-		if (!strcicmp(szFileName,pathname))
-		{
-            printf("\nWarning: The input and output file names are the same.\n");
-            printf("Output file names are renamed with 'ERR' as the prefix.\n");
-            strcpy(szFileName, "ERR");
-			if (fileext_o ==FILE_ESRI){
-				strcat(szFileName,pathname_o);
-				strcpy(pathname_o, szFileName);
-			}
-			strcpy(szFileName, "ERR");
-			strcat(szFileName,pathname);
+// Writes an .asc grid of the noisy surface with nSide x nSide cells of unit
+// size, heights in cells, and a round hole of nodata values.
+static void BenchWriteGrid(FILE* fp, int nSide)
+{
+    int i, j;
+    double h = 1.0/(nSide-1), x, y;
+    unsigned long long nState = 2;
+    struct OutBuffer ob;
+
+    fprintf(fp,"ncols          %d\n",nSide);
+    fprintf(fp,"nrows          %d\n",nSide);
+    fprintf(fp,"xllcorner      %lf\n",0.0);
+    fprintf(fp,"yllcorner      %lf\n",0.0);
+    fprintf(fp,"cellsize       %lf\n",1.0);
+    fprintf(fp,"NODATA_value   %lf\n",-9999.0);
+    OutOpen(&ob, fp, 3);
+    for (i=0; i<nSide; i++)
+    {
+        for (j=0; j<nSide; j++)
+        {
+            x = j*h;
+            y = 1-i*h;
+            if ((x-0.7)*(x-0.7)+(y-0.7)*(y-0.7)<0.005)
+                OutNumber(&ob, -9999.0);
+            else
+                OutNumber(&ob, (BenchHeight(x, y)+h/3*BenchNoise(&nState))*(nSide-1));
+            OutText(&ob, (j<nSide-1) ? " " : "\n");
         }
-        strcpy(pathname, szFileName);
     }
+    OutClose(&ob);
+}
 
-    fp = fopen(pathname, "w");
-    if (!fp) {
-        printf("Can't open file to write!\n");
-        return 0;
-    }
+static void BenchPhase(const char* pszPhase, double dSeconds, double dFaces)
+{
+    printf("  %-18s %10.3f %12.3g\n", pszPhase, dSeconds, (dSeconds>0) ? dFaces/dSeconds : 0.0);
+}
 
+// Runs the whole pipeline on a synthetic mesh and a synthetic grid of about
+// pnFaces[k] faces each, with the options of denoiser, and prints the
+// wall-clock time and throughput of every phase. The rings of both
+// neighbourhoods are built; the filters count faces or vertices once per
+// iteration. The input and output files are written in the current
+// directory and removed.
+void RunBenchmark(CDenoiser* denoiser, const int* pnFaces, int nSizes)
+{
+    const char* pszIn[2] = { "mdenoise_bench.off", "mdenoise_bench.asc" };
+    const char* pszOut[2] = { "mdenoise_bench_out.off", "mdenoise_bench_out.asc" };
+    int pnExt[2] = { FILE_OFF, FILE_ESRI };
+    int k, m, nSide, nFaces;
+    bool bZOnly = denoiser->m_bZOnly, bGrid = denoiser->m_bGrid;
+    double t, dWrite, dRead, dFaces, dVertices;
+    struct ESRIHeader header;
+    FILE* fp;
+
+    memset(&header, 0, sizeof(header));
+    printf("Benchmark: n1 %d, n2 %d, %s neighbourhood, %d threads\n", denoiser->m_nIterations, denoiser->m_nVIterations,
+        denoiser->m_bNeighbourCV ? "common vertex" : "common edge", denoiser->m_nThreads);
+    for (k=0; k<nSizes; k++)
+    {
+        nSide = std::max((int)ceil(sqrt(pnFaces[k]/2.0))+1, 3);
+        for (m=0; m<2; m++)
+        {
+            // the mesh is denoised in 3D unless -z is given, the grid as an .asc file
+            denoiser->m_bZOnly = m ? TRUE : bZOnly;
+            denoiser->m_bGrid = m ? bGrid : FALSE;
+            t = WallClock();
+            fp = fopen(pszIn[m], "wb");
+            if (!fp)
+            {
+                printf("Can't open file to write!\n");
+                return;
+            }
+            if (m)
+                BenchWriteGrid(fp, nSide);
+            else
+                BenchWriteMesh(fp, nSide);
+            fclose(fp);
+            dWrite = WallClock()-t;
+
+            denoiser->FreeModel();
+            denoiser->FreeGrid();
+            t = WallClock();
+            fp = fopen(pszIn[m], "rb");
+            nFaces = denoiser->ReadData(fp, pnExt[m], &header);
+            fclose(fp);
+            dRead = WallClock()-t;
+            dFaces = nFaces;
+            dVertices = denoiser->m_nNumVertex;
+            printf("\n%s of %d x %d points, %d faces\n", m ? "Grid" : "Mesh", nSide, nSide, nFaces);
+            printf("  %-18s %10s %12s\n", "phase", "seconds", "faces/s");
+            BenchPhase("write input", dWrite, dFaces);
+            BenchPhase("read", dRead, dFaces);
+
+            if (!denoiser->m_bGrid)
+            {
+                denoiser->ReserveArena();
+                t = WallClock();
+                denoiser->ComputeEdges();
+                BenchPhase("edge table", WallClock()-t, dFaces);
+                t = WallClock();
+                denoiser->ComputeVRing1V();
+                BenchPhase("vertex ring", WallClock()-t, dFaces);
+                t = WallClock();
+                denoiser->ComputeVRing1T();
+                BenchPhase("vertex faces", WallClock()-t, dFaces);
+                t = WallClock();
+                denoiser->ComputeTRing1TCV();
+                BenchPhase("common vertex ring", WallClock()-t, dFaces);
+                t = WallClock();
+                denoiser->ComputeTRing1TCE();
+                BenchPhase("common edge ring", WallClock()-t, dFaces);
+            }
 
-    SaveData(fp,fileext_o,&eheader);
-    fclose(fp);
+            t = WallClock();
+            denoiser->MeshDenoise(denoiser->m_bNeighbourCV, denoiser->m_fSigma, denoiser->m_nIterations, denoiser->m_nVIterations);
+            if (denoiser->m_bGrid)
+                BenchPhase("grid denoise", WallClock()-t, dFaces*(denoiser->m_nIterations+denoiser->m_nVIterations));
+            else
+            {
+                BenchPhase("normal filter", denoiser->m_dNormalTime, dFaces*denoiser->m_nNormalPasses);
+                printf("  %-18s %10.3f %12.3g vertices/s\n", "vertex update", denoiser->m_dVertexTime,
+                    (denoiser->m_dVertexTime>0) ? dVertices*denoiser->m_nVertexPasses/denoiser->m_dVertexTime : 0.0);
+            }
 
-	FILE *in,*out;
-	char ch;
-	if (fileext_o==FILE_ESRI)
-	{
-		if((in=fopen(pathname_i,"rb"))==NULL)
-			printf("No .prj file is found.\n");
-		else if((out=fopen(pathname_o,"wb"))==NULL)
-			printf("Cannot open the target .prj file.\n");
-		else{
-
-			/* start copy */
-			ch = getc(in);
-			while(!feof(in)){
-				putc(ch,out);
-				ch = getc(in);
-			}
-			fclose(in);
-			fclose(out);
-		}
-	}
+            t = WallClock();
+            fp = fopen(pszOut[m], "w");
+            if (!fp)
+            {
+                printf("Can't open file to write!\n");
+                return;
+            }
+            denoiser->SaveData(fp, pnExt[m], &header);
+            fclose(fp);
+            BenchPhase("save", WallClock()-t, dFaces);
+
+            free(header.index);
+            header.index = NULL;
+            remove(pszIn[m]);
+            remove(pszOut[m]);
+        }
+    }
+    denoiser->m_bZOnly = bZOnly;
+    denoiser->m_bGrid = bGrid;
+}
 
-    finish = clock();
-    duration = (double)(finish - start) / CLOCKS_PER_SEC;
-    printf( "%10.3f seconds\n", duration );
+#ifndef MDENOISE_NO_MAIN
+// Run report (--stats): the wall-clock and CPU time and the peak resident
+// memory after each phase, with the counts of the model, the sizes of its
+// rings, the iterations run and the bytes read and written, as JSON.
+struct StatsPhase {
+    const char* pszName;
+    int nRun;                   // run of a sweep, -1 before the first one
+    double dWall;
+    double dCpu;
+    long long nPeakRSS;
+};
+
+static long long PeakRSS(void)
+{
+#if defined(__linux__) || defined(__APPLE__)
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (long long)ru.ru_maxrss;
+#else
+    return (long long)ru.ru_maxrss*1024;
+#endif
+#else
     return 0;
+#endif
 }
 
-int strcicmp(const char *string1, const char *string2)
+static long long FileBytes(const char* pszFile)
 {
-    int result, len1, len2;
-    len1 = strlen(string1);
-    len2 = strlen(string2);
-    len1 = (len1 <len2) ? len1 : len2;
-    for(int i =0;i<len1+1;i++)
+    struct stat st;
+    return (stat(pszFile, &st) == 0) ? (long long)st.st_size : 0;
+}
+
+static void StatsString(FILE* fp, const char* psz)
+{
+    fputc('"', fp);
+    for (; *psz; psz++)
     {
-        result = string1[i]-string2[i];
-        if((string1[i]>='A')&&(string1[i]<='Z'))
-            result += 'a'-'A';
-        if((string2[i]>='A')&&(string2[i]<='Z'))
-            result -= 'a'-'A';
-        if (result!=0)
-            break;
+        if ((*psz=='"')||(*psz=='\\'))
+            fputc('\\', fp);
+        if ((unsigned char)*psz<' ')
+            fprintf(fp, "\\u%04x", *psz);
+        else
+            fputc(*psz, fp);
     }
-    return result;
+    fputc('"', fp);
 }
 
+struct StatsRun {
+    float fSigma;
+    int nIterations;
+    int nVIterations;
+    int nNormalPasses;          // iterations run
+    int nVertexPasses;
+    bool bNormalConverged;
+    double dRingTime;           // wall-clock seconds of the ring builders,
+    double dNormalTime;         // the normal filter,
+    double dVertexTime;         // and vertex updating
+    long long nNormalUpdates;
+    long long nVertexUpdates;
+    char szOutput[256];
+    long long nWritten;         // bytes of the output and its .prj file
+};
+
+// Writes the average and largest size of a ring, if it has been built, and
+// returns whether it has.
+static bool StatsRing(FILE* fp, const char* pszName, const struct RingList* ring, int nNum, bool bFirst)
+{
+    int i, nMax = 0;
+
+    if ((ring->pnStart == NULL) || (nNum == 0))
+        return FALSE;
+    for (i=0; i<nNum; i++)
+        nMax = std::max(nMax, RING_SIZE(*ring, i));
+    fprintf(fp, "%s\n    \"%s\": {\"average\": %.4f, \"max\": %d}", bFirst ? "" : ",", pszName,
+        (double)ring->pnStart[nNum]/nNum, nMax);
+    return TRUE;
+}
 
-int FindInputExt(char* pPath)
+static void SaveStats(const char* pszFile, CDenoiser* denoiser, const char* pszInput, long long nRead,
+    const std::vector<StatsPhase>& vPhase, const std::vector<StatsRun>& vRun)
 {
-    int nfile_ext = 0;
-    char pFile[201];
-    char fileext[6];
-    int filelen = strlen(pPath);
-    int endpoint = filelen;
-    char *pdest = strrchr(pPath,'.');
+    size_t k;
+    long long nWritten = 0;
+    bool bAny = FALSE;
+    FILE* fp = fopen(pszFile, "w");
 
-    if (pdest!=NULL)
+    if (!fp)
     {
-        endpoint = (int )(pdest-pPath);
-        if ((filelen-endpoint)>5)
-        {
-            strcpy(pFile,pPath);
-            fileext[0] ='\0';
-        }
-        else
-        {
-            endpoint=(endpoint<200 ? endpoint : 200);
-            strncpy(pFile,pPath,endpoint);
-            pFile[endpoint]='\0';
-            strcpy(fileext,pdest);
-        }
+        printf("Warning:\nThe report file %s can't be written!\n", pszFile);
+        return;
     }
-    else
+    for (k=0; k<vRun.size(); k++)
+        nWritten += vRun[k].nWritten;
+    fprintf(fp, "{\n  \"version\": 1,\n  \"input\": ");
+    StatsString(fp, pszInput);
+    fprintf(fp, ",\n  \"threads\": %d,\n  \"bytes_read\": %lld,\n  \"bytes_written\": %lld,\n  \"peak_rss\": %lld,\n",
+        denoiser->m_nThreads, nRead, nWritten, PeakRSS());
+    fprintf(fp, "  \"mesh\": {\"vertices\": %d, \"faces\": %d, \"edges\": %d, \"boundary_edges\": %d, \"non_manifold_edges\": %d},\n",
+        denoiser->m_nNumVertex, denoiser->m_nNumFace, denoiser->m_nNumEdge, denoiser->m_nNumBoundaryEdge, denoiser->m_nNumNonManifoldEdge);
+    fprintf(fp, "  \"rings\": {");
+    bAny = StatsRing(fp, "vertex_vertices", &denoiser->m_VRing1V, denoiser->m_nNumVertex, !bAny) || bAny;
+    bAny = StatsRing(fp, "vertex_faces", &denoiser->m_VRing1T, denoiser->m_nNumVertex, !bAny) || bAny;
+    bAny = StatsRing(fp, "face_common_vertex", &denoiser->m_TRing1TCV, denoiser->m_nNumFace, !bAny) || bAny;
+    bAny = StatsRing(fp, "face_common_edge", &denoiser->m_TRing1TCE, denoiser->m_nNumFace, !bAny) || bAny;
+    fprintf(fp, "%s},\n  \"phases\": [", bAny ? "\n  " : "");
+    for (k=0; k<vPhase.size(); k++)
+        fprintf(fp, "%s\n    {\"phase\": \"%s\", \"run\": %d, \"wall\": %.6f, \"cpu\": %.6f, \"peak_rss\": %lld}",
+            k ? "," : "", vPhase[k].pszName, vPhase[k].nRun, vPhase[k].dWall, vPhase[k].dCpu, vPhase[k].nPeakRSS);
+    fprintf(fp, "\n  ],\n  \"runs\": [");
+    for (k=0; k<vRun.size(); k++)
     {
-        strcpy(pFile,pPath);
-        fileext[0] ='\0';
+        const StatsRun& run = vRun[k];
+        fprintf(fp, "%s\n    {\"threshold\": %g, \"n1\": %d, \"n2\": %d, \"normal_iterations\": %d, \"vertex_iterations\": %d, "
+            "\"normal_converged\": %s, \"rings_wall\": %.6f, \"normal_wall\": %.6f, \"vertex_wall\": %.6f, "
+            "\"face_updates\": %lld, \"vertex_updates\": %lld, \"output\": ", k ? "," : "", run.fSigma, run.nIterations,
+            run.nVIterations, run.nNormalPasses, run.nVertexPasses, run.bNormalConverged ? "true" : "false",
+            run.dRingTime, run.dNormalTime, run.dVertexTime, run.nNormalUpdates, run.nVertexUpdates);
+        StatsString(fp, run.szOutput);
+        fprintf(fp, ", \"bytes_written\": %lld}", run.nWritten);
     }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
 
-    if(!strcicmp(fileext,".gts"))
-        nfile_ext = FILE_GTS;
-    else if(!strcicmp(fileext,".obj"))
-        nfile_ext = FILE_OBJ;
-    else if(!strcicmp(fileext,".off"))
-        nfile_ext = FILE_OFF;
-    else if(!strcicmp(fileext,".ply"))
-        nfile_ext = FILE_PLY;
-    else if(!strcicmp(fileext,".ply2"))
-        nfile_ext = FILE_PLY2;
-    else if(!strcicmp(fileext,".smf"))
-        nfile_ext = FILE_SMF;
-    else if(!strcicmp(fileext,".stl"))
-        nfile_ext = FILE_STL;
-    else if(!strcicmp(fileext,".wrl"))
-        nfile_ext = FILE_WRL;
-    else if(!strcicmp(fileext,".xyz"))
-        nfile_ext = FILE_XYZ;
-    else if(!strcicmp(fileext,".asc"))
-	{
-		m_bZOnly = TRUE;
-        nfile_ext = FILE_ESRI;
-	}
-    else if(fileext[0]=='\0')
+// Batch mode (--batch): the tiles go through a reader, a denoiser and a
+// writer thread, each working on one slot at a time, so that reading,
+// filtering and writing of consecutive tiles overlap. The slots go round
+// from stage to stage; a slot keeps its CDenoiser, and with it the arena
+// block of the largest tile so far, from one tile to the next.
+#define BATCH_SLOTS 3
+struct BatchSlot {
+    CDenoiser denoiser;
+    struct ESRIHeader header;
+    int nInput;                 // tile of the input list, -1 at the end of the batch
+    int nfileext;
+    bool bRead;                 // the tile could be read and has faces
+    double dRead;
+    double dDenoise;
+};
+
+// Queue of slots between two stages, in the order of the tiles; the
+// BATCH_SLOTS slots bound what it may hold.
+struct BatchQueue {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<BatchSlot*> vSlot;
+
+    void Push(BatchSlot* slot)
     {
-        nfile_ext = FILE_OFF;
-        strcat(pPath,".off");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            vSlot.push_back(slot);
+        }
+        cv.notify_one();
     }
-    else{
-        printf("This input file format is not supported!\n");
-        exit(-1);
+    BatchSlot* Pop(void)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]{ return !vSlot.empty(); });
+        BatchSlot* slot = vSlot.front();
+        vSlot.erase(vSlot.begin());
+        return slot;
     }
-    return nfile_ext;
+};
+
+// The type of a batch input as FindInputExt gives it, or 0 for a file
+// without a supported extension, which is skipped.
+static int BatchInputExt(const char* pszInput)
+{
+    static const char* pszExt[] = { ".gts", ".obj", ".off", ".ply", ".ply2", ".smf", ".stl", ".wrl", ".xyz", ".asc" };
+    const char *pdest = strrchr(pszInput,'.');
+    char szPath[206];
+
+    if ((pdest==NULL) || (strlen(pszInput)>200))
+        return 0;
+    for (size_t k=0; k<sizeof(pszExt)/sizeof(pszExt[0]); k++)
+        if (!strcicmp(pdest,pszExt[k]))
+        {
+            strcpy(szPath,pszInput);
+            return FindInputExt(szPath);
+        }
+    return 0;
 }
 
-int FindOutputExt(char* pPath)
+// Whether the file is named as the output of a run, <name>_V_0.40_20_50.<ext>
+// or with _E_, so that a pattern of inputs does not take in earlier outputs.
+static bool IsOutputName(const char* pszPath)
 {
-    int nfile_ext = 0;
-    char pFile[201];
-    char fileext[6];
-    int filelen = strlen(pPath);
-    int endpoint = filelen;
-    char *pdest = strrchr(pPath,'.');
+    const char *pdest = strrchr(pszPath,'.'), *p;
+    float fSigma;
+    int n1, n2, nLen = -1;
+
+    if (pdest==NULL)
+        return FALSE;
+    for (p=pdest-1; p>=pszPath+2; p--)
+        if ((p[-2]=='_') && ((p[-1]=='V')||(p[-1]=='E')) && (p[0]=='_'))
+            break;
+    if (p<pszPath+2)
+        return FALSE;
+    if ((sscanf(p+1, "%f_%d_%d%n", &fSigma, &n1, &n2, &nLen)!=3) || (p+1+nLen!=pdest))
+        return FALSE;
+    return TRUE;
+}
 
-    if (pdest!=NULL)
+// Adds the inputs of one --batch or --mosaic argument: the lines of a list
+// file given as @file, the files matching a pattern with * ? or [ other than
+// earlier outputs, or the file itself.
+static void BatchAddInput(std::vector<char*>& vInput, const char* pszArg)
+{
+    char szLine[512];
+    FILE *fp;
+    int k;
+
+    if (pszArg[0]=='@')
     {
-        endpoint = (int )(pdest-pPath);
-        if ((filelen-endpoint)>5)
+        if ((fp = fopen(pszArg+1, "r"))==NULL)
         {
-            strcpy(pFile,pPath);
-            fileext[0] ='\0';
+            printf("Warning:\nThe batch list %s can't be opened!\n", pszArg+1);
+            return;
         }
-        else
+        while (fgets(szLine, sizeof(szLine), fp)!=NULL)
         {
-            endpoint=(endpoint<200 ? endpoint : 200);
-            strncpy(pFile,pPath,endpoint);
-            pFile[endpoint]='\0';
-            strcpy(fileext,pdest);
+            for (k=strlen(szLine); (k>0) && ((unsigned char)szLine[k-1]<=' '); k--)
+                szLine[k-1] = '\0';
+            if ((szLine[0]!='\0') && (szLine[0]!='#'))
+                BatchAddInput(vInput, szLine);
         }
+        fclose(fp);
+        return;
     }
-    else
+#if defined(__linux__) || defined(__APPLE__)
+    if (strpbrk(pszArg, "*?[")!=NULL)
     {
-        strcpy(pFile,pPath);
-        fileext[0] ='\0';
+        glob_t g;
+        if (glob(pszArg, 0, NULL, &g)!=0)
+            printf("Warning:\nNo file matches %s!\n", pszArg);
+        else
+            for (size_t n=0; n<g.gl_pathc; n++)
+                if (!IsOutputName(g.gl_pathv[n]))
+                    vInput.push_back(strdup(g.gl_pathv[n]));
+        globfree(&g);
+        return;
     }
+#endif
+    vInput.push_back(strdup(pszArg));
+}
 
-/*    if(!strcicmp(fileext,".gts"))
-        nfile_ext = FILE_GTS;
-    else*/ if(!strcicmp(fileext,".obj"))
-        nfile_ext = FILE_OBJ;
-    else if(!strcicmp(fileext,".off"))
-        nfile_ext = FILE_OFF;
-    else if(!strcicmp(fileext,".ply"))
-        nfile_ext = FILE_PLY;
-    else if(!strcicmp(fileext,".ply2"))
-        nfile_ext = FILE_PLY2;
-/*    else if(!strcicmp(fileext,".smf"))
-        nfile_ext = FILE_SMF;
-    else if(!strcicmp(fileext,".stl"))
-        nfile_ext = FILE_STL;
-    else if(!strcicmp(fileext,".wrl"))
-        nfile_ext = FILE_WRL;
-*/    else if(!strcicmp(fileext,".xyz"))
-        nfile_ext = FILE_XYZ;
-    else if(!strcicmp(fileext,".asc"))
-        nfile_ext = FILE_ESRI;
+// The output of a batch tile, named as the default output of a single run,
+// <name>_V_0.40_20_50.<ext>, in pszDir or next to the input; with its .prj
+// file and the .prj file of the input.
+static int BatchOutput(const char* pszInput, int nfileext, const char* pszDir, const CDenoiser* denoiser,
+    char* pszOut, char* pszPrj, char* pszPrjIn, size_t nSize)
+{
+    char szStem[256], szBase[300];
+    const char *pszBase, *pszExt;
+    int nfileext_o = nfileext;
+
+    snprintf(szStem, sizeof(szStem), "%s", pszInput);
+    *strrchr(szStem,'.') = '\0';
+    snprintf(pszPrjIn, nSize, "%s.prj", szStem);
+    pszBase = szStem;
+    for (int k=0; szStem[k]; k++)
+        if ((szStem[k]=='/')||(szStem[k]=='\\'))
+            pszBase = szStem+k+1;
+    if (pszDir!=NULL)
+        snprintf(szBase, sizeof(szBase), "%s/%s", pszDir, pszBase);
+    else
+        snprintf(szBase, sizeof(szBase), "%s", szStem);
+    sprintf(szBase+strlen(szBase), "_%c_%4.2f_%d_%d", denoiser->m_bNeighbourCV ? 'V' : 'E',
+        denoiser->m_fSigma, denoiser->m_nIterations, denoiser->m_nVIterations);
 
-    else if(fileext[0]=='\0')
+    pszExt = strrchr(pszInput,'.');
+    if ((nfileext==FILE_GTS)||(nfileext==FILE_SMF)||(nfileext==FILE_WRL))
     {
-        nfile_ext = FILE_DFLT;
-        //strcat(pPath,".off");
-    }
-    else{
-        printf("\nWarning:\nThis output file format is not supported!\n");
-        printf("Default file format (.off) is used!\n");
-        nfile_ext = FILE_OFF;
-        strcat(pPath,".off");
+        nfileext_o = FILE_OFF;
+        pszExt = ".off";
     }
-    return nfile_ext;
+    snprintf(pszOut, nSize, "%s%s", szBase, pszExt);
+    snprintf(pszPrj, nSize, "%s.prj", szBase);
+    return nfileext_o;
 }
 
-int ReadData(FILE * fp, int nfileext, struct ESRIHeader* header)
+// Denoises every input with the options of denoiser, one run each, and
+// writes the outputs in pszDir, or next to the inputs when it is NULL.
+static void RunBatch(CDenoiser* denoiser, const std::vector<char*>& vInput, const char* pszDir)
 {
-    m_nNumFace=0;
-
-    switch (nfileext)
+    BatchSlot pSlot[BATCH_SLOTS];
+    BatchQueue qFree, qRead, qDenoised;
+    int nInputs = (int)vInput.size(), nDone = 0, nFailed = 0;
+    double dStart = WallClock();
+
+    printf("Batch: %d tiles\n", nInputs);
+    if (pszDir!=NULL)
+        printf("Output Directory: %s\n", pszDir);
+    for (int k=0; k<BATCH_SLOTS; k++)
     {
-    case FILE_GTS:
-        ReadGTS(fp);
-        break;
+        CDenoiser* d = &pSlot[k].denoiser;
+        d->m_bNeighbourCV = denoiser->m_bNeighbourCV;
+        d->m_fSigma = denoiser->m_fSigma;
+        d->m_nIterations = denoiser->m_nIterations;
+        d->m_nVIterations = denoiser->m_nVIterations;
+        d->m_bAddVertices = denoiser->m_bAddVertices;
+        d->m_nTiles = denoiser->m_nTiles;
+        d->m_bJacobi = denoiser->m_bJacobi;
+        d->m_bSoA = denoiser->m_bSoA;
+        d->m_bReorder = denoiser->m_bReorder;
+        d->m_bCompact = denoiser->m_bCompact;
+        d->m_nThreads = denoiser->m_nThreads;
+        d->m_bGpu = denoiser->m_bGpu;
+        d->m_bHugePages = denoiser->m_bHugePages;
+        d->m_bKeepArena = TRUE;
+        d->m_vMosaic = denoiser->m_vMosaic;
+        d->m_nMosaicHalo = denoiser->m_nMosaicHalo;
+        d->m_nPrecision = denoiser->m_nPrecision;
+        d->m_fNormalTol = denoiser->m_fNormalTol;
+        d->m_fVertexTol = denoiser->m_fVertexTol;
+        d->m_fWorkNormalTol = denoiser->m_fWorkNormalTol;
+        d->m_fWorkVertexTol = denoiser->m_fWorkVertexTol;
+        d->m_nLevels = denoiser->m_nLevels;
+        memset(&pSlot[k].header, 0, sizeof(pSlot[k].header));
+        qFree.Push(&pSlot[k]);
+    }
 
-    case FILE_OBJ:
+    // reader: the slot of the last tile is emptied and the next tile read into it
+    std::thread reader([&]{
+        for (int n=0; n<=nInputs; n++)
+        {
+            BatchSlot* slot = qFree.Pop();
+            CDenoiser* d = &slot->denoiser;
+            FILE* fp;
+
+            slot->nInput = (n<nInputs) ? n : -1;
+            if (slot->nInput<0)
+            {
+                qRead.Push(slot);
+                break;
+            }
+            double t = WallClock();
+            d->FreeModel();
+            d->FreeGrid();
+            free(slot->header.index);
+            memset(&slot->header, 0, sizeof(slot->header));
+            slot->nfileext = BatchInputExt(vInput[n]);
+            d->m_bZOnly = denoiser->m_bZOnly || (slot->nfileext==FILE_ESRI);
+            d->m_bGrid = denoiser->m_bGrid && (slot->nfileext==FILE_ESRI);
+            slot->bRead = FALSE;
+            if ((slot->nfileext!=0) && ((fp = fopen(vInput[n], "rb"))!=NULL))
+            {
+                slot->bRead = (d->ReadData(fp, slot->nfileext, &slot->header)>0);
+                fclose(fp);
+                if (slot->bRead && d->m_bReorder)
+                    d->ReorderMesh();
+            }
+            slot->dRead = WallClock()-t;
+            qRead.Push(slot);
+        }
+    });
+
+    // writer: the tile is saved, with its .prj file, and the slot handed back to the reader
+    std::thread writer([&]{
+        char szOut[512], szPrj[512], szPrjIn[512];
+        FILE *fp, *in;
+        int ch;
+
+        while (TRUE)
+        {
+            BatchSlot* slot = qDenoised.Pop();
+            CDenoiser* d = &slot->denoiser;
+
+            if (slot->nInput<0)
+                break;
+            nDone++;
+            if (!slot->bRead)
+            {
+                printf("Tile %d/%d: %s can't be read!\n", nDone, nInputs, vInput[slot->nInput]);
+                nFailed++;
+                qFree.Push(slot);
+                continue;
+            }
+            double t = WallClock();
+            int nfileext_o = BatchOutput(vInput[slot->nInput], slot->nfileext, pszDir, d, szOut, szPrj, szPrjIn, sizeof(szOut));
+            bool bBinary = (nfileext_o==FILE_STL) ? (denoiser->m_nOutFormat!=PLY_ASCII) : (denoiser->m_nOutFormat==PLY_BLITTLE);
+            if ((nfileext_o!=FILE_STL) && (nfileext_o!=FILE_PLY))
+                bBinary = FALSE;
+            d->m_nOutFormat = bBinary ? PLY_BLITTLE : PLY_ASCII;
+            if ((fp = fopen(szOut, bBinary ? "wb" : "w"))==NULL)
+            {
+                printf("Tile %d/%d: can't open %s to write!\n", nDone, nInputs, szOut);
+                nFailed++;
+                qFree.Push(slot);
+                continue;
+            }
+            d->SaveData(fp, nfileext_o, &slot->header);
+            fclose(fp);
+            if ((nfileext_o==FILE_ESRI) && ((in = fopen(szPrjIn, "rb"))!=NULL))
+            {
+                if ((fp = fopen(szPrj, "wb"))==NULL)
+                    printf("Cannot open the target .prj file.\n");
+                else
+                {
+                    while ((ch = getc(in))!=EOF)
+                        putc(ch, fp);
+                    fclose(fp);
+                }
+                fclose(in);
+            }
+            printf("Tile %d/%d: %s -> %s, %d faces, read %.3f, denoise %.3f, save %.3f seconds\n", nDone, nInputs,
+                vInput[slot->nInput], szOut, d->m_nNumFace, slot->dRead, slot->dDenoise, WallClock()-t);
+            qFree.Push(slot);
+        }
+    });
+
+    // denoiser: on this thread, with the worker threads of -j; a slot is not
+    // touched once it has been handed on
+    bool bEnd = FALSE;
+    while (!bEnd)
+    {
+        BatchSlot* slot = qRead.Pop();
+        CDenoiser* d = &slot->denoiser;
+
+        bEnd = (slot->nInput<0);
+        if (!bEnd && slot->bRead)
+        {
+            double t = WallClock();
+            d->MeshDenoise(d->m_bNeighbourCV, d->m_fSigma, d->m_nIterations, d->m_nVIterations);
+            slot->dDenoise = WallClock()-t;
+        }
+        qDenoised.Push(slot);
+    }
+    reader.join();
+    writer.join();
+    // the tile names of the mosaic belong to denoiser
+    for (int k=0; k<BATCH_SLOTS; k++)
+    {
+        free(pSlot[k].header.index);
+        pSlot[k].denoiser.m_vMosaic.clear();
+    }
+    printf("Batch: %d tiles in %.3f seconds", nInputs-nFailed, WallClock()-dStart);
+    if (nFailed>0)
+        printf(", %d failed", nFailed);
+    printf("\n");
+}
+
+#ifdef MDENOISE_MPI
+// Ends MPI when the program exits, however main returns.
+static void MpiFinalize(void)
+{
+    int bDone;
+
+    MPI_Finalized(&bDone);
+    if (!bDone)
+        MPI_Finalize();
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    clock_t start, finish;
+    double  duration;
+    int filename_i=0;
+    int filename_o=0;
+    int filename_l=0;
+    int filename_c=0;
+    bool bCache=FALSE, bCached=FALSE;
+	struct ESRIHeader eheader;
+    CDenoiser denoiser;      // holds the default parameters
+    int k, nRun, nRuns, nSigma=1, nN1=1, nN2=1;
+    float pfSigma[SWEEP_MAX];
+    int pnIterations[SWEEP_MAX], pnVIterations[SWEEP_MAX];
+    float pfWork[2];
+    float pfBox[6];
+    int nBox=0, nDone;
+    int pnBench[SWEEP_MAX], nBench=0;
+    const char *pszStats = NULL;
+    bool bBatch = FALSE;
+    std::vector<char*> vBatch;
+    const char *pszOutDir = NULL;
+    std::vector<StatsPhase> vPhase;
+    std::vector<StatsRun> vRun;
+    long long nRead = 0;
+    double dWall = 0;
+    auto Phase = [&](const char* pszName, int nPhaseRun) {
+        StatsPhase phase = { pszName, nPhaseRun, WallClock()-dWall, (double)(finish - start) / CLOCKS_PER_SEC, PeakRSS() };
+        vPhase.push_back(phase);
+    };
+    int nRank = 0, nRanks = 1;  // process of the MPI build and number of processes
+    bool bDomain = FALSE;       // the grid is split into domains among them
+
+#ifdef MDENOISE_MPI
+    // every process parses the same command line, and only the first prints
+    MPI_Init(&argc, &argv);
+    atexit(MpiFinalize);
+    MPI_Comm_rank(MPI_COMM_WORLD, &nRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    if ((nRank>0) && (freopen("/dev/null", "w", stdout)==NULL))
+        return 0;
+#endif
+
+    // the ESRI index is freed on the way out, unless it is mapped from the cache
+    memset(&eheader, 0, sizeof(eheader));
+    pfSigma[0] = denoiser.m_fSigma;
+    pnIterations[0] = denoiser.m_nIterations;
+    pnVIterations[0] = denoiser.m_nVIterations;
+   
+    //Initialisation;
+    //_set_new_handler( MyNewHandler );//** This line should be commented out on unix
+
+    /* parse command line */
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            switch(argv[i][1]) {
+                case 'e':
+                case 'E':
+                    denoiser.m_bNeighbourCV = FALSE;
+                    break;
+                case 't':
+                case 'T':
+                    i++;
+                    if ((k = ScanList(argv[i], pfSigma, SWEEP_MAX))>0)
+                        nSigma = k;
+                    WarnList("-t", argv[i], k, SWEEP_MAX);
+                    for (k=0; k<nSigma; k++)
+                        if ((pfSigma[k]<0)||(pfSigma[k]>1))
+                        {
+                            printf("Warning:\nThe threshold must be within (0,1)!\n");
+                            printf("The default value [0.4] is used in the following computation!\n");
+                            pfSigma[k] = 0.4;
+                        }
+                    break;
+                case 'n':
+                case 'N':
+                    i++;
+                    if ((k = ScanList(argv[i], pnIterations, SWEEP_MAX))>0)
+                        nN1 = k;
+                    WarnList("-n", argv[i], k, SWEEP_MAX);
+                    for (k=0; k<nN1; k++)
+                        if (pnIterations[k]<1)
+                        {
+                            printf("Warning:\nThe number of iteration for normal updating must be greater than 1!\n");
+                            printf("The default value 20 is used in the following computation!\n");
+                            pnIterations[k] = 20;
+                        }
+                    break;
+                case 'v':
+                case 'V':
+                    i++;
+                    if ((k = ScanList(argv[i], pnVIterations, SWEEP_MAX))>0)
+                        nN2 = k;
+                    WarnList("-v", argv[i], k, SWEEP_MAX);
+                    for (k=0; k<nN2; k++)
+                        if (pnVIterations[k]<1)
+                        {
+                            printf("Warning:\nThe number of iteration for vertex updating must be greater than 1!\n");
+                            printf("The default value 50 is used in the following computation!\n");
+                            pnVIterations[k] = 50;
+                        }
+                    break;
+                case 'c':
+                case 'C':
+                    i++;
+                    sscanf(argv[i],"%f",&denoiser.m_fNormalTol);
+                    if (denoiser.m_fNormalTol<0)
+                    {
+                        printf("Warning:\nThe normal tolerance must not be negative!\n");
+                        printf("All the iterations for normal updating are run!\n");
+                        denoiser.m_fNormalTol = -1;
+                    }
+                    break;
+                case 'd':
+                case 'D':
+                    i++;
+                    sscanf(argv[i],"%f",&denoiser.m_fVertexTol);
+                    if (denoiser.m_fVertexTol<0)
+                    {
+                        printf("Warning:\nThe vertex tolerance must not be negative!\n");
+                        printf("All the iterations for vertex updating are run!\n");
+                        denoiser.m_fVertexTol = -1;
+                    }
+                    break;
+                case 'w':
+                case 'W':
+                    i++;
+                    pfWork[1] = -1;
+                    if (ScanList(argv[i], pfWork, 2)>0)
+                    {
+                        denoiser.m_fWorkNormalTol = pfWork[0];
+                        denoiser.m_fWorkVertexTol = pfWork[1];
+                    }
+                    if ((denoiser.m_fWorkNormalTol<0)&&(denoiser.m_fWorkVertexTol<0))
+                    {
+                        printf("Warning:\nThe worklist tolerances must not be negative!\n");
+                        printf("All the elements are updated in every iteration!\n");
+                    }
+                    break;
+                case 'u':
+                case 'U':
+                    denoiser.m_bJacobi = TRUE;
+                    break;
+                case 'r':
+                case 'R':
+                    denoiser.m_bReorder = TRUE;
+                    break;
+                case 's':
+                case 'S':
+                    denoiser.m_bSoA = TRUE;
+                    break;
+                case 'b':
+                case 'B':
+                    i++;
+                    sscanf(argv[i],"%d",&denoiser.m_nBandRows);
+                    if (denoiser.m_nBandRows<1)
+                    {
+                        printf("Warning:\nThe number of rows per band must be at least 1!\n");
+                        printf("The whole grid is processed at once!\n");
+                        denoiser.m_nBandRows = 0;
+                    }
+                    break;
+                case 'g':
+                case 'G':
+                    denoiser.m_bGrid = TRUE;
+                    break;
+                case 'm':
+                case 'M':
+                    i++;
+                    sscanf(argv[i],"%d",&denoiser.m_nLevels);
+                    if (denoiser.m_nLevels<0)
+                    {
+                        printf("Warning:\nThe number of coarser levels must be at least 0!\n");
+                        printf("The normals are filtered on the model only!\n");
+                        denoiser.m_nLevels = 0;
+                    }
+                    break;
+                case 'q':
+                case 'Q':
+                    denoiser.m_bGrid = denoiser.m_bCompact = TRUE;
+                    break;
+                case 'j':
+                case 'J':
+                    i++;
+                    sscanf(argv[i],"%d",&denoiser.m_nThreads);
+                    if (denoiser.m_nThreads<1)
+                    {
+                        printf("Warning:\nThe number of threads must be at least 1!\n");
+                        printf("The default value 1 is used in the following computation!\n");
+                        denoiser.m_nThreads = 1;
+                    }
+                    break;
+                case 'p':
+                case 'P':
+                    i++;
+                    sscanf(argv[i],"%d",&denoiser.m_nPrecision);
+                    if (denoiser.m_nPrecision>20)
+                    {
+                        printf("Warning:\nThe number of decimals must be at most 20!\n");
+                        printf("The default value 6 is used in the following computation!\n");
+                        denoiser.m_nPrecision = 6;
+                    }
+                    break;
+                case 'f':
+                case 'F':
+                    i++;
+                    if (!strcicmp(argv[i],"binary"))
+                        denoiser.m_nOutFormat = PLY_BLITTLE;
+                    else if (!strcicmp(argv[i],"ascii"))
+                        denoiser.m_nOutFormat = PLY_ASCII;
+                    else
+                        printf("Warning:\nThe output format must be ascii or binary!\nThe default format is used!\n");
+                    break;
+                case 'l':
+                case 'L':
+                    i++;
+                    filename_l = i;
+                    break;
+                case 'k':
+                case 'K':
+                    i++;
+                    nBox = ScanList(argv[i], pfBox, 6);
+                    if ((nBox!=4)&&(nBox!=6))
+                    {
+                        printf("Warning:\nThe box must be given as xmin,ymin,xmax,ymax[,zmin,zmax]!\n");
+                        printf("The box is not used!\n");
+                        nBox = 0;
+                    }
+                    break;
+                case 'i':
+                case 'I':
+                    i++;
+                    filename_i = i;
+                    break;
+                case 'o':
+                case 'O':
+                    i++;
+                    filename_o = i;
+                    break;
+                case 'a':
+                case 'A':
+                    denoiser.m_bAddVertices = TRUE;
+                    break;
+                case 'y':
+                case 'Y':
+                    i++;
+                    sscanf(argv[i],"%d",&denoiser.m_nTiles);
+                    if (denoiser.m_nTiles<1)
+                    {
+                        printf("Warning:\nThe number of tiles per side must be at least 1!\n");
+                        printf("The whole point cloud is triangulated at once!\n");
+                        denoiser.m_nTiles = 1;
+                    }
+                    break;
+                case 'z':
+                case 'Z':
+                    denoiser.m_bZOnly = TRUE;
+                    break;
+                case 'x':
+                case 'X':
+#ifdef MDENOISE_OPENCL
+                    denoiser.m_bGpu = denoiser.m_bJacobi = TRUE;
+#else
+                    printf("Warning:\nThis program was built without the OpenCL backend, the CPU is used!\n");
+#endif
+                    break;
+                case 'h':
+                case 'H':
+                    denoiser.m_bHugePages = TRUE;
+                    break;
+                case '-':
+                    if (!strcicmp(argv[i],"--cache"))
+                        bCache = TRUE;
+                    else if (!strcicmp(argv[i],"--cache-dir"))
+                    {
+                        i++;
+                        filename_c = i;
+                        bCache = TRUE;
+                    }
+                    else if (!strcicmp(argv[i],"--stats"))
+                    {
+                        i++;
+                        pszStats = argv[i];
+                    }
+                    else if (!strcicmp(argv[i],"--batch"))
+                    {
+                        bBatch = TRUE;
+                        while ((i+1<argc) && (argv[i+1][0]!='-'))
+                            BatchAddInput(vBatch, argv[++i]);
+                    }
+                    else if (!strcicmp(argv[i],"--mosaic"))
+                    {
+                        while ((i+1<argc) && (argv[i+1][0]!='-'))
+                            BatchAddInput(denoiser.m_vMosaic, argv[++i]);
+                        if (denoiser.m_vMosaic.empty())
+                            printf("Warning:\nThe mosaic has no tiles, each grid is denoised on its own!\n");
+                    }
+                    else if (!strcicmp(argv[i],"--out-dir"))
+                    {
+                        i++;
+                        pszOutDir = argv[i];
+                    }
+                    else if (!strcicmp(argv[i],"--bench"))
+                    {
+                        i++;
+                        nBench = ScanList(argv[i], pnBench, SWEEP_MAX);
+                        for (k=0; k<nBench; k++)
+                            if (pnBench[k]<8)
+                            {
+                                printf("Warning:\nThe benchmark sizes must be at least 8 faces!\n");
+                                printf("8 faces are used!\n");
+                                pnBench[k] = 8;
+                            }
+                    }
+                    else
+                    {
+                        printf("unknown option %s\n",argv[i]);
+                        options(argv[0]);
+                    }
+                    break;
+                default:
+                    printf("unknown option %s\n",argv[i]);
+                    options(argv[0]);
+            }
+        }
+        else {
+            printf("unknown option %s\n",argv[i]);
+            options(argv[0]);
+        }
+    }
+
+	
+    if ((nRanks>1) && ((nBench>0) || bBatch))
+    {
+        printf("Warning: the benchmark and the batch run on the first process only.\n");
+        if (nRank>0)
+            return 0;
+    }
+
+    // the benchmark makes its own models, with the first value of each option
+    if (nBench>0)
+    {
+        denoiser.m_fSigma = pfSigma[0];
+        denoiser.m_nIterations = pnIterations[0];
+        denoiser.m_nVIterations = pnVIterations[0];
+        RunBenchmark(&denoiser, pnBench, nBench);
+        return 0;
+    }
+
+    // the batch runs each tile once, through the reader, denoiser and writer threads
+    if (bBatch)
+    {
+        if (vBatch.empty())
+        {
+            printf("Error: no input file for the batch\n");
+            options(argv[0]);
+        }
+        if (nSigma*nN1*nN2>1)
+            printf("Warning: a batch runs each tile once, with the first value of each option.\n");
+        if ((filename_i!=0)||(filename_o!=0))
+            printf("Warning: the batch takes its inputs from --batch and writes to --out-dir, -i and -o are not used.\n");
+        if ((denoiser.m_nBandRows>0)||(filename_l!=0)||bCache||(pszStats!=NULL))
+            printf("Warning: -b, -l, --cache and --stats do not work in a batch and are not used.\n");
+        if (denoiser.m_bGpu && ((denoiser.m_fWorkNormalTol>=0) || (denoiser.m_fWorkVertexTol>=0) || (denoiser.m_fNormalTol>=0) || (denoiser.m_fVertexTol>=0)))
+        {
+            printf("Warning: the GPU backend runs all iterations, the CPU is used for -c, -d and -w.\n");
+            denoiser.m_bGpu = FALSE;
+        }
+        if (denoiser.m_bSoA)
+            printf("Layout: structure of arrays, %s kernels\n",SelectKernels());
+        printf("Threads: %d\n",denoiser.m_nThreads);
+        denoiser.m_fSigma = pfSigma[0];
+        denoiser.m_nIterations = pnIterations[0];
+        denoiser.m_nVIterations = pnVIterations[0];
+        RunBatch(&denoiser, vBatch, pszOutDir);
+        for (size_t n=0; n<vBatch.size(); n++)
+            free(vBatch[n]);
+        return 0;
+    }
+
+	/////////////////////////////////////////////////////////////////////////////////
+//	filename_i = 2;
+///////////////////////////////////////////////////////////////////////////////////
+    if (filename_i == 0) {
+        printf("Error: input filename required\n");
+        options(argv[0]);
+    }
+	/////////////////////////////////////////////////////////////////////
+
+    //Read file
+    int fileext_i;
+    int fileext_o;
+    char filename[201];
+    char pathname[206];
+    char pathname_i[206];  // Only for copy prj file of .acs file
+    char pathname_o[206];  // Only for copy prj file of .acs file
+    int filelen = strlen(argv[filename_i]);
+    strcpy(pathname,argv[filename_i]);
+//    int filelen = 14;
+//	strcpy(pathname,"m1_dem_utm.asc");
+//	strcpy(pathname,"localities.xyz");
+    pathname[filelen]='\0';
+    fileext_i = FindInputExt(pathname);
+    if (fileext_i==FILE_ESRI)
+        denoiser.m_bZOnly = TRUE;
+    fileext_o = fileext_i;
+    if (fileext_i==FILE_PLY2)
+    {
+        strncpy(filename,pathname,filelen-5);
+        filename[filelen-5]='\0';
+    }
+    else
+    {
+        strncpy(filename,pathname,filelen-4);
+        filename[filelen-4]='\0';
+    }
+
+    if (fileext_i==FILE_ESRI)
+    {
+		strcpy(pathname_i,filename);
+		strcat(pathname_i,".prj");
+    }
+
+    // band by band processing and the grid engine need .asc input and output
+    char *pdest = (filename_o==0) ? NULL : strrchr(argv[filename_o],'.');
+    bool bAscOut = (fileext_i==FILE_ESRI) && !((pdest!=NULL) && strcicmp(pdest,".asc") && (strlen(pdest)<=5));
+    bool bBands = bAscOut && (denoiser.m_nBandRows>0);
+    if ((denoiser.m_nBandRows>0) && !bAscOut)
+        printf("Warning: band by band processing only works from .asc to .asc files, the whole model is processed.\n");
+    if (denoiser.m_bGrid && !bAscOut)
+    {
+        printf("Warning: the grid engine only works from .asc to .asc files, the mesh is used.\n");
+        denoiser.m_bGrid = FALSE;
+    }
+    bool bWork = (denoiser.m_fWorkNormalTol>=0)||(denoiser.m_fWorkVertexTol>=0);
+    if (bWork && denoiser.m_bGrid)
+    {
+        printf("Warning: the grid engine has no worklist mode, the mesh is used.\n");
+        denoiser.m_bGrid = FALSE;
+    }
+    if ((denoiser.m_nLevels>0) && denoiser.m_bGrid)
+    {
+        printf("Warning: multiresolution clusters the vertices of the mesh, the mesh is used.\n");
+        denoiser.m_bGrid = FALSE;
+    }
+    if ((denoiser.m_nLevels>0) && (denoiser.m_fWorkNormalTol>=0))
+    {
+        printf("Warning: worklist normal filtering works on the model only, -m is not used.\n");
+        denoiser.m_nLevels = 0;
+    }
+    if (denoiser.m_bGpu && (bWork || (denoiser.m_fNormalTol>=0) || (denoiser.m_fVertexTol>=0)))
+    {
+        printf("Warning: the GPU backend runs all iterations, the CPU is used for -c, -d and -w.\n");
+        denoiser.m_bGpu = FALSE;
+    }
+    if (denoiser.m_bGpu && denoiser.m_bGrid)
+    {
+        printf("Warning: the GPU backend works on the mesh, -g is not used.\n");
+        denoiser.m_bGrid = FALSE;
+    }
+    if (bCache && (bBands || denoiser.m_bGrid))
+    {
+        printf("Warning: the cache holds the mesh, it is not used with -b and -g.\n");
+        bCache = FALSE;
+    }
+    bool bMosaic = !denoiser.m_vMosaic.empty() && (fileext_i==FILE_ESRI);
+    if (bMosaic && (bBands || bCache || (filename_l!=0)))
+    {
+        printf("Warning: a mosaic tile is read with its halo, -b, -l and --cache are not used.\n");
+        bBands = bCache = FALSE;
+        filename_l = 0;
+    }
+
+    // with several processes, an .asc grid is split into domains of rows
+    bDomain = (nRanks>1) && bAscOut;
+    if ((nRanks>1) && !bDomain)
+    {
+        printf("Warning: only .asc grids written to .asc files are split among processes, the first one denoises the model.\n");
+        if (nRank>0)
+            return 0;
+    }
+    if (bDomain && (bBands || bMosaic || bCache || (filename_l!=0) || denoiser.m_bGrid || denoiser.m_bReorder || denoiser.m_bSoA || denoiser.m_bGpu))
+    {
+        printf("Warning: the domains are denoised on the mesh, -b, -l, -g, -r, -s, -x, --mosaic and --cache are not used.\n");
+        bBands = bMosaic = bCache = denoiser.m_bGrid = denoiser.m_bReorder = denoiser.m_bSoA = denoiser.m_bGpu = FALSE;
+        for (size_t n=0; n<denoiser.m_vMosaic.size(); n++)
+            free(denoiser.m_vMosaic[n]);
+        denoiser.m_vMosaic.clear();
+        filename_l = 0;
+    }
+    if (bDomain && (bWork || (denoiser.m_fNormalTol>=0) || (denoiser.m_fVertexTol>=0)))
+    {
+        printf("Warning: the domains run all iterations, -c, -d and -w are not used.\n");
+        denoiser.m_fNormalTol = denoiser.m_fVertexTol = denoiser.m_fWorkNormalTol = denoiser.m_fWorkVertexTol = -1;
+    }
+    if (bDomain && (denoiser.m_nLevels>0))
+    {
+        printf("Warning: the coarse models would cross the borders of the domains, -m is not used.\n");
+        denoiser.m_nLevels = 0;
+    }
+    if (bDomain && !denoiser.m_bJacobi)
+        printf("Warning: Gauss-Seidel vertex updating differs at the borders of the domains, -u gives the result of one process.\n");
+
+    // the cache is <input>.mdc, next to the input or in the --cache-dir directory
+    char szCache[512];
+    if (filename_c == 0)
+        snprintf(szCache, sizeof(szCache), "%s.mdc", pathname);
+    else
+    {
+        const char *pszBase = pathname;
+        for (k=0; pathname[k]; k++)
+            if ((pathname[k]=='/')||(pathname[k]=='\\'))
+                pszBase = pathname+k+1;
+        snprintf(szCache, sizeof(szCache), "%s/%s.mdc", argv[filename_c], pszBase);
+    }
+
+    // a sweep reads the model and builds its topology once, then runs every
+    // combination of the listed values; the runs of one threshold go by
+    // increasing n1, so that each continues from the normals of the last
+    nRuns = nSigma*nN1*nN2;
+    std::sort(pnIterations, pnIterations+nN1);
+    // the halo of a mosaic tile is that of the longest run
+    if (bMosaic && (nRuns>1))
+        denoiser.m_nMosaicHalo = pnIterations[nN1-1] + *std::max_element(pnVIterations, pnVIterations+nN2) + 2;
+    denoiser.m_fSigma = pfSigma[0];
+    denoiser.m_nIterations = pnIterations[0];
+    denoiser.m_nVIterations = pnVIterations[0];
+    // incremental denoising of a single run, on the mesh in input order
+    bool bIncremental = (filename_l!=0);
+    if (bIncremental && (nRuns>1))
+    {
+        printf("Warning: incremental denoising does not work with a parameter sweep, the whole model is processed.\n");
+        bIncremental = FALSE;
+    }
+    if (bIncremental && (bBands || denoiser.m_bGrid || denoiser.m_bReorder))
+    {
+        printf("Warning: incremental denoising works on the mesh in input order, -b, -g and -r are not used.\n");
+        bBands = denoiser.m_bGrid = denoiser.m_bReorder = FALSE;
+    }
+    if (nRuns>1)
+    {
+        denoiser.m_bKeepNormals = TRUE;
+        if (bBands)
+        {
+            printf("Warning: band by band processing does not work with a parameter sweep, the whole grid is processed.\n");
+            bBands = FALSE;
+        }
+    }
+
+    printf("Input File: %s\n",pathname);
+    FILE *fp = fopen(pathname, "rb");
+    FILE *fpIn = NULL;
+    if (!fp) {
+        printf("Can't open file to load!\n");
+        return 0;
+    }
+    else
+    {
+        if (denoiser.m_bNeighbourCV)
+        {
+            printf("Neighbourhood: Common Vertex\n");
+        }
+        else
+        {
+            printf("Neighbourhood: Common Edge\n");
+        }
+        printf("Threshold: %f",pfSigma[0]);
+        for (k=1; k<nSigma; k++)
+            printf(", %f",pfSigma[k]);
+        printf("\nn1: %d",pnIterations[0]);
+        for (k=1; k<nN1; k++)
+            printf(", %d",pnIterations[k]);
+        printf("\nn2: %d",pnVIterations[0]);
+        for (k=1; k<nN2; k++)
+            printf(", %d",pnVIterations[k]);
+        printf("\n");
+        if (nRuns>1)
+            printf("Sweep: %d runs\n",nRuns);
+        if (denoiser.m_fNormalTol>=0)
+            printf("Normal tolerance: %g degrees\n",denoiser.m_fNormalTol);
+        if (denoiser.m_fVertexTol>=0)
+            printf("Vertex tolerance: %g\n",denoiser.m_fVertexTol);
+        if (denoiser.m_fWorkNormalTol>=0)
+            printf("Worklist normal filtering: %g degrees\n",denoiser.m_fWorkNormalTol);
+        if (denoiser.m_fWorkVertexTol>=0)
+            printf("Worklist vertex updating: %g\n",denoiser.m_fWorkVertexTol);
+        if (denoiser.m_nLevels>0)
+            printf("Multiresolution: %d coarser levels\n",denoiser.m_nLevels);
+        if (denoiser.m_bJacobi)
+            printf("Vertex updating: Jacobi\n");
+        if (denoiser.m_bGpu)
+            printf("Backend: OpenCL\n");
+        if (denoiser.m_bSoA)
+        {
+            printf("Layout: structure of arrays, %s kernels\n",SelectKernels());
+        }
+        printf("Threads: %d\n",denoiser.m_nThreads);
+        if (denoiser.m_nPrecision<0)
+            printf("Output precision: shortest\n");
+        else if (denoiser.m_nPrecision!=6)
+            printf("Output precision: %d decimals\n",denoiser.m_nPrecision);
+
+        if (bBands)
+            printf("Bands: %d rows\n",denoiser.m_nBandRows);
+        if (bDomain)
+            printf("Domains: %d processes\n",nRanks);
+        if (denoiser.m_bGrid)
+            printf("Engine: implicit grid\n");
+        if ((denoiser.m_nTiles>1)&&(fileext_i==FILE_XYZ))
+            printf("Tiles: %d x %d\n",denoiser.m_nTiles,denoiser.m_nTiles);
+
+        start = clock();
+        dWall = WallClock();
+        printf("Read Model...");
+#ifdef MDENOISE_MPI
+        if (bDomain)
+            denoiser.m_nNumFace = denoiser.ReadESRIDomain(fp,&eheader);
+        else
+#endif
+        if (bBands)
+            denoiser.ReadESRIHeader(fp,&eheader); // the grid itself is read band by band
+        else if (bCache && denoiser.ReadCache(szCache, pathname, fileext_i, &eheader))
+            bCached = TRUE;
+        else
+            denoiser.m_nNumFace = denoiser.ReadData(fp, fileext_i,&eheader);
+        finish = clock();
+        duration = (double)(finish - start) / CLOCKS_PER_SEC;
+        printf( "%10.3f seconds\n", duration );
+        if (bCached)
+            printf("Cache: %s\n", szCache);
+        if (bMosaic)
+            printf("Mosaic: %d neighbouring tiles, halo of %d cells\n", denoiser.m_nMosaicTiles, denoiser.m_nMosaicHalo);
+        if (bDomain && (denoiser.m_nNumFace==0))
+        {
+            printf("Warning: the grid can't be split into %d domains with faces, fewer processes are needed.\n",nRanks);
+            fclose(fp);
+            free(eheader.index);
+            return 0;
+        }
+        Phase("read", -1);
+        nRead = bCached ? FileBytes(szCache) : FileBytes(pathname);
+    }
+    if (bBands)
+        fpIn = fp;
+    else
+        fclose(fp);
+
+    FVECTOR3 *pf3Prev = NULL;
+    unsigned char *pnSeed = NULL;
+    if (bIncremental)
+    {
+        char szPrev[206];
+        strncpy(szPrev,argv[filename_l],200);
+        szPrev[200] = '\0';
+        int fileext_l = FindInputExt(szPrev);
+        printf("Previous Output: %s\n",szPrev);
+        nRead += FileBytes(szPrev);
+        fp = ((fileext_l==FILE_ESRI)==(fileext_i==FILE_ESRI)) ? fopen(szPrev, "rb") : NULL;
+        pf3Prev = new FVECTOR3[denoiser.m_nNumVertex];
+        pnSeed = (unsigned char *)MyMalloc(denoiser.m_nNumVertex+1);
+        memset(pnSeed, 0, denoiser.m_nNumVertex+1);
+        if (!fp || !denoiser.ReadPrevious(fp, fileext_l, &eheader, pf3Prev, pnSeed))
+        {
+            printf("Warning: the previous output can't be used, the whole model is processed.\n");
+            bIncremental = FALSE;
+        }
+        else if (nBox>0)
+            denoiser.SeedBox(pfBox, nBox, fileext_i, &eheader, pnSeed);
+        if (fp)
+            fclose(fp);
+    }
+
+    if (denoiser.m_bReorder && !bBands && !bCached)
+    {
+        start = clock();
+        dWall = WallClock();
+        printf("Reorder Model...");
+        denoiser.ReorderMesh();
+        finish = clock();
+        duration = (double)(finish - start) / CLOCKS_PER_SEC;
+        printf( "%10.3f seconds\n", duration );
+        Phase("reorder", -1);
+    }
+
+    char szFileName[206];
+    if (filename_o == 0)
+    {
+        strcpy(pathname,filename);   
+        if (denoiser.m_bNeighbourCV)
+            strcat(pathname,"_V_");
+        else
+            strcat(pathname,"_E_");
+        sprintf(szFileName,"%4.2f_",denoiser.m_fSigma);
+        strcat(pathname,szFileName);
+        sprintf(szFileName,"%d_",denoiser.m_nIterations);
+        strcat(pathname,szFileName);
+        sprintf(szFileName,"%d",denoiser.m_nVIterations);
+        strcat(pathname,szFileName);
+
+        switch (fileext_i)
+        {
+/*        case FILE_GTS:
+            strcat(pathname,".gts");
+            break;
+
+*/        case FILE_OBJ:
+            strcat(pathname,".obj");
+            break;
+
+        case FILE_OFF:
+            strcat(pathname,".off");
+            break;
+
+        case FILE_PLY:
+            strcat(pathname,".ply");
+            break;
+
+        case FILE_PLY2:
+            strcat(pathname,".ply2");
+            break;
+
+        case FILE_STL:
+            strcat(pathname,".stl");
+            break;
+
+/*        case FILE_SMF:
+            strcat(pathname,".smf");
+            break;
+
+        case FILE_WRL:
+            strcat(pathname,".wrl");
+            break;
+*/
+        case FILE_XYZ:
+            strcat(pathname,".xyz");
+            break;
+
+		case FILE_ESRI:
+			strcpy(pathname_o,pathname);
+			strcat(pathname_o,".prj");
+			strcat(pathname,".asc");
+            break;
+
+		default:
+            fileext_o = FILE_OFF;
+            strcat(pathname,".off");
+        }
+    }
+    else
+    {   
+        strcpy(szFileName,argv[filename_o]);
+        filelen = strlen(argv[filename_o]);
+        szFileName[filelen]='\0';
+        fileext_o = FindOutputExt(szFileName);
+        if (fileext_o==FILE_DFLT)
+        {
+            fileext_o = fileext_i;
+            switch (fileext_i)
+            {
+    /*        case FILE_GTS:
+                strcat(szFileName,".gts");
+                break;
+
+*/            case FILE_OBJ:
+                strcat(szFileName,".obj");
+                break;
+
+            case FILE_OFF:
+                strcat(szFileName,".off");
+                break;
+
+            case FILE_PLY:
+                strcat(szFileName,".ply");
+                break;
+   
+            case FILE_PLY2:
+                strcat(szFileName,".ply2");
+                break;
+
+            case FILE_STL:
+                strcat(szFileName,".stl");
+                break;
+
+    /*        case FILE_SMF:
+                strcat(szFileName,".smf");
+                break;
+
+            case FILE_WRL:
+                strcat(szFileName,".wrl");
+                break;
+    */
+            case FILE_XYZ:
+                strcat(szFileName,".xyz");
+                break;
+
+			case FILE_ESRI:
+				strcpy(pathname_o,szFileName);
+				strcat(pathname_o,".prj");
+	            strcat(szFileName,".asc");
+		        break;
+
+			default:
+				fileext_o = FILE_OFF;
+				strcat(szFileName,".off");
+			}
+		} else if (fileext_o ==FILE_ESRI){
+			strcpy(pathname_o,szFileName);
+			pathname_o[filelen-4]='\0';
+			strcat(pathname_o,".prj");
+		}
+
+		if (!strcicmp(szFileName,pathname))
+		{
+            printf("\nWarning: The input and output file names are the same.\n");
+            printf("Output file names are renamed with 'ERR' as the prefix.\n");
+            strcpy(szFileName, "ERR");
+			if (fileext_o ==FILE_ESRI){
+				strcat(szFileName,pathname_o);
+				strcpy(pathname_o, szFileName);
+			}
+			strcpy(szFileName, "ERR");
+			strcat(szFileName,pathname);
+        }
+        strcpy(pathname, szFileName);
+    }
+
+    // binary output is written for .stl files, and for .ply files with -f binary
+    bool bBinary = (fileext_o==FILE_STL) ? (denoiser.m_nOutFormat!=PLY_ASCII) : (denoiser.m_nOutFormat==PLY_BLITTLE);
+    if (bBinary && (fileext_o!=FILE_STL) && (fileext_o!=FILE_PLY))
+    {
+        printf("\nWarning: binary output is only available for .ply and .stl files, ASCII is written.\n");
+        bBinary = FALSE;
+    }
+    denoiser.m_nOutFormat = bBinary ? PLY_BLITTLE : PLY_ASCII;
+
+    char szRunName[256];   // output of one run of a sweep
+    char szRunPrj[256];
+    char *pszOut = pathname;
+    char *pszPrj = pathname_o;
+    FILE *in,*out;
+    char ch;
+    for (nRun=0; nRun<nRuns; nRun++)
+    {
+        if (nRuns>1)
+        {
+            denoiser.m_fSigma = pfSigma[nRun/(nN1*nN2)];
+            denoiser.m_nIterations = pnIterations[(nRun/nN2)%nN1];
+            denoiser.m_nVIterations = pnVIterations[nRun%nN2];
+            printf("Run %d: threshold %4.2f, n1 %d, n2 %d\n",nRun+1,denoiser.m_fSigma,denoiser.m_nIterations,denoiser.m_nVIterations);
+
+            // <name>_V_0.40_20_50.<ext>, as the default output file names
+            strcpy(szRunName, (filename_o==0) ? filename : pathname);
+            if ((filename_o!=0) && ((pdest = strrchr(szRunName,'.'))!=NULL))
+                *pdest = '\0';
+            sprintf(szRunName+strlen(szRunName),"_%c_%4.2f_%d_%d",denoiser.m_bNeighbourCV ? 'V' : 'E',
+                denoiser.m_fSigma,denoiser.m_nIterations,denoiser.m_nVIterations);
+            strcpy(szRunPrj,szRunName);
+            strcat(szRunPrj,".prj");
+            pdest = strrchr(pathname,'.');
+            strcat(szRunName,(pdest!=NULL) ? pdest : "");
+            pszOut = szRunName;
+            pszPrj = szRunPrj;
+        }
+
+        //Denoising Model...
+        if (!bBands)
+        {
+            start = clock();
+            dWall = WallClock();
+            printf("Denoising Model...");
+            if (bIncremental)
+                nDone = denoiser.DenoiseRegion(pnSeed, pf3Prev, denoiser.m_bNeighbourCV, denoiser.m_fSigma, denoiser.m_nIterations, denoiser.m_nVIterations);
+            else
+                denoiser.MeshDenoise(denoiser.m_bNeighbourCV, denoiser.m_fSigma, denoiser.m_nIterations, denoiser.m_nVIterations);
+            finish = clock();
+            duration = (double)(finish - start) / CLOCKS_PER_SEC;
+            printf( "%10.3f seconds\n", duration );
+            Phase("denoise", nRun);
+            if (bIncremental)
+                printf("Incremental: %d of %d vertices computed again\n",nDone,denoiser.m_nNumVertex);
+            if ((denoiser.m_fNormalTol>=0)||(denoiser.m_fVertexTol>=0))
+                denoiser.ReportConvergence();
+            if (denoiser.m_fWorkNormalTol>=0)
+                printf("Face updates: %lld (%.1f%% of %d iterations)\n",denoiser.m_nNormalUpdates,
+                    100.0*denoiser.m_nNormalUpdates/(double(denoiser.m_nNumFace)*denoiser.m_nIterations),denoiser.m_nIterations);
+            if (denoiser.m_fWorkVertexTol>=0)
+                printf("Vertex updates: %lld (%.1f%% of %d iterations)\n",denoiser.m_nVertexUpdates,
+                    100.0*denoiser.m_nVertexUpdates/(double(denoiser.m_nNumVertex)*denoiser.m_nVIterations),denoiser.m_nVIterations);
+        }
+
+        // the first run has built the rings, which go to the cache with the model
+        if (bCache && (nRun==0))
+            denoiser.SaveCache(szCache, argv[filename_i], fileext_i, &eheader);
+
+        //Saving Model...
+        start = clock();
+        dWall = WallClock();
+        if (bBands)
+            printf("Denoising and Saving Model...");
+        else
+            printf("Saving Model...");
+
+#ifdef MDENOISE_MPI
+        if (bDomain)
+        {
+            if (!denoiser.SaveESRIDomain(pszOut, &eheader)) {
+                printf("Can't open file to write!\n");
+                if (!bCached)
+                    free(eheader.index);
+                return 0;
+            }
+        }
+        else
+#endif
+        {
+            fp = fopen(pszOut, bBinary ? "wb" : "w");
+            if (!fp) {
+                printf("Can't open file to write!\n");
+                if (!bCached)
+                    free(eheader.index);
+                return 0;
+            }
+
+            if (bBands)
+            {
+                denoiser.DenoiseESRIBands(fpIn, fp, &eheader);
+                fclose(fpIn);
+            }
+            else
+                denoiser.SaveData(fp,fileext_o,&eheader);
+            fclose(fp);
+        }
+
+        // the .prj file is copied by the first process
+        if ((fileext_o==FILE_ESRI) && (nRank==0))
+        {
+            if((in=fopen(pathname_i,"rb"))==NULL)
+                printf("No .prj file is found.\n");
+            else if((out=fopen(pszPrj,"wb"))==NULL)
+                printf("Cannot open the target .prj file.\n");
+            else{
+
+                /* start copy */
+                ch = getc(in);
+                while(!feof(in)){
+                    putc(ch,out);
+                    ch = getc(in);
+                }
+                fclose(in);
+                fclose(out);
+            }
+        }
+
+        finish = clock();
+        duration = (double)(finish - start) / CLOCKS_PER_SEC;
+        printf( "%10.3f seconds\n", duration );
+        Phase(bBands ? "denoise_save" : "save", nRun);
+
+        StatsRun run;
+        run.fSigma = denoiser.m_fSigma;
+        run.nIterations = denoiser.m_nIterations;
+        run.nVIterations = denoiser.m_nVIterations;
+        run.nNormalPasses = denoiser.m_nNormalPasses;
+        run.nVertexPasses = denoiser.m_nVertexPasses;
+        run.bNormalConverged = denoiser.m_bNormalConverged;
+        run.dRingTime = denoiser.m_dRingTime;
+        run.dNormalTime = denoiser.m_dNormalTime;
+        run.dVertexTime = denoiser.m_dVertexTime;
+        run.nNormalUpdates = denoiser.m_nNormalUpdates;
+        run.nVertexUpdates = denoiser.m_nVertexUpdates;
+        snprintf(run.szOutput, sizeof(run.szOutput), "%s", pszOut);
+        run.nWritten = FileBytes(pszOut)+((fileext_o==FILE_ESRI) ? FileBytes(pszPrj) : 0);
+        vRun.push_back(run);
+    }
+    if ((pszStats != NULL) && (nRank==0))
+        SaveStats(pszStats, &denoiser, argv[filename_i], nRead, vPhase, vRun);
+    delete []pf3Prev;
+    free(pnSeed);
+    if (!bCached)
+        free(eheader.index);
+    return 0;
+}
+#endif // MDENOISE_NO_MAIN
+
+int strcicmp(const char *string1, const char *string2)
+{
+    int result, len1, len2;
+    len1 = strlen(string1);
+    len2 = strlen(string2);
+    len1 = (len1 <len2) ? len1 : len2;
+    for(int i =0;i<len1+1;i++)
+    {
+        result = string1[i]-string2[i];
+        if((string1[i]>='A')&&(string1[i]<='Z'))
+            result += 'a'-'A';
+        if((string2[i]>='A')&&(string2[i]<='Z'))
+            result -= 'a'-'A';
+        if (result!=0)
+            break;
+    }
+    return result;
+}
+
+
+// Reads the comma separated values of pszList into pfValue and returns
+// their number; values that do not parse are skipped.
+int ScanList(const char* pszList, float* pfValue, int nMax)
+{
+    int nNum = 0;
+    const char *p = pszList;
+
+    while ((p!=NULL) && (nNum<nMax))
+    {
+        if (sscanf(p,"%f",&pfValue[nNum])==1)
+            nNum++;
+        p = strchr(p,',');
+        if (p!=NULL)
+            p++;
+    }
+    return nNum;
+}
+
+int ScanList(const char* pszList, int* pnValue, int nMax)
+{
+    int nNum = 0;
+    const char *p = pszList;
+
+    while ((p!=NULL) && (nNum<nMax))
+    {
+        if (sscanf(p,"%d",&pnValue[nNum])==1)
+            nNum++;
+        p = strchr(p,',');
+        if (p!=NULL)
+            p++;
+    }
+    return nNum;
+}
+
+// Warns when ScanList kept fewer values than pszList has, because some did
+// not parse or there were more than nMax of them.
+void WarnList(const char* pszOption, const char* pszList, int nNum, int nMax)
+{
+    int nList = 1;
+    const char *p;
+
+    if (pszList==NULL)
+        return;
+    for (p=strchr(pszList,','); p!=NULL; p=strchr(p+1,','))
+        nList++;
+    if (nNum<nList)
+    {
+        printf("Warning:\n%d of the %d values of %s %s are used, a list takes up to %d numbers!\n", nNum, nList, pszOption, pszList, nMax);
+        if (nNum==0)
+            printf("The default value is used in the following computation!\n");
+    }
+}
+
+int FindInputExt(char* pPath)
+{
+    int nfile_ext = 0;
+    char pFile[201];
+    char fileext[6];
+    int filelen = strlen(pPath);
+    int endpoint = filelen;
+    char *pdest = strrchr(pPath,'.');
+
+    if (pdest!=NULL)
+    {
+        endpoint = (int )(pdest-pPath);
+        if ((filelen-endpoint)>5)
+        {
+            strcpy(pFile,pPath);
+            fileext[0] ='\0';
+        }
+        else
+        {
+            endpoint=(endpoint<200 ? endpoint : 200);
+            strncpy(pFile,pPath,endpoint);
+            pFile[endpoint]='\0';
+            strcpy(fileext,pdest);
+        }
+    }
+    else
+    {
+        strcpy(pFile,pPath);
+        fileext[0] ='\0';
+    }
+
+    if(!strcicmp(fileext,".gts"))
+        nfile_ext = FILE_GTS;
+    else if(!strcicmp(fileext,".obj"))
+        nfile_ext = FILE_OBJ;
+    else if(!strcicmp(fileext,".off"))
+        nfile_ext = FILE_OFF;
+    else if(!strcicmp(fileext,".ply"))
+        nfile_ext = FILE_PLY;
+    else if(!strcicmp(fileext,".ply2"))
+        nfile_ext = FILE_PLY2;
+    else if(!strcicmp(fileext,".smf"))
+        nfile_ext = FILE_SMF;
+    else if(!strcicmp(fileext,".stl"))
+        nfile_ext = FILE_STL;
+    else if(!strcicmp(fileext,".wrl"))
+        nfile_ext = FILE_WRL;
+    else if(!strcicmp(fileext,".xyz"))
+        nfile_ext = FILE_XYZ;
+    else if(!strcicmp(fileext,".asc"))
+        nfile_ext = FILE_ESRI;
+    else if(fileext[0]=='\0')
+    {
+        nfile_ext = FILE_OFF;
+        strcat(pPath,".off");
+    }
+    else{
+        printf("This input file format is not supported!\n");
+        exit(-1);
+    }
+    return nfile_ext;
+}
+
+int FindOutputExt(char* pPath)
+{
+    int nfile_ext = 0;
+    char pFile[201];
+    char fileext[6];
+    int filelen = strlen(pPath);
+    int endpoint = filelen;
+    char *pdest = strrchr(pPath,'.');
+
+    if (pdest!=NULL)
+    {
+        endpoint = (int )(pdest-pPath);
+        if ((filelen-endpoint)>5)
+        {
+            strcpy(pFile,pPath);
+            fileext[0] ='\0';
+        }
+        else
+        {
+            endpoint=(endpoint<200 ? endpoint : 200);
+            strncpy(pFile,pPath,endpoint);
+            pFile[endpoint]='\0';
+            strcpy(fileext,pdest);
+        }
+    }
+    else
+    {
+        strcpy(pFile,pPath);
+        fileext[0] ='\0';
+    }
+
+/*    if(!strcicmp(fileext,".gts"))
+        nfile_ext = FILE_GTS;
+    else*/ if(!strcicmp(fileext,".obj"))
+        nfile_ext = FILE_OBJ;
+    else if(!strcicmp(fileext,".off"))
+        nfile_ext = FILE_OFF;
+    else if(!strcicmp(fileext,".ply"))
+        nfile_ext = FILE_PLY;
+    else if(!strcicmp(fileext,".ply2"))
+        nfile_ext = FILE_PLY2;
+    else if(!strcicmp(fileext,".stl"))
+        nfile_ext = FILE_STL;
+/*    else if(!strcicmp(fileext,".smf"))
+        nfile_ext = FILE_SMF;
+    else if(!strcicmp(fileext,".wrl"))
+        nfile_ext = FILE_WRL;
+*/    else if(!strcicmp(fileext,".xyz"))
+        nfile_ext = FILE_XYZ;
+    else if(!strcicmp(fileext,".asc"))
+        nfile_ext = FILE_ESRI;
+
+    else if(fileext[0]=='\0')
+    {
+        nfile_ext = FILE_DFLT;
+        //strcat(pPath,".off");
+    }
+    else{
+        printf("\nWarning:\nThis output file format is not supported!\n");
+        printf("Default file format (.off) is used!\n");
+        nfile_ext = FILE_OFF;
+        strcat(pPath,".off");
+    }
+    return nfile_ext;
+}
+
+int CDenoiser::ReadData(FILE * fp, int nfileext, struct ESRIHeader* header)
+{
+    m_nNumFace=0;
+    m_nModelAlloc = MODEL_NEW;
+
+    switch (nfileext)
+    {
+    case FILE_GTS:
+        ReadGTS(fp);
+        break;
+
+    case FILE_OBJ:
         ReadOBJ(fp);
         break;
 
-    case FILE_OFF:
-        ReadOFF(fp);
-        break;
+    case FILE_OFF:
+        ReadOFF(fp);
+        break;
+
+    case FILE_PLY:
+        ReadPLY(fp);
+        break;
+
+    case FILE_PLY2:
+        ReadPLY2(fp);
+        break;
+
+    case FILE_SMF:
+        ReadSMF(fp);
+        break;
+
+    case FILE_STL:
+        ReadSTL(fp);
+        break;
+
+    case FILE_WRL:
+        ReadWRL(fp);
+        break;
+
+    case FILE_XYZ:
+        ReadXYZ(fp);
+        break;
+
+    case FILE_ESRI:
+        if (!m_vMosaic.empty())
+        {
+            ReadESRIMosaic(fp,header);
+            if (m_bGrid)
+                return m_nNumFace;
+            break;
+        }
+        if (m_bGrid)
+        {
+            ReadGrid(fp,header);
+            return m_nNumFace;
+        }
+        ReadESRI(fp,header);
+        break;
+
+	default:
+        return 0;
+    }
+
+    InitModel();
+
+    return m_nNumFace;
+}
+
+// Scales the model that has just been read, computes its normals and sets
+// up the produced mesh as a copy of it.
+void CDenoiser::InitModel(void)
+{
+    ScalingBox(); // scale to a box
+    InitScaledModel();
+}
+
+// As InitModel, for a model that is already scaled.
+void CDenoiser::InitScaledModel(void)
+{
+    ReserveArena();
+    ComputeNormal(FALSE);
+    InitProducedModel();
+}
+
+// Sets up the produced mesh as a copy of the model and its normals.
+void CDenoiser::InitProducedModel(void)
+{
+    m_nNumVertexP = m_nNumVertex;
+    m_nNumFaceP = m_nNumFace;
+    m_pf3VertexP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertexP*sizeof(FVECTOR3));
+    m_pn3FaceP = (NVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFaceP*sizeof(NVECTOR3));
+    m_pf3VertexNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertexP*sizeof(FVECTOR3));
+    m_pf3FaceNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFaceP*sizeof(FVECTOR3));
+
+    for (int i=0;i<m_nNumVertex;i++)
+    {
+        VEC3_ASN_OP(m_pf3VertexP[i],=,m_pf3Vertex[i]);
+        VEC3_ASN_OP(m_pf3VertexNormalP[i],=,m_pf3VertexNormal[i]);
+    }
+    for (int i=0;i<m_nNumFace;i++)
+    {
+        VEC3_ASN_OP(m_pn3FaceP[i],=,m_pn3Face[i]);
+        VEC3_ASN_OP(m_pf3FaceNormalP[i],=,m_pf3FaceNormal[i]);
+    }
+}
+
+// Sizes the arena of the job from the vertex and face counts: the normals
+// and produced mesh, the normals kept by a sweep, the edge table and the
+// rings of the chosen neighbourhood. A common vertex ring is taken as 13
+// faces, as in a regular mesh, and an edge ring as 4; anything beyond comes
+// from MyMalloc. The grid engine keeps its own buffers. A block kept from
+// the last model is used again when it is large enough.
+void CDenoiser::ReserveArena(void)
+{
+    size_t nV = m_nNumVertex, nF = m_nNumFace, nE = 3*nF/2+nV;
+    size_t nBytes;
+
+    if (m_bGrid || (m_nNumFace == 0))
+        return;
+    if ((m_Arena.pBase != NULL) && ((m_Arena.nUsed > 0) || (m_nCacheSections != 0)))
+        return;
+
+    nBytes = (3*nV+(m_bKeepNormals ? 3 : 2)*nF)*sizeof(FVECTOR3)+2*nF*sizeof(NVECTOR3);
+    nBytes += (2*nE+1+nE+1+3*nF+1)*sizeof(int);    //edge table
+    nBytes += (nV+1+3*nF+1+nV+1+2*nE+1)*sizeof(int); //rings of each vertex
+    if (m_bNeighbourCV)
+        nBytes += (nF+1+13*nF+1)*sizeof(int);
+    else
+        nBytes += (nF+1+4*nF+1)*sizeof(int);
+    nBytes += 20*ARENA_ALIGN;
+    if (m_Arena.pBase != NULL)
+    {
+        if (m_Arena.nSize >= nBytes)
+            return;
+        ArenaRelease(&m_Arena);
+    }
+    ArenaInit(&m_Arena, nBytes, m_bHugePages);
+}
+
+// Releases the model and its neighbourhoods, so that a new one can be set up.
+void CDenoiser::FreeModel(void)
+{
+    if (m_nModelAlloc==MODEL_MALLOC)
+    {
+        free(m_pf3Vertex);
+        free(m_pn3Face);
+    }
+    else if (m_nModelAlloc==MODEL_NEW)
+    {
+        delete []m_pf3Vertex;
+        delete []m_pn3Face;
+    }
+    m_nModelAlloc = MODEL_NEW;
+    ArenaFree(&m_Arena, m_pf3FaceNormal);
+    ArenaFree(&m_Arena, m_pf3VertexNormal);
+    ArenaFree(&m_Arena, m_pf3VertexP);
+    ArenaFree(&m_Arena, m_pn3FaceP);
+    ArenaFree(&m_Arena, m_pf3FaceNormalP);
+    ArenaFree(&m_Arena, m_pf3VertexNormalP);
+    ArenaFree(&m_Arena, m_pf3KeptNormal);
+    ArenaFree(&m_Arena, m_pnVertexOrder);
+    ArenaFree(&m_Arena, m_pnFaceOrder);
+    m_pf3KeptNormal = NULL;
+    m_nKeptIterations = -1;
+    m_pf3Vertex = m_pf3FaceNormal = m_pf3VertexNormal = NULL;
+    m_pf3VertexP = m_pf3FaceNormalP = m_pf3VertexNormalP = NULL;
+    m_pn3Face = m_pn3FaceP = NULL;
+    m_pnVertexOrder = m_pnFaceOrder = NULL;
+    m_nNumVertex = m_nNumFace = m_nNumVertexP = m_nNumFaceP = 0;
+    FreeRing(&m_VRing1V, &m_Arena);
+    FreeRing(&m_VRing1T, &m_Arena);
+    FreeRing(&m_TRing1TCV, &m_Arena);
+    FreeRing(&m_TRing1TCE, &m_Arena);
+    FreeRing(&m_EdgeT, &m_Arena);
+    ArenaFree(&m_Arena, m_pnEdgeVertex);
+    ArenaFree(&m_Arena, m_pn3FaceEdge);
+    m_pnEdgeVertex = NULL;
+    m_pn3FaceEdge = NULL;
+    m_nNumEdge = m_nNumBoundaryEdge = m_nNumNonManifoldEdge = 0;
+    free(m_Mosaic.index);
+    memset(&m_Mosaic, 0, sizeof(m_Mosaic));
+    free(m_Domain.index);
+    m_Domain.index = NULL;
+    if (m_bKeepArena && (m_nCacheSections == 0))
+        m_Arena.nUsed = 0;
+    else
+        ArenaRelease(&m_Arena);
+    m_nCacheSections = 0;
+#ifdef MDENOISE_OPENCL
+    GpuRelease(m_pGpu);
+#endif
+}
+
+// Binary cache of the preprocessed model. The header holds what the model
+// depends on, the input file and the options that change it; a cache whose
+// header differs is read again from the input and written anew.
+bool CDenoiser::CacheKey(const char* pszInput, int nfileext, struct CacheHeader* ch)
+{
+    struct stat st;
+
+    if (stat(pszInput, &st) != 0)
+        return FALSE;
+    memset(ch, 0, sizeof(struct CacheHeader));
+    memcpy(ch->szMagic, CACHE_MAGIC, sizeof(ch->szMagic));
+    ch->nVersion = CACHE_VERSION;
+    ch->nByteOrder = 0x01020304;
+    ch->nInputSize = (long long)st.st_size;
+    ch->nInputTime = (long long)st.st_mtime;
+    ch->nFileType = nfileext;
+    ch->nOptions = m_bReorder ? CACHE_REORDER : 0;
+    if (nfileext==FILE_XYZ)
+    {
+        ch->nOptions |= m_bAddVertices ? CACHE_ADDVERTICES : 0;
+        ch->nTiles = m_nTiles;
+    }
+    return TRUE;
+}
+
+// FNV-1a hash of the nBytes bytes at p, taken a 32-bit word at a time; the
+// sections are all made of 4-byte words.
+static unsigned long long CacheChecksum(const void* p, long long nBytes)
+{
+    const unsigned int* pn = (const unsigned int *)p;
+    unsigned long long h = 14695981039346656037ULL;
+
+    for (long long i=0; i<nBytes/4; i++)
+        h = (h ^ pn[i]) * 1099511628211ULL;
+    return h;
+}
+
+// The place and size in bytes of each section. An optional section has the
+// size it would have when stored; a ring index needs its starts in place.
+void CDenoiser::CacheSections(void** ppData[CACHE_SECTIONS], long long pnBytes[CACHE_SECTIONS], struct ESRIHeader* header)
+{
+    long long nV = m_nNumVertex, nF = m_nNumFace, nE = m_nNumEdge;
+    struct RingList* pRing[5] = { &m_EdgeT, &m_VRing1V, &m_VRing1T, &m_TRing1TCV, &m_TRing1TCE };
+    long long pnNum[5] = { nE, nV, nV, nF, nF };
+    int i;
+
+    ppData[0] = (void **)&m_pf3Vertex;          pnBytes[0] = nV*sizeof(FVECTOR3);
+    ppData[1] = (void **)&m_pn3Face;            pnBytes[1] = nF*sizeof(NVECTOR3);
+    ppData[2] = (void **)&m_pf3FaceNormal;      pnBytes[2] = nF*sizeof(FVECTOR3);
+    ppData[3] = (void **)&m_pf3VertexNormal;    pnBytes[3] = nV*sizeof(FVECTOR3);
+    ppData[4] = (void **)&m_pnVertexOrder;      pnBytes[4] = nV*sizeof(int);
+    ppData[5] = (void **)&m_pnFaceOrder;        pnBytes[5] = nF*sizeof(int);
+    ppData[6] = (header != NULL) ? (void **)&header->index : NULL;
+    pnBytes[6] = (header != NULL) ? (long long)header->ncols*header->nrows*sizeof(int) : 0;
+    ppData[7] = (void **)&m_pnEdgeVertex;       pnBytes[7] = (2*nE+1)*sizeof(int);
+    ppData[8] = (void **)&m_pn3FaceEdge;        pnBytes[8] = nF*sizeof(NVECTOR3);
+    for (i=0; i<5; i++)
+    {
+        ppData[9+2*i] = (void **)&pRing[i]->pnStart;
+        pnBytes[9+2*i] = (pnNum[i]+1)*sizeof(int);
+        ppData[10+2*i] = (void **)&pRing[i]->pnIndex;
+        pnBytes[10+2*i] = (pRing[i]->pnStart != NULL) ? (pRing[i]->pnStart[pnNum[i]]+1)*sizeof(int) : 0;
+    }
+}
+
+// Sets up the model from the cache pszCache of the input file pszInput. The
+// file is mapped read-only as the arena of the job, so the buffers made
+// later come from MyMalloc. Returns FALSE, with no model, when there is no
+// cache of this input and these options.
+bool CDenoiser::ReadCache(const char* pszCache, const char* pszInput, int nfileext, struct ESRIHeader* header)
+{
+    struct CacheHeader ch, key;
+    struct stat st;
+    void** ppData[CACHE_SECTIONS];
+    long long pnBytes[CACHE_SECTIONS];
+    char* pBase;
+    size_t nSize;
+    bool bMapped = FALSE;
+    int s;
+    FILE* fp;
+
+    if (!CacheKey(pszInput, nfileext, &key) || (stat(pszCache, &st) != 0) || ((size_t)st.st_size < sizeof(ch)))
+        return FALSE;
+    fp = fopen(pszCache, "rb");
+    if (!fp)
+        return FALSE;
+    if ((fread(&ch, sizeof(ch), 1, fp) != 1) || memcmp(ch.szMagic, key.szMagic, sizeof(ch.szMagic)) ||
+        (ch.nVersion != key.nVersion) || (ch.nByteOrder != key.nByteOrder) || (ch.nInputSize != key.nInputSize) ||
+        (ch.nInputTime != key.nInputTime) || (ch.nFileType != key.nFileType) || (ch.nOptions != key.nOptions) ||
+        (ch.nTiles != key.nTiles) || (ch.nNumVertex <= 0) || (ch.nNumFace <= 0))
+    {
+        fclose(fp);
+        return FALSE;
+    }
+    nSize = (size_t)st.st_size;
+    pBase = NULL;
+#ifdef __linux__
+    void *p = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (p != MAP_FAILED)
+    {
+        pBase = (char *)p;
+        bMapped = TRUE;
+    }
+#endif
+    if (pBase == NULL)
+    {
+        pBase = (char *)MyMalloc(nSize);
+        rewind(fp);
+        if (fread(pBase, 1, nSize, fp) != nSize)
+        {
+            free(pBase);
+            fclose(fp);
+            return FALSE;
+        }
+    }
+    fclose(fp);
+
+    FreeModel();
+    m_Arena.pBase = pBase;
+    m_Arena.nSize = m_Arena.nUsed = nSize;
+    m_Arena.bMapped = bMapped;
+    m_nModelAlloc = MODEL_ARENA;
+    m_nNumVertex = ch.nNumVertex;
+    m_nNumFace = ch.nNumFace;
+    m_nNumEdge = ch.nNumEdge;
+    m_nNumBoundaryEdge = ch.nNumBoundaryEdge;
+    m_nNumNonManifoldEdge = ch.nNumNonManifoldEdge;
+    m_fScale = ch.fScale;
+    VEC3_ASN_OP(m_f3Centre, =, ch.f3Centre);
+    if (nfileext==FILE_ESRI)
+    {
+        *header = ch.esri;
+        header->nfirst = 0;
+        header->index = NULL;
+    }
+    else
+        header = NULL;
+
+    // each section in turn, as the size of a ring index is read from its starts
+    m_nCacheSections = 0;
+    for (s=0; s<CACHE_SECTIONS; s++)
+    {
+        CacheSections(ppData, pnBytes, header);
+        if (ppData[s] == NULL)
+            continue;
+        if (ch.pnSection[s][1] == 0)
+        {
+            // the model, its normals and the ESRI index are always stored
+            if ((s<4)||(s==6))
+                break;
+            continue;
+        }
+        if ((ch.pnSection[s][1] != pnBytes[s]) || (ch.pnSection[s][0] % ARENA_ALIGN) ||
+            (ch.pnSection[s][0] < (long long)sizeof(ch)) || (ch.pnSection[s][0]+ch.pnSection[s][1] > (long long)nSize) ||
+            (CacheChecksum(pBase+ch.pnSection[s][0], ch.pnSection[s][1]) != ch.pnChecksum[s]))
+            break;
+        *ppData[s] = pBase+ch.pnSection[s][0];
+        m_nCacheSections |= 1u<<s;
+    }
+    if (s<CACHE_SECTIONS)
+    {
+        printf("\nWarning:\nThe cache file %s is damaged!\nThe model is read from the input file!\n", pszCache);
+        if (header != NULL)
+            header->index = NULL;
+        FreeModel();
+        m_nCacheSections = 0;
+        return FALSE;
+    }
+    InitProducedModel();
+    return TRUE;
+}
+
+// Writes the model and the edges and rings built so far to the cache
+// pszCache of the input file pszInput, unless it was read from a cache that
+// holds them all. The file is written under another name and then renamed,
+// so that a run that has it mapped keeps the old one.
+void CDenoiser::SaveCache(const char* pszCache, const char* pszInput, int nfileext, struct ESRIHeader* header)
+{
+    struct CacheHeader ch;
+    void** ppData[CACHE_SECTIONS];
+    long long pnBytes[CACHE_SECTIONS], nPos;
+    char szTmp[512];
+    static const char pPad[ARENA_ALIGN] = { 0 };
+    unsigned int nSections = 0;
+    bool bOK;
+    int s;
+    FILE* fp;
+
+    if ((m_nNumFace == 0) || m_bGrid || !CacheKey(pszInput, nfileext, &ch))
+        return;
+    if (nfileext != FILE_ESRI)
+        header = NULL;
+    CacheSections(ppData, pnBytes, header);
+    for (s=0; s<CACHE_SECTIONS; s++)
+        if ((ppData[s] != NULL) && (*ppData[s] != NULL))
+            nSections |= 1u<<s;
+    if (nSections == m_nCacheSections)
+        return;
+
+    ch.nNumVertex = m_nNumVertex;
+    ch.nNumFace = m_nNumFace;
+    ch.nNumEdge = m_nNumEdge;
+    ch.nNumBoundaryEdge = m_nNumBoundaryEdge;
+    ch.nNumNonManifoldEdge = m_nNumNonManifoldEdge;
+    ch.fScale = m_fScale;
+    VEC3_ASN_OP(ch.f3Centre, =, m_f3Centre);
+    if (header != NULL)
+    {
+        ch.esri = *header;
+        ch.esri.index = NULL;
+    }
+    nPos = (sizeof(ch)+ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN;
+    for (s=0; s<CACHE_SECTIONS; s++)
+        if (nSections & (1u<<s))
+        {
+            ch.pnSection[s][0] = nPos;
+            ch.pnSection[s][1] = pnBytes[s];
+            ch.pnChecksum[s] = CacheChecksum(*ppData[s], pnBytes[s]);
+            nPos += (pnBytes[s]+ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN;
+        }
+
+    snprintf(szTmp, sizeof(szTmp), "%s.tmp", pszCache);
+    fp = fopen(szTmp, "wb");
+    bOK = (fp != NULL);
+    if (bOK)
+    {
+        bOK = (fwrite(&ch, sizeof(ch), 1, fp) == 1);
+        nPos = sizeof(ch);
+        for (s=0; bOK && (s<CACHE_SECTIONS); s++)
+            if (nSections & (1u<<s))
+            {
+                bOK = (fwrite(pPad, 1, (size_t)(ch.pnSection[s][0]-nPos), fp) == (size_t)(ch.pnSection[s][0]-nPos)) &&
+                    (fwrite(*ppData[s], 1, (size_t)pnBytes[s], fp) == (size_t)pnBytes[s]);
+                nPos = ch.pnSection[s][0]+pnBytes[s];
+            }
+        bOK = (fclose(fp) == 0) && bOK;
+    }
+    if (bOK && (rename(szTmp, pszCache) != 0))
+    {
+        remove(pszCache);
+        bOK = (rename(szTmp, pszCache) == 0);
+    }
+    if (!bOK)
+    {
+        remove(szTmp);
+        printf("Warning:\nThe cache file %s can't be written!\n", pszCache);
+        return;
+    }
+    m_nCacheSections = nSections;
+}
+
+// Bulk text input. The files are read in large blocks and the numbers are
+// converted with std::from_chars, which rounds like fscanf. A block of
+// numbers of known count is split into chunks that are parsed on the
+// worker threads. From the second block on, the one after it is read ahead
+// on a thread of its own while the block is parsed, so that a slow file
+// system and the parsing overlap.
+void TextOpen(struct TextBuffer* tb, FILE* fp)
+{
+    tb->fp = fp;
+    tb->nSize = TEXT_BLOCK;
+    tb->pBuf = (char *)MyMalloc(tb->nSize);
+    tb->nPos = tb->nLen = 0;
+    tb->bEOF = FALSE;
+    tb->nFills = 0;
+    tb->pAhead = NULL;
+    tb->nAheadPos = tb->nAheadLen = 0;
+    tb->bAheadEOF = FALSE;
+    tb->pReader = NULL;
+}
+
+// Waits for the block that is being read ahead.
+static void TextWait(struct TextBuffer* tb)
+{
+    if (tb->pReader!=NULL)
+    {
+        tb->pReader->join();
+        delete tb->pReader;
+        tb->pReader = NULL;
+    }
+}
+
+// Gives the bytes that have not been used, and those read ahead, back to
+// the file, so that it can be read on from there.
+void TextClose(struct TextBuffer* tb)
+{
+    TextWait(tb);
+    if (tb->nLen-tb->nPos+tb->nAheadLen-tb->nAheadPos>0)
+        fseek(tb->fp, -(long)(tb->nLen-tb->nPos+tb->nAheadLen-tb->nAheadPos), SEEK_CUR);
+    free(tb->pBuf);
+    free(tb->pAhead);
+    tb->pBuf = tb->pAhead = NULL;
+}
+
+// Moves up to nMax bytes of the file to p, first those read ahead, and
+// starts reading the next block ahead once the reader has come back for
+// more than one block.
+static size_t TextTake(struct TextBuffer* tb, char* p, size_t nMax)
+{
+    size_t n;
+
+    TextWait(tb);
+    n = (tb->nAheadLen-tb->nAheadPos<nMax) ? tb->nAheadLen-tb->nAheadPos : nMax;
+    if (n>0)
+    {
+        memcpy(p, tb->pAhead+tb->nAheadPos, n);
+        tb->nAheadPos += n;
+    }
+    if ((n<nMax) && !tb->bAheadEOF)
+    {
+        n += fread(p+n, 1, nMax-n, tb->fp);
+        tb->bAheadEOF = (n<nMax);
+    }
+    if ((++tb->nFills>1) && (tb->nAheadPos==tb->nAheadLen) && !tb->bAheadEOF)
+    {
+        if (tb->pAhead==NULL)
+            tb->pAhead = (char *)MyMalloc(TEXT_BLOCK);
+        tb->nAheadPos = tb->nAheadLen = 0;
+        tb->pReader = new std::thread([tb]{
+            tb->nAheadLen = fread(tb->pAhead, 1, TEXT_BLOCK, tb->fp);
+            tb->bAheadEOF = (tb->nAheadLen<TEXT_BLOCK);
+        });
+    }
+    return n;
+}
+
+// Keeps the bytes that have not been used and reads the next block after them.
+void TextFill(struct TextBuffer* tb)
+{
+    size_t n;
+
+    if (tb->bEOF)
+        return;
+    memmove(tb->pBuf, tb->pBuf+tb->nPos, tb->nLen-tb->nPos);
+    tb->nLen -= tb->nPos;
+    tb->nPos = 0;
+    if (tb->nLen==tb->nSize)
+    {
+        tb->nSize *= 2;
+        tb->pBuf = (char *)MyRealloc(tb->pBuf, tb->nSize);
+    }
+    n = TextTake(tb, tb->pBuf+tb->nLen, tb->nSize-tb->nLen);
+    tb->nLen += n;
+    if (tb->nLen<tb->nSize)
+        tb->bEOF = TRUE;
+}
+
+// Finds the next line, without its '\n'. The line is valid until the next
+// call.
+bool TextGetLine(struct TextBuffer* tb, const char** ppLine, const char** ppEnd)
+{
+    char *p;
+
+    for(;;)
+    {
+        p = (char *)memchr(tb->pBuf+tb->nPos, '\n', tb->nLen-tb->nPos);
+        if (p!=NULL)
+        {
+            *ppLine = tb->pBuf+tb->nPos;
+            *ppEnd = p;
+            tb->nPos = p+1-tb->pBuf;
+            return TRUE;
+        }
+        if (tb->bEOF)
+        {
+            if (tb->nPos==tb->nLen)
+                return FALSE;
+            *ppLine = tb->pBuf+tb->nPos;
+            *ppEnd = tb->pBuf+tb->nLen;
+            tb->nPos = tb->nLen;
+            return TRUE;
+        }
+        TextFill(tb);
+    }
+}
+
+// Reads the next number after the separators from p; returns the first
+// character after it, or NULL if there is no number.
+const char* ScanNumber(const char* p, const char* pEnd, double* v)
+{
+    while ((p<pEnd)&&IS_SEPARATOR(*p))
+        p++;
+    if ((p<pEnd)&&(*p=='+'))
+        p++;
+    std::from_chars_result r = std::from_chars(p, pEnd, *v);
+    return (r.ec==std::errc()) ? r.ptr : NULL;
+}
+
+const char* ScanNumber(const char* p, const char* pEnd, float* v)
+{
+    while ((p<pEnd)&&IS_SEPARATOR(*p))
+        p++;
+    if ((p<pEnd)&&(*p=='+'))
+        p++;
+    std::from_chars_result r = std::from_chars(p, pEnd, *v);
+    return (r.ec==std::errc()) ? r.ptr : NULL;
+}
+
+const char* ScanNumber(const char* p, const char* pEnd, int* v)
+{
+    while ((p<pEnd)&&IS_SEPARATOR(*p))
+        p++;
+    if ((p<pEnd)&&(*p=='+'))
+        p++;
+    std::from_chars_result r = std::from_chars(p, pEnd, *v);
+    return (r.ec==std::errc()) ? r.ptr : NULL;
+}
+
+// Stores the numbers of [p, pEnd) as numbers nFirst, nFirst+1, ... of nb, up
+// to its last one. *pnNum is set to the number stored and *ppLast to the end
+// of the last one; returns FALSE if a word is not a number.
+bool ParseNumberBlock(const char* p, const char* pEnd, struct NumberBlock* nb, int nFirst, int* pnNum, const char** ppLast)
+{
+    int g, r, nTotal;
+    const char* q = p;
+
+    nTotal = nb->nDouble+nb->nFloat+nb->nInt*nb->nIntGroup;
+    for (g=nFirst; g<nTotal; g++)
+    {
+        while ((p<pEnd)&&IS_SEPARATOR(*p))
+            p++;
+        if (p==pEnd)
+            break;
+        if (g<nb->nDouble)
+            q = ScanNumber(p, pEnd, nb->pdDouble+g);
+        else if (g-nb->nDouble<nb->nFloat)
+            q = ScanNumber(p, pEnd, nb->pfFloat+g-nb->nDouble);
+        else
+        {
+            r = g-nb->nDouble-nb->nFloat;
+            if (r%nb->nIntGroup)
+                q = ScanNumber(p, pEnd, nb->pnInt+(r/nb->nIntGroup)*(nb->nIntGroup-1)+r%nb->nIntGroup-1);
+            else
+                q = ScanNumber(p, pEnd, &r);
+        }
+        if ((q==NULL)||((q<pEnd)&&!IS_SEPARATOR(*q)))
+        {
+            *pnNum = g-nFirst;
+            *ppLast = p;
+            return FALSE;
+        }
+        p = q;
+    }
+    *pnNum = g-nFirst;
+    *ppLast = p;
+    return TRUE;
+}
+
+// As ParseNumberBlock, but [p, pEnd) is split into chunks at separators; the
+// numbers in each chunk are counted, and then the chunks are parsed on the
+// nThreads worker threads.
+bool ParseNumberChunks(const char* p, const char* pEnd, struct NumberBlock* nb, int nFirst, int nThreads, int* pnNum, const char** ppLast)
+{
+    int k, nChunks;
+    size_t nLen = pEnd-p;
+
+    nChunks = (nThreads>1) ? 4*nThreads : 1;
+    if ((nChunks==1)||(nLen<(1<<20)))
+        return ParseNumberBlock(p, pEnd, nb, nFirst, pnNum, ppLast);
+
+    std::vector<const char*> pBegin(nChunks+1);
+    std::vector<int> nStart(nChunks+1), nNum(nChunks);
+    std::vector<const char*> pLast(nChunks);
+    std::vector<char> bOK(nChunks);
+    pBegin[0] = p;
+    pBegin[nChunks] = pEnd;
+    for (k=1; k<nChunks; k++)
+    {
+        const char* q = p+nLen*k/nChunks;
+        if (q<pBegin[k-1])
+            q = pBegin[k-1];
+        while ((q<pEnd)&&!IS_SEPARATOR(*q))
+            q++;
+        pBegin[k] = q;
+    }
+
+    // count the words of each chunk
+    RunParallel(nThreads, 0, nChunks, [&](int nFrom, int nTo) {
+        for (int c=nFrom; c<nTo; c++)
+        {
+            int n = 0;
+            bool bSep = TRUE;
+            for (const char* q=pBegin[c]; q<pBegin[c+1]; q++)
+            {
+                if (IS_SEPARATOR(*q))
+                    bSep = TRUE;
+                else if (bSep)
+                {
+                    n++;
+                    bSep = FALSE;
+                }
+            }
+            nStart[c+1] = n;
+        }
+    });
+    nStart[0] = nFirst;
+    for (k=0; k<nChunks; k++)
+        nStart[k+1] += nStart[k];
+
+    RunParallel(nThreads, 0, nChunks, [&](int nFrom, int nTo) {
+        for (int c=nFrom; c<nTo; c++)
+            bOK[c] = ParseNumberBlock(pBegin[c], pBegin[c+1], nb, nStart[c], &nNum[c], &pLast[c]);
+    });
+
+    // the block ends where a chunk fails or stops short of its words
+    *pnNum = 0;
+    *ppLast = p;
+    for (k=0; k<nChunks; k++)
+    {
+        *pnNum += nNum[k];
+        if (nNum[k]>0)
+            *ppLast = pLast[k];
+        if (!bOK[k])
+        {
+            *ppLast = pLast[k];
+            return FALSE;
+        }
+        if (nStart[k]+nNum[k]<nStart[k+1])
+            break;
+    }
+    return TRUE;
+}
+
+// Reads all the numbers of nb from tb and returns how many were read.
+int TextReadNumbers(struct TextBuffer* tb, struct NumberBlock* nb, int nThreads)
+{
+    int nDone, nNum, nTotal;
+    size_t nEnd;
+    const char* pLast;
+    bool bOK;
+
+    nTotal = nb->nDouble+nb->nFloat+nb->nInt*nb->nIntGroup;
+    nDone = 0;
+    while (nDone<nTotal)
+    {
+        // only parse up to the last separator, the rest may be a cut number
+        nEnd = tb->nLen;
+        if (!tb->bEOF)
+            while ((nEnd>tb->nPos)&&!IS_SEPARATOR(tb->pBuf[nEnd-1]))
+                nEnd--;
+        if (nEnd==tb->nPos)
+        {
+            if (tb->bEOF)
+                break;
+            TextFill(tb);
+            continue;
+        }
+        bOK = ParseNumberChunks(tb->pBuf+tb->nPos, tb->pBuf+nEnd, nb, nDone, nThreads, &nNum, &pLast);
+        nDone += nNum;
+        if (!bOK)
+        {
+            tb->nPos = pLast-tb->pBuf;
+            break;
+        }
+        tb->nPos = (nDone<nTotal) ? nEnd : pLast-tb->pBuf;
+    }
+    return nDone;
+}
+
+// Parses the .xyz lines of [p, pEnd) into pf3Vertex and returns the number of
+// points. A line is a point if its first character is not below '0' and it
+// starts with three numbers; the rest of the line is ignored.
+int ParseXYZLines(const char* p, const char* pEnd, FVECTOR3* pf3Vertex)
+{
+    int n = 0;
+    const char *pLine, *q;
+
+    while (p<pEnd)
+    {
+        q = (const char *)memchr(p, '\n', pEnd-p);
+        if (q==NULL)
+            q = pEnd;
+        pLine = p;
+        p = (q<pEnd) ? q+1 : pEnd;
+        while ((pLine<q)&&IS_SEPARATOR(*pLine))
+            pLine++;
+        if ((pLine<q)&&!(*pLine<'0')&&
+            ((pLine=ScanNumber(pLine, q, &(pf3Vertex[n][0])))!=NULL)&&
+            ((pLine=ScanNumber(pLine, q, &(pf3Vertex[n][1])))!=NULL)&&
+            (ScanNumber(pLine, q, &(pf3Vertex[n][2]))!=NULL))
+            n++;
+    }
+    return n;
+}
+
+// Reads the points of an .xyz file into *ppf3Vertex, allocated with MyMalloc,
+// and returns their number. The whole lines in tb are split in chunks, which
+// are parsed on the nThreads worker threads.
+int TextReadXYZ(struct TextBuffer* tb, FVECTOR3** ppf3Vertex, int nThreads)
+{
+    int k, nChunks, nNum, nBase, nAlloc;
+    size_t nEnd, nLen;
+    const char *p, *pEnd;
+    FVECTOR3* pf3Vertex;
+
+    nAlloc = 10000;
+    pf3Vertex = (FVECTOR3 *)MyMalloc(nAlloc*sizeof(FVECTOR3));
+    nNum = 0;
+    for(;;)
+    {
+        // only parse up to the last '\n', the rest may be a cut line
+        nEnd = tb->nLen;
+        if (!tb->bEOF)
+            while ((nEnd>tb->nPos)&&(tb->pBuf[nEnd-1]!='\n'))
+                nEnd--;
+        if (nEnd==tb->nPos)
+        {
+            if (tb->bEOF)
+                break;
+            TextFill(tb);
+            continue;
+        }
+        p = tb->pBuf+tb->nPos;
+        pEnd = tb->pBuf+nEnd;
+        nLen = pEnd-p;
+        nChunks = ((nThreads>1)&&(nLen>=(1<<20))) ? 4*nThreads : 1;
+
+        std::vector<const char*> pBegin(nChunks+1);
+        std::vector<int> nStart(nChunks+1), nDone(nChunks);
+        pBegin[0] = p;
+        pBegin[nChunks] = pEnd;
+        for (k=1; k<nChunks; k++)
+        {
+            const char* q = p+nLen*k/nChunks;
+            if (q<pBegin[k-1])
+                q = pBegin[k-1];
+            q = (const char *)memchr(q, '\n', pEnd-q);
+            pBegin[k] = (q==NULL) ? pEnd : q+1;
+        }
+
+        // the lines of each chunk bound its points
+        RunParallel(nThreads, 0, nChunks, [&](int nFrom, int nTo) {
+            for (int c=nFrom; c<nTo; c++)
+            {
+                int n = 1;
+                for (const char* q=pBegin[c]; (q<pBegin[c+1])&&((q=(const char *)memchr(q, '\n', pBegin[c+1]-q))!=NULL); q++)
+                    n++;
+                nStart[c+1] = n;
+            }
+        });
+        nStart[0] = 0;
+        for (k=0; k<nChunks; k++)
+            nStart[k+1] += nStart[k];
+        if (nNum+nStart[nChunks]>nAlloc)
+        {
+            nAlloc = std::max(2*nAlloc, nNum+nStart[nChunks]);
+            pf3Vertex = (FVECTOR3 *)MyRealloc(pf3Vertex, nAlloc*sizeof(FVECTOR3));
+        }
+
+        RunParallel(nThreads, 0, nChunks, [&](int nFrom, int nTo) {
+            for (int c=nFrom; c<nTo; c++)
+                nDone[c] = ParseXYZLines(pBegin[c], pBegin[c+1], pf3Vertex+nNum+nStart[c]);
+        });
+        // close the gaps of the lines without a point
+        nBase = nNum;
+        for (k=0; k<nChunks; k++)
+        {
+            if (nNum<nBase+nStart[k])
+                memmove(pf3Vertex+nNum, pf3Vertex+nBase+nStart[k], nDone[k]*sizeof(FVECTOR3));
+            nNum += nDone[k];
+        }
+        tb->nPos = nEnd;
+    }
+    *ppf3Vertex = pf3Vertex;
+    return nNum;
+}
+
+// Reads the faces and vertices of an .off or .ply2 body.
+bool CDenoiser::TextReadMesh(FILE* fp)
+{
+    struct TextBuffer tb;
+    struct NumberBlock nb;
+    int nNum;
+
+    memset(&nb, 0, sizeof(nb));
+    nb.nFloat = 3*m_nNumVertex;
+    nb.pfFloat = &(m_pf3Vertex[0][0]);
+    nb.nInt = m_nNumFace;
+    nb.pnInt = &(m_pn3Face[0][0]);
+    nb.nIntGroup = 4;
+    TextOpen(&tb, fp);
+    nNum = TextReadNumbers(&tb, &nb, m_nThreads);
+    TextClose(&tb);
+    return nNum==nb.nFloat+4*nb.nInt;
+}
+
+void CDenoiser::ReadGTS(FILE* fp)
+{
+    int i;
+    int tmp, tmp1, tmp2, tmp3;
+    char sTmp[200],sTmp1[200];
+    NVECTOR2 *edge;
+
+    do
+    {
+        fgets(sTmp, 200, fp);
+        sscanf(sTmp, "%s", sTmp1);
+    }while (sTmp1[0]=='#');
+
+
+    i = sscanf(sTmp,"%d%d%d", &m_nNumVertex, &tmp, &m_nNumFace);
+    while(i!=3)
+    {
+        i = fscanf(fp,"%d%d%d", &m_nNumVertex, &tmp, &m_nNumFace);
+    }
+
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    edge = new NVECTOR2[tmp];
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+
+    for (i=0;i<m_nNumVertex;i++)
+    {
+        fgets(sTmp, 200, fp);
+        sscanf(sTmp,"%f%f%f", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));
+    }
+    for (i=0;i<tmp;i++)
+    {
+        fscanf(fp,"%d%d", &(edge[i][0]), &(edge[i][1]));
+    }
+    for (i=0;i<m_nNumFace;i++)
+    {
+        fscanf(fp,"%d%d%d", &tmp1, &tmp2, &tmp3);
+        m_pn3Face[i][0] = edge[tmp1-1][0]-1;
+        m_pn3Face[i][1] = edge[tmp1-1][1]-1;
+        if ((edge[tmp2-1][0] == edge[tmp1-1][0])||(edge[tmp2-1][0] == edge[tmp1-1][1]))
+            m_pn3Face[i][2] = edge[tmp2-1][1]-1;
+        else
+            m_pn3Face[i][2] = edge[tmp2-1][0]-1;
+    }
+    delete []edge;
+}
+
+void CDenoiser::ReadOBJ(FILE* fp)
+{
+    int i, j;
+    int pnIndex[5];
+    struct TextBuffer tb;
+    const char *pLine, *pEnd, *p;
+    FVECTOR3 *vVertex;
+    NVECTOR3 * tTriangle;
+
+    vVertex = (FVECTOR3 *)MyMalloc(10000* sizeof(FVECTOR3));
+    tTriangle = (NVECTOR3 *)MyMalloc(10002* sizeof(NVECTOR3));
+
+    m_nNumVertex = m_nNumFace = 0;
+    TextOpen(&tb, fp);
+    while (TextGetLine(&tb, &pLine, &pEnd))
+    {
+        // skip the keyword
+        for (p=pLine; (p<pEnd)&&!IS_SEPARATOR(*p); p++)
+            ;
+        if((pLine<pEnd)&&(pLine[0]=='v'))
+        {
+            if((pLine+1<pEnd)&&((pLine[1]=='t')||(pLine[1]=='n')))
+            {
+                printf("This OBJ file is not supported!\n");
+                m_nNumVertex = m_nNumFace = 0;
+                free(vVertex);
+                free(tTriangle);
+                TextClose(&tb);
+                return;
+            }
+            else
+            {
+                for (j=0; (j<3)&&(p!=NULL); j++)
+                    p = ScanNumber(p, pEnd, &(vVertex[m_nNumVertex][j]));
+                m_nNumVertex++;
+                if (!(m_nNumVertex % 10000))
+                    vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10000)* sizeof(FVECTOR3));
+            }
+        }
+        else if((pLine<pEnd)&&(pLine[0]=='f'))
+        {
+            // count the vertex indices as sscanf("%d") would, "1/2/3" stops after the 1
+            for (j=0; j<5; j++)
+            {
+                p = ScanNumber(p, pEnd, pnIndex+j);
+                if (p==NULL)
+                    break;
+                if ((p<pEnd)&&!IS_SEPARATOR(*p))
+                {
+                    j++;
+                    break;
+                }
+            }
+            VEC3_ASN_OP(tTriangle[m_nNumFace], =, pnIndex);
+            if (j==3)
+            {
+                tTriangle[m_nNumFace][0]--;
+                tTriangle[m_nNumFace][1]--;
+                tTriangle[m_nNumFace][2]--;
+            }
+            else if(j==4)
+            {
+                tTriangle[m_nNumFace][0]--;
+                tTriangle[m_nNumFace][1]--;
+                tTriangle[m_nNumFace][2]--;
+                m_nNumFace++;
+                if (!(m_nNumFace % 10000))
+                    tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10002)* sizeof(NVECTOR3));
+                tTriangle[m_nNumFace][0] = tTriangle[m_nNumFace-1][2];
+                tTriangle[m_nNumFace][1] = pnIndex[3]-1;
+                tTriangle[m_nNumFace][2] = tTriangle[m_nNumFace-1][0];
+            }
+            else
+            {
+                printf("This OBJ file is not supported!\n");
+                m_nNumVertex = m_nNumFace = 0;
+                free(vVertex);
+                free(tTriangle);
+                TextClose(&tb);
+                return;
+            }
+            m_nNumFace++;
+            if (!(m_nNumFace % 10000))
+                tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10002)* sizeof(NVECTOR3));
+        }
+    }
+    TextClose(&tb);
+
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[i]);
+    }
+    free(vVertex);
+
+     m_pn3Face = new NVECTOR3[m_nNumFace];
+    for(i=0; i<m_nNumFace; i++)
+    {
+        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+    }
+    free(tTriangle);
+}
+
+void CDenoiser::ReadOFF(FILE* fp)
+{
+    int j;
+    char tmp[300];
+
+    fscanf(fp,"%s", tmp);
+    if ((strncmp(tmp, "OFF",3))||(fscanf(fp,"%d %d %d",&m_nNumVertex,&m_nNumFace, &j)<2))
+    {
+        printf("The file is not a valid OFF one!111\n");
+        m_nNumVertex = m_nNumFace = 0;
+        return;
+    }
+
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+
+    if (!TextReadMesh(fp))
+        printf("Warning: the OFF file ends before all vertices and faces are read!\n");
+}
+
+void CDenoiser::ReadPLY(FILE* fp)
+{
+    int i,j;
+    char seps[]  = " ,\t\n\r";
+    char sTmp[200], *sTmp1;
+    int plyType = PLY_ASCII;
+    int nVFreeByte = 0;
+
+    fgets(sTmp, 200, fp);
+    sTmp[3] ='\0';
+
+    if (strcicmp(sTmp, "ply"))
+    {
+        printf("This file is not a valid PLY one!");
+        m_nNumVertex = m_nNumFace = 0;
+        return;
+    }
+
+
+    //read the file header
+    while (!feof(fp))
+    {
+        fgets(sTmp, 200, fp);
+        sTmp1 = strtok(sTmp, seps);
+        if (!strcicmp(sTmp1, "format"))
+        {
+        //    sscanf(sTmp+6 , "%s", sTmp1);       
+            sTmp1 = strtok( NULL, seps );
+            if (!strcicmp(sTmp1, "ascii"))
+                plyType = PLY_ASCII;
+            else if (!strcicmp(sTmp1, "binary_little_endian"))
+                plyType = PLY_BLITTLE;
+            else if (!strcicmp(sTmp1, "binary_big_endian"))
+                plyType = PLY_BBIG;
+            else
+            {
+                printf("This format is not supported.!\n");
+                return;
+            }
+            sTmp1 = strtok(NULL,seps);
+            if (strcicmp(sTmp1, "1.0"))
+            {
+                printf("Only PLY format version 1.0 is supported!");
+                return;
+            }
+            break;
+        }
+    }
+
+    m_nNumVertex = 0;
+    m_nNumFace = 0;
+    bool bVertex = FALSE;
+    bool bFace = FALSE;
+    while (!feof(fp))
+    {
+        fgets(sTmp,200,fp);
+        sTmp1 = strtok(sTmp, seps);
+        if (!strcicmp(sTmp, "element"))
+        {
+            sTmp1 = strtok(NULL,seps);
+            if (!strcicmp(sTmp1, "vertex"))
+            {
+                sTmp1 = strtok(NULL,seps);
+                m_nNumVertex = atoi(sTmp1);
+                bVertex = TRUE;
+                bFace = FALSE;
+            }
+            else if (!strcicmp(sTmp1, "face"))
+            {
+                sTmp1 = strtok(NULL,seps);
+                m_nNumFace = atoi(sTmp1);
+                bVertex = FALSE;
+                bFace = TRUE;
+            }
+            else
+            {
+                bVertex = FALSE;
+                bFace = FALSE;
+            }
+        }
+        else if (!strcicmp(sTmp, "property"))
+        {
+            if(bVertex)
+            {
+                sTmp1 = strtok(NULL,seps);
+                if (!(strcicmp(sTmp1, "float")&&strcicmp(sTmp1, "float32")))
+                {
+                    sTmp1 = strtok(NULL,seps);
+                    if (strcicmp(sTmp1, "x")&& strcicmp(sTmp1, "y")&& strcicmp(sTmp1, "z"))
+                        nVFreeByte += 4;
+                }
+                else if (!strcicmp(sTmp1, "char"))
+                        nVFreeByte += 1;
+                else if (!strcicmp(sTmp1, "uchar"))
+                        nVFreeByte += 1;
+                else if (!strcicmp(sTmp1, "uint8"))
+                        nVFreeByte += 1;
+                else if (!strcicmp(sTmp1, "short"))
+                        nVFreeByte += 2;
+                else if (!strcicmp(sTmp1, "ushort"))
+                        nVFreeByte += 2;
+                else if (!strcicmp(sTmp1, "int"))
+                        nVFreeByte += 4;
+                else if (!strcicmp(sTmp1, "uint"))
+                        nVFreeByte += 4;
+                else if (!strcicmp(sTmp1, "double"))
+                        nVFreeByte += 8;
+            }
+            else if(bFace)
+            {
+                //to be further developped.
+            }
+        }
+        else if (!strcicmp(sTmp1, "end_header"))
+            break;
+    }
+
+    if (plyType==PLY_ASCII)
+    {
+        m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+        m_pn3Face = new NVECTOR3[m_nNumFace];
+   
+        for (i=0;i<m_nNumVertex;i++)
+        {
+            fgets(sTmp,200,fp);
+            j = sscanf(sTmp,"%f%f%f", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));
+                    if (j!=3)
+                        break;
+        }
+        for (i=0;i<m_nNumFace;i++)
+        {
+            fgets(sTmp,200,fp);   
+            sscanf(sTmp,"%d%d%d%d,", &j, &(m_pn3Face[i][0]), &(m_pn3Face[i][1]), &(m_pn3Face[i][2]));
+        }
+    }
+    else // PLY_BBIG and PLYBLITTLE
+    {
+        m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+        m_pn3Face = new NVECTOR3[m_nNumFace];
+
+        for (i=0; i<m_nNumVertex; i++)
+        {
+            fread(&(m_pf3Vertex[i]),sizeof(float),3,fp);
+            if (plyType==PLY_BBIG)
+            {
+                char* c = (char*) &(m_pf3Vertex[i][0]);
+                char cTmp;
+               
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+                float *x = (float *) &c[0];
+                m_pf3Vertex[i][0] = *x;
+
+                c = (char*) &(m_pf3Vertex[i][1]);
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+                x = (float *) &c[0];
+                m_pf3Vertex[i][1] = *x;
+
+                c = (char*) &(m_pf3Vertex[i][2]);
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+                x = (float *) &c[0];
+                m_pf3Vertex[i][2] = *x;
+            }
+            // special///////////////////////////////////
+            if (nVFreeByte != 0)
+            {
+                char cTmp[200];
+                fread(cTmp,sizeof(char),nVFreeByte,fp);
+            }
+        }
+        for (i=0; i<m_nNumFace; i++)
+        {
+            unsigned char cTmp;
+            fread(&cTmp,sizeof(unsigned char),1,fp);
+            fread(&(m_pn3Face[i]),sizeof(int),3,fp);
+            if (plyType==PLY_BBIG)
+            {
+                char* c = (char*) &(m_pn3Face[i][0]);
+                char cTmp;
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+
+                c = (char*) &(m_pn3Face[i][1]);
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+
+                c = (char*) &(m_pn3Face[i][2]);
+                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
+                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+
+            }
+        }
+        return;
+    }
+}
+
+void CDenoiser::ReadPLY2(FILE* fp)
+{
+
+    if(fscanf(fp,"%d%d",&m_nNumVertex,&m_nNumFace)!=2)
+    {
+        printf("This is not a valid PLY2 file!\n");
+        m_nNumVertex = m_nNumFace = 0;
+        return;
+    }
+
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+
+    if (!TextReadMesh(fp))
+        printf("Warning: the PLY2 file ends before all vertices and faces are read!\n");
+}
+
+void CDenoiser::ReadSMF(FILE* fp)
+{
+    int i;
+    char sTmp[200], sTmp1[200];
+
+    FVECTOR3 *vVertex;
+    NVECTOR3 * tTriangle;
+
+    vVertex = (FVECTOR3 *)MyMalloc(10000* sizeof(FVECTOR3));
+    tTriangle = (NVECTOR3 *)MyMalloc(10000* sizeof(NVECTOR3));
+
+    m_nNumVertex = m_nNumFace = 0;
+    while (!feof(fp))
+    {
+        fgets(sTmp, 200, fp);
+        if(sTmp[0]=='v')
+        {
+            sscanf(sTmp,"%s%f%f%f", sTmp1, &(vVertex[m_nNumVertex][0]), \
+                &(vVertex[m_nNumVertex][1]),&(vVertex[m_nNumVertex][2]));
+            m_nNumVertex +=1;
+            if (!(m_nNumVertex % 10000))
+                vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10000)* sizeof(FVECTOR3));
+        }
+        else if((sTmp[0]=='t')||(sTmp[0]=='f'))
+        {
+            sscanf(sTmp,"%s%d%d%d", sTmp1, &(tTriangle[m_nNumFace][0]), \
+                &(tTriangle[m_nNumFace][1]),&(tTriangle[m_nNumFace][2]));
+            tTriangle[m_nNumFace][0]--;
+            tTriangle[m_nNumFace][1]--;
+            tTriangle[m_nNumFace][2]--;
+            m_nNumFace +=1;
+            if (!(m_nNumFace % 10000))
+                tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10000)* sizeof(NVECTOR3));
+        }
+    }
+
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[i]);
+    }
+    free(vVertex);
+
+     m_pn3Face = new NVECTOR3[m_nNumFace];
+    for(i=0; i<m_nNumFace; i++)
+    {
+        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+    }
+    free(tTriangle);
+}
+
+void CDenoiser::ReadSTL(FILE* fp)
+{
+    int i, j, k, m;
+    int nTmp, nTmp1, nTmp2;
+    char sTmp[200], sTmp1[40], sTmp2[40];
+    FVECTOR3 *vVertex;
+    NVECTOR3 *tTriangle;
+    int *indexVertex;
+    int **iiVertex;
+    bool *biVertex;
+
+    m_nNumVertex = m_nNumFace = 0;
+    vVertex = (FVECTOR3 *)MyMalloc(10002* sizeof(FVECTOR3));
+    while(!feof(fp))  //read the vertex data
+    {
+        fgets(sTmp, 200, fp);
+        sscanf(sTmp,"%s%s", sTmp1, sTmp2);
+        if(!(strcicmp(sTmp1, "outer")) && !(strcicmp(sTmp2,"loop")))
+        {
+            for(i=0; i<3; i++)
+            {
+                fgets(sTmp, 200, fp);
+                sscanf(sTmp,"%s%f%f%f", sTmp1, &vVertex[m_nNumVertex][0],\
+                    &vVertex[m_nNumVertex][1], &vVertex[m_nNumVertex][2]);
+                if(strcicmp(sTmp1,"vertex"))
+                {
+                    printf("This STL file is not supported!\n");
+                    m_nNumVertex = m_nNumFace = 0;
+                    free(vVertex);
+                    return;
+                }
+                else
+                {
+                    m_nNumVertex++;
+                    if (!(m_nNumVertex % 10000))
+                    vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10002)* sizeof(FVECTOR3));
+                }
+            }
+            fgets(sTmp, 200, fp);
+            sscanf(sTmp,"%s", sTmp1);
+            if(strcicmp(sTmp1,"endloop"))
+            {
+                printf("This STL file is not supported!\n");
+                m_nNumVertex = m_nNumFace = 0;
+                free(vVertex);
+                return;
+            }
+        }   
+    }
+
+    indexVertex = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    biVertex = (bool *)MyMalloc(m_nNumVertex*sizeof(bool));
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        indexVertex[i] = i;
+        biVertex[i]=TRUE;
+    }
+
+    m_nNumFace = m_nNumVertex/3;
+    tTriangle = (NVECTOR3 *)MyMalloc(m_nNumFace* sizeof(NVECTOR3));
+    iiVertex =(int **) MyMalloc(m_nNumVertex * sizeof(int *));
+
+    nTmp = 0; // nTmp is now the number of deleted vertices
+    for(i=0; i<m_nNumFace; i++) //get rid of the redundant vertex data
+    {
+        for(m=0; m<3; m++)
+        {
+            if(biVertex[3*i+m]) //the vertex 3*i+m has no identical one
+            {
+                iiVertex[3*i+m] = (int *)MyMalloc(6*sizeof(int));
+                nTmp1 = 0;
+                for(j=i+1; j<m_nNumFace; j++)
+                {
+                    for(k=0; k<3; k++)
+                    {
+                        if(biVertex[3*j+k]) //the vertex 3*j+k has no identical one
+                        {
+                            if(VEC3_EQ(vVertex[3*j+k], vVertex[3*i+m]))//vertex 3*j+k is identical to 3*i+m
+                            {
+                                indexVertex[3*j+k] = indexVertex[3*i+m];
+                                biVertex[3*j+k] = FALSE;
+                                iiVertex[3*i+m][++nTmp1] =3*j+k;
+                                iiVertex[3*i+m][0] = nTmp1;
+                                nTmp++;
+                                if(!(nTmp1%5))
+                                    iiVertex[3*i+m] = (int *)MyRealloc(iiVertex[3*i+m], (nTmp1+6)*sizeof(int));
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        tTriangle[i][0]=indexVertex[3*i];
+        tTriangle[i][1]=indexVertex[3*i+1];
+        tTriangle[i][2]=indexVertex[3*i+2];
+    }
+
+    j=m_nNumVertex-1;
+    for(i=0; i<m_nNumVertex-nTmp; i++)
+    {
+        if(!biVertex[i])
+        {
+            while(!biVertex[j])
+            {
+                j--;
+            }
+            indexVertex[i] = j;
+            indexVertex[j] = i;   
+            for(k=1; k<iiVertex[j][0]+1; k++)
+            {
+                indexVertex[iiVertex[j][k]] = i;
+            }
+            j--;
+        }
+    }
+   
+    for(i=m_nNumVertex-nTmp; i<m_nNumVertex;i++)
+    {
+            nTmp1 = i/3;
+            nTmp2 = i%3;
+            tTriangle[nTmp1][nTmp2] = indexVertex[i];
+    }
+
+    m_nNumVertex = m_nNumVertex-nTmp;
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    for(i=0; i<m_nNumVertex; i++)
+        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[indexVertex[i]]);
+
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+    for(i=0; i<m_nNumFace; i++)
+        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+
+    for(i=0; i<m_nNumVertex+nTmp; i++)
+    {
+        if(biVertex[i])
+            free(iiVertex[i]);
+    }
+    free(iiVertex);
+    free(indexVertex);
+    free(biVertex);
+    free(vVertex);
+    free(tTriangle);
+}
+
+void CDenoiser::ReadWRL(FILE* fp)
+{
+    int i,j;
+    char sTmp[200], *tmp, *sTmp1;
+    char seps[]  = " ,\t\n";
+    FVECTOR3    tmpV;
+    NVECTOR3    tmpT;
+    FVECTOR3*    fVertex ;
+    NVECTOR3*   nTriangle;
+
+    m_nNumVertex = 0;
+//    char* key = "point [";
+    fVertex = (FVECTOR3*) MyMalloc(1000*sizeof(FVECTOR3));
+    tmp = new char[100];
+    fscanf(fp,"%s", tmp);
+    //while (tmp!="")
+    while (*tmp != '\0')
+    {
+        fscanf(fp,"%s", tmp);
+        if(!strcicmp(tmp,"point"))
+        {
+            fscanf(fp,"%s", tmp);
+            if(!strcicmp(tmp,"["))
+            {
+                while (TRUE)
+                {
+                    j = fscanf(fp,"%f%f%f,", &tmpV[0], &tmpV[1], &tmpV[2]);
+                    if (j!=3)
+                        break;
+                    VEC3_ASN_OP(fVertex[m_nNumVertex],=, tmpV);
+                    m_nNumVertex +=1;
+                    if(!(m_nNumVertex %1000))
+                        fVertex = (FVECTOR3* )MyRealloc(fVertex, (m_nNumVertex+1000)*sizeof(FVECTOR3));
+                }
+                break;
+            }
+        }
+    }
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    for (i =0; i<m_nNumVertex; i++)
+        VEC3_ASN_OP(m_pf3Vertex[i], =, fVertex[i]);
+    free(fVertex);
+
+    m_nNumFace = 0;
+//    key = "coordIndex [";
+    nTriangle = (NVECTOR3*) MyMalloc(1000*sizeof(NVECTOR3));
+    fscanf(fp,"%s", tmp);
+    //while (tmp!="")
+    while (*tmp != '\0')
+    {
+        if(!strcicmp(tmp,"coordIndex"))
+        {
+            fscanf(fp,"%s", tmp);
+            if(!strcicmp(tmp,"["))
+            {
+                fgets(sTmp, 200, fp);
+                while (TRUE)
+                {
+                    fgets(sTmp, 200, fp);
+                    sTmp1 = strtok(sTmp, seps);
+                    for(i=0; i<3;i++)
+                    {
+                        if(sTmp1!=NULL)
+                        {
+                            sscanf(sTmp1, "%d",&tmpT[i]);
+                        }
+                        else
+                            break;
+                        sTmp1 = strtok( NULL, seps );
+                    }
+                    //sTmp1 = strtok(sTmp, seps);
+                    if(sTmp1!=NULL)
+                    {
+                        i=sscanf(sTmp1,"%d,", &j);
+                    }
+                    else
+                        break;
+                    if ((i == 0) ||(j!=-1))
+                        break;
+                    VEC3_ASN_OP(nTriangle[m_nNumFace], =, tmpT);
+                    m_nNumFace +=1;
+                    if(!(m_nNumFace %1000))
+                        nTriangle = (NVECTOR3* )MyRealloc(nTriangle, (m_nNumFace+1000)*sizeof(NVECTOR3));
+                }
+                break;
+            }
+        }
+        else
+            fscanf(fp,"%s", tmp);
+    }
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+    for (i =0; i<m_nNumFace; i++)
+        VEC3_ASN_OP(m_pn3Face[i], =, nTriangle[i]);
+    free(nTriangle);
+    delete tmp;
+}
+
+//extern void triangulate(char *, struct triangulateio *,
+//                struct triangulateio *, struct triangulateio *);
+void CDenoiser::ReadXYZ(FILE* fp)
+{
+    int i,nTmp;
+    struct triangulateio in, out, vorout;
+    struct TextBuffer tb;
+    FVECTOR3 *vVertex;
+
+    TextOpen(&tb, fp);
+    m_nNumVertex = TextReadXYZ(&tb, &vVertex, m_nThreads);
+    TextClose(&tb);
+
+    printf("\nTriangulation...\n");
+    if ((m_nTiles>1)&&m_bAddVertices)
+        printf("Warning:\nVertices can only be added to the whole point cloud!\nIt is triangulated in one piece!\n");
+    else if ((m_nTiles>1)&&(m_nNumVertex>=3))
+    {
+        // the points are the vertices, the tiles only give the faces
+        m_nModelAlloc = MODEL_MALLOC;
+        m_pf3Vertex = (FVECTOR3 *)MyRealloc(vVertex, m_nNumVertex*sizeof(FVECTOR3));
+        if (TriangulateTiles())
+            return;
+        printf("Warning:\nThe tiles do not stitch into one triangulation!\nThe whole point cloud is triangulated!\n");
+        vVertex = m_pf3Vertex;
+        m_pf3Vertex = NULL;
+        m_nModelAlloc = MODEL_NEW;
+    }
+
+    in.numberofpoints=m_nNumVertex;
+    in.numberofpointattributes = 1;
+    in.pointlist = (REAL *) MyMalloc(in.numberofpoints * 2 * sizeof(REAL));
+    in.pointattributelist = (REAL *) MyMalloc(in.numberofpoints * in.numberofpointattributes * sizeof(REAL));
+    for(i=0;i<m_nNumVertex;i++)
+    {
+        in.pointlist[i*2]=vVertex[i][0];
+        in.pointlist[i*2+1]=vVertex[i][1];
+        in.pointattributelist[i]=vVertex[i][2];
+    }
+    free(vVertex);
+    in.pointmarkerlist=(int *) NULL;
+
+    out.pointlist = (REAL *) NULL;
+    out.pointattributelist = (REAL *) NULL;
+    out.trianglelist = (int *) NULL;
+
+    if(m_bAddVertices)
+        triangulate(const_cast<char*>("zqBQ"),&in,&out,&vorout);
+    else
+        triangulate(const_cast<char*>("zBQ"),&in,&out,&vorout);
+
+    m_nNumVertex = out.numberofpoints;
+    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
+    for (i=0; i<m_nNumVertex; i++)
+    {
+        m_pf3Vertex[i][0]=out.pointlist[2*i];
+        m_pf3Vertex[i][1]=out.pointlist[2*i+1];
+        m_pf3Vertex[i][2]=out.pointattributelist[i];
+    }
+
+    m_nNumFace = out.numberoftriangles;
+    m_pn3Face = new NVECTOR3[m_nNumFace];
+    for (i=0; i<m_nNumFace; i++)
+    {
+        m_pn3Face[i][0] = out.trianglelist[3*i];
+        m_pn3Face[i][1] = out.trianglelist[3*i+1];
+        m_pn3Face[i][2] = out.trianglelist[3*i+2];
+    }
+    free(in.pointlist);
+    free(in.pointattributelist);
+    free(in.pointmarkerlist);
+    free(out.pointlist);
+    free(out.pointattributelist);
+    free(out.trianglelist);
+}
+
+// Centre and radius of the circumcircle of a, b and c, and in pdCircle
+// (xmin, ymin, xmax, ymax) the box of its part within pdAll, the box of all
+// the points. Returns FALSE if a, b and c are on a line.
+static bool CircleBox(const float* a, const float* b, const float* c, const double* pdAll, double* pdU, double* pdR, double* pdCircle)
+{
+    int i;
+    double d, r, dist, w, pdB[2], pdC[2];
+
+    for (i=0; i<2; i++)
+    {
+        pdB[i] = (double)b[i]-a[i];
+        pdC[i] = (double)c[i]-a[i];
+    }
+    d = 2*(pdB[0]*pdC[1]-pdB[1]*pdC[0]);
+    if (d==0)
+        return FALSE;
+    pdU[0] = (pdC[1]*(pdB[0]*pdB[0]+pdB[1]*pdB[1])-pdB[1]*(pdC[0]*pdC[0]+pdC[1]*pdC[1]))/d;
+    pdU[1] = (pdB[0]*(pdC[0]*pdC[0]+pdC[1]*pdC[1])-pdC[0]*(pdB[0]*pdB[0]+pdB[1]*pdB[1]))/d;
+    *pdR = r = sqrt(pdU[0]*pdU[0]+pdU[1]*pdU[1]);
+    pdU[0] += a[0];
+    pdU[1] += a[1];
+    for (i=0; i<2; i++)
+    {
+        // extent along axis i of the circle within the band of pdAll across it
+        dist = std::max(0.0, std::max(pdAll[1-i]-pdU[1-i], pdU[1-i]-pdAll[3-i]));
+        w = (dist<r) ? sqrt(r*r-dist*dist) : 0;
+        w += 1e-6*r;
+        pdCircle[i] = std::max(pdU[i]-w, pdAll[i]);
+        pdCircle[i+2] = std::min(pdU[i]+w, pdAll[i+2]);
+    }
+    return TRUE;
+}
+
+// Tile of the point (x, y): pdX holds the nTiles+1 column bounds, and pdY the
+// nTiles+1 row bounds of each column in turn.
+static int TileOf(double x, double y, const double* pdX, const double* pdY, int nTiles)
+{
+    int k, j;
+    const double* pdRow;
+
+    k = (int)(std::upper_bound(pdX+1, pdX+nTiles, x)-(pdX+1));
+    pdRow = pdY+k*(nTiles+1);
+    j = (int)(std::upper_bound(pdRow+1, pdRow+nTiles, y)-(pdRow+1));
+    return k*nTiles+j;
+}
+
+// Twice the signed area of p, q, r: positive if they turn counterclockwise.
+// Exact in sign when the coordinate differences take at most 26 bits.
+static double Orient(const float* p, const float* q, const float* r)
+{
+    return ((double)q[0]-p[0])*((double)r[1]-p[1])-((double)q[1]-p[1])*((double)r[0]-p[0]);
+}
+
+// Triangulates the m_nNumVertex points of m_pf3Vertex in m_nTiles x m_nTiles
+// tiles on the worker threads. The columns and the rows within each column
+// hold equal numbers of points. A tile is triangulated with the points within
+// a border around it, and keeps the triangles whose centroid is in the tile;
+// the points outside the border that are in the circumcircle of one of those
+// are added and the tile is triangulated again, until the kept triangles are
+// triangles of the whole cloud. The edges of the kept triangles that are not
+// shared within a tile must then pair up between the tiles, or lie on the
+// convex hull of the cloud; else the tile of the triangle across the edge is
+// triangulated again with the points of it that it misses, or with twice the
+// border when it misses none. Returns FALSE, with no
+// faces, when that cannot help as a tile already holds all the points, as for
+// gridded points whose cocircular quads two tiles split differently.
+bool CDenoiser::TriangulateTiles(void)
+{
+    struct TileEdge {
+        int nFrom, nTo, nOpp;   // nOpp: third vertex of the kept triangle
+        int nTile;              // tile of the kept triangle
+    };
+    int i, j, k, n, nS, nTiles, nCols, nRows;
+    double dArea, dHalo, dCell, pdAll[4];
+
+    n = m_nNumVertex;
+    nS = m_nTiles;
+    nTiles = nS*nS;
+    pdAll[0] = pdAll[2] = m_pf3Vertex[0][0];
+    pdAll[1] = pdAll[3] = m_pf3Vertex[0][1];
+    for (i=1; i<n; i++)
+    {
+        pdAll[0] = std::min(pdAll[0], (double)m_pf3Vertex[i][0]);
+        pdAll[1] = std::min(pdAll[1], (double)m_pf3Vertex[i][1]);
+        pdAll[2] = std::max(pdAll[2], (double)m_pf3Vertex[i][0]);
+        pdAll[3] = std::max(pdAll[3], (double)m_pf3Vertex[i][1]);
+    }
+    dArea = (pdAll[2]-pdAll[0])*(pdAll[3]-pdAll[1]);
+    dHalo = (dArea>0) ? TILE_HALO*sqrt(dArea/n) : ((pdAll[2]-pdAll[0])+(pdAll[3]-pdAll[1]))/nS;
+    if (dHalo<=0)
+        return FALSE;
+
+    // the points by cells of about four of them
+    dCell = (dArea>0) ? 2*sqrt(dArea/n) : dHalo;
+    dCell = std::max(dCell, ((pdAll[2]-pdAll[0])+(pdAll[3]-pdAll[1]))/n);
+    nCols = (int)((pdAll[2]-pdAll[0])/dCell)+1;
+    nRows = (int)((pdAll[3]-pdAll[1])/dCell)+1;
+    auto CellOf = [&](double v, int e) {
+        int c = (int)((v-pdAll[e])/dCell);
+        return std::max(0, std::min(c, (e ? nRows : nCols)-1));
+    };
+    std::vector<int> vCellStart((long long)nCols*nRows+1, 0), vCellPoint(n);
+    for (i=0; i<n; i++)
+        vCellStart[CellOf(m_pf3Vertex[i][0], 0)+(long long)CellOf(m_pf3Vertex[i][1], 1)*nCols+1]++;
+    for (i=0; i<nCols*nRows; i++)
+        vCellStart[i+1] += vCellStart[i];
+    {
+        std::vector<int> vNext(vCellStart.begin(), vCellStart.end()-1);
+        for (i=0; i<n; i++)
+            vCellPoint[vNext[CellOf(m_pf3Vertex[i][0], 0)+(long long)CellOf(m_pf3Vertex[i][1], 1)*nCols]++] = i;
+    }
+    auto InBox = [](const float* p, const double* pdBox) {
+        return (p[0]>=pdBox[0])&&(p[0]<=pdBox[2])&&(p[1]>=pdBox[1])&&(p[1]<=pdBox[3]);
+    };
+
+    // adds to vFound the points that are neither in pdBox nor in vExtra and
+    // are within the circle of centre pdU and radius r, whose part within the
+    // cloud is in pdCircle
+    auto PointsInCircle = [&](const double* pdU, double r, const double* pdCircle, const double* pdBox,
+        const std::vector<int>& vExtra, std::vector<int>& vFound) {
+        int c0 = std::max(CellOf(pdCircle[0], 0)-1, 0), c1 = std::min(CellOf(pdCircle[2], 0)+1, nCols-1);
+        int r0 = std::max(CellOf(pdCircle[1], 1)-1, 0), r1 = std::min(CellOf(pdCircle[3], 1)+1, nRows-1);
+        for (int rr=r0; rr<=r1; rr++)
+            for (int cc=c0; cc<=c1; cc++)
+                for (int q=vCellStart[rr*nCols+cc]; q<vCellStart[rr*nCols+cc+1]; q++)
+                {
+                    const float* p = m_pf3Vertex[vCellPoint[q]];
+                    double dx = p[0]-pdU[0], dy = p[1]-pdU[1];
+                    if ((dx*dx+dy*dy<r*r*(1-1e-9))&&!InBox(p, pdBox)&&
+                        !std::binary_search(vExtra.begin(), vExtra.end(), vCellPoint[q]))
+                        vFound.push_back(vCellPoint[q]);
+                }
+    };
+
+    // bounds of the columns, then of the rows of each column
+    std::vector<int> vOrder(n);
+    std::vector<double> vX(nS+1), vY(nS*(nS+1));
+    for (i=0; i<n; i++)
+        vOrder[i] = i;
+    vX[0] = pdAll[0];
+    vX[nS] = pdAll[2];
+    for (k=1; k<nS; k++)
+    {
+        std::nth_element(vOrder.begin()+(long long)n*(k-1)/nS, vOrder.begin()+(long long)n*k/nS, vOrder.end(),
+            [&](int a, int b) { return m_pf3Vertex[a][0]<m_pf3Vertex[b][0]; });
+        vX[k] = m_pf3Vertex[vOrder[(long long)n*k/nS]][0];
+    }
+    ParallelFor(0, nS, [&](int nFrom, int nTo) {
+        for (int c=nFrom; c<nTo; c++)
+        {
+            std::vector<int>::iterator pBegin = vOrder.begin()+(long long)n*c/nS;
+            std::vector<int>::iterator pEnd = vOrder.begin()+(long long)n*(c+1)/nS;
+            long long m = pEnd-pBegin;
+            double* pdRow = &vY[c*(nS+1)];
+            pdRow[0] = pdAll[1];
+            pdRow[nS] = pdAll[3];
+            for (int r=1; r<nS; r++)
+            {
+                std::nth_element(pBegin+m*(r-1)/nS, pBegin+m*r/nS, pEnd,
+                    [&](int a, int b) { return m_pf3Vertex[a][1]<m_pf3Vertex[b][1]; });
+                pdRow[r] = (m>0) ? m_pf3Vertex[pBegin[m*r/nS]][1] : pdAll[3];
+            }
+        }
+    });
+
+    // the vertices of the convex hull of the cloud, given to every tile for
+    // the long triangles along it
+    ParallelFor(0, nS, [&](int nFrom, int nTo) {
+        std::sort(vOrder.begin()+(long long)n*nFrom/nS, vOrder.begin()+(long long)n*nTo/nS, [&](int a, int b) {
+            if (m_pf3Vertex[a][0]!=m_pf3Vertex[b][0])
+                return m_pf3Vertex[a][0]<m_pf3Vertex[b][0];
+            return m_pf3Vertex[a][1]<m_pf3Vertex[b][1];
+        });
+    });
+    std::vector<int> vHull;
+    for (k=0; k<2; k++)
+    {
+        size_t nLower = vHull.size();
+        for (i=0; i<n; i++)
+        {
+            int p = k ? vOrder[n-1-i] : vOrder[i];
+            while ((vHull.size()>=nLower+2)&&(Orient(m_pf3Vertex[vHull[vHull.size()-2]], m_pf3Vertex[vHull.back()], m_pf3Vertex[p])<=0))
+                vHull.pop_back();
+            vHull.push_back(p);
+        }
+        vHull.pop_back();
+    }
+    std::sort(vHull.begin(), vHull.end());
+    std::vector<int>().swap(vOrder);
+
+    std::vector<std::vector<int> > vFace(nTiles), vExtra(nTiles, vHull), vMissed(nTiles);
+    std::vector<std::vector<TileEdge> > vEdge(nTiles);
+    std::vector<double> vHalo(nTiles, dHalo), vBox(4*nTiles);
+    std::vector<char> bAll(nTiles), bDouble(nTiles);
+    std::vector<int> vRedo(nTiles);
+    for (i=0; i<nTiles; i++)
+        vRedo[i] = i;
+    while (!vRedo.empty())
+    {
+        RunParallel(m_nThreads, 0, (int)vRedo.size(), [&](int nFrom, int nTo) {
+            for (int q=nFrom; q<nTo; q++)
+            {
+                int t = vRedo[q], c = t/nS, r = t%nS;
+                int f, e, nNum, nNumFace;
+                double dR, pdCore[4], pdU[2], pdCircle[4];
+                double* pdBox = &vBox[4*t];
+                bool bWider;
+                struct triangulateio in, out;
+                std::vector<int> vLocal, vFound;
+
+                pdCore[0] = vX[c];
+                pdCore[1] = vY[c*(nS+1)+r];
+                pdCore[2] = vX[c+1];
+                pdCore[3] = vY[c*(nS+1)+r+1];
+                for(;;)
+                {
+                    vFace[t].clear();
+                    vEdge[t].clear();
+                    bAll[t] = TRUE;
+                    for (e=0; e<2; e++)
+                    {
+                        pdBox[e] = std::max(pdCore[e]-vHalo[t], pdAll[e]);
+                        pdBox[e+2] = std::min(pdCore[e+2]+vHalo[t], pdAll[e+2]);
+                        bAll[t] = bAll[t]&&(pdBox[e]==pdAll[e])&&(pdBox[e+2]==pdAll[e+2]);
+                    }
+
+                    // the points in the box and the added ones, the first of equal points
+                    vLocal = vExtra[t];
+                    for (int rr=CellOf(pdBox[1], 1); rr<=CellOf(pdBox[3], 1); rr++)
+                        for (int cc=CellOf(pdBox[0], 0); cc<=CellOf(pdBox[2], 0); cc++)
+                            for (e=vCellStart[rr*nCols+cc]; e<vCellStart[rr*nCols+cc+1]; e++)
+                                if (InBox(m_pf3Vertex[vCellPoint[e]], pdBox))
+                                    vLocal.push_back(vCellPoint[e]);
+                    std::sort(vLocal.begin(), vLocal.end(), [&](int a, int b) {
+                        if (m_pf3Vertex[a][0]!=m_pf3Vertex[b][0])
+                            return m_pf3Vertex[a][0]<m_pf3Vertex[b][0];
+                        if (m_pf3Vertex[a][1]!=m_pf3Vertex[b][1])
+                            return m_pf3Vertex[a][1]<m_pf3Vertex[b][1];
+                        return a<b;
+                    });
+                    vLocal.erase(std::unique(vLocal.begin(), vLocal.end(), [&](int a, int b) {
+                        return (m_pf3Vertex[a][0]==m_pf3Vertex[b][0])&&(m_pf3Vertex[a][1]==m_pf3Vertex[b][1]);
+                    }), vLocal.end());
+                    nNum = (int)vLocal.size();
+                    if (nNum<3)
+                    {
+                        if (bAll[t])
+                            break;
+                        vHalo[t] *= 2;
+                        continue;
+                    }
+
+                    memset(&in, 0, sizeof(in));
+                    memset(&out, 0, sizeof(out));
+                    in.numberofpoints = nNum;
+                    in.pointlist = (REAL *) MyMalloc(nNum * 2 * sizeof(REAL));
+                    for (e=0; e<nNum; e++)
+                    {
+                        in.pointlist[e*2] = m_pf3Vertex[vLocal[e]][0];
+                        in.pointlist[e*2+1] = m_pf3Vertex[vLocal[e]][1];
+                    }
+                    triangulate(const_cast<char*>("zNBnQ"),&in,&out,NULL);
+                    nNumFace = out.numberoftriangles;
+                    free(in.pointlist);
+
+                    // tile of each triangle; those of this one must be triangles of the whole cloud
+                    std::vector<int> vOwner(nNumFace);
+                    vFound.clear();
+                    bWider = FALSE;
+                    for (f=0; f<nNumFace; f++)
+                    {
+                        const float* a = m_pf3Vertex[vLocal[out.trianglelist[3*f]]];
+                        const float* b = m_pf3Vertex[vLocal[out.trianglelist[3*f+1]]];
+                        const float* d = m_pf3Vertex[vLocal[out.trianglelist[3*f+2]]];
+                        vOwner[f] = TileOf(((double)a[0]+b[0]+d[0])/3, ((double)a[1]+b[1]+d[1])/3, &vX[0], &vY[0], nS);
+                        if ((vOwner[f]!=t)||bAll[t])
+                            continue;
+                        if (!CircleBox(a, b, d, pdAll, pdU, &dR, pdCircle))
+                            bWider = TRUE;
+                        else if ((pdCircle[0]<pdBox[0])||(pdCircle[1]<pdBox[1])||(pdCircle[2]>pdBox[2])||(pdCircle[3]>pdBox[3]))
+                            PointsInCircle(pdU, dR, pdCircle, pdBox, vExtra[t], vFound);
+                    }
+                    if (!bWider&&vFound.empty())
+                        for (f=0; f<nNumFace; f++)
+                            for (e=0; e<3; e++)
+                            {
+                                int nb = out.neighborlist[3*f+e];
+                                if (vOwner[f]!=t)
+                                    continue;
+                                vFace[t].push_back(vLocal[out.trianglelist[3*f+e]]);
+                                if ((nb<0)||(vOwner[nb]!=t))
+                                {
+                                    TileEdge edge;
+                                    edge.nFrom = vLocal[out.trianglelist[3*f+(e+1)%3]];
+                                    edge.nTo = vLocal[out.trianglelist[3*f+(e+2)%3]];
+                                    edge.nOpp = vLocal[out.trianglelist[3*f+e]];
+                                    edge.nTile = t;
+                                    vEdge[t].push_back(edge);
+                                }
+                            }
+                    free(out.trianglelist);
+                    free(out.neighborlist);
+                    if (bWider)
+                        vHalo[t] *= 2;
+                    else if (!vFound.empty())
+                    {
+                        vExtra[t].insert(vExtra[t].end(), vFound.begin(), vFound.end());
+                        std::sort(vExtra[t].begin(), vExtra[t].end());
+                        vExtra[t].erase(std::unique(vExtra[t].begin(), vExtra[t].end()), vExtra[t].end());
+                    }
+                    else
+                        break;
+                }
+            }
+        });
+
+        // an edge between the triangles of two tiles is met once in each
+        // direction; an edge met once that is not on the convex hull of the
+        // cloud lacks the triangle across it, whose tile is given its points,
+        // or twice the border
+        std::vector<TileEdge> vAll;
+        for (i=0; i<nTiles; i++)
+            vAll.insert(vAll.end(), vEdge[i].begin(), vEdge[i].end());
+        std::sort(vAll.begin(), vAll.end(), [](const TileEdge& a, const TileEdge& b) {
+            int a0 = std::min(a.nFrom, a.nTo), b0 = std::min(b.nFrom, b.nTo);
+            if (a0!=b0)
+                return a0<b0;
+            a0 = std::max(a.nFrom, a.nTo);
+            b0 = std::max(b.nFrom, b.nTo);
+            if (a0!=b0)
+                return a0<b0;
+            return a.nFrom<b.nFrom;
+        });
+        auto Redo = [&](int t, const int* pnPoint, int nNum) -> bool {
+            bool bMissed = FALSE;
+            if (bAll[t])
+                return FALSE;
+            for (int q=0; q<nNum; q++)
+                if (!InBox(m_pf3Vertex[pnPoint[q]], &vBox[4*t])&&
+                    !std::binary_search(vExtra[t].begin(), vExtra[t].end(), pnPoint[q]))
+                {
+                    vMissed[t].push_back(pnPoint[q]);
+                    bMissed = TRUE;
+                }
+            if (!bMissed)
+                bDouble[t] = TRUE;
+            return TRUE;
+        };
+        std::fill(bDouble.begin(), bDouble.end(), FALSE);
+        for (i=0; i<(int)vAll.size(); i=j)
+        {
+            const TileEdge& edge = vAll[i];
+            bool bRedo;
+            for (j=i+1; (j<(int)vAll.size())&&(std::min(vAll[j].nFrom, vAll[j].nTo)==std::min(edge.nFrom, edge.nTo))&&
+                (std::max(vAll[j].nFrom, vAll[j].nTo)==std::max(edge.nFrom, edge.nTo)); j++)
+                ;
+            if (j-i==1)
+            {
+                // the third vertex across the edge is the point on that side
+                // whose circle with the edge has its centre the least across
+                const float* a = m_pf3Vertex[edge.nFrom];
+                const float* b = m_pf3Vertex[edge.nTo];
+                double dSide = (Orient(a, b, m_pf3Vertex[edge.nOpp])>0) ? -1 : 1;
+                double pdM[2], pdN[2], dH2, dT, dBest = 0;
+                int pnTri[3], nBest = -1;
+                pdM[0] = ((double)a[0]+b[0])/2;
+                pdM[1] = ((double)a[1]+b[1])/2;
+                pdN[0] = -dSide*((double)b[1]-a[1]);
+                pdN[1] = dSide*((double)b[0]-a[0]);
+                dH2 = (pdM[0]-a[0])*(pdM[0]-a[0])+(pdM[1]-a[1])*(pdM[1]-a[1]);
+                for (k=0; k<n; k++)
+                {
+                    const float* p = m_pf3Vertex[k];
+                    if (Orient(a, b, p)*dSide<=0)
+                        continue;
+                    double dx = p[0]-pdM[0], dy = p[1]-pdM[1];
+                    dT = (dx*dx+dy*dy-dH2)/(2*(pdN[0]*dx+pdN[1]*dy));
+                    if ((nBest<0)||(dT<dBest))
+                    {
+                        nBest = k;
+                        dBest = dT;
+                    }
+                }
+                if (nBest<0)
+                    continue;
+                pnTri[0] = edge.nFrom;
+                pnTri[1] = edge.nTo;
+                pnTri[2] = nBest;
+                const float* d = m_pf3Vertex[nBest];
+                bRedo = Redo(TileOf(((double)a[0]+b[0]+d[0])/3, ((double)a[1]+b[1]+d[1])/3, &vX[0], &vY[0], nS), pnTri, 3);
+            }
+            else if ((j-i>2)||(edge.nFrom==vAll[i+1].nFrom))
+            {
+                // triangles of two tiles overlap
+                bRedo = FALSE;
+                for (k=i; k<j; k++)
+                    if (Redo(vAll[k].nTile, NULL, 0))
+                        bRedo = TRUE;
+            }
+            else
+                continue;
+            // a tile that holds all the points cannot do better
+            if (!bRedo)
+                return FALSE;
+        }
+        vRedo.clear();
+        for (i=0; i<nTiles; i++)
+            if (bDouble[i]||!vMissed[i].empty())
+            {
+                if (bDouble[i])
+                    vHalo[i] *= 2;
+                vExtra[i].insert(vExtra[i].end(), vMissed[i].begin(), vMissed[i].end());
+                std::sort(vExtra[i].begin(), vExtra[i].end());
+                vExtra[i].erase(std::unique(vExtra[i].begin(), vExtra[i].end()), vExtra[i].end());
+                vMissed[i].clear();
+                vRedo.push_back(i);
+            }
+    }
+
+    m_nNumFace = 0;
+    for (i=0; i<nTiles; i++)
+        m_nNumFace += (int)vFace[i].size()/3;
+    m_pn3Face = (NVECTOR3 *)MyMalloc(std::max(m_nNumFace, 1)*sizeof(NVECTOR3));
+    for (i=0, k=0; i<nTiles; i++)
+    {
+        if (!vFace[i].empty())
+            memcpy(&(m_pn3Face[k][0]), &vFace[i][0], vFace[i].size()*sizeof(int));
+        k += (int)vFace[i].size()/3;
+    }
+    return TRUE;
+}
+
+void CDenoiser::ReadESRI(FILE* fp, struct ESRIHeader* header)
+{
+    int nTotal;
+	double * value;
+
+	ReadESRIHeader(fp, header);
+	nTotal = header->ncols*header->nrows;
+	value = (double *)MyMalloc(nTotal*sizeof(double));
+	ReadESRIValues(fp, header, value, nTotal);
+	BuildESRIMesh(header, value, 0);
+    free(value);
+}
+
+// Mosaic mode (--mosaic): the tile is read inside a window with a halo of
+// m_nMosaicHalo cells on each side, filled from the tiles of m_vMosaic with
+// the same cell size that reach into it, as told by their headers; what no
+// tile covers is nodata. So the filters reach the same cells as in the merged
+// grid (exactly so for Jacobi vertex updating, as with -b), and SaveData
+// writes the tile's own cells. The model is scaled by its own box, not that
+// of the merged grid, so the heights agree with a run on the merged grid only
+// up to the rounding of the scaling, which a neighbour weight near sigma can
+// carry on through the iterations. Only one tile and its halo are held, so the
+// tiles may be denoised separately, and in parallel.
+void CDenoiser::ReadESRIMosaic(FILE* fp, struct ESRIHeader* header)
+{
+    int k, nHalo, nTotal;
+    double *pdWindow;
+    struct ESRIHeader tile;
+    FILE *fpTile;
+
+    ReadESRIHeader(fp, header);
+    if (m_nMosaicHalo<=0)
+        m_nMosaicHalo = m_nIterations + m_nVIterations + 2;
+    nHalo = m_nMosaicHalo;
+    m_Mosaic = *header;
+    m_Mosaic.ncols = header->ncols+2*nHalo;
+    m_Mosaic.nrows = header->nrows+2*nHalo;
+    m_Mosaic.xllcorner = header->xllcorner-nHalo*header->cellsize;
+    m_Mosaic.yllcorner = header->yllcorner-nHalo*header->cellsize;
+    m_Mosaic.isnodata = true;
+    m_Mosaic.nodata_value = header->isnodata ? header->nodata_value : -9999;
+    m_Mosaic.nfirst = 0;
+    m_Mosaic.index = NULL;
+    nTotal = m_Mosaic.ncols*m_Mosaic.nrows;
+    pdWindow = (double *)MyMalloc((size_t)nTotal*sizeof(double));
+    for (k=0; k<nTotal; k++)
+        pdWindow[k] = m_Mosaic.nodata_value;
+
+    MosaicCopy(fp, header, header, pdWindow);
+    m_nMosaicTiles = 0;
+    for (size_t n=0; n<m_vMosaic.size(); n++)
+    {
+        if ((fpTile = fopen(m_vMosaic[n], "rb"))==NULL)
+        {
+            printf("Warning: the mosaic tile %s can't be opened!\n", m_vMosaic[n]);
+            continue;
+        }
+        ReadESRIHeader(fpTile, &tile);
+        if (MosaicCopy(fpTile, header, &tile, pdWindow))
+            m_nMosaicTiles++;
+        fclose(fpTile);
+    }
+
+    if (m_bGrid)
+        BuildGrid(&m_Mosaic, pdWindow, -nHalo);
+    else
+        BuildESRIMesh(&m_Mosaic, pdWindow, -nHalo);
+    free(pdWindow);
+}
+
+// Copies the cells of tile, whose header has just been read from fp, that
+// fall in the mosaic window of the tile described by header; for another
+// tile, only those outside header itself. Returns FALSE, without reading
+// the grid values, when tile is header's own tile, has another cell size or
+// does not reach into the window. The values are read a block of rows at a
+// time, up to the last row in the window.
+bool CDenoiser::MosaicCopy(FILE* fp, struct ESRIHeader* header, struct ESRIHeader* tile, double* pdWindow)
+{
+    int i, j, r, nRow, nCol, nRows, nBlock, nHalo = m_nMosaicHalo;
+    double dCell = header->cellsize, v, *pdBlock;
+    bool bOwn = (tile==header);
+
+    if (fabs(tile->cellsize-dCell)>1e-6*dCell)
+        return FALSE;
+    // the tile's first row and column in the grid of header
+    nCol = (int)floor((tile->xllcorner-header->xllcorner)/dCell+0.5);
+    nRow = (int)floor((header->yllcorner+header->nrows*dCell-tile->yllcorner-tile->nrows*dCell)/dCell+0.5);
+    if (!bOwn && (nRow==0) && (nCol==0) && (tile->nrows==header->nrows) && (tile->ncols==header->ncols))
+        return FALSE;
+    if ((nRow>=header->nrows+nHalo) || (nRow+tile->nrows<=-nHalo) ||
+        (nCol>=header->ncols+nHalo) || (nCol+tile->ncols<=-nHalo))
+        return FALSE;
+
+    nBlock = std::max(1, std::min(tile->nrows, (1<<20)/std::max(tile->ncols, 1)));
+    pdBlock = (double *)MyMalloc((size_t)nBlock*tile->ncols*sizeof(double));
+    for (r=0; (r<tile->nrows) && (nRow+r<header->nrows+nHalo); r+=nRows)
+    {
+        nRows = std::min(nBlock, tile->nrows-r);
+        ReadESRIValues(fp, tile, pdBlock, nRows*tile->ncols);
+        for (i=std::max(r, -nHalo-nRow); (i<r+nRows) && (nRow+i<header->nrows+nHalo); i++)
+            for (j=std::max(0, -nHalo-nCol); (j<tile->ncols) && (nCol+j<header->ncols+nHalo); j++)
+            {
+                if (!bOwn && (nRow+i>=0) && (nRow+i<header->nrows) && (nCol+j>=0) && (nCol+j<header->ncols))
+                    continue;
+                v = pdBlock[(size_t)(i-r)*tile->ncols+j];
+                if (tile->isnodata && (abs(v-tile->nodata_value)<FLT_EPSILON))
+                    v = m_Mosaic.nodata_value;
+                pdWindow[(size_t)(nRow+i+nHalo)*m_Mosaic.ncols+nCol+j+nHalo] = v;
+            }
+    }
+    free(pdBlock);
+    return TRUE;
+}
+
+// Reads the six header lines. Without a NODATA_value line the first two grid
+// values have been read as well; they are kept in header->first.
+void CDenoiser::ReadESRIHeader(FILE* fp, struct ESRIHeader* header)
+{
+	char sTmp[40];
+	double fTmp;
+
+	fscanf(fp,"%s %d", sTmp, &(header->ncols));
+	fscanf(fp,"%s %d", sTmp, &(header->nrows));
+	fscanf(fp,"%s %lf", sTmp, &(header->xllcorner));
+	fscanf(fp,"%s %lf", sTmp, &(header->yllcorner));
+	fscanf(fp,"%s %lf", sTmp, &(header->cellsize));
+	fscanf(fp,"%s %lf", sTmp, &fTmp);
+
+	header->index = NULL;
+	if((sTmp[0]=='n')||(sTmp[0]=='N'))
+	{
+		header->isnodata = true;
+		header->nodata_value = fTmp;
+		header->nfirst = 0;
+	}
+	else
+	{
+		header->isnodata = false;
+		sscanf(sTmp,"%lf",header->first);
+		header->first[1] = fTmp;
+		header->nfirst = 2;
+	}
+}
+
+// Reads the next nNum grid values, starting with those kept in header->first.
+void CDenoiser::ReadESRIValues(FILE* fp, struct ESRIHeader* header, double* value, int nNum)
+{
+	int i = 0;
+	struct TextBuffer tb;
+	struct NumberBlock nb;
+
+	while((header->nfirst>0)&&(i<nNum))
+	{
+		value[i++] = header->first[0];
+		header->first[0] = header->first[1];
+		header->nfirst--;
+	}
+	if (i==nNum)
+		return;
+	memset(&nb, 0, sizeof(nb));
+	nb.nDouble = nNum-i;
+	nb.pdDouble = value+i;
+	TextOpen(&tb, fp);
+	if (TextReadNumbers(&tb, &nb, m_nThreads)<nb.nDouble)
+		printf("Warning: the ESRI file ends before all grid values are read!\n");
+	TextClose(&tb);
+}
+
+// Builds the triangle mesh of the header->nrows rows of grid values; row 0
+// of value is row nRowOffset of the whole grid.
+void CDenoiser::BuildESRIMesh(struct ESRIHeader* header, double* value, int nRowOffset)
+{
+    int i,ii,j,k,kk[4],nTotal;
+
+	nTotal = header->ncols*header->nrows;
+	header->index = (int *)MyMalloc(nTotal*sizeof(int));
+	m_nModelAlloc = MODEL_MALLOC;
+	m_pf3Vertex = (FVECTOR3 *)MyMalloc(nTotal*sizeof(FVECTOR3));
+	m_pn3Face = (NVECTOR3 *)MyMalloc(2*(header->ncols-1)*(header->nrows-1)*sizeof(NVECTOR3));
+	m_nNumFace = 0;
+	if(header->isnodata)
+	{
+		m_nNumVertex = 0;
+		for(i=0; i<header->nrows; i++)
+		{
+			for(j=0;j<header->ncols;j++)
+			{
+				k = j+i*header->ncols;
+				if(abs(value[k]-header->nodata_value)<FLT_EPSILON)
+				{
+					header->index[k] =nTotal;
+				}
+				else
+				{
+					m_pf3Vertex[m_nNumVertex][0]=float((i+nRowOffset)*header->cellsize);
+					m_pf3Vertex[m_nNumVertex][1]=float(j*header->cellsize);
+					m_pf3Vertex[m_nNumVertex][2]=float(value[k]);
+					header->index[k] =m_nNumVertex;
+					m_nNumVertex++;
+				}
+			}
+		}
+		m_pf3Vertex = (FVECTOR3 *)MyRealloc(m_pf3Vertex, (m_nNumVertex+1)*sizeof(FVECTOR3));
+
+		for(i=0; i<header->nrows-1; i++)
+		{
+			for(j=0;j<header->ncols-1;j++)
+			{
+				kk[0] = j+i*header->ncols;
+				kk[1] = kk[0]+1;
+				kk[2] = kk[0]+header->ncols;
+				kk[3] = kk[2]+1;
+				k = 4;
+				for(ii=0;ii<4;ii++){
+					if(header->index[kk[ii]]==nTotal){
+						if(k<ii){
+							k=5;
+							break;
+						}else{
+							k=ii;
+						}
+					}
+				}
+				if(k==0){
+					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+				}else if(k==1){
+					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+				}else if(k==2){
+					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
+					m_nNumFace++;
+				}else if(k==3){
+					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+				}else if(k==4){//generate two triangles with minimum total area 
+					if((abs(value[kk[2]]-value[kk[0]])> abs(value[kk[3]]-value[kk[1]]))&& 
+						(abs(value[kk[1]]-value[kk[0]])> abs(value[kk[3]]-value[kk[2]])))
+					{
+						m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+						m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
+						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+						m_nNumFace++;
+						m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+						m_nNumFace++;
+					}else{
+						m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+						m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
+						m_nNumFace++;
+						m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+						m_nNumFace++;
+					}
+				}
+			}
+		}
+		m_pn3Face = (NVECTOR3 *)MyRealloc(m_pn3Face, (m_nNumFace+1)*sizeof(NVECTOR3));
+	}
+	else
+	{
+		m_nNumVertex = nTotal;
+		for(i=0; i<header->nrows; i++)
+		{
+			for(j=0;j<header->ncols;j++)
+			{
+				k = j+i*header->ncols;
+				m_pf3Vertex[k][0]=float((i+nRowOffset)*header->cellsize);
+				m_pf3Vertex[k][1]=float(j*header->cellsize);
+				m_pf3Vertex[k][2]=float(value[k]);
+				header->index[k]=k;
+			}
+		}
+		for(i=0; i<header->nrows-1; i++)
+		{
+			for(j=0;j<header->ncols-1;j++)
+			{
+				kk[0] = j+i*header->ncols;
+				kk[1] = kk[0]+1;
+				kk[2] = kk[0]+header->ncols;
+				kk[3] = kk[2]+1;
+				if((abs(value[header->index[kk[2]]]-value[header->index[kk[0]]])> 
+					abs(value[header->index[kk[3]]]-value[header->index[kk[1]]]))&& 
+					(abs(value[header->index[kk[1]]]-value[header->index[kk[0]]])> 
+					abs(value[header->index[kk[3]]]-value[header->index[kk[2]]])))
+				{
+					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+				}else{
+					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
+					m_nNumFace++;
+					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
+					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
+					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
+					m_nNumFace++;
+				}
+			}
+		}
+	}
+}
+
+// Implicit grid model for .asc input (-g).
+// Only the heights, a nodata flag per point and the diagonal of each cell
+// are stored; positions come from (row, col), and the faces and their
+// neighbourhoods are worked out arithmetically. The faces of the cell whose
+// top-left point is c are numbered 2*c and 2*c+1, which is the order in
+// which BuildESRIMesh creates them, and all neighbours are visited in the
+// order used by the mesh rings, so both engines give the same result.
+void CDenoiser::ReadGrid(FILE* fp, struct ESRIHeader* header)
+{
+    int nTotal;
+	double * value;
 
-    case FILE_PLY:
-        ReadPLY(fp);
-        break;
+	ReadESRIHeader(fp, header);
+	nTotal = header->ncols*header->nrows;
+	value = (double *)MyMalloc(nTotal*sizeof(double));
+	ReadESRIValues(fp, header, value, nTotal);
+	BuildGrid(header, value, 0);
+    free(value);
+}
 
-    case FILE_PLY2:
-        ReadPLY2(fp);
-        break;
+// Sets up m_Grid from header->nrows rows of grid values; row 0 of value is
+// row nRowOffset of the whole grid. The model is scaled as in ScalingBox.
+void CDenoiser::BuildGrid(struct ESRIHeader* header, double* value, int nRowOffset)
+{
+    int i,j,k,m,nTotal;
+    float box[2][3];
+    FVECTOR3 v;
+    unsigned char *pnFlag;
 
-    case FILE_SMF:
-        ReadSMF(fp);
-        break;
+    m_Grid.nrows = header->nrows;
+    m_Grid.ncols = header->ncols;
+	nTotal = header->ncols*header->nrows;
+    m_Grid.pfX = (float *)MyMalloc(header->nrows*sizeof(float));
+    m_Grid.pfY = (float *)MyMalloc(header->ncols*sizeof(float));
+    m_Grid.pfZ = (float *)MyMalloc(nTotal*sizeof(float));
+    m_Grid.pnFlag = pnFlag = (unsigned char *)MyMalloc(nTotal);
+    m_Grid.pNormal = MyMalloc(m_bCompact ? 2*nTotal*2*sizeof(short) : 2*nTotal*sizeof(FVECTOR3));
 
-    case FILE_STL:
-        ReadSTL(fp);
-        break;
+    box[0][0] = box[0][1] = box[0][2] = FLT_MAX;
+    box[1][0] = box[1][1] = box[1][2] = -FLT_MAX;
+    m_nNumVertex = 0;
+	for(i=0; i<header->nrows; i++)
+	{
+		for(j=0;j<header->ncols;j++)
+		{
+			k = j+i*header->ncols;
+            pnFlag[k] = 0;
+			if(header->isnodata && (abs(value[k]-header->nodata_value)<FLT_EPSILON))
+            {
+				pnFlag[k] = GRID_NODATA;
+                continue;
+            }
+            v[0]=float((i+nRowOffset)*header->cellsize);
+            v[1]=float(j*header->cellsize);
+            v[2]=float(value[k]);
+            for (m=0;m<3;m++)
+            {
+                if (box[0][m]>v[m])
+                    box[0][m] = v[m];
+                if (box[1][m]<v[m])
+                    box[1][m] = v[m];
+            }
+            m_nNumVertex++;
+        }
+    }
+    m_f3Centre[0] = (box[0][0]+box[1][0])/2.0;
+    m_f3Centre[1] = (box[0][1]+box[1][1])/2.0;
+    m_f3Centre[2] = (box[0][2]+box[1][2])/2.0;
+    m_fScale = FMAX(box[1][0]-box[0][0],FMAX(box[1][1]-box[0][1],box[1][2]-box[0][2]));
+    m_fScale /=2.0;
 
-    case FILE_WRL:
-        ReadWRL(fp);
-        break;
+	for(i=0; i<header->nrows; i++)
+        m_Grid.pfX[i] = (float((i+nRowOffset)*header->cellsize)-m_f3Centre[0])/m_fScale;
+	for(j=0; j<header->ncols; j++)
+        m_Grid.pfY[j] = (float(j*header->cellsize)-m_f3Centre[1])/m_fScale;
+    for(k=0; k<nTotal; k++)
+        m_Grid.pfZ[k] = (float(value[k])-m_f3Centre[2])/m_fScale;
 
-    case FILE_XYZ:
-        ReadXYZ(fp);
-        break;
+    // choose the diagonal of each cell as BuildESRIMesh does
+	for(i=0; i<header->nrows-1; i++)
+	{
+		for(j=0;j<header->ncols-1;j++)
+		{
+            k = j+i*header->ncols;
+            if((abs(value[k+header->ncols]-value[k])> abs(value[k+header->ncols+1]-value[k+1]))&& 
+                (abs(value[k+1]-value[k])> abs(value[k+header->ncols+1]-value[k+header->ncols])))
+                pnFlag[k] |= GRID_DIAG;
+        }
+    }
 
-    case FILE_ESRI:
-        ReadESRI(fp,header);
-        break;
+    m_nNumFace = 0;
+    NVECTOR3 tri[2];
+    for(i=0; i<header->nrows-1; i++)
+        for(j=0;j<header->ncols-1;j++)
+            m_nNumFace += GridCellFaces(j+i*header->ncols, tri);
+    // the produced mesh lives in m_Grid only
+    m_nNumVertexP = m_nNumFaceP = 0;
+}
 
-	default:
-        return 0;
+void CDenoiser::FreeGrid(void)
+{
+    free(m_Grid.pfX);
+    free(m_Grid.pfY);
+    free(m_Grid.pfZ);
+    free(m_Grid.pnFlag);
+    free(m_Grid.pNormal);
+    free(m_Grid.pfZ0);
+    memset(&m_Grid, 0, sizeof(m_Grid));
+    m_nKeptIterations = -1;
+}
+
+// Stores the points of the faces of the cell whose top-left point is c, in
+// the vertex order of BuildESRIMesh, and returns the number of faces.
+int CDenoiser::GridCellFaces(int c, NVECTOR3* pn3Tri)
+{
+    int ii, k, kk[4];
+    const unsigned char *pnFlag = m_Grid.pnFlag;
+
+    kk[0] = c;
+    kk[1] = c+1;
+    kk[2] = c+m_Grid.ncols;
+    kk[3] = kk[2]+1;
+    k = 4;
+    for(ii=0;ii<4;ii++){
+        if(pnFlag[kk[ii]] & GRID_NODATA){
+            if(k<ii)
+                return 0;
+            k=ii;
+        }
+    }
+    switch (k)
+    {
+    case 0:
+        pn3Tri[0][0] = kk[1]; pn3Tri[0][1] = kk[3]; pn3Tri[0][2] = kk[2];
+        return 1;
+    case 1:
+        pn3Tri[0][0] = kk[0]; pn3Tri[0][1] = kk[3]; pn3Tri[0][2] = kk[2];
+        return 1;
+    case 2:
+        pn3Tri[0][0] = kk[1]; pn3Tri[0][1] = kk[3]; pn3Tri[0][2] = kk[0];
+        return 1;
+    case 3:
+        pn3Tri[0][0] = kk[0]; pn3Tri[0][1] = kk[1]; pn3Tri[0][2] = kk[2];
+        return 1;
+    }
+    if (pnFlag[c] & GRID_DIAG)
+    {
+        pn3Tri[0][0] = kk[0]; pn3Tri[0][1] = kk[1]; pn3Tri[0][2] = kk[2];
+        pn3Tri[1][0] = kk[1]; pn3Tri[1][1] = kk[3]; pn3Tri[1][2] = kk[2];
+    }
+    else
+    {
+        pn3Tri[0][0] = kk[1]; pn3Tri[0][1] = kk[3]; pn3Tri[0][2] = kk[0];
+        pn3Tri[1][0] = kk[0]; pn3Tri[1][1] = kk[3]; pn3Tri[1][2] = kk[2];
     }
+    return 2;
+}
 
-    ScalingBox(); // scale to a box
-    ComputeNormal(FALSE);
+// Stores the faces around point p in increasing order, with their points,
+// and returns their number (at most 8).
+int CDenoiser::GridVertexFaces(int p, int* pnFace, NVECTOR3* pn3Point)
+{
+    int i, j, ci, cj, c, s, nNum, n = 0;
+    NVECTOR3 tri[2];
 
-    m_nNumVertexP = m_nNumVertex;
-    m_nNumFaceP = m_nNumFace;
-    m_pf3VertexP = new FVECTOR3[m_nNumVertexP];
-    m_pn3FaceP = new NVECTOR3[m_nNumFaceP];
-    m_pf3VertexNormalP = new FVECTOR3[m_nNumVertexP];
-    m_pf3FaceNormalP = new FVECTOR3[m_nNumFaceP];
+    i = p/m_Grid.ncols;
+    j = p%m_Grid.ncols;
+    for (ci=i-1; ci<=i; ci++)
+    {
+        if ((ci<0)||(ci>=m_Grid.nrows-1))
+            continue;
+        for (cj=j-1; cj<=j; cj++)
+        {
+            if ((cj<0)||(cj>=m_Grid.ncols-1))
+                continue;
+            c = cj+ci*m_Grid.ncols;
+            nNum = GridCellFaces(c, tri);
+            for (s=0; s<nNum; s++)
+            {
+                if ((tri[s][0]==p)||(tri[s][1]==p)||(tri[s][2]==p))
+                {
+                    pnFace[n] = 2*c+s;
+                    VEC3_ASN_OP(pn3Point[n],=,tri[s]);
+                    n++;
+                }
+            }
+        }
+    }
+    return n;
+}
 
-    for (int i=0;i<m_nNumVertex;i++)
+// Collects the neighbouring faces of the face with points pnTri, as
+// ComputeTRing1TCV or ComputeTRing1TCE would, and returns their number.
+int CDenoiser::GridFaceRing(NVECTOR3 pnTri, bool bNeighbourCV, int* pnRing)
+{
+    int i, m, nNum, nFaces;
+    int pnFace[8];
+    NVECTOR3 pn3Point[8];
+    int tmp0 = pnTri[0], tmp1 = pnTri[1], tmp2 = pnTri[2];
+
+    nNum = 0;
+    if (bNeighbourCV)
     {
-        VEC3_ASN_OP(m_pf3VertexP[i],=,m_pf3Vertex[i]);
-        VEC3_ASN_OP(m_pf3VertexNormalP[i],=,m_pf3VertexNormal[i]);
+        for (m=0; m<3; m++)
+        {
+            nFaces = GridVertexFaces(pnTri[m], pnFace, pn3Point);
+            for (i=0; i<nFaces; i++)
+            {
+                if ((m>0) && ((pn3Point[i][0]==tmp0)||(pn3Point[i][1]==tmp0)||(pn3Point[i][2]==tmp0)))
+                    continue;
+                if ((m>1) && ((pn3Point[i][0]==tmp1)||(pn3Point[i][1]==tmp1)||(pn3Point[i][2]==tmp1)))
+                    continue;
+                pnRing[nNum++] = pnFace[i];
+            }
+        }
+        return nNum;
     }
-    for (int i=0;i<m_nNumFace;i++)
+
+    nFaces = GridVertexFaces(tmp0, pnFace, pn3Point);
+    for (i=0; i<nFaces; i++)
     {
-        VEC3_ASN_OP(m_pn3FaceP[i],=,m_pn3Face[i]);
-        VEC3_ASN_OP(m_pf3FaceNormalP[i],=,m_pf3FaceNormal[i]);
+        if ((pn3Point[i][0] == tmp1)||(pn3Point[i][0] == tmp2)||(pn3Point[i][1] == tmp1)||\
+            (pn3Point[i][1] == tmp2)||(pn3Point[i][2] == tmp1)||(pn3Point[i][2] == tmp2))
+        {
+            if (nNum==4)
+                break;
+            pnRing[nNum++] = pnFace[i];
+        }
+    }
+    nFaces = GridVertexFaces(tmp1, pnFace, pn3Point);
+    for (i=0; i<nFaces; i++)
+    {
+        if (((pn3Point[i][0] == tmp1)&&((pn3Point[i][1] == tmp2)||(pn3Point[i][2] == tmp2)))||\
+            ((pn3Point[i][0] == tmp2)&&((pn3Point[i][1] == tmp1)||(pn3Point[i][2] == tmp1)))||\
+            ((pn3Point[i][1] == tmp2)&&(pn3Point[i][2] == tmp1))||\
+            ((pn3Point[i][1] == tmp1)&&(pn3Point[i][2] == tmp2)&&(pn3Point[i][0] != tmp0)))
+        {
+            if (nNum<4)
+                pnRing[nNum++] = pnFace[i];
+            break;
+        }
     }
+    return nNum;
+}
 
-    return m_nNumFace;
+// Position of grid point p with the heights pfZ.
+inline void CDenoiser::GridPoint(int p, const float* pfZ, FVECTOR3 v)
+{
+    v[0] = m_Grid.pfX[p/m_Grid.ncols];
+    v[1] = m_Grid.pfY[p%m_Grid.ncols];
+    v[2] = pfZ[p];
 }
 
-void ReadGTS(FILE* fp)
+// Face normal k of a grid normal buffer, which holds FVECTOR3s or, with
+// m_bCompact, octahedral pairs.
+inline void CDenoiser::GridGetNormal(const void* pNormal, int k, FVECTOR3 v)
 {
-    int i;
-    int tmp, tmp1, tmp2, tmp3;
-    char sTmp[200],sTmp1[200];
-    NVECTOR2 *edge;
+    if (m_bCompact)
+        OctDecode((const short *)pNormal+2*k, v);
+    else
+        VEC3_ASN_OP(v,=,((const FVECTOR3 *)pNormal)[k]);
+}
 
-    do
+inline void CDenoiser::GridSetNormal(void* pNormal, int k, const FVECTOR3 v)
+{
+    if (m_bCompact)
+        OctEncode(v, (short *)pNormal+2*k);
+    else
+        VEC3_ASN_OP(((FVECTOR3 *)pNormal)[k],=,v);
+}
+
+// Runs f(c) for every cell c, split among the worker threads by rows.
+void CDenoiser::GridForCells(const std::function<void(int)>& f)
+{
+    ParallelFor(0, m_Grid.nrows-1, [&](int nFrom, int nTo) {
+        for (int i=nFrom; i<nTo; i++)
+            for (int j=0; j<m_Grid.ncols-1; j++)
+                f(j+i*m_Grid.ncols);
+    });
+}
+
+void CDenoiser::GridDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations)
+{
+    int nTotal = m_Grid.nrows*m_Grid.ncols;
+    void *TNormal = MyMalloc(m_bCompact ? 2*nTotal*2*sizeof(short) : 2*nTotal*sizeof(FVECTOR3));
+    void *pTmp;
+
+    // a sweep starts every run from the heights as built, and from the
+    // normals of the previous run when they are on the way
+    m_nNormalPasses = 0;
+    m_bNormalConverged = FALSE;
+    m_vNormalResidual.clear();
+    if (m_bKeepNormals)
     {
-        fgets(sTmp, 200, fp);
-        sscanf(sTmp, "%s", sTmp1);
-    }while (sTmp1[0]=='#');
+        if (m_Grid.pfZ0==NULL)
+        {
+            m_Grid.pfZ0 = (float *)MyMalloc(nTotal*sizeof(float));
+            memcpy(m_Grid.pfZ0, m_Grid.pfZ, nTotal*sizeof(float));
+        }
+        else
+            memcpy(m_Grid.pfZ, m_Grid.pfZ0, nTotal*sizeof(float));
+        if ((m_nKeptIterations>=0) && (m_bKeptCV==bNeighbourCV) && (m_fKeptSigma==fSigma) && (m_nKeptIterations<=nIterations))
+        {
+            m_nNormalPasses = m_nKeptIterations;
+            m_bNormalConverged = m_bKeptConverged;
+            m_vNormalResidual = m_vKeptResidual;
+        }
+    }
 
+    // face normals, as in ComputeNormal
+    if (m_nNormalPasses==0)
+    {
+        GridForCells([&](int c) {
+            NVECTOR3 tri[2];
+            FVECTOR3 vect[3], p[3];
+            int s, nNum = GridCellFaces(c, tri);
+            for (s=0; s<nNum; s++)
+            {
+                GridPoint(tri[s][0], m_Grid.pfZ, p[0]);
+                GridPoint(tri[s][1], m_Grid.pfZ, p[1]);
+                GridPoint(tri[s][2], m_Grid.pfZ, p[2]);
+                VEC3_V_OP_V(vect[0],p[1],-,p[0]);
+                VEC3_V_OP_V(vect[1],p[2],-,p[0]);
+                CROSSPROD3(vect[2],vect[0],vect[1]);
+                V3Normalize(vect[2]);
+                GridSetNormal(m_Grid.pNormal, 2*c+s, vect[2]);
+            }
+        });
+    }
 
-    i = sscanf(sTmp,"%d%d%d", &m_nNumVertex, &tmp, &m_nNumFace);
-    while(i!=3)
+    for(; (m_nNormalPasses<nIterations) && !m_bNormalConverged; m_nNormalPasses++)
+    {
+        pTmp = TNormal;
+        TNormal = m_Grid.pNormal;
+        m_Grid.pNormal = pTmp;
+        GridForCells([&](int c) {
+            NVECTOR3 tri[2];
+            int pnRing[32];
+            int i, k, s, nNum, nRing;
+            float tmp3;
+            FVECTOR3 f3Own, f3Ring, f3Sum;
+            nNum = GridCellFaces(c, tri);
+            for (s=0; s<nNum; s++)
+            {
+                k = 2*c+s;
+                nRing = GridFaceRing(tri[s], bNeighbourCV, pnRing);
+                GridGetNormal(TNormal, k, f3Own);
+                VEC3_ZERO(f3Sum);
+                for(i=0; i<nRing; i++)
+                {
+                    GridGetNormal(TNormal, pnRing[i], f3Ring);
+                    tmp3 = DOTPROD3(f3Ring,f3Own)-fSigma;
+                    if( tmp3 > 0.0)
+                    {
+                        VEC3_V_OP_V_OP_S(f3Sum,f3Sum, +, f3Ring, *, tmp3*tmp3);
+                    }
+                }
+                V3Normalize(f3Sum);
+                GridSetNormal(m_Grid.pNormal, k, f3Sum);
+            }
+        });
+
+        if (m_fNormalTol>=0)
+            m_bNormalConverged = NormalConverged(ParallelMax(0, m_Grid.nrows-1, [&](int nFrom, int nTo) {
+                NVECTOR3 tri[2];
+                FVECTOR3 f3Old, f3New, d;
+                float f = 0;
+                int i, j, k, s, nNum;
+                for(i=nFrom; i<nTo; i++)
+                    for(j=0; j<m_Grid.ncols-1; j++)
+                    {
+                        nNum = GridCellFaces(j+i*m_Grid.ncols, tri);
+                        for (s=0; s<nNum; s++)
+                        {
+                            k = 2*(j+i*m_Grid.ncols)+s;
+                            GridGetNormal(TNormal, k, f3Old);
+                            GridGetNormal(m_Grid.pNormal, k, f3New);
+                            VEC3_V_OP_V(d, f3New, -, f3Old);
+                            f = FMAX(f, DOTPROD3(d, d));
+                        }
+                    }
+                return f;
+            }));
+    }
+    free(TNormal);
+    if (m_bKeepNormals)
+    {
+        // the vertex updating leaves m_Grid.pNormal alone
+        m_bKeptCV = bNeighbourCV;
+        m_fKeptSigma = fSigma;
+        m_nKeptIterations = m_nNormalPasses;
+        m_bKeptConverged = m_bNormalConverged;
+        m_vKeptResidual = m_vNormalResidual;
+    }
+
+    GridVertexUpdate(nVIterations);
+}
+
+// Only the heights change, as with -z.
+void CDenoiser::GridVertexUpdate(int nVIterations)
+{
+    int m, p, nTotal = m_Grid.nrows*m_Grid.ncols;
+    float *pfTarget, *pfTmp;
+    float fOld, fMove;
+    bool bConverged = FALSE;
+
+    m_vVertexResidual.clear();
+    if (!m_bJacobi)
+    {
+        for(m=0; (m<nVIterations) && !bConverged; m++)
+        {
+            fMove = 0;
+            for(p=0; p<nTotal; p++)
+                if (!(m_Grid.pnFlag[p] & GRID_NODATA))
+                {
+                    fOld = m_Grid.pfZ[p];
+                    m_Grid.pfZ[p] = GridVertexMove(p, m_Grid.pfZ);
+                    fMove = FMAX(fMove, fabs(m_Grid.pfZ[p]-fOld));
+                }
+            if (m_fVertexTol>=0)
+                bConverged = VertexConverged(fMove*fMove);
+        }
+    }
+    else
+    {
+        pfTarget = (float *)MyMalloc(nTotal*sizeof(float));
+        for(m=0; (m<nVIterations) && !bConverged; m++)
+        {
+            ParallelFor(0, nTotal, [&](int nFrom, int nTo) {
+                for(int q=nFrom; q<nTo; q++)
+                    pfTarget[q] = (m_Grid.pnFlag[q] & GRID_NODATA) ? m_Grid.pfZ[q] : GridVertexMove(q, m_Grid.pfZ);
+            });
+            if (m_fVertexTol>=0)
+                bConverged = VertexConverged(ParallelMax(0, nTotal, [&](int nFrom, int nTo) {
+                    float f = 0;
+                    for(int q=nFrom; q<nTo; q++)
+                        f = FMAX(f, fabs(pfTarget[q]-m_Grid.pfZ[q]));
+                    return f*f;
+                }));
+            pfTmp = m_Grid.pfZ;
+            m_Grid.pfZ = pfTarget;
+            pfTarget = pfTmp;
+        }
+        free(pfTarget);
+    }
+    m_nVertexPasses = m;
+}
+
+// New height of point p from the heights pfZ, as in VertexMove.
+float CDenoiser::GridVertexMove(int p, const float* pfZ)
+{
+    int j, nNum;
+    int pnFace[8];
+    NVECTOR3 pn3Point[8];
+    float fTmp1;
+    FVECTOR3 vect[2], q[4], f3Normal;
+
+    nNum = GridVertexFaces(p, pnFace, pn3Point);
+    if (nNum==0)
+        return pfZ[p];
+    GridPoint(p, pfZ, q[3]);
+    vect[1][2] = 0;
+    for(j=0; j<nNum; j++)
+    {
+        GridPoint(pn3Point[j][0], pfZ, q[0]);
+        GridPoint(pn3Point[j][1], pfZ, q[1]);
+        GridPoint(pn3Point[j][2], pfZ, q[2]);
+        VEC3_V_OP_V_OP_V(vect[0], q[0],+, q[1],+, q[2]);
+        VEC3_V_OP_S(vect[0], vect[0], /, 3.0); //vect[0] is the centr of the triangle.
+        VEC3_V_OP_V(vect[0], vect[0], -, q[3]); //vect[0] is now vector PC.
+        GridGetNormal(m_Grid.pNormal, pnFace[j], f3Normal);
+        fTmp1 = DOTPROD3(vect[0], f3Normal);
+        vect[1][2] = vect[1][2] + f3Normal[2] * fTmp1;
+    }
+    return q[3][2] + vect[1][2]/nNum;
+}
+
+void CDenoiser::SaveGrid(FILE * fp, struct ESRIHeader* header)
+{
+    SaveESRIHeader(fp, header);
+    SaveGridRows(fp, header, 0, header->nrows);
+}
+
+// Writes rows nFirst to nLast-1 of m_Grid in the units of the input, columns
+// nFirstCol to nLastCol-1 of them (-1: to the last one).
+void CDenoiser::SaveGridRows(FILE * fp, struct ESRIHeader* header, int nFirst, int nLast, int nFirstCol, int nLastCol)
+{
+    int i,j,k;
+    struct OutBuffer ob;
+
+	if (nLastCol<0)
+		nLastCol = header->ncols;
+	OutOpen(&ob, fp, m_nPrecision);
+	for(i=nFirst;i<nLast;i++)
+	{
+		for(j=nFirstCol;j<nLastCol;j++){
+			k = j+i*header->ncols;
+			if(m_Grid.pnFlag[k] & GRID_NODATA){
+				OutNumber(&ob, header->nodata_value);
+			}else{
+				OutNumber(&ob, m_f3Centre[2]+m_Grid.pfZ[k]*m_fScale);
+			}
+			OutText(&ob, " ");
+		}
+		OutText(&ob, "\n");
+	}
+	OutClose(&ob);
+}
+
+// Writes nRows rows of nCols scaled heights, NAN where there is no data, in
+// the units of the input, as SaveESRIRows and SaveGridRows do.
+static void SaveBandRows(FILE* fp, const float* pfZ, int nRows, int nCols, double dNodata,
+    float fCentre, float fScale, int nPrecision)
+{
+    int i, j;
+    struct OutBuffer ob;
+
+    OutOpen(&ob, fp, nPrecision);
+    for(i=0; i<nRows; i++)
+    {
+        for(j=0; j<nCols; j++, pfZ++)
+        {
+            if (isnan(*pfZ))
+                OutNumber(&ob, dNodata);
+            else
+                OutNumber(&ob, fCentre+*pfZ*fScale);
+            OutText(&ob, " ");
+        }
+        OutText(&ob, "\n");
+    }
+    OutClose(&ob);
+}
+
+// Out-of-core processing of an ESRI grid: the grid is read, denoised and
+// written band by band. Each band of m_nBandRows rows is denoised together
+// with nHalo rows on either side, beyond which the filters cannot reach
+// (exactly so for Jacobi vertex updating), so only the band itself and its
+// halo are ever held in memory. The bands go through three threads: once a
+// band is built from pdWindow, the rows of the next band are read into it
+// on a reader thread, and once it is denoised, its heights are copied out
+// and written on a writer thread while the next band is denoised.
+void CDenoiser::DenoiseESRIBands(FILE* fpIn, FILE* fpOut, struct ESRIHeader* header)
+{
+    int i, j, k, nCols, nHalo, nRow0, nRow1, nWin0, nWin1, nTotal;
+    int nFirst, nLast;   // grid rows nFirst to nLast-1 are in pdWindow
+    double *pdWindow;
+    float *pfBand, fCentre, fScale;
+    struct ESRIHeader tile;
+    std::thread *pReader = NULL, *pWriter = NULL;
+
+    nCols = header->ncols;
+    nHalo = m_nIterations + m_nVIterations + 2;
+    pdWindow = (double *)MyMalloc((size_t)(m_nBandRows+2*nHalo)*nCols*sizeof(double));
+    nFirst = nLast = 0;
+
+    // slides the window down to the rows of the band from nBand and its halo
+    auto SlideWindow = [&](int nBand) {
+        int nBand1 = (nBand+m_nBandRows<header->nrows) ? nBand+m_nBandRows : header->nrows;
+        int nFrom = (nBand-nHalo>0) ? nBand-nHalo : 0;
+        int nTo = (nBand1+nHalo<header->nrows) ? nBand1+nHalo : header->nrows;
+        memmove(pdWindow, pdWindow+(size_t)(nFrom-nFirst)*nCols, (size_t)(nLast-nFrom)*nCols*sizeof(double));
+        nFirst = nFrom;
+        ReadESRIValues(fpIn, header, pdWindow+(size_t)(nLast-nFirst)*nCols, (nTo-nLast)*nCols);
+        nLast = nTo;
+    };
+
+    SaveESRIHeader(fpOut, header);
+    SlideWindow(0);
+    for(nRow0=0; nRow0<header->nrows; nRow0+=m_nBandRows)
+    {
+        nRow1 = (nRow0+m_nBandRows<header->nrows) ? nRow0+m_nBandRows : header->nrows;
+        nWin0 = nFirst;
+        nWin1 = nLast;
+
+        tile = *header;
+        tile.nrows = nWin1-nWin0;
+        if (m_bGrid)
+            BuildGrid(&tile, pdWindow, nWin0);
+        else
+            BuildESRIMesh(&tile, pdWindow, nWin0);
+        if (nRow1<header->nrows)
+            pReader = new std::thread(SlideWindow, nRow1);
+        pfBand = (float *)MyMalloc((size_t)(nRow1-nRow0)*nCols*sizeof(float));
+        nTotal = tile.nrows*nCols;
+        if (m_bGrid)
+        {
+            MeshDenoise(m_bNeighbourCV, m_fSigma, m_nIterations, m_nVIterations);
+            fCentre = m_f3Centre[2];
+            fScale = m_fScale;
+            for (i=0, k=(nRow0-nWin0)*nCols; i<(nRow1-nRow0)*nCols; i++, k++)
+                pfBand[i] = (m_Grid.pnFlag[k] & GRID_NODATA) ? NAN : m_Grid.pfZ[k];
+            FreeGrid();
+        }
+        else
+        {
+            InitModel();
+            if (m_bReorder)
+                ReorderMesh();
+            MeshDenoise(m_bNeighbourCV, m_fSigma, m_nIterations, m_nVIterations);
+            if (m_pnVertexOrder != NULL)
+                RestoreOrder();
+            fCentre = m_f3Centre[2];
+            fScale = m_fScale;
+            for (i=0, k=(nRow0-nWin0)*nCols; i<(nRow1-nRow0)*nCols; i++, k++)
+            {
+                j = tile.isnodata ? tile.index[k] : k;
+                pfBand[i] = (j==nTotal) ? NAN : m_pf3VertexP[j][2];
+            }
+            FreeModel();
+            free(tile.index);
+        }
+
+        // the bands are written in order, with the scale of their own model
+        if (pWriter!=NULL)
+        {
+            pWriter->join();
+            delete pWriter;
+        }
+        pWriter = new std::thread([=]() {
+            SaveBandRows(fpOut, pfBand, nRow1-nRow0, nCols, header->nodata_value, fCentre, fScale, m_nPrecision);
+            free(pfBand);
+        });
+        if (pReader!=NULL)
+        {
+            pReader->join();
+            delete pReader;
+            pReader = NULL;
+        }
+    }
+    if (pWriter!=NULL)
+    {
+        pWriter->join();
+        delete pWriter;
+    }
+    free(pdWindow);
+}
+
+#ifdef MDENOISE_MPI
+// Domain decomposition (MDENOISE_MPI): process r of n denoises the grid rows
+// nrows*r/n to nrows*(r+1)/n-1, read in a window with one ghost row above
+// and two below them; the faces of a cell row belong to the process of its
+// upper row. The model is scaled by the box of the whole grid, and after
+// each pass the first and last owned rows go to the processes around in
+// place of their ghost rows, so that with Jacobi vertex updating (-u) the
+// result is that of one process. Returns the faces of the domain, or 0 on
+// every process when one of the domains has none.
+int CDenoiser::ReadESRIDomain(FILE* fp, struct ESRIHeader* header)
+{
+    int i, j, k, nRank, nRanks, nWin1, nRows, nTotal, nOk;
+    double *pdWindow;
+    float box[2][3], pfBox[6];
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &nRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    ReadESRIHeader(fp, header);
+    m_nDomainFirst = (int)((long long)header->nrows*nRank/nRanks);
+    m_nDomainLast = (int)((long long)header->nrows*(nRank+1)/nRanks);
+    m_nDomainWin = (m_nDomainFirst>0) ? m_nDomainFirst-1 : 0;
+    nWin1 = (m_nDomainLast+2<header->nrows) ? m_nDomainLast+2 : header->nrows;
+    nRows = nWin1-m_nDomainWin;
+
+    // the rows above the window are read a window at a time and dropped
+    pdWindow = (double *)MyMalloc((size_t)nRows*header->ncols*sizeof(double));
+    for (i=0; i<m_nDomainWin; i+=k)
+    {
+        k = (m_nDomainWin-i<nRows) ? m_nDomainWin-i : nRows;
+        ReadESRIValues(fp, header, pdWindow, k*header->ncols);
+    }
+    ReadESRIValues(fp, header, pdWindow, nRows*header->ncols);
+    m_Domain = *header;
+    m_Domain.nrows = nRows;
+    BuildESRIMesh(&m_Domain, pdWindow, m_nDomainWin);
+    free(pdWindow);
+
+    // the vertices and faces are made row by row
+    nTotal = m_Domain.ncols*m_Domain.nrows;
+    m_vDomainVertex.assign(nRows+1, 0);
+    for (i=0; i<nRows; i++)
+    {
+        m_vDomainVertex[i+1] = m_vDomainVertex[i];
+        for (j=0; j<m_Domain.ncols; j++)
+            if (m_Domain.index[j+i*m_Domain.ncols]<nTotal)
+                m_vDomainVertex[i+1]++;
+    }
+    m_vDomainFace.assign(nRows+1, 0);
+    for (i=0; i<m_nNumFace; i++)
     {
-        i = fscanf(fp,"%d%d%d", &m_nNumVertex, &tmp, &m_nNumFace);
+        k = (m_pn3Face[i][0]<m_pn3Face[i][1]) ? m_pn3Face[i][0] : m_pn3Face[i][1];
+        k = (k<m_pn3Face[i][2]) ? k : m_pn3Face[i][2];
+        j = (int)(std::upper_bound(m_vDomainVertex.begin(), m_vDomainVertex.end(), k)-m_vDomainVertex.begin());
+        m_vDomainFace[j]++;     // after cell row j-1
     }
+    for (i=1; i<=nRows; i++)
+        m_vDomainFace[i] += m_vDomainFace[i-1];
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    edge = new NVECTOR2[tmp];
-    m_pn3Face = new NVECTOR3[m_nNumFace];
+    nOk = (m_nDomainLast>m_nDomainFirst) && (m_nNumFace>0);
+    MPI_Allreduce(MPI_IN_PLACE, &nOk, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if (!nOk)
+        return 0;
 
-    for (i=0;i<m_nNumVertex;i++)
+    // the box of the whole grid, as ScalingBox finds it
+    ModelBox(box);
+    for (j=0; j<3; j++)
     {
-        fgets(sTmp, 200, fp);
-        sscanf(sTmp,"%f%f%f", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));
-    }
-    for (i=0;i<tmp;i++)
-    {
-        fscanf(fp,"%d%d", &(edge[i][0]), &(edge[i][1]));
+        pfBox[j] = -box[0][j];
+        pfBox[j+3] = box[1][j];
     }
-    for (i=0;i<m_nNumFace;i++)
+    MPI_Allreduce(MPI_IN_PLACE, pfBox, 6, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+    for (j=0; j<3; j++)
     {
-        fscanf(fp,"%d%d%d", &tmp1, &tmp2, &tmp3);
-        m_pn3Face[i][0] = edge[tmp1-1][0]-1;
-        m_pn3Face[i][1] = edge[tmp1-1][1]-1;
-        if ((edge[tmp2-1][0] == edge[tmp1-1][0])||(edge[tmp2-1][0] == edge[tmp1-1][1]))
-            m_pn3Face[i][2] = edge[tmp2-1][1]-1;
-        else
-            m_pn3Face[i][2] = edge[tmp2-1][0]-1;
+        box[0][j] = -pfBox[j];
+        box[1][j] = pfBox[j+3];
     }
-    delete []edge;
+    ScaleToBox(box);
+    InitScaledModel();
+
+    m_fnFaceGhosts = [this](FVECTOR3* pf3) { DomainExchange(pf3, m_vDomainFace); };
+    m_fnVertexGhosts = [this](FVECTOR3* pf3) { DomainExchange(pf3, m_vDomainVertex); };
+    return m_nNumFace;
 }
 
-void ReadOBJ(FILE* fp)
+// Sends the first and last owned rows of pf3, whose window rows start at the
+// elements of vRow, to the processes above and below, and receives their
+// first and last rows into the ghost rows next to them. Each process talks
+// to the one above first, so the exchanges go down the chain of processes.
+void CDenoiser::DomainExchange(FVECTOR3* pf3, const std::vector<int>& vRow)
 {
-    int i, j;
-    int nTmp,nTmp1;
-    char sTmp[200], sTmp1[200];
-    FVECTOR3 *vVertex;
-    NVECTOR3 * tTriangle;
-
-    vVertex = (FVECTOR3 *)MyMalloc(10000* sizeof(FVECTOR3));
-    tTriangle = (NVECTOR3 *)MyMalloc(10002* sizeof(NVECTOR3));
+    int nRank, nRanks;
+    int nFirst = m_nDomainFirst-m_nDomainWin, nLast = m_nDomainLast-m_nDomainWin;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &nRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+    if (nRank>0)
+        MPI_Sendrecv(pf3[vRow[nFirst]], 3*(vRow[nFirst+1]-vRow[nFirst]), MPI_FLOAT, nRank-1, 0,
+            pf3[vRow[nFirst-1]], 3*(vRow[nFirst]-vRow[nFirst-1]), MPI_FLOAT, nRank-1, 1,
+            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    if (nRank<nRanks-1)
+        MPI_Sendrecv(pf3[vRow[nLast-1]], 3*(vRow[nLast]-vRow[nLast-1]), MPI_FLOAT, nRank+1, 1,
+            pf3[vRow[nLast]], 3*(vRow[nLast+1]-vRow[nLast]), MPI_FLOAT, nRank+1, 0,
+            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
 
-    m_nNumVertex = m_nNumFace = 0;
-    while (!feof(fp))
+// Writes the grid into pszOut, the header from the first process and the
+// owned rows from each: the rows are formatted in memory and written at the
+// offset that follows the rows of the processes before.
+bool CDenoiser::SaveESRIDomain(const char* pszOut, struct ESRIHeader* header)
+{
+    int i, nRank;
+    char *pBuffer = NULL;
+    size_t nSize = 0, n, nChunk;
+    long long nBytes, nOffset = 0;
+    MPI_File fh;
+    FILE *fp;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &nRank);
+    for (i=0;i<m_nNumVertexP;i++)
     {
-        fgets(sTmp, 200, fp);
-        if(sTmp[0]=='v')
-        {
-            if((sTmp[1]=='t')||(sTmp[1]=='n'))
-            {
-                printf("This OBJ file is not supported!\n");
-                m_nNumVertex = m_nNumFace = 0;
-                free(vVertex);
-                free(tTriangle);
-                return;
-            }
-            else
-            {
-                sscanf(sTmp,"%s%f%f%f", sTmp1, &(vVertex[m_nNumVertex][0]), \
-                    &(vVertex[m_nNumVertex][1]),&(vVertex[m_nNumVertex][2]));
-                m_nNumVertex++;
-                if (!(m_nNumVertex % 10000))
-                    vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10000)* sizeof(FVECTOR3));
-            }
-        }
-        else if(sTmp[0]=='f')
-        {
-            j = sscanf(sTmp,"%s%d%d%d%d%d", sTmp1, &(tTriangle[m_nNumFace][0]), \
-                &(tTriangle[m_nNumFace][1]),&(tTriangle[m_nNumFace][2]), &nTmp, &nTmp1);
-            if (j==4)
-            {
-                tTriangle[m_nNumFace][0]--;
-                tTriangle[m_nNumFace][1]--;
-                tTriangle[m_nNumFace][2]--;
-            }
-            else if(j==5)
-            {
-                tTriangle[m_nNumFace][0]--;
-                tTriangle[m_nNumFace][1]--;
-                tTriangle[m_nNumFace][2]--;
-                m_nNumFace++;
-                if (!(m_nNumFace % 10000))
-                    tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10002)* sizeof(NVECTOR3));
-                tTriangle[m_nNumFace][0] = tTriangle[m_nNumFace-1][2];
-                tTriangle[m_nNumFace][1] = (--nTmp);
-                tTriangle[m_nNumFace][2] = tTriangle[m_nNumFace-1][0];
-            }
-            else
-            {
-                printf("This OBJ file is not supported!\n");
-                m_nNumVertex = m_nNumFace = 0;
-                free(vVertex);
-                free(tTriangle);
-                return;
-            }
-            m_nNumFace++;
-            if (!(m_nNumFace % 10000))
-                tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10002)* sizeof(NVECTOR3));
-        }
+        VEC3_V_OP_V_OP_S(m_pf3VertexP[i],m_f3Centre,+, m_pf3VertexP[i],*, m_fScale);
     }
+    fp = open_memstream(&pBuffer, &nSize);
+    if (nRank==0)
+        SaveESRIHeader(fp, header);
+    SaveESRIRows(fp, &m_Domain, m_nDomainFirst-m_nDomainWin, m_nDomainLast-m_nDomainWin);
+    fclose(fp);
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for(i=0; i<m_nNumVertex; i++)
+    nBytes = (long long)nSize;
+    MPI_Exscan(&nBytes, &nOffset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (nRank==0)
+        nOffset = 0;
+    if (MPI_File_open(MPI_COMM_WORLD, (char *)pszOut, MPI_MODE_CREATE|MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS)
     {
-        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[i]);
+        free(pBuffer);
+        return FALSE;
     }
-    free(vVertex);
+    MPI_File_set_size(fh, 0);
+    for (n=0; n<nSize; n+=nChunk)
+    {
+        nChunk = (nSize-n<(1<<30)) ? nSize-n : (1<<30);
+        MPI_File_write_at(fh, nOffset+n, pBuffer+n, (int)nChunk, MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&fh);
+    free(pBuffer);
+    return TRUE;
+}
+#endif
 
-     m_pn3Face = new NVECTOR3[m_nNumFace];
-    for(i=0; i<m_nNumFace; i++)
+// Interleaves the bits of the three coordinates (21 bits each) of a vertex
+// of the scaled model.
+unsigned long long MortonCode(FVECTOR3 v)
+{
+    int i;
+    unsigned long long nCode = 0, x;
+    float f;
+
+    for (i=0;i<3;i++)
     {
-        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+        f = (v[i]+1.0f)*0.5f*2097151.0f;
+        f = (f<0.0f) ? 0.0f : ((f>2097151.0f) ? 2097151.0f : f);
+        x = (unsigned long long)f;
+        x = (x | x << 32) & 0x1f00000000ffffULL;
+        x = (x | x << 16) & 0x1f0000ff0000ffULL;
+        x = (x | x << 8) & 0x100f00f00f00f00fULL;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+        x = (x | x << 2) & 0x1249249249249249ULL;
+        nCode |= x << i;
     }
-    free(tTriangle);
+    return nCode;
+}
+
+// Reorders the elements of an array so that element i becomes the former
+// element pnOrder[i].
+void PermuteArray(void* pData, size_t nSize, int* pnOrder, int nNum)
+{
+    int i;
+    char *pSrc = (char *)pData;
+    char *pTmp = (char *)MyMalloc(nNum*nSize);
+
+    for (i=0;i<nNum;i++)
+        memcpy(pTmp+i*nSize, pSrc+(size_t)pnOrder[i]*nSize, nSize);
+    memcpy(pSrc, pTmp, nNum*nSize);
+    free(pTmp);
 }
 
-void ReadOFF(FILE* fp)
+// Sorts the vertices and then the faces along a Morton curve, so that
+// neighbouring elements are close in memory. m_pnVertexOrder and
+// m_pnFaceOrder keep the original index of each element for SaveData.
+void CDenoiser::ReorderMesh(void)
 {
     int i,j;
-    char tmp[300];
+    int *pnNewIndex;
+    FVECTOR3 f3Centre;
+    std::vector<std::pair<unsigned long long, int> > code;
 
-    fscanf(fp,"%s", tmp);
-    if ((strncmp(tmp, "OFF",3))||(fscanf(fp,"%d %d %d",&m_nNumVertex,&m_nNumFace, &j)<2))
-    {
-        printf("The file is not a valid OFF one!111\n");
-        m_nNumVertex = m_nNumFace = 0;
+    if ((m_nNumVertex==0)||(m_nNumFace==0))
         return;
-    }
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    m_pn3Face = new NVECTOR3[m_nNumFace];
+    m_pnVertexOrder = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    m_pnFaceOrder = (int *)MyMalloc(m_nNumFace*sizeof(int));
 
+    code.resize(m_nNumVertex);
     for (i=0;i<m_nNumVertex;i++)
+        code[i] = std::make_pair(MortonCode(m_pf3Vertex[i]), i);
+    std::sort(code.begin(), code.end());
+    pnNewIndex = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    for (i=0;i<m_nNumVertex;i++)
+    {
+        m_pnVertexOrder[i] = code[i].second;
+        pnNewIndex[code[i].second] = i;
+    }
+    PermuteArray(m_pf3Vertex, sizeof(FVECTOR3), m_pnVertexOrder, m_nNumVertex);
+    PermuteArray(m_pf3VertexNormal, sizeof(FVECTOR3), m_pnVertexOrder, m_nNumVertex);
+    PermuteArray(m_pf3VertexP, sizeof(FVECTOR3), m_pnVertexOrder, m_nNumVertex);
+    PermuteArray(m_pf3VertexNormalP, sizeof(FVECTOR3), m_pnVertexOrder, m_nNumVertex);
+    for (i=0;i<m_nNumFace;i++)
     {
-        fscanf(fp,"%f%f%f,", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));       
+        for (j=0;j<3;j++)
+            m_pn3Face[i][j] = pnNewIndex[m_pn3Face[i][j]];
     }
+    free(pnNewIndex);
+
+    code.resize(m_nNumFace);
     for (i=0;i<m_nNumFace;i++)
     {
-        fscanf(fp,"%d%d%d%d", &j, &(m_pn3Face[i][0]), &(m_pn3Face[i][1]), &(m_pn3Face[i][2]));       
+        VEC3_V_OP_V_OP_V(f3Centre, m_pf3Vertex[m_pn3Face[i][0]],+, m_pf3Vertex[m_pn3Face[i][1]],+, m_pf3Vertex[m_pn3Face[i][2]]);
+        VEC3_V_OP_S(f3Centre, f3Centre, /, 3.0f);
+        code[i] = std::make_pair(MortonCode(f3Centre), i);
     }
+    std::sort(code.begin(), code.end());
+    for (i=0;i<m_nNumFace;i++)
+        m_pnFaceOrder[i] = code[i].second;
+    PermuteArray(m_pn3Face, sizeof(NVECTOR3), m_pnFaceOrder, m_nNumFace);
+    PermuteArray(m_pf3FaceNormal, sizeof(FVECTOR3), m_pnFaceOrder, m_nNumFace);
+    PermuteArray(m_pf3FaceNormalP, sizeof(FVECTOR3), m_pnFaceOrder, m_nNumFace);
+    for (i=0;i<m_nNumFace;i++)
+        VEC3_ASN_OP(m_pn3FaceP[i],=,m_pn3Face[i]);
 }
 
-void ReadPLY(FILE* fp)
+// Puts the produced mesh back into the original vertex and face order.
+void CDenoiser::RestoreOrder(void)
 {
     int i,j;
-    char seps[]  = " ,\t\n\r";
-    char sTmp[200], *sTmp1;
-    int plyType = PLY_ASCII;
-    int nVFreeByte = 0;
+    FVECTOR3* pf3Tmp;
+    NVECTOR3* pn3Tmp;
 
-    fgets(sTmp, 200, fp);
-    sTmp[3] ='\0';
+    pf3Tmp = new FVECTOR3[m_nNumVertexP];
+    for (i=0;i<m_nNumVertexP;i++)
+        VEC3_ASN_OP(pf3Tmp[m_pnVertexOrder[i]],=,m_pf3VertexP[i]);
+    memcpy(m_pf3VertexP, pf3Tmp, m_nNumVertexP*sizeof(FVECTOR3));
+    for (i=0;i<m_nNumVertexP;i++)
+        VEC3_ASN_OP(pf3Tmp[m_pnVertexOrder[i]],=,m_pf3VertexNormalP[i]);
+    memcpy(m_pf3VertexNormalP, pf3Tmp, m_nNumVertexP*sizeof(FVECTOR3));
+    delete []pf3Tmp;
 
-    if (strcicmp(sTmp, "ply"))
+    pf3Tmp = new FVECTOR3[m_nNumFaceP];
+    pn3Tmp = new NVECTOR3[m_nNumFaceP];
+    for (i=0;i<m_nNumFaceP;i++)
     {
-        printf("This file is not a valid PLY one!");
-        m_nNumVertex = m_nNumFace = 0;
-        return;
+        for (j=0;j<3;j++)
+            pn3Tmp[m_pnFaceOrder[i]][j] = m_pnVertexOrder[m_pn3FaceP[i][j]];
+        VEC3_ASN_OP(pf3Tmp[m_pnFaceOrder[i]],=,m_pf3FaceNormalP[i]);
     }
+    memcpy(m_pn3FaceP, pn3Tmp, m_nNumFaceP*sizeof(NVECTOR3));
+    memcpy(m_pf3FaceNormalP, pf3Tmp, m_nNumFaceP*sizeof(FVECTOR3));
+    delete []pn3Tmp;
+    delete []pf3Tmp;
+}
 
+void CDenoiser::ScalingBox(void)
+{
+    float box[2][3];
 
-    //read the file header
-    while (!feof(fp))
+    ModelBox(box);
+    ScaleToBox(box);
+}
+
+// The bounding box of the model, box[0] the lower and box[1] the upper corner.
+void CDenoiser::ModelBox(float box[2][3])
+{
+    int i,j;
+
+    box[0][0] = box[0][1] = box[0][2] = FLT_MAX;
+    box[1][0] = box[1][1] = box[1][2] = -FLT_MAX;
+    for (i=0;i<m_nNumVertex;i++)
     {
-        fgets(sTmp, 200, fp);
-        sTmp1 = strtok(sTmp, seps);
-        if (!strcicmp(sTmp1, "format"))
+        for (j=0;j<3;j++)
         {
-        //    sscanf(sTmp+6 , "%s", sTmp1);       
-            sTmp1 = strtok( NULL, seps );
-            if (!strcicmp(sTmp1, "ascii"))
-                plyType = PLY_ASCII;
-            else if (!strcicmp(sTmp1, "binary_little_endian"))
-                plyType = PLY_BLITTLE;
-            else if (!strcicmp(sTmp1, "binary_big_endian"))
-                plyType = PLY_BBIG;
-            else
-            {
-                printf("This format is not supported.!\n");
-                return;
-            }
-            sTmp1 = strtok(NULL,seps);
-            if (strcicmp(sTmp1, "1.0"))
-            {
-                printf("Only PLY format version 1.0 is supported!");
-                return;
-            }
-            break;
+            if (box[0][j]>m_pf3Vertex[i][j])
+                box[0][j] = m_pf3Vertex[i][j];
+            if (box[1][j]<m_pf3Vertex[i][j])
+                box[1][j] = m_pf3Vertex[i][j];
         }
     }
+}
 
-    m_nNumVertex = 0;
-    m_nNumFace = 0;
-    bool bVertex = FALSE;
-    bool bFace = FALSE;
-    while (!feof(fp))
+// Scales the model into the unit box around the centre of box.
+void CDenoiser::ScaleToBox(float box[2][3])
+{
+    int i;
+
+    m_f3Centre[0] = (box[0][0]+box[1][0])/2.0;
+    m_f3Centre[1] = (box[0][1]+box[1][1])/2.0;
+    m_f3Centre[2] = (box[0][2]+box[1][2])/2.0;
+
+    m_fScale = FMAX(box[1][0]-box[0][0],FMAX(box[1][1]-box[0][1],box[1][2]-box[0][2]));
+    m_fScale /=2.0;
+    for (i=0;i<m_nNumVertex;i++)
     {
-        fgets(sTmp,200,fp);
-        sTmp1 = strtok(sTmp, seps);
-        if (!strcicmp(sTmp, "element"))
-        {
-            sTmp1 = strtok(NULL,seps);
-            if (!strcicmp(sTmp1, "vertex"))
-            {
-                sTmp1 = strtok(NULL,seps);
-                m_nNumVertex = atoi(sTmp1);
-                bVertex = TRUE;
-                bFace = FALSE;
-            }
-            else if (!strcicmp(sTmp1, "face"))
-            {
-                sTmp1 = strtok(NULL,seps);
-                m_nNumFace = atoi(sTmp1);
-                bVertex = FALSE;
-                bFace = TRUE;
-            }
-            else
-            {
-                bVertex = FALSE;
-                bFace = FALSE;
-            }
-        }
-        else if (!strcicmp(sTmp, "property"))
-        {
-            if(bVertex)
-            {
-                sTmp1 = strtok(NULL,seps);
-                if (!(strcicmp(sTmp1, "float")&&strcicmp(sTmp1, "float32")))
-                {
-                    sTmp1 = strtok(NULL,seps);
-                    if (strcicmp(sTmp1, "x")&& strcicmp(sTmp1, "y")&& strcicmp(sTmp1, "z"))
-                        nVFreeByte += 4;
-                }
-                else if (!strcicmp(sTmp1, "char"))
-                        nVFreeByte += 1;
-                else if (!strcicmp(sTmp1, "uchar"))
-                        nVFreeByte += 1;
-                else if (!strcicmp(sTmp1, "uint8"))
-                        nVFreeByte += 1;
-                else if (!strcicmp(sTmp1, "short"))
-                        nVFreeByte += 2;
-                else if (!strcicmp(sTmp1, "ushort"))
-                        nVFreeByte += 2;
-                else if (!strcicmp(sTmp1, "int"))
-                        nVFreeByte += 4;
-                else if (!strcicmp(sTmp1, "uint"))
-                        nVFreeByte += 4;
-                else if (!strcicmp(sTmp1, "double"))
-                        nVFreeByte += 8;
-            }
-            else if(bFace)
+        VEC3_VOPV_OP_S(m_pf3Vertex[i],m_pf3Vertex[i],-,m_f3Centre,/,m_fScale);
+    }
+}
+
+void CDenoiser::ComputeNormal(bool bProduced)
+{
+    int i, j;
+    FVECTOR3 vect[3];
+    float fArea;
+   
+    if(bProduced)
+    {
+        if(m_pf3VertexNormalP == NULL)
+            m_pf3VertexNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertexP*sizeof(FVECTOR3));
+        if(m_pf3FaceNormalP == NULL)
+            m_pf3FaceNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFaceP*sizeof(FVECTOR3));
+       
+        for (i=0;i<m_nNumVertexP;i++)
+        {
+            VEC3_ZERO(m_pf3VertexNormalP[i]);
+        }
+        for (i=0;i<m_nNumFaceP;i++) // compute each triangle normal and vertex normal
+        {
+            VEC3_V_OP_V(vect[0],m_pf3VertexP[m_pn3FaceP[i][1]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
+            VEC3_V_OP_V(vect[1],m_pf3VertexP[m_pn3FaceP[i][2]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
+            CROSSPROD3(vect[2],vect[0],vect[1]);
+            fArea = sqrt(DOTPROD3(vect[2], vect[2]))/2.0f; // Area of the face
+            V3Normalize(vect[2]);
+            VEC3_ASN_OP(m_pf3FaceNormalP[i],=,vect[2]);
+            for (j=0;j<3;j++)
             {
-                //to be further developped.
+                VEC3_V_OP_V_OP_S(m_pf3VertexNormalP[m_pn3FaceP[i][j]], \
+                    m_pf3VertexNormalP[m_pn3FaceP[i][j]], +, vect[2], *, fArea);
             }
         }
-        else if (!strcicmp(sTmp1, "end_header"))
-            break;
+        for (i=0;i<m_nNumVertexP;i++)
+            V3Normalize(m_pf3VertexNormalP[i]);
     }
-
-    if (plyType==PLY_ASCII)
-    {
-        m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-        m_pn3Face = new NVECTOR3[m_nNumFace];
-   
+    else
+    {   
+        if(m_pf3VertexNormal == NULL)
+            m_pf3VertexNormal = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertex*sizeof(FVECTOR3));
+        if(m_pf3FaceNormal == NULL)
+            m_pf3FaceNormal = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFace*sizeof(FVECTOR3));
+       
         for (i=0;i<m_nNumVertex;i++)
         {
-            fgets(sTmp,200,fp);
-            j = sscanf(sTmp,"%f%f%f", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));
-                    if (j!=3)
-                        break;
+            VEC3_ZERO(m_pf3VertexNormal[i]);
         }
-        for (i=0;i<m_nNumFace;i++)
+        for (i=0;i<m_nNumFace;i++) // compute each triangle normal and vertex normal
         {
-            fgets(sTmp,200,fp);   
-            sscanf(sTmp,"%d%d%d%d,", &j, &(m_pn3Face[i][0]), &(m_pn3Face[i][1]), &(m_pn3Face[i][2]));
+            VEC3_V_OP_V(vect[0],m_pf3Vertex[m_pn3Face[i][1]],-,m_pf3Vertex[m_pn3Face[i][0]]);
+            VEC3_V_OP_V(vect[1],m_pf3Vertex[m_pn3Face[i][2]],-,m_pf3Vertex[m_pn3Face[i][0]]);
+            CROSSPROD3(vect[2],vect[0],vect[1]);
+            fArea = sqrt(DOTPROD3(vect[2], vect[2]))/2.0f; // Area of the face
+            V3Normalize(vect[2]);
+            VEC3_ASN_OP(m_pf3FaceNormal[i],=,vect[2]);
+            for (j=0;j<3;j++)
+            {
+                VEC3_V_OP_V_OP_S(m_pf3VertexNormal[m_pn3Face[i][j]], \
+                    m_pf3VertexNormal[m_pn3Face[i][j]], +, vect[2], *, fArea);
+            }
         }
+        for (i=0;i<m_nNumVertex;i++)
+            V3Normalize(m_pf3VertexNormal[i]);
     }
-    else // PLY_BBIG and PLYBLITTLE
+}
+
+void V3Normalize(FVECTOR3 v)
+{
+    float len;
+    len=sqrt(DOTPROD3(v,v));
+    if (len!=0.0)
     {
-        m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-        m_pn3Face = new NVECTOR3[m_nNumFace];
+        v[0]=v[0]/len;
+        v[1]=v[1]/len;
+        v[2]=v[2]/len;
+    }
+}
 
-        for (i=0; i<m_nNumVertex; i++)
-        {
-            fread(&(m_pf3Vertex[i]),sizeof(float),3,fp);
-            if (plyType==PLY_BBIG)
-            {
-                char* c = (char*) &(m_pf3Vertex[i][0]);
-                char cTmp;
-               
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
-                float *x = (float *) &c[0];
-                m_pf3Vertex[i][0] = *x;
+// Octahedral encoding of a unit vector: it is projected onto the octahedron
+// |x|+|y|+|z|=1, the lower half is folded over the upper one, and x and y
+// are stored in 16 bits each.
+void OctEncode(const FVECTOR3 v, short* pnOct)
+{
+    float x, y, t, s = fabs(v[0])+fabs(v[1])+fabs(v[2]);
 
-                c = (char*) &(m_pf3Vertex[i][1]);
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
-                x = (float *) &c[0];
-                m_pf3Vertex[i][1] = *x;
+    if (s==0)
+    {
+        pnOct[0] = pnOct[1] = 0;
+        return;
+    }
+    x = v[0]/s;
+    y = v[1]/s;
+    if (v[2]<0)
+    {
+        t = (1-fabs(y))*((x>=0) ? 1 : -1);
+        y = (1-fabs(x))*((y>=0) ? 1 : -1);
+        x = t;
+    }
+    pnOct[0] = (short)lrintf(x*32767);
+    pnOct[1] = (short)lrintf(y*32767);
+}
 
-                c = (char*) &(m_pf3Vertex[i][2]);
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
-                x = (float *) &c[0];
-                m_pf3Vertex[i][2] = *x;
-            }
-            // special///////////////////////////////////
-            if (nVFreeByte != 0)
-            {
-                char cTmp[200];
-                fread(cTmp,sizeof(char),nVFreeByte,fp);
-            }
-        }
-        for (i=0; i<m_nNumFace; i++)
+void OctDecode(const short* pnOct, FVECTOR3 v)
+{
+    float t;
+
+    v[0] = pnOct[0]/32767.0f;
+    v[1] = pnOct[1]/32767.0f;
+    v[2] = 1-fabs(v[0])-fabs(v[1]);
+    if (v[2]<0)
+    {
+        t = (1-fabs(v[1]))*((v[0]>=0) ? 1 : -1);
+        v[1] = (1-fabs(v[0]))*((v[1]>=0) ? 1 : -1);
+        v[0] = t;
+    }
+    // the point is never the origin, so it can be scaled by one reciprocal
+    t = 1.0f/sqrtf(DOTPROD3(v,v));
+    VEC3_V_OP_S(v, v, *, t);
+}
+
+// Specialised kernels of the normal and vertex passes: the ring size, the
+// z-only update and the weight are fixed when the kernel is chosen, once per
+// pass, instead of being tested for each neighbour. They use the operations
+// of FaceFilter and VertexMove in the same order, so give the same result.
+
+// Filters the normals of faces [nFrom, nTo) from TNormal into pf3Out. With
+// NRING>0 no ring holds more than NRING faces, as the common edge rings of a
+// manifold mesh (the face and its up to three edge neighbours), and the ring
+// loop has a fixed length. The weight max(n.n_k-sigma, 0)^2 has no branch; a
+// neighbour below the threshold, or past the end of a shorter ring, adds 0.
+template <int NRING>
+static void FaceFilterKernel(const struct RingList* ttRing, const FVECTOR3* TNormal, float fSigma, FVECTOR3* pf3Out, int nFrom, int nTo)
+{
+    int i, j, k, nRing, nNum;
+    const int *pnRing;
+    float tmp3, fWeight;
+    bool bIn;
+
+    for(k=nFrom; k<nTo; k++)
+    {
+        pnRing = ttRing->pnIndex+ttRing->pnStart[k];
+        nRing = RING_SIZE(*ttRing, k);
+        nNum = (NRING>0) ? NRING : nRing;
+        VEC3_ZERO(pf3Out[k]);
+        for(i=0; i<nNum; i++)
         {
-            unsigned char cTmp;
-            fread(&cTmp,sizeof(unsigned char),1,fp);
-            fread(&(m_pn3Face[i]),sizeof(int),3,fp);
-            if (plyType==PLY_BBIG)
-            {
-                char* c = (char*) &(m_pn3Face[i][0]);
-                char cTmp;
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+            bIn = (NRING==0) || (i<nRing);
+            j = bIn ? pnRing[i] : k;
+            tmp3 = DOTPROD3(TNormal[j],TNormal[k])-fSigma;
+            fWeight = (bIn && (tmp3 > 0.0)) ? tmp3*tmp3 : 0.0f;
+            VEC3_V_OP_V_OP_S(pf3Out[k],pf3Out[k], +, TNormal[j], *, fWeight);
+        }
+        V3Normalize(pf3Out[k]);
+    }
+}
 
-                c = (char*) &(m_pn3Face[i][1]);
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+// The centroids of faces [nFrom, nTo) of the positions pf3Vertex, for the
+// vertex kernels of one Jacobi pass; each face is visited by its three
+// vertices, and its centroid is computed once.
+static void FaceCentroids(const NVECTOR3* pn3Face, const FVECTOR3* pf3Vertex, FVECTOR3* pf3Centroid, int nFrom, int nTo)
+{
+    int f;
 
-                c = (char*) &(m_pn3Face[i][2]);
-                cTmp = c[0]; c[0] = c[3]; c[3] = cTmp;
-                cTmp = c[1]; c[1] = c[2]; c[2] = cTmp;
+    for(f=nFrom; f<nTo; f++)
+    {
+        VEC3_V_OP_V_OP_V(pf3Centroid[f], pf3Vertex[pn3Face[f][0]],+, pf3Vertex[pn3Face[f][1]],+, pf3Vertex[pn3Face[f][2]]);
+        VEC3_V_OP_S(pf3Centroid[f], pf3Centroid[f], /, 3.0);
+    }
+}
+
+// Moves vertices [nFrom, nTo) from pf3In to pf3Out (Jacobi) as VertexMove,
+// from the face centroids of pf3In; ZONLY moves the z coordinate only.
+template <bool ZONLY>
+static void VertexKernel(const struct RingList* tRing, const FVECTOR3* pf3Centroid, const FVECTOR3* pf3Normal,
+    const FVECTOR3* pf3In, FVECTOR3* pf3Out, int nFrom, int nTo)
+{
+    int i, j, f, nNum;
+    float fTmp1;
+    FVECTOR3 vect[2];
 
+    for(i=nFrom; i<nTo; i++)
+    {
+        VEC3_ZERO(vect[1]);
+        for(j=tRing->pnStart[i]; j<tRing->pnStart[i+1]; j++)
+        {
+            f = tRing->pnIndex[j];
+            VEC3_V_OP_V(vect[0], pf3Centroid[f], -, pf3In[i]);
+            fTmp1 = DOTPROD3(vect[0], pf3Normal[f]);
+            if (ZONLY)
+                vect[1][2] = vect[1][2] + pf3Normal[f][2] * fTmp1;
+            else
+                VEC3_V_OP_V_OP_S(vect[1], vect[1], +, pf3Normal[f],*, fTmp1);
+        }
+        nNum = RING_SIZE(*tRing, i);
+        if (nNum!=0)
+        {
+            if (ZONLY)
+            {
+                pf3Out[i][0] = pf3In[i][0];
+                pf3Out[i][1] = pf3In[i][1];
+                pf3Out[i][2] = pf3In[i][2] + vect[1][2]/nNum;
             }
+            else
+                VEC3_V_OP_V_OP_S(pf3Out[i], pf3In[i],+, vect[1], /, nNum);
         }
-        return;
+        else
+            VEC3_ASN_OP(pf3Out[i], =, pf3In[i]);
     }
 }
 
-void ReadPLY2(FILE* fp)
+void CDenoiser::MeshDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations)
 {
-    int i, j;
+    struct RingList* ttRing; //store the list of triangle neighbours of a triangle
 
-    if(fscanf(fp,"%d%d",&m_nNumVertex,&m_nNumFace)!=2)
+    FVECTOR3 *Vertex;
+    FVECTOR3 *TNormal;
+
+    int i;
+    double dStart;
+
+    if (m_nNumFace == 0)
+        return;
+
+    if (m_bGrid)
     {
-        printf("This is not a valid PLY2 file!\n");
-        m_nNumVertex = m_nNumFace = 0;
+        GridDenoise(bNeighbourCV, fSigma, nIterations, nVIterations);
         return;
     }
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    m_pn3Face = new NVECTOR3[m_nNumFace];
+    dStart = WallClock();
+    ReserveArena();
+    ComputeVRing1V(); //find the neighbouring vertices of each vertex
+    ComputeVRing1T();     //find the neighbouring triangles of each vertex
 
-    for (i=0;i<m_nNumVertex;i++)
+    //find out the neighbouring triangles of each triangle
+    if (bNeighbourCV)
     {
-        fscanf(fp,"%f%f%f", &(m_pf3Vertex[i][0]), &(m_pf3Vertex[i][1]), &(m_pf3Vertex[i][2]));
+        ComputeTRing1TCV();
+        ttRing = &m_TRing1TCV;
     }
-    for (i=0;i<m_nNumFace;i++)
+    else
     {
-        fscanf(fp,"%d%d%d%d", &j, &(m_pn3Face[i][0]), &(m_pn3Face[i][1]), &(m_pn3Face[i][2]));
+        ComputeTRing1TCE();
+        ttRing = &m_TRing1TCE;
     }
-}
+    m_dRingTime = WallClock()-dStart;
+#ifdef MDENOISE_OPENCL
+    if (m_bGpu && !GpuOpenModel(ttRing))
+        m_bGpu = FALSE;
+#endif
 
-void ReadSMF(FILE* fp)
-{
-    int i;
-    char sTmp[200], sTmp1[200];
+    //begin filter
+    //the produced buffers of the job are reused by each run
+    m_nNumVertexP = m_nNumVertex;
+    m_nNumFaceP = m_nNumFace;
+    if (m_pf3VertexP == NULL)
+        m_pf3VertexP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertexP*sizeof(FVECTOR3));
+    if (m_pf3FaceNormalP == NULL)
+        m_pf3FaceNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFaceP*sizeof(FVECTOR3));
+    if (m_pf3VertexNormalP == NULL)
+        m_pf3VertexNormalP = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumVertexP*sizeof(FVECTOR3));
+    Vertex = new FVECTOR3[m_nNumVertexP];
+    TNormal = new FVECTOR3[m_nNumFace];
+    for(i=0; i<m_nNumFace; i++)
+    {
+        VEC3_ASN_OP(m_pf3FaceNormalP[i], =, m_pf3FaceNormal[i]);
+    }
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        VEC3_ASN_OP(m_pf3VertexP[i], =, m_pf3Vertex[i]);
+    }
+    for(i=0; i<m_nNumFace; i++)
+    {
+        VEC3_ASN_OP(m_pn3FaceP[i], =, m_pn3Face[i]);
+    }
 
-    FVECTOR3 *vVertex;
-    NVECTOR3 * tTriangle;
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        VEC3_ASN_OP(Vertex[i], =, m_pf3VertexP[i]);
+    }
 
-    vVertex = (FVECTOR3 *)MyMalloc(10000* sizeof(FVECTOR3));
-    tTriangle = (NVECTOR3 *)MyMalloc(10000* sizeof(NVECTOR3));
+    //a sweep continues from the normals of the previous run when they are on the way,
+    //and multiresolution from the normals filtered on the coarser models; as the
+    //coarse passes depend on nIterations, a multiresolution run starts anew
+    m_nNormalPasses = 0;
+    m_bNormalConverged = FALSE;
+    m_vNormalResidual.clear();
+    bool bKept = m_bKeepNormals && (m_nLevels==0) && (m_fWorkNormalTol<0) && (m_nKeptIterations>=0) && (m_bKeptCV==bNeighbourCV) && (m_fKeptSigma==fSigma) && (m_nKeptIterations<=nIterations);
+    if (!bKept && (m_nLevels>0) && (m_fWorkNormalTol<0))
+        bKept = CoarseNormals(bNeighbourCV, fSigma, nIterations);
+    if (bKept)
+    {
+        for(i=0; i<m_nNumFace; i++)
+        {
+            VEC3_ASN_OP(m_pf3FaceNormalP[i], =, m_pf3KeptNormal[i]);
+        }
+        m_nNormalPasses = m_nKeptIterations;
+        m_bNormalConverged = m_bKeptConverged;
+        m_vNormalResidual = m_vKeptResidual;
+    }
 
-    m_nNumVertex = m_nNumFace = 0;
-    while (!feof(fp))
+    dStart = WallClock();
+    if (m_fWorkNormalTol>=0)
+        NormalFilterActive(ttRing, fSigma, nIterations);
+#ifdef MDENOISE_OPENCL
+    else if (m_bGpu)
+        GpuNormalFilter(fSigma, nIterations);
+#endif
+    else if (m_bSoA)
+        NormalFilterSoA(ttRing, fSigma, nIterations);
+    else
     {
-        fgets(sTmp, 200, fp);
-        if(sTmp[0]=='v')
+        // the common edge rings of a manifold mesh have a fixed length
+        bool bRing4 = !bNeighbourCV;
+        for(i=0; bRing4 && (i<m_nNumFace); i++)
+            bRing4 = (RING_SIZE(*ttRing, i)<=4);
+        for(; (m_nNormalPasses<nIterations) && !m_bNormalConverged; m_nNormalPasses++)
         {
-            sscanf(sTmp,"%s%f%f%f", sTmp1, &(vVertex[m_nNumVertex][0]), \
-                &(vVertex[m_nNumVertex][1]),&(vVertex[m_nNumVertex][2]));
-            m_nNumVertex +=1;
-            if (!(m_nNumVertex % 10000))
-                vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10000)* sizeof(FVECTOR3));
+            //initialization
+            ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+                for(int i=nFrom; i<nTo; i++)
+                {
+                    VEC3_ASN_OP(TNormal[i], =, m_pf3FaceNormalP[i]);
+                }
+            });
+
+            //modify triangle normal; each face only reads TNormal, so the faces
+            //are split among the worker threads
+            ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+                if (bRing4)
+                    FaceFilterKernel<4>(ttRing, TNormal, fSigma, m_pf3FaceNormalP, nFrom, nTo);
+                else
+                    FaceFilterKernel<0>(ttRing, TNormal, fSigma, m_pf3FaceNormalP, nFrom, nTo);
+            });
+            if (m_fnFaceGhosts)
+                m_fnFaceGhosts(m_pf3FaceNormalP);
+
+            if (m_fNormalTol>=0)
+                m_bNormalConverged = NormalConverged(ParallelMax(0, m_nNumFace, [&](int nFrom, int nTo) {
+                    float f = 0;
+                    FVECTOR3 d;
+                    for(int k=nFrom; k<nTo; k++)
+                    {
+                        VEC3_V_OP_V(d, m_pf3FaceNormalP[k], -, TNormal[k]);
+                        f = FMAX(f, DOTPROD3(d, d));
+                    }
+                    return f;
+                }));
         }
-        else if((sTmp[0]=='t')||(sTmp[0]=='f'))
+    }
+
+    m_dNormalTime = WallClock()-dStart;
+
+    if (m_bKeepNormals)
+    {
+        if (m_pf3KeptNormal==NULL)
+            m_pf3KeptNormal = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFace*sizeof(FVECTOR3));
+        for(i=0; i<m_nNumFace; i++)
         {
-            sscanf(sTmp,"%s%d%d%d", sTmp1, &(tTriangle[m_nNumFace][0]), \
-                &(tTriangle[m_nNumFace][1]),&(tTriangle[m_nNumFace][2]));
-            tTriangle[m_nNumFace][0]--;
-            tTriangle[m_nNumFace][1]--;
-            tTriangle[m_nNumFace][2]--;
-            m_nNumFace +=1;
-            if (!(m_nNumFace % 10000))
-                tTriangle = (NVECTOR3 *)MyRealloc(tTriangle, (m_nNumFace+10000)* sizeof(NVECTOR3));
+            VEC3_ASN_OP(m_pf3KeptNormal[i], =, m_pf3FaceNormalP[i]);
         }
+        m_bKeptCV = bNeighbourCV;
+        m_fKeptSigma = fSigma;
+        m_nKeptIterations = m_nNormalPasses;
+        m_bKeptConverged = m_bNormalConverged;
+        m_vKeptResidual = m_vNormalResidual;
     }
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for(i=0; i<m_nNumVertex; i++)
+    //modify vertex coordinates
+    dStart = WallClock();
+    VertexUpdate(&m_VRing1T, nVIterations);
+    m_dVertexTime = WallClock()-dStart;
+    //m_L2Error = L2Error();
+
+    delete []Vertex;
+    delete []TNormal;
+
+    return;
+}
+
+// Multiresolution: the vertices are clustered in cubes of twice the mean
+// edge length, each cluster becoming a vertex at the mean of its members and
+// each face with three clusters a face of the coarse model. The coarse model
+// is filtered with all nIterations passes (itself from a coarser one while
+// levels are left), and its normals are prolonged to the faces as the kept
+// normals, from which MeshDenoise runs the last quarter of the passes. Each
+// face takes the coarse normal closest to its own among the coarse faces
+// around its clusters, so that a face next to a crease keeps to its side,
+// and keeps its own when none is within the threshold of it.
+// Returns FALSE when there is nothing to gain, and the filter starts from
+// the normals of the model.
+bool CDenoiser::CoarseNormals(bool bNeighbourCV, float fSigma, int nIterations)
+{
+    int i, j, f, c, nClusters, nCoarse, nFine = (nIterations+3)/4;
+    int *pnCluster;
+    double dEdge = 0, *pdSum;
+    float h, f3[3];
+    FVECTOR3 d;
+    unsigned long long x;
+    CDenoiser coarse;
+    std::vector<std::pair<unsigned long long, int> > code;
+    struct CoarseKey { int n[3]; int f; };
+    std::vector<CoarseKey> vKey;
+
+    if ((nFine>=nIterations) || (m_nNumFace==0))
+        return FALSE;
+    for (f=0; f<m_nNumFace; f++)
+        for (j=0; j<3; j++)
+        {
+            VEC3_V_OP_V(d, m_pf3Vertex[m_pn3Face[f][j]], -, m_pf3Vertex[m_pn3Face[f][(j+1)%3]]);
+            dEdge += sqrt(DOTPROD3(d, d));
+        }
+    h = (float)(2*dEdge/(3.0*m_nNumFace));
+    if (h<=0)
+        return FALSE;
+
+    // the clusters are numbered along their 21-bit cell coordinates
+    code.resize(m_nNumVertex);
+    for (i=0; i<m_nNumVertex; i++)
+    {
+        code[i].first = 0;
+        for (j=0; j<3; j++)
+        {
+            f3[j] = (m_pf3Vertex[i][j]+1.0f)/h;
+            x = (f3[j]<0.0f) ? 0 : ((f3[j]>2097151.0f) ? 2097151 : (unsigned long long)f3[j]);
+            code[i].first |= x << (21*j);
+        }
+        code[i].second = i;
+    }
+    std::sort(code.begin(), code.end());
+    pnCluster = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    nClusters = 0;
+    for (i=0; i<m_nNumVertex; i++)
     {
-        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[i]);
+        if ((i>0) && (code[i].first!=code[i-1].first))
+            nClusters++;
+        pnCluster[code[i].second] = nClusters;
     }
-    free(vVertex);
+    nClusters++;
 
-     m_pn3Face = new NVECTOR3[m_nNumFace];
-    for(i=0; i<m_nNumFace; i++)
+    coarse.m_nModelAlloc = MODEL_MALLOC;
+    coarse.m_pf3Vertex = (FVECTOR3 *)MyMalloc(nClusters*sizeof(FVECTOR3));
+    pdSum = (double *)MyMalloc(4*nClusters*sizeof(double));
+    memset(pdSum, 0, 4*nClusters*sizeof(double));
+    for (i=0; i<m_nNumVertex; i++)
     {
-        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+        for (j=0; j<3; j++)
+            pdSum[4*pnCluster[i]+j] += m_pf3Vertex[i][j];
+        pdSum[4*pnCluster[i]+3] += 1;
     }
-    free(tTriangle);
-}
-
-void ReadSTL(FILE* fp)
-{
-    int i, j, k, m;
-    int nTmp, nTmp1, nTmp2;
-    char sTmp[200], sTmp1[40], sTmp2[40];
-    FVECTOR3 *vVertex;
-    NVECTOR3 *tTriangle;
-    int *indexVertex;
-    int **iiVertex;
-    bool *biVertex;
+    for (c=0; c<nClusters; c++)
+        for (j=0; j<3; j++)
+            coarse.m_pf3Vertex[c][j] = (float)(pdSum[4*c+j]/pdSum[4*c+3]);
+    free(pdSum);
 
-    m_nNumVertex = m_nNumFace = 0;
-    vVertex = (FVECTOR3 *)MyMalloc(10002* sizeof(FVECTOR3));
-    while(!feof(fp))  //read the vertex data
+    // a coarse face for each set of three clusters, turned as its first face
+    for (f=0; f<m_nNumFace; f++)
     {
-        fgets(sTmp, 200, fp);
-        sscanf(sTmp,"%s%s", sTmp1, sTmp2);
-        if(!(strcicmp(sTmp1, "outer")) && !(strcicmp(sTmp2,"loop")))
+        CoarseKey key;
+        for (j=0; j<3; j++)
+            key.n[j] = pnCluster[m_pn3Face[f][j]];
+        if ((key.n[0]==key.n[1]) || (key.n[1]==key.n[2]) || (key.n[0]==key.n[2]))
+            continue;
+        std::sort(key.n, key.n+3);
+        key.f = f;
+        vKey.push_back(key);
+    }
+    std::sort(vKey.begin(), vKey.end(), [](const CoarseKey& a, const CoarseKey& b) {
+        return (a.n[0]!=b.n[0]) ? (a.n[0]<b.n[0]) : ((a.n[1]!=b.n[1]) ? (a.n[1]<b.n[1]) : ((a.n[2]!=b.n[2]) ? (a.n[2]<b.n[2]) : (a.f<b.f)));
+    });
+    coarse.m_pn3Face = (NVECTOR3 *)MyMalloc((vKey.size()+1)*sizeof(NVECTOR3));
+    nCoarse = 0;
+    for (size_t k=0; k<vKey.size(); k++)
+    {
+        if ((k==0) || memcmp(vKey[k].n, vKey[k-1].n, sizeof(vKey[k].n)))
         {
-            for(i=0; i<3; i++)
+            for (j=0; j<3; j++)
+                coarse.m_pn3Face[nCoarse][j] = pnCluster[m_pn3Face[vKey[k].f][j]];
+            nCoarse++;
+        }
+    }
+    coarse.m_nNumVertex = nClusters;
+    coarse.m_nNumFace = nCoarse;
+
+    coarse.m_nThreads = m_nThreads;
+    coarse.m_bSoA = m_bSoA;
+    coarse.m_nLevels = m_nLevels-1;
+    coarse.m_bCoarseModel = TRUE;
+    coarse.m_bKeepNormals = TRUE;      // the filtered normals, before vertex updating
+    if (nCoarse>0)
+    {
+        coarse.InitScaledModel();
+        coarse.MeshDenoise(bNeighbourCV, fSigma, nIterations, 0);
+    }
+    if (coarse.m_pf3KeptNormal==NULL)
+    {
+        free(pnCluster);
+        return FALSE;
+    }
+
+    if (m_pf3KeptNormal==NULL)
+        m_pf3KeptNormal = (FVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFace*sizeof(FVECTOR3));
+    ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+        for (int f=nFrom; f<nTo; f++)
+        {
+            int c = -1;
+            float fDot, fBest = -2;
+            for (int j=0; j<3; j++)
             {
-                fgets(sTmp, 200, fp);
-                sscanf(sTmp,"%s%f%f%f", sTmp1, &vVertex[m_nNumVertex][0],\
-                    &vVertex[m_nNumVertex][1], &vVertex[m_nNumVertex][2]);
-                if(strcicmp(sTmp1,"vertex"))
-                {
-                    printf("This STL file is not supported!\n");
-                    m_nNumVertex = m_nNumFace = 0;
-                    free(vVertex);
-                    return;
-                }
-                else
+                int v = pnCluster[m_pn3Face[f][j]];
+                for (int k=coarse.m_VRing1T.pnStart[v]; k<coarse.m_VRing1T.pnStart[v+1]; k++)
                 {
-                    m_nNumVertex++;
-                    if (!(m_nNumVertex % 10000))
-                    vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10002)* sizeof(FVECTOR3));
+                    fDot = DOTPROD3(coarse.m_pf3KeptNormal[coarse.m_VRing1T.pnIndex[k]], m_pf3FaceNormal[f]);
+                    if (fDot>fBest)
+                    {
+                        fBest = fDot;
+                        c = coarse.m_VRing1T.pnIndex[k];
+                    }
                 }
             }
-            fgets(sTmp, 200, fp);
-            sscanf(sTmp,"%s", sTmp1);
-            if(strcicmp(sTmp1,"endloop"))
+            if (c<0)
             {
-                printf("This STL file is not supported!\n");
-                m_nNumVertex = m_nNumFace = 0;
-                free(vVertex);
-                return;
+                VEC3_ASN_OP(m_pf3KeptNormal[f], =, m_pf3FaceNormal[f]);
             }
-        }   
-    }
+            else
+            {
+                VEC3_ASN_OP(m_pf3KeptNormal[f], =, coarse.m_pf3KeptNormal[c]);
+            }
+        }
+    });
+    free(pnCluster);
+    m_bKeptCV = bNeighbourCV;
+    m_fKeptSigma = fSigma;
+    m_nKeptIterations = nIterations-nFine;
+    m_bKeptConverged = FALSE;
+    m_vKeptResidual.clear();
+    return TRUE;
+}
 
-    indexVertex = (int *)MyMalloc(m_nNumVertex*sizeof(int));
-    biVertex = (bool *)MyMalloc(m_nNumVertex*sizeof(bool));
-    for(i=0; i<m_nNumVertex; i++)
+// Reads the output of an earlier run on a previous version of the model into
+// pf3Prev, scaled as the model. Vertices whose previous position is unknown
+// are marked in pnSeed. Meshes must have the same vertices; .asc grids must
+// have the same size, and their points are matched by row and column, so
+// that filled voids and new nodata points are marked as changed.
+bool CDenoiser::ReadPrevious(FILE* fp, int nfileext, struct ESRIHeader* header, FVECTOR3* pf3Prev, unsigned char* pnSeed)
+{
+    int i, j, k, c, ii, jj, nTotal;
+    double *value;
+    struct ESRIHeader prevheader;
+    CDenoiser prev;
+
+    if (nfileext!=FILE_ESRI)
     {
-        indexVertex[i] = i;
-        biVertex[i]=TRUE;
+        if ((prev.ReadData(fp, nfileext, &prevheader)==0) || (prev.m_nNumVertex!=m_nNumVertex))
+        {
+            printf("\nWarning: the previous output does not have the vertices of the input.\n");
+            return FALSE;
+        }
+        for (i=0; i<m_nNumVertex; i++)
+            for (j=0; j<3; j++)
+                pf3Prev[i][j] = (prev.m_pf3Vertex[i][j]*prev.m_fScale+prev.m_f3Centre[j]-m_f3Centre[j])/m_fScale;
+        return TRUE;
     }
 
-    m_nNumFace = m_nNumVertex/3;
-    tTriangle = (NVECTOR3 *)MyMalloc(m_nNumFace* sizeof(NVECTOR3));
-    iiVertex =(int **) MyMalloc(m_nNumVertex * sizeof(int *));
-
-    nTmp = 0; // nTmp is now the number of deleted vertices
-    for(i=0; i<m_nNumFace; i++) //get rid of the redundant vertex data
+    ReadESRIHeader(fp, &prevheader);
+    if ((prevheader.nrows!=header->nrows) || (prevheader.ncols!=header->ncols))
     {
-        for(m=0; m<3; m++)
+        printf("\nWarning: the previous output is not a grid of the size of the input.\n");
+        return FALSE;
+    }
+    nTotal = header->nrows*header->ncols;
+    value = (double *)MyMalloc(nTotal*sizeof(double));
+    ReadESRIValues(fp, &prevheader, value, nTotal);
+    for (i=0; i<header->nrows; i++)
+        for (j=0; j<header->ncols; j++)
         {
-            if(biVertex[3*i+m]) //the vertex 3*i+m has no identical one
+            c = j+i*header->ncols;
+            k = header->isnodata ? header->index[c] : c;
+            if (prevheader.isnodata && (abs(value[c]-prevheader.nodata_value)<FLT_EPSILON))
             {
-                iiVertex[3*i+m] = (int *)MyMalloc(6*sizeof(int));
-                nTmp1 = 0;
-                for(j=i+1; j<m_nNumFace; j++)
-                {
-                    for(k=0; k<3; k++)
-                    {
-                        if(biVertex[3*j+k]) //the vertex 3*j+k has no identical one
-                        {
-                            if(VEC3_EQ(vVertex[3*j+k], vVertex[3*i+m]))//vertex 3*j+k is identical to 3*i+m
-                            {
-                                indexVertex[3*j+k] = indexVertex[3*i+m];
-                                biVertex[3*j+k] = FALSE;
-                                iiVertex[3*i+m][++nTmp1] =3*j+k;
-                                iiVertex[3*i+m][0] = nTmp1;
-                                nTmp++;
-                                if(!(nTmp1%5))
-                                    iiVertex[3*i+m] = (int *)MyRealloc(iiVertex[3*i+m], (nTmp1+6)*sizeof(int));
-                                break;
-                            }
-                        }
-                    }
-                }
+                // no previous height: the point is new
+                if (k!=nTotal)
+                    pnSeed[k] = 1;
+                continue;
+            }
+            if (k!=nTotal)
+            {
+                VEC3_ASN_OP(pf3Prev[k], =, m_pf3Vertex[k]);
+                pf3Prev[k][2] = (float(value[c])-m_f3Centre[2])/m_fScale;
+                continue;
             }
+            // the point has become nodata, its neighbours have lost a face
+            for (ii=FMAX(i-1,0); ii<=i+1 && ii<header->nrows; ii++)
+                for (jj=FMAX(j-1,0); jj<=j+1 && jj<header->ncols; jj++)
+                    if (header->index[jj+ii*header->ncols]!=nTotal)
+                        pnSeed[header->index[jj+ii*header->ncols]] = 1;
         }
-        tTriangle[i][0]=indexVertex[3*i];
-        tTriangle[i][1]=indexVertex[3*i+1];
-        tTriangle[i][2]=indexVertex[3*i+2];
-    }
+    free(value);
+    return TRUE;
+}
 
-    j=m_nNumVertex-1;
-    for(i=0; i<m_nNumVertex-nTmp; i++)
+// Marks in pnSeed the vertices inside the box pfBox: xmin, ymin, xmax, ymax,
+// and optionally zmin, zmax (nBox is 4 or 6), in the units of the input. For
+// .asc grids, x and y are the map coordinates of the cell centres.
+void CDenoiser::SeedBox(const float* pfBox, int nBox, int nfileext, struct ESRIHeader* header, unsigned char* pnSeed)
+{
+    int i, j, k, nTotal;
+    double x, y;
+    FVECTOR3 v;
+
+    if (nfileext==FILE_ESRI)
     {
-        if(!biVertex[i])
-        {
-            while(!biVertex[j])
+        nTotal = header->nrows*header->ncols;
+        for (i=0; i<header->nrows; i++)
+            for (j=0; j<header->ncols; j++)
             {
-                j--;
+                x = header->xllcorner+(j+0.5)*header->cellsize;
+                y = header->yllcorner+(header->nrows-i-0.5)*header->cellsize;
+                k = header->isnodata ? header->index[j+i*header->ncols] : j+i*header->ncols;
+                if ((k!=nTotal) && (x>=pfBox[0]) && (y>=pfBox[1]) && (x<=pfBox[2]) && (y<=pfBox[3]) &&
+                    ((nBox<6) || ((m_pf3Vertex[k][2]*m_fScale+m_f3Centre[2]>=pfBox[4]) && (m_pf3Vertex[k][2]*m_fScale+m_f3Centre[2]<=pfBox[5]))))
+                    pnSeed[k] = 1;
             }
-            indexVertex[i] = j;
-            indexVertex[j] = i;   
-            for(k=1; k<iiVertex[j][0]+1; k++)
+        return;
+    }
+    for (k=0; k<m_nNumVertex; k++)
+    {
+        VEC3_V_OP_S(v, m_pf3Vertex[k], *, m_fScale);
+        VEC3_ASN_OP(v, +=, m_f3Centre);
+        if ((v[0]>=pfBox[0]) && (v[1]>=pfBox[1]) && (v[0]<=pfBox[2]) && (v[1]<=pfBox[3]) &&
+            ((nBox<6) || ((v[2]>=pfBox[4]) && (v[2]<=pfBox[5]))))
+            pnSeed[k] = 1;
+    }
+}
+
+// Incremental denoising: only the vertices within n1+n2+2 rings of the
+// seeds are computed again, on the part of the model within twice as many
+// rings, and all others keep their positions pf3Prev from an earlier run.
+// The result is left in m_pf3VertexP; returns the number of vertices
+// computed. With -u it matches denoising the whole model.
+int CDenoiser::DenoiseRegion(const unsigned char* pnSeed, FVECTOR3* pf3Prev, bool bNeighbourCV, float fSigma, int nIterations, int nVIterations)
+{
+    int i, j, k, nHead, nTail, nSubV, nSubF, nDone;
+    int nHalo = nIterations+nVIterations+2;
+    int *pnDist, *pnQueue, *pnMap;
+    CDenoiser sub;
+
+    ComputeVRing1V();
+    pnDist = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    pnQueue = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    pnMap = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+
+    // ring distance of each vertex from the seeds, up to 2*nHalo
+    nTail = 0;
+    for (i=0; i<m_nNumVertex; i++)
+    {
+        pnDist[i] = pnSeed[i] ? 0 : -1;
+        if (pnSeed[i])
+            pnQueue[nTail++] = i;
+    }
+    for (nHead=0; nHead<nTail; nHead++)
+    {
+        i = pnQueue[nHead];
+        if (pnDist[i]==2*nHalo)
+            continue;
+        for (j=m_VRing1V.pnStart[i]; j<m_VRing1V.pnStart[i+1]; j++)
+        {
+            k = m_VRing1V.pnIndex[j];
+            if (pnDist[k]<0)
             {
-                indexVertex[iiVertex[j][k]] = i;
+                pnDist[k] = pnDist[i]+1;
+                pnQueue[nTail++] = k;
             }
-            j--;
         }
     }
-   
-    for(i=m_nNumVertex-nTmp; i<m_nNumVertex;i++)
+
+    // the part of the model that is denoised again, in the same scale
+    nSubV = 0;
+    for (i=0; i<m_nNumVertex; i++)
+        pnMap[i] = (pnDist[i]>=0) ? nSubV++ : -1;
+    nSubF = 0;
+    for (i=0; i<m_nNumFace; i++)
+        if ((pnMap[m_pn3Face[i][0]]>=0) && (pnMap[m_pn3Face[i][1]]>=0) && (pnMap[m_pn3Face[i][2]]>=0))
+            nSubF++;
+    sub.m_nNumVertex = nSubV;
+    sub.m_nNumFace = nSubF;
+    sub.m_pf3Vertex = new FVECTOR3[nSubV];
+    sub.m_pn3Face = new NVECTOR3[nSubF];
+    for (i=0; i<m_nNumVertex; i++)
+        if (pnMap[i]>=0)
+        {
+            VEC3_ASN_OP(sub.m_pf3Vertex[pnMap[i]], =, m_pf3Vertex[i]);
+        }
+    nSubF = 0;
+    for (i=0; i<m_nNumFace; i++)
+        if ((pnMap[m_pn3Face[i][0]]>=0) && (pnMap[m_pn3Face[i][1]]>=0) && (pnMap[m_pn3Face[i][2]]>=0))
+        {
+            for (j=0; j<3; j++)
+                sub.m_pn3Face[nSubF][j] = pnMap[m_pn3Face[i][j]];
+            nSubF++;
+        }
+    sub.m_fScale = m_fScale;
+    VEC3_ASN_OP(sub.m_f3Centre, =, m_f3Centre);
+    sub.m_bZOnly = m_bZOnly;
+    sub.m_bJacobi = m_bJacobi;
+    sub.m_bSoA = m_bSoA;
+    sub.m_nThreads = m_nThreads;
+    sub.m_fNormalTol = m_fNormalTol;
+    sub.m_fVertexTol = m_fVertexTol;
+    sub.m_fWorkNormalTol = m_fWorkNormalTol;
+    sub.m_fWorkVertexTol = m_fWorkVertexTol;
+    sub.InitScaledModel();
+    sub.MeshDenoise(bNeighbourCV, fSigma, nIterations, nVIterations);
+
+    nDone = 0;
+    for (i=0; i<m_nNumVertex; i++)
     {
-            nTmp1 = i/3;
-            nTmp2 = i%3;
-            tTriangle[nTmp1][nTmp2] = indexVertex[i];
+        if ((pnDist[i]>=0) && (pnDist[i]<=nHalo))
+        {
+            VEC3_ASN_OP(m_pf3VertexP[i], =, sub.m_pf3VertexP[pnMap[i]]);
+            nDone++;
+        }
+        else
+            VEC3_ASN_OP(m_pf3VertexP[i], =, pf3Prev[i]);
     }
+    ComputeNormal(TRUE);
 
-    m_nNumVertex = m_nNumVertex-nTmp;
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for(i=0; i<m_nNumVertex; i++)
-        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[indexVertex[i]]);
+    m_nNormalPasses = sub.m_nNormalPasses;
+    m_nVertexPasses = sub.m_nVertexPasses;
+    m_vNormalResidual = sub.m_vNormalResidual;
+    m_vVertexResidual = sub.m_vVertexResidual;
+    m_nNormalUpdates = sub.m_nNormalUpdates;
+    m_nVertexUpdates = sub.m_nVertexUpdates;
+    free(pnDist);
+    free(pnQueue);
+    free(pnMap);
+    return nDone;
+}
 
-    m_pn3Face = new NVECTOR3[m_nNumFace];
-    for(i=0; i<m_nNumFace; i++)
-        VEC3_ASN_OP(m_pn3Face[i], =, tTriangle[i]);
+// New normal of face k from the normals TNormal of the previous iteration.
+void CDenoiser::FaceFilter(struct RingList* ttRing, FVECTOR3* TNormal, float fSigma, int k)
+{
+    int i;
+    float tmp3;
 
-    for(i=0; i<m_nNumVertex+nTmp; i++)
+    VEC3_ZERO(m_pf3FaceNormalP[k]);
+    for(i=ttRing->pnStart[k]; i<ttRing->pnStart[k+1]; i++)
     {
-        if(biVertex[i])
-            free(iiVertex[i]);
+        tmp3 = DOTPROD3(TNormal[ttRing->pnIndex[i]],TNormal[k])-fSigma;
+        if( tmp3 > 0.0)
+        {
+            VEC3_V_OP_V_OP_S(m_pf3FaceNormalP[k],m_pf3FaceNormalP[k], +, TNormal[ttRing->pnIndex[i]], *, tmp3*tmp3);
+        }
     }
-    free(iiVertex);
-    free(indexVertex);
-    free(biVertex);
-    free(vVertex);
-    free(tTriangle);
+    V3Normalize(m_pf3FaceNormalP[k]);
 }
 
-void ReadWRL(FILE* fp)
+// Builds the worklist of the next iteration: the elements of pnList whose
+// pnChanged flag is set, together with their neighbours in ring. pnQueued is
+// all zero on entry and on return. Returns the length of the new list.
+int NextWorklist(struct RingList* ring, int* pnList, int nList, const unsigned char* pnChanged, unsigned char* pnQueued, int* pnNext)
 {
-    int i,j;
-    char sTmp[200], *tmp, *sTmp1;
-    char seps[]  = " ,\t\n";
-    FVECTOR3    tmpV;
-    NVECTOR3    tmpT;
-    FVECTOR3*    fVertex ;
-    NVECTOR3*   nTriangle;
+    int a, i, j, k, nNext = 0;
 
-    m_nNumVertex = 0;
-//    char* key = "point [";
-    fVertex = (FVECTOR3*) MyMalloc(1000*sizeof(FVECTOR3));
-    tmp = new char[100];
-    fscanf(fp,"%s", tmp);
-    //while (tmp!="")
-    while (*tmp != '\0')
+    for(a=0; a<nList; a++)
     {
-        fscanf(fp,"%s", tmp);
-        if(!strcicmp(tmp,"point"))
+        k = pnList[a];
+        if (!pnChanged[k])
+            continue;
+        if (!pnQueued[k])
         {
-            fscanf(fp,"%s", tmp);
-            if(!strcicmp(tmp,"["))
+            pnQueued[k] = 1;
+            pnNext[nNext++] = k;
+        }
+        for(i=ring->pnStart[k]; i<ring->pnStart[k+1]; i++)
+        {
+            j = ring->pnIndex[i];
+            if (!pnQueued[j])
             {
-                while (TRUE)
-                {
-                    j = fscanf(fp,"%f%f%f,", &tmpV[0], &tmpV[1], &tmpV[2]);
-                    if (j!=3)
-                        break;
-                    VEC3_ASN_OP(fVertex[m_nNumVertex],=, tmpV);
-                    m_nNumVertex +=1;
-                    if(!(m_nNumVertex %1000))
-                        fVertex = (FVECTOR3* )MyRealloc(fVertex, (m_nNumVertex+1000)*sizeof(FVECTOR3));
-                }
-                break;
+                pnQueued[j] = 1;
+                pnNext[nNext++] = j;
             }
         }
     }
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for (i =0; i<m_nNumVertex; i++)
-        VEC3_ASN_OP(m_pf3Vertex[i], =, fVertex[i]);
-    free(fVertex);
+    for(a=0; a<nNext; a++)
+        pnQueued[pnNext[a]] = 0;
+    std::sort(pnNext, pnNext+nNext);
+    return nNext;
+}
 
-    m_nNumFace = 0;
-//    key = "coordIndex [";
-    nTriangle = (NVECTOR3*) MyMalloc(1000*sizeof(NVECTOR3));
-    fscanf(fp,"%s", tmp);
-    //while (tmp!="")
-    while (*tmp != '\0')
+// Normal filtering on a worklist: only the faces with a neighbour whose
+// normal turned by more than m_fWorkNormalTol degrees in the previous
+// iteration are filtered again. The turn is measured by the squared length
+// of the change of the normal, 2*(1-cos) of the angle, which unlike 1-cos
+// stays above 0 for the smallest turns, so that a tolerance of 0 keeps every
+// changing face. The result is left in m_pf3FaceNormalP.
+void CDenoiser::NormalFilterActive(struct RingList* ttRing, float fSigma, int nIterations)
+{
+    int a, nList, *pnTmp;
+    float fMax, fTol = float(2.0*(1.0-cos(m_fWorkNormalTol*PI/180.0)));
+    FVECTOR3 *TNormal = new FVECTOR3[m_nNumFace];
+    int *pnList = (int *)MyMalloc(m_nNumFace*sizeof(int));
+    int *pnNext = (int *)MyMalloc(m_nNumFace*sizeof(int));
+    unsigned char *pnChanged = (unsigned char *)MyMalloc(m_nNumFace);
+    unsigned char *pnQueued = (unsigned char *)MyMalloc(m_nNumFace);
+
+    // TNormal and m_pf3FaceNormalP agree at the start of each iteration
+    for(a=0; a<m_nNumFace; a++)
     {
-        if(!strcicmp(tmp,"coordIndex"))
-        {
-            fscanf(fp,"%s", tmp);
-            if(!strcicmp(tmp,"["))
+        VEC3_ASN_OP(TNormal[a], =, m_pf3FaceNormalP[a]);
+        pnList[a] = a;
+    }
+    memset(pnQueued, 0, m_nNumFace);
+    nList = m_nNumFace;
+    m_nNormalUpdates = 0;
+    for(; (m_nNormalPasses<nIterations) && !m_bNormalConverged && (nList>0); m_nNormalPasses++)
+    {
+        fMax = ParallelMax(0, nList, [&](int nFrom, int nTo) {
+            float f = 0, g;
+            FVECTOR3 d;
+            for(int b=nFrom; b<nTo; b++)
             {
-                fgets(sTmp, 200, fp);
-                while (TRUE)
-                {
-                    fgets(sTmp, 200, fp);
-                    sTmp1 = strtok(sTmp, seps);
-                    for(i=0; i<3;i++)
-                    {
-                        if(sTmp1!=NULL)
-                        {
-                            sscanf(sTmp1, "%d",&tmpT[i]);
-                        }
-                        else
-                            break;
-                        sTmp1 = strtok( NULL, seps );
-                    }
-                    //sTmp1 = strtok(sTmp, seps);
-                    if(sTmp1!=NULL)
-                    {
-                        i=sscanf(sTmp1,"%d,", &j);
-                    }
+                int k = pnList[b];
+                FaceFilter(ttRing, TNormal, fSigma, k);
+                VEC3_V_OP_V(d, m_pf3FaceNormalP[k], -, TNormal[k]);
+                g = DOTPROD3(d, d);
+                pnChanged[k] = (g > fTol);
+                f = FMAX(f, g);
+            }
+            return f;
+        });
+        m_nNormalUpdates += nList;
+        if (m_fNormalTol>=0)
+            m_bNormalConverged = NormalConverged(fMax);
+        for(a=0; a<nList; a++)
+        {
+            VEC3_ASN_OP(TNormal[pnList[a]], =, m_pf3FaceNormalP[pnList[a]]);
+        }
+        nList = NextWorklist(ttRing, pnList, nList, pnChanged, pnQueued, pnNext);
+        pnTmp = pnList;
+        pnList = pnNext;
+        pnNext = pnTmp;
+    }
+    delete []TNormal;
+    free(pnList);
+    free(pnNext);
+    free(pnChanged);
+    free(pnQueued);
+}
+
+// Vertex updating on a worklist: only the vertices with a neighbour that
+// moved by more than m_fWorkVertexTol in the previous iteration are moved
+// again, in place or, with -u, from the positions of the previous iteration.
+void CDenoiser::VertexUpdateActive(struct RingList* tRing, int nVIterations)
+{
+    int a, i, m, nList, *pnTmp;
+    float fMax, fMove, fTol = m_fWorkVertexTol/m_fScale;
+    FVECTOR3 f3Old, d;
+    FVECTOR3 *pf3Target = m_bJacobi ? new FVECTOR3[m_nNumVertexP] : NULL;
+    int *pnList = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    int *pnNext = (int *)MyMalloc(m_nNumVertex*sizeof(int));
+    unsigned char *pnChanged = (unsigned char *)MyMalloc(m_nNumVertex);
+    unsigned char *pnQueued = (unsigned char *)MyMalloc(m_nNumVertex);
+    bool bConverged = FALSE;
+
+    fTol = fTol*fTol;
+    for(a=0; a<m_nNumVertex; a++)
+        pnList[a] = a;
+    memset(pnQueued, 0, m_nNumVertex);
+    nList = m_nNumVertex;
+    m_nVertexUpdates = 0;
+    for(m=0; (m<nVIterations) && !bConverged && (nList>0); m++)
+    {
+        if (!m_bJacobi)
+        {
+            fMax = 0;
+            for(a=0; a<nList; a++)
+            {
+                i = pnList[a];
+                VEC3_ASN_OP(f3Old, =, m_pf3VertexP[i]);
+                if (m_bZOnly)
+                    VertexMove<true>(tRing, i, m_pf3VertexP, m_pf3VertexP[i]);
+                else
+                    VertexMove<false>(tRing, i, m_pf3VertexP, m_pf3VertexP[i]);
+                VEC3_V_OP_V(d, m_pf3VertexP[i], -, f3Old);
+                fMove = DOTPROD3(d, d);
+                pnChanged[i] = (fMove > fTol);
+                fMax = FMAX(fMax, fMove);
+            }
+        }
+        else
+        {
+            // the moved vertices are copied back, so both buffers agree at
+            // the start of each iteration
+            fMax = ParallelMax(0, nList, [&](int nFrom, int nTo) {
+                float f = 0, g;
+                FVECTOR3 e;
+                for(int b=nFrom; b<nTo; b++)
+                {
+                    int j = pnList[b];
+                    if (m_bZOnly)
+                        VertexMove<true>(tRing, j, m_pf3VertexP, pf3Target[j]);
                     else
-                        break;
-                    if ((i == 0) ||(j!=-1))
-                        break;
-                    VEC3_ASN_OP(nTriangle[m_nNumFace], =, tmpT);
-                    m_nNumFace +=1;
-                    if(!(m_nNumFace %1000))
-                        nTriangle = (NVECTOR3* )MyRealloc(nTriangle, (m_nNumFace+1000)*sizeof(NVECTOR3));
+                        VertexMove<false>(tRing, j, m_pf3VertexP, pf3Target[j]);
+                    VEC3_V_OP_V(e, pf3Target[j], -, m_pf3VertexP[j]);
+                    g = DOTPROD3(e, e);
+                    pnChanged[j] = (g > fTol);
+                    f = FMAX(f, g);
                 }
-                break;
+                return f;
+            });
+            for(a=0; a<nList; a++)
+            {
+                VEC3_ASN_OP(m_pf3VertexP[pnList[a]], =, pf3Target[pnList[a]]);
             }
         }
-        else
-            fscanf(fp,"%s", tmp);
+        m_nVertexUpdates += nList;
+        if (m_fVertexTol>=0)
+            bConverged = VertexConverged(fMax);
+        nList = NextWorklist(&m_VRing1V, pnList, nList, pnChanged, pnQueued, pnNext);
+        pnTmp = pnList;
+        pnList = pnNext;
+        pnNext = pnTmp;
     }
-    m_pn3Face = new NVECTOR3[m_nNumFace];
-    for (i =0; i<m_nNumFace; i++)
-        VEC3_ASN_OP(m_pn3Face[i], =, nTriangle[i]);
-    free(nTriangle);
-    delete tmp;
+    m_nVertexPasses = m;
+    delete []pf3Target;
+    free(pnList);
+    free(pnNext);
+    free(pnChanged);
+    free(pnQueued);
 }
 
-//extern void triangulate(char *, struct triangulateio *,
-//                struct triangulateio *, struct triangulateio *);
-void ReadXYZ(FILE* fp)
+void RingAllocIndex(struct RingList* ring, int nNum, struct Arena* arena)
 {
-    int i,nTmp;
-    float fTmp0,fTmp1,fTmp2;
-    struct triangulateio in, out, vorout;
-    char sTmp[200],sTmp1[200];
-    FVECTOR3 *vVertex;
+    int i;
 
-    vVertex = (FVECTOR3 *)MyMalloc(10000* sizeof(FVECTOR3));
-    m_nNumVertex = 0;
-	while (!feof(fp)){
-		sTmp[0]=sTmp1[0]='\0';
-		fgets(sTmp, 200, fp);
-		sscanf(sTmp, "%s", sTmp1);
-		if(!(sTmp1[0]<'0')||(sTmp1[0]>'9')){
-			sscanf(sTmp,"%f %f %f", &(vVertex[m_nNumVertex][0]), \
-				&(vVertex[m_nNumVertex][1]),&(vVertex[m_nNumVertex][2]));
-			m_nNumVertex++;
-			if (!(m_nNumVertex % 10000))
-				vVertex = (FVECTOR3 *)MyRealloc(vVertex, (m_nNumVertex+10000)* sizeof(FVECTOR3));
-		}
-	}
+    // ring->pnStart[i+1] holds the number of neighbours of element i on entry
+    ring->pnStart[0] = 0;
+    for (i=0;i<nNum;i++)
+        ring->pnStart[i+1] += ring->pnStart[i];
+    if (arena != NULL)
+        ring->pnIndex = (int *)ArenaAlloc(arena, (ring->pnStart[nNum]+1)*sizeof(int));
+    else
+        ring->pnIndex = (int *)MyMalloc((ring->pnStart[nNum]+1)*sizeof(int));
+}
 
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for(i=0; i<m_nNumVertex; i++)
+void FreeRing(struct RingList* ring, struct Arena* arena)
+{
+    if (arena != NULL)
     {
-        VEC3_ASN_OP(m_pf3Vertex[i], =, vVertex[i]);
+        ArenaFree(arena, ring->pnStart);
+        ArenaFree(arena, ring->pnIndex);
     }
-    free(vVertex);
+    else
+    {
+        free(ring->pnStart);
+        free(ring->pnIndex);
+    }
+    ring->pnStart = ring->pnIndex = NULL;
+}
 
-    in.numberofpoints=m_nNumVertex;
-    in.numberofpointattributes = 1;
-    in.pointlist = (REAL *) MyMalloc(in.numberofpoints * 2 * sizeof(REAL));
-    in.pointattributelist = (REAL *) MyMalloc(in.numberofpoints * in.numberofpointattributes * sizeof(REAL));
-    for(i=0;i<m_nNumVertex;i++)
+// The neighbouring vertices of a vertex are the other ends of its edges,
+// in ascending order.
+void CDenoiser::ComputeVRing1V(void)
+{
+    int i,a,b;
+    int *pnPos;
+
+    if(m_VRing1V.pnStart != NULL)
+        return;
+
+    ComputeEdges();
+    m_VRing1V.pnStart=(int *)ArenaAlloc(&m_Arena, (m_nNumVertex+1)*sizeof(int));
+    memset(m_VRing1V.pnStart, 0, (m_nNumVertex+1)*sizeof(int));
+    for (i=0; i<m_nNumEdge; i++)
     {
-        fscanf(fp, "%f%f%f",&fTmp0,&fTmp1,&fTmp2);
-        in.pointlist[i*2]=m_pf3Vertex[i][0];
-        in.pointlist[i*2+1]=m_pf3Vertex[i][1];
-        in.pointattributelist[i]=m_pf3Vertex[i][2];
+        m_VRing1V.pnStart[m_pnEdgeVertex[2*i]+1] += 1;
+        m_VRing1V.pnStart[m_pnEdgeVertex[2*i+1]+1] += 1;
     }
-    in.pointmarkerlist=(int *) NULL;
+    RingAllocIndex(&m_VRing1V, m_nNumVertex, &m_Arena);
 
-    out.pointlist = (REAL *) NULL;
-    out.pointattributelist = (REAL *) NULL;
-    out.trianglelist = (int *) NULL;
+    // the edges are sorted by lower then higher vertex, so each vertex gets
+    // its lower neighbours before its higher ones
+    pnPos=(int *)MyMalloc(m_nNumVertex*sizeof(int));
+    memcpy(pnPos, m_VRing1V.pnStart, m_nNumVertex*sizeof(int));
+    for (i=0; i<m_nNumEdge; i++)
+    {
+        a = m_pnEdgeVertex[2*i];
+        b = m_pnEdgeVertex[2*i+1];
+        m_VRing1V.pnIndex[pnPos[a]++] = b;
+        m_VRing1V.pnIndex[pnPos[b]++] = a;
+    }
+    free(pnPos);
+}
 
-    printf("\nTriangulation...\n");
-    if(m_bAddVertices)
-        triangulate(const_cast<char*>("zqBQ"),&in,&out,&vorout);
-    else
-        triangulate(const_cast<char*>("zBQ"),&in,&out,&vorout);
+// The edge table. Each triangle contributes three half-edges, which are
+// bucketed by their lower vertex and sorted within the bucket by their
+// higher vertex, then by triangle; each run of equal vertex pairs is one
+// edge, and its triangles come out in ascending order. Edges of more than
+// two triangles (non-manifold) are kept with all of them.
+void CDenoiser::ComputeEdges(void)
+{
+    int i,j,k,c,v,pass;
+    int *pnHigh, *pnPos;
+    struct RingList half;
 
-    m_nNumVertex = out.numberofpoints;
-    m_pf3Vertex = new FVECTOR3[m_nNumVertex];
-    for (i=0; i<m_nNumVertex; i++)
+    if(m_EdgeT.pnStart != NULL)
+        return;
+
+    // half-edge 3*k+j joins vertices j and (j+1)%3 of triangle k
+    pnHigh=(int *)MyMalloc(3*m_nNumFace*sizeof(int));
+    half.pnStart=(int *)MyMalloc((m_nNumVertex+1)*sizeof(int));
+    memset(half.pnStart, 0, (m_nNumVertex+1)*sizeof(int));
+    for (k=0; k<m_nNumFace; k++)
+        for (j=0; j<3; j++)
+        {
+            pnHigh[3*k+j] = std::max(m_pn3Face[k][j], m_pn3Face[k][(j+1)%3]);
+            half.pnStart[std::min(m_pn3Face[k][j], m_pn3Face[k][(j+1)%3])+1] += 1;
+        }
+    RingAllocIndex(&half, m_nNumVertex);
+
+    pnPos=(int *)MyMalloc(m_nNumVertex*sizeof(int));
+    memcpy(pnPos, half.pnStart, m_nNumVertex*sizeof(int));
+    for (k=0; k<m_nNumFace; k++)
+        for (j=0; j<3; j++)
+            half.pnIndex[pnPos[std::min(m_pn3Face[k][j], m_pn3Face[k][(j+1)%3])]++] = 3*k+j;
+    free(pnPos);
+    ParallelFor(0, m_nNumVertex, [&](int nFrom, int nTo) {
+        for (int w=nFrom; w<nTo; w++)
+            std::sort(half.pnIndex+half.pnStart[w], half.pnIndex+half.pnStart[w+1], [&](int c0, int c1) {
+                return (pnHigh[c0]<pnHigh[c1]) || ((pnHigh[c0]==pnHigh[c1]) && (c0<c1));
+            });
+    });
+
+    // pass 0 counts the edges, pass 1 stores them
+    m_pn3FaceEdge=(NVECTOR3 *)ArenaAlloc(&m_Arena, m_nNumFace*sizeof(NVECTOR3));
+    m_EdgeT.pnIndex=(int *)ArenaAlloc(&m_Arena, (3*m_nNumFace+1)*sizeof(int));
+    for (pass=0; pass<2; pass++)
     {
-        m_pf3Vertex[i][0]=out.pointlist[2*i];
-        m_pf3Vertex[i][1]=out.pointlist[2*i+1];
-        m_pf3Vertex[i][2]=out.pointattributelist[i];
+        m_nNumEdge = 0;
+        for (v=0; v<m_nNumVertex; v++)
+        {
+            for (i=half.pnStart[v]; i<half.pnStart[v+1]; i++)
+            {
+                c = half.pnIndex[i];
+                if ((i==half.pnStart[v]) || (pnHigh[c]!=pnHigh[half.pnIndex[i-1]]))
+                {
+                    if (pass)
+                    {
+                        m_EdgeT.pnStart[m_nNumEdge] = i;
+                        m_pnEdgeVertex[2*m_nNumEdge] = v;
+                        m_pnEdgeVertex[2*m_nNumEdge+1] = pnHigh[c];
+                    }
+                    m_nNumEdge++;
+                }
+                if (pass)
+                {
+                    m_pn3FaceEdge[c/3][c%3] = m_nNumEdge-1;
+                    m_EdgeT.pnIndex[i] = c/3;
+                }
+            }
+        }
+        if (!pass)
+        {
+            m_pnEdgeVertex=(int *)ArenaAlloc(&m_Arena, (2*m_nNumEdge+1)*sizeof(int));
+            m_EdgeT.pnStart=(int *)ArenaAlloc(&m_Arena, (m_nNumEdge+1)*sizeof(int));
+        }
     }
+    m_EdgeT.pnStart[m_nNumEdge] = 3*m_nNumFace;
+    FreeRing(&half);
+    free(pnHigh);
 
-    m_nNumFace = out.numberoftriangles;
-    m_pn3Face = new NVECTOR3[m_nNumFace];
-    for (i=0; i<m_nNumFace; i++)
+    m_nNumBoundaryEdge = m_nNumNonManifoldEdge = 0;
+    for (i=0; i<m_nNumEdge; i++)
     {
-        m_pn3Face[i][0] = out.trianglelist[3*i];
-        m_pn3Face[i][1] = out.trianglelist[3*i+1];
-        m_pn3Face[i][2] = out.trianglelist[3*i+2];
+        if (RING_SIZE(m_EdgeT, i)==1)
+            m_nNumBoundaryEdge++;
+        else if (RING_SIZE(m_EdgeT, i)>2)
+            m_nNumNonManifoldEdge++;
     }
-    free(in.pointlist);
-    free(in.pointattributelist);
-    free(in.pointmarkerlist);
-    free(out.pointlist);
-    free(out.pointattributelist);
-    free(out.trianglelist);
+    if (m_nNumNonManifoldEdge && !m_bCoarseModel)
+        printf("Warning:\n%d edges are shared by more than two triangles!\n", m_nNumNonManifoldEdge);
 }
 
-void ReadESRI(FILE* fp, struct ESRIHeader* header)
+void CDenoiser::ComputeVRing1T(void)
 {
-    int i,ii,j,k,kk[4],nTmp,nTotal;
-    float fTmp0,fTmp1,fTmp2;
-	char sTmp[40];
-	double * value, fTmp;
+    int i,k;
+    int tmp;
+    int *pnPos;
 
-	fscanf(fp,"%s %d", sTmp, &(header->ncols));
-	fscanf(fp,"%s %d", sTmp, &(header->nrows));
-	fscanf(fp,"%s %lf", sTmp, &(header->xllcorner));
-	fscanf(fp,"%s %lf", sTmp, &(header->yllcorner));
-	fscanf(fp,"%s %lf", sTmp, &(header->cellsize));
-	fscanf(fp,"%s %lf", sTmp, &fTmp);
+    if(m_VRing1T.pnStart != NULL)
+        return;
 
-	nTotal = header->ncols*header->nrows;
-	value = (double *)MyMalloc(nTotal*sizeof(double));
-	header->index = (int *)MyMalloc(nTotal*sizeof(int));
-	if((sTmp[0]=='n')||(sTmp[0]=='N'))
-	{
-		header->isnodata = true;
-		header->nodata_value = fTmp;
-		for(i=0;i<nTotal;i++)
-		{
-			//fscanf(fp,"%lf", &fTmp);
-			//value[i] = fTmp;
-			fscanf(fp,"%lf", value+i);
-		}
-	}
-	else
-	{
-		header->isnodata = false;
-		value[1] = fTmp;
-		//sscanf(sTmp,"%lf",&fTmp);
-		//value[0] = fTmp;
-		sscanf(sTmp,"%lf",value);
-		for(i=2;i<nTotal;i++)
-		{
-			//fscanf(fp,"%lf", &fTmp);
-			//value[i] = fTmp;
-			fscanf(fp,"%lf", value+i);
-		}
-	}
+    m_VRing1T.pnStart=(int *)ArenaAlloc(&m_Arena, (m_nNumVertex+1)*sizeof(int));
+    memset(m_VRing1T.pnStart, 0, (m_nNumVertex+1)*sizeof(int));
+    for (k=0; k<m_nNumFace; k++)
+    {
+        for (i=0;i<3;i++)
+            m_VRing1T.pnStart[m_pn3Face[k][i]+1] += 1;
+    }
+    RingAllocIndex(&m_VRing1T, m_nNumVertex, &m_Arena);
 
-	m_pf3Vertex = (FVECTOR3 *)MyMalloc(nTotal*sizeof(FVECTOR3));
-	m_pn3Face = (NVECTOR3 *)MyMalloc(2*(header->ncols-1)*(header->nrows-1)*sizeof(NVECTOR3));
-	if(header->isnodata)
-	{
-		m_nNumVertex = 0;
-		for(i=0; i<header->nrows; i++)
-		{
-			for(j=0;j<header->ncols;j++)
-			{
-				k = j+i*header->ncols;
-				if(abs(value[k]-header->nodata_value)<FLT_EPSILON)
-				{
-					header->index[k] =nTotal;
-				}
-				else
-				{
-					m_pf3Vertex[m_nNumVertex][0]=float(i*header->cellsize);
-					m_pf3Vertex[m_nNumVertex][1]=float(j*header->cellsize);
-					m_pf3Vertex[m_nNumVertex][2]=float(value[k]);
-					header->index[k] =m_nNumVertex;
-					m_nNumVertex++;
-				}
-			}
-		}
-		m_pf3Vertex = (FVECTOR3 *)MyRealloc(m_pf3Vertex, m_nNumVertex*sizeof(FVECTOR3));
+    pnPos=(int *)MyMalloc(m_nNumVertex*sizeof(int));
+    memcpy(pnPos, m_VRing1T.pnStart, m_nNumVertex*sizeof(int));
+    for (k=0; k<m_nNumFace; k++)
+    {
+        for (i=0;i<3;i++)
+        {
+            tmp = m_pn3Face[k][i]; //the vertex incident to the k-th triangle
+            m_VRing1T.pnIndex[pnPos[tmp]++] = k;
+        }
+    }
+    free(pnPos);
+}
 
-		m_nNumFace = 0;
-		for(i=0; i<header->nrows-1; i++)
-		{
-			for(j=0;j<header->ncols-1;j++)
-			{
-				kk[0] = j+i*header->ncols;
-				kk[1] = kk[0]+1;
-				kk[2] = kk[0]+header->ncols;
-				kk[3] = kk[2]+1;
-				k = 4;
-				for(ii=0;ii<4;ii++){
-					if(header->index[kk[ii]]==nTotal){
-						if(k<ii){
-							k=5;
-							break;
-						}else{
-							k=ii;
-						}
-					}
-				}
-				if(k==0){
-					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-				}else if(k==1){
-					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-				}else if(k==2){
-					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
-					m_nNumFace++;
-				}else if(k==3){
-					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-				}else if(k==4){//generate two triangles with minimum total area 
-					if((abs(value[header->index[kk[2]]]-value[header->index[kk[0]]])> 
-						abs(value[header->index[kk[3]]]-value[header->index[kk[1]]]))&& 
-						(abs(value[header->index[kk[1]]]-value[header->index[kk[0]]])> 
-						abs(value[header->index[kk[3]]]-value[header->index[kk[2]]])))
-					{
-						m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-						m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
-						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-						m_nNumFace++;
-						m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-						m_nNumFace++;
-					}else{
-						m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-						m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
-						m_nNumFace++;
-						m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-						m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-						m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-						m_nNumFace++;
-					}
-				}
-			}
-		}
-		m_pn3Face = (NVECTOR3 *)MyRealloc(m_pn3Face, m_nNumFace*sizeof(NVECTOR3));
-	}
-	else
-	{
-		m_nNumVertex = nTotal;
-		for(i=0; i<header->nrows; i++)
-		{
-			for(j=0;j<header->ncols;j++)
-			{
-				k = j+i*header->ncols;
-				m_pf3Vertex[k][0]=float(i*header->cellsize);
-				m_pf3Vertex[k][1]=float(j*header->cellsize);
-				m_pf3Vertex[k][2]=float(value[k]);
-				header->index[k]=k;
-			}
-		}
-		for(i=0; i<header->nrows-1; i++)
+// The common vertex ring of a face is the triangle ring of its first vertex,
+// then the triangles of the second vertex without the first one, then those
+// of the third vertex with neither. A triangle is left out by testing its
+// vertices; walking the sorted vertex rings along in step, or leaving out the
+// triangles of the face's edges in the edge table, both measured slower on
+// the rings of about six triangles that meshes have. The faces are split
+// among the worker threads.
+void CDenoiser::ComputeTRing1TCV(void)
+{
+    int pass;
+
+    if(m_TRing1TCV.pnStart != NULL)
+        return;
+
+    m_TRing1TCV.pnStart=(int *)ArenaAlloc(&m_Arena, (m_nNumFace+1)*sizeof(int));
+    // pass 0 counts the neighbours of each triangle, pass 1 stores them
+    for (pass=0; pass<2; pass++)
+    {
+        ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+            int i,k;
+            int tmp,tmp0,tmp1,tmp2,nNum;
+            const int *pnFace;
+            int *pnRing = NULL;
+            for (k=nFrom; k<nTo; k++)
+            {
+                tmp0 = m_pn3Face[k][0];
+                tmp1 = m_pn3Face[k][1];
+                tmp2 = m_pn3Face[k][2];
+                if (pass)
+                    pnRing = m_TRing1TCV.pnIndex+m_TRing1TCV.pnStart[k];
+
+                nNum = m_VRing1T.pnStart[tmp0+1]-m_VRing1T.pnStart[tmp0];
+                if (pass)
+                    memcpy(pnRing, m_VRing1T.pnIndex+m_VRing1T.pnStart[tmp0], nNum*sizeof(int));
+
+                for (i=m_VRing1T.pnStart[tmp1]; i<m_VRing1T.pnStart[tmp1+1]; i++)
+                {
+                    tmp = m_VRing1T.pnIndex[i];
+                    pnFace = m_pn3Face[tmp];
+                    if ((pnFace[0] != tmp0) && (pnFace[1] != tmp0) && (pnFace[2] != tmp0))
+                    {
+                        if (pass)
+                            pnRing[nNum] = tmp;
+                        nNum++;
+                    }
+                }
+
+                for (i=m_VRing1T.pnStart[tmp2]; i<m_VRing1T.pnStart[tmp2+1]; i++)
+                {
+                    tmp = m_VRing1T.pnIndex[i];
+                    pnFace = m_pn3Face[tmp];
+                    if ((pnFace[0] != tmp0) && (pnFace[1] != tmp0) && (pnFace[2] != tmp0)
+                        && (pnFace[0] != tmp1) && (pnFace[1] != tmp1) && (pnFace[2] != tmp1))
+                    {
+                        if (pass)
+                            pnRing[nNum] = tmp;
+                        nNum++;
+                    }
+                }
+
+                if (!pass)
+                    m_TRing1TCV.pnStart[k+1] = nNum;
+            }
+        });
+        if (!pass)
+            RingAllocIndex(&m_TRing1TCV, m_nNumFace, &m_Arena);
+    }
+}
+
+// The common edge ring of a face is read from the edge table: the face and
+// those across its two edges at the first vertex, merged in ascending order,
+// then those across the opposite edge. Non-manifold edges give all their
+// faces.
+// The faces are split among the worker threads.
+void CDenoiser::ComputeTRing1TCE(void)
+{
+    int pass;
+
+    if(m_TRing1TCE.pnStart != NULL)
+        return;
+
+    ComputeEdges();
+    m_TRing1TCE.pnStart=(int *)ArenaAlloc(&m_Arena, (m_nNumFace+1)*sizeof(int));
+    // pass 0 counts the neighbours of each triangle, pass 1 stores them
+    for (pass=0; pass<2; pass++)
+    {
+        ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+            int i,j,k,tmp,tmp0,nNum;
+            const int *pnA, *pnB, *pnAEnd, *pnBEnd, *pnFace;
+            int *pnRing = NULL;
+            for (k=nFrom; k<nTo; k++)
+            {
+                if (pass)
+                    pnRing = m_TRing1TCE.pnIndex+m_TRing1TCE.pnStart[k];
+                nNum = 0;
+
+                // edges 0 and 2 both hold vertex 0
+                pnA = m_EdgeT.pnIndex+m_EdgeT.pnStart[m_pn3FaceEdge[k][0]];
+                pnAEnd = m_EdgeT.pnIndex+m_EdgeT.pnStart[m_pn3FaceEdge[k][0]+1];
+                pnB = m_EdgeT.pnIndex+m_EdgeT.pnStart[m_pn3FaceEdge[k][2]];
+                pnBEnd = m_EdgeT.pnIndex+m_EdgeT.pnStart[m_pn3FaceEdge[k][2]+1];
+                while ((pnA<pnAEnd) || (pnB<pnBEnd))
+                {
+                    if ((pnB==pnBEnd) || ((pnA<pnAEnd) && (*pnA<*pnB)))
+                        tmp = *pnA++;
+                    else if ((pnA==pnAEnd) || (*pnB<*pnA))
+                        tmp = *pnB++;
+                    else
+                    {
+                        tmp = *pnA++;
+                        pnB++;
+                    }
+                    if (pass)
+                        pnRing[nNum] = tmp;
+                    nNum++;
+                }
+
+                // a face that also holds vertex 0 was already met above
+                tmp0 = m_pn3Face[k][0];
+                j = m_pn3FaceEdge[k][1];
+                for (i=m_EdgeT.pnStart[j]; i<m_EdgeT.pnStart[j+1]; i++)
+                {
+                    tmp = m_EdgeT.pnIndex[i];
+                    pnFace = m_pn3Face[tmp];
+                    if ((pnFace[0] == tmp0) || (pnFace[1] == tmp0) || (pnFace[2] == tmp0))
+                        continue;
+                    if (pass)
+                        pnRing[nNum] = tmp;
+                    nNum++;
+                }
+
+                if (!pass)
+                    m_TRing1TCE.pnStart[k+1] = nNum;
+            }
+        });
+        if (!pass)
+            RingAllocIndex(&m_TRing1TCE, m_nNumFace, &m_Arena);
+    }
+}
+
+void CDenoiser::VertexUpdate(struct RingList* tRing, int nVIterations)
+{
+    int m;
+    FVECTOR3 *pf3Target, *pf3Tmp, *pf3Centroid;
+    float fMove;
+    bool bConverged = FALSE;
+
+    m_vVertexResidual.clear();
+    if(m_fWorkVertexTol>=0)
+        VertexUpdateActive(tRing, nVIterations);
+#ifdef MDENOISE_OPENCL
+    else if(m_bGpu)
+        GpuVertexUpdate(nVIterations);
+#endif
+    else if(m_bJacobi && m_bSoA)
+        VertexUpdateSoA(tRing, nVIterations);
+    else if(!m_bJacobi)
+    {
+        // Gauss-Seidel: each vertex sees the already updated vertices before it
+        for(m=0; (m<nVIterations) && !bConverged; m++)
+        {
+            fMove = m_bZOnly ? VertexPass<true>(tRing, m_fVertexTol>=0) : VertexPass<false>(tRing, m_fVertexTol>=0);
+            if (m_fVertexTol<0)
+            {
+                if (m_fnVertexGhosts)
+                    m_fnVertexGhosts(m_pf3VertexP);
+                continue;
+            }
+            bConverged = VertexConverged(fMove);
+        }
+        m_nVertexPasses = m;
+    }
+    else
+    {
+        // Jacobi: read one buffer, write the other, so the vertices of an
+        // iteration are independent and can be split among threads
+        pf3Target = new FVECTOR3[m_nNumVertexP];
+        pf3Centroid = new FVECTOR3[m_nNumFace];
+        for(m=0; (m<nVIterations) && !bConverged; m++)
+        {
+            ParallelFor(0, m_nNumFace, [&](int nFrom, int nTo) {
+                FaceCentroids(m_pn3Face, m_pf3VertexP, pf3Centroid, nFrom, nTo);
+            });
+            ParallelFor(0, m_nNumVertex, [&](int nFrom, int nTo) {
+                if (m_bZOnly)
+                    VertexKernel<true>(tRing, pf3Centroid, m_pf3FaceNormalP, m_pf3VertexP, pf3Target, nFrom, nTo);
+                else
+                    VertexKernel<false>(tRing, pf3Centroid, m_pf3FaceNormalP, m_pf3VertexP, pf3Target, nFrom, nTo);
+            });
+            if (m_fVertexTol>=0)
+                bConverged = VertexConverged(ParallelMax(0, m_nNumVertex, [&](int nFrom, int nTo) {
+                    float f = 0;
+                    FVECTOR3 e;
+                    for(int j=nFrom; j<nTo; j++)
+                    {
+                        VEC3_V_OP_V(e, pf3Target[j], -, m_pf3VertexP[j]);
+                        f = FMAX(f, DOTPROD3(e, e));
+                    }
+                    return f;
+                }));
+            pf3Tmp = m_pf3VertexP;
+            m_pf3VertexP = pf3Target;
+            pf3Target = pf3Tmp;
+            if (m_fnVertexGhosts)
+                m_fnVertexGhosts(m_pf3VertexP);
+        }
+        m_nVertexPasses = m;
+        if (m%2)
+        {
+            // the result goes back into the buffer of the job
+            memcpy(pf3Target, m_pf3VertexP, m_nNumVertexP*sizeof(FVECTOR3));
+            pf3Tmp = m_pf3VertexP;
+            m_pf3VertexP = pf3Target;
+            pf3Target = pf3Tmp;
+        }
+        delete []pf3Target;
+        delete []pf3Centroid;
+    }
+    ComputeNormal(TRUE);
+}
+
+// One Gauss-Seidel pass of VertexMove over the vertices; returns the largest
+// squared move when bMove is set.
+template <bool ZONLY>
+float CDenoiser::VertexPass(struct RingList* tRing, bool bMove)
+{
+    int i;
+    float fMove = 0;
+    FVECTOR3 f3Old, d;
+
+    for(i=0; i<m_nNumVertex; i++)
+    {
+        if (bMove)
+            VEC3_ASN_OP(f3Old, =, m_pf3VertexP[i]);
+        VertexMove<ZONLY>(tRing, i, m_pf3VertexP, m_pf3VertexP[i]);
+        if (bMove)
+        {
+            VEC3_V_OP_V(d, m_pf3VertexP[i], -, f3Old);
+            fMove = FMAX(fMove, DOTPROD3(d, d));
+        }
+    }
+    return fMove;
+}
+
+// Computes the new position of vertex i from the positions pf3Vertex; with
+// ZONLY only the height changes (m_bZOnly). f3Result may be pf3Vertex[i] itself.
+template <bool ZONLY>
+void CDenoiser::VertexMove(struct RingList* tRing, int i, FVECTOR3* pf3Vertex, FVECTOR3 f3Result)
+{
+    int j;
+    int nTmp0, nTmp1, nTmp2, nNum;
+    float fTmp1;
+
+    FVECTOR3 vect[3];
+
+    VEC3_ZERO(vect[1]);
+    for(j=tRing->pnStart[i]; j<tRing->pnStart[i+1]; j++)
+    {
+        nTmp0 = m_pn3Face[tRing->pnIndex[j]][0]; // the vertex number of triangle tRing->pnIndex[j]
+        nTmp1 = m_pn3Face[tRing->pnIndex[j]][1];
+        nTmp2 = m_pn3Face[tRing->pnIndex[j]][2];
+        VEC3_V_OP_V_OP_V(vect[0], pf3Vertex[nTmp0],+, pf3Vertex[nTmp1],+, pf3Vertex[nTmp2]);
+        VEC3_V_OP_S(vect[0], vect[0], /, 3.0); //vect[0] is the centr of the triangle.
+        VEC3_V_OP_V(vect[0], vect[0], -, pf3Vertex[i]); //vect[0] is now vector PC.
+        fTmp1 = DOTPROD3(vect[0], m_pf3FaceNormalP[tRing->pnIndex[j]]);
+		if(ZONLY)
+			vect[1][2] = vect[1][2] + m_pf3FaceNormalP[tRing->pnIndex[j]][2] * fTmp1;
+		else
+			VEC3_V_OP_V_OP_S(vect[1], vect[1], +, m_pf3FaceNormalP[tRing->pnIndex[j]],*, fTmp1);                   
+    }
+    nNum = RING_SIZE(*tRing, i);
+    if (nNum!=0)
+    {
+		if(ZONLY)
 		{
-			for(j=0;j<header->ncols-1;j++)
-			{
-				kk[0] = j+i*header->ncols;
-				kk[1] = kk[0]+1;
-				kk[2] = kk[0]+header->ncols;
-				kk[3] = kk[2]+1;
-				if((abs(value[header->index[kk[2]]]-value[header->index[kk[0]]])> 
-					abs(value[header->index[kk[3]]]-value[header->index[kk[1]]]))&& 
-					(abs(value[header->index[kk[1]]]-value[header->index[kk[0]]])> 
-					abs(value[header->index[kk[3]]]-value[header->index[kk[2]]])))
-				{
-					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-				}else{
-					m_pn3Face[m_nNumFace][0] = header->index[kk[1]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[0]];
-					m_nNumFace++;
-					m_pn3Face[m_nNumFace][0] = header->index[kk[0]];
-					m_pn3Face[m_nNumFace][1] = header->index[kk[3]];
-					m_pn3Face[m_nNumFace][2] = header->index[kk[2]];
-					m_nNumFace++;
-				}
-			}
+			f3Result[0] = pf3Vertex[i][0];
+			f3Result[1] = pf3Vertex[i][1];
+			f3Result[2] = pf3Vertex[i][2] + vect[1][2]/nNum;
 		}
-	}
-    free(value);
+		else
+			VEC3_V_OP_V_OP_S(f3Result, pf3Vertex[i],+, vect[1], /, nNum);
+    }
+    else
+        VEC3_ASN_OP(f3Result, =, pf3Vertex[i]);
 }
 
-void ScalingBox(void)
+// Structure-of-arrays kernels.
+// NormalKernel* filter the normals of faces [nFrom, nTo) read from pfIn and
+// write them to pfOut; VertexKernel* move vertices [nFrom, nTo) (Jacobi).
+// All kernels use the same operations in the same order as the scalar
+// code, so every kernel gives the same result. The kernels depend on the
+// CPU only, so SelectKernels chooses them once for all CDenoiser objects.
+static NORMALKERNEL g_pfnNormalKernel = NULL;
+static VERTEXKERNEL g_pfnVertexKernel = NULL;
+static const char* g_pszKernel = NULL;
+
+void NormalKernelScalar(struct RingList* ring, float* const pfIn[3], float fSigma, float* const pfOut[3], int nFrom, int nTo)
 {
-    int i,j;
-    float box[2][3];
+    int i, j, k;
+    float tmp3, fLen;
+    FVECTOR3 f3Sum;
 
-    box[0][0] = box[0][1] = box[0][2] = FLT_MAX;
-    box[1][0] = box[1][1] = box[1][2] = -FLT_MAX;
-    for (i=0;i<m_nNumVertex;i++)
+    for(k=nFrom; k<nTo; k++)
     {
-        for (j=0;j<3;j++)
+        VEC3_ZERO(f3Sum);
+        for(i=ring->pnStart[k]; i<ring->pnStart[k+1]; i++)
         {
-            if (box[0][j]>m_pf3Vertex[i][j])
-                box[0][j] = m_pf3Vertex[i][j];
-            if (box[1][j]<m_pf3Vertex[i][j])
-                box[1][j] = m_pf3Vertex[i][j];
+            j = ring->pnIndex[i];
+            tmp3 = pfIn[0][j]*pfIn[0][k] + pfIn[1][j]*pfIn[1][k] + pfIn[2][j]*pfIn[2][k] - fSigma;
+            if( tmp3 > 0.0)
+            {
+                f3Sum[0] = f3Sum[0] + pfIn[0][j]*(tmp3*tmp3);
+                f3Sum[1] = f3Sum[1] + pfIn[1][j]*(tmp3*tmp3);
+                f3Sum[2] = f3Sum[2] + pfIn[2][j]*(tmp3*tmp3);
+            }
         }
+        fLen = sqrt(DOTPROD3(f3Sum, f3Sum));
+        if (fLen!=0.0)
+            VEC3_V_OP_S(f3Sum, f3Sum, /, fLen);
+        pfOut[0][k] = f3Sum[0];
+        pfOut[1][k] = f3Sum[1];
+        pfOut[2][k] = f3Sum[2];
     }
-    m_f3Centre[0] = (box[0][0]+box[1][0])/2.0;
-    m_f3Centre[1] = (box[0][1]+box[1][1])/2.0;
-    m_f3Centre[2] = (box[0][2]+box[1][2])/2.0;
+}
 
-    m_fScale = FMAX(box[1][0]-box[0][0],FMAX(box[1][1]-box[0][1],box[1][2]-box[0][2]));
-    m_fScale /=2.0;
-    for (i=0;i<m_nNumVertex;i++)
+void VertexKernelScalar(struct RingList* tRing, NVECTOR3* pn3Face, float* const pfNormal[3], float* const pfIn[3], float* const pfOut[3], bool bZOnly, int nFrom, int nTo)
+{
+    int i, j, f, nNum;
+    float fTmp1;
+    FVECTOR3 vect[2];
+
+    for(i=nFrom; i<nTo; i++)
     {
-        VEC3_VOPV_OP_S(m_pf3Vertex[i],m_pf3Vertex[i],-,m_f3Centre,/,m_fScale);
+        VEC3_ZERO(vect[1]);
+        for(j=tRing->pnStart[i]; j<tRing->pnStart[i+1]; j++)
+        {
+            f = tRing->pnIndex[j];
+            vect[0][0] = pfIn[0][pn3Face[f][0]] + pfIn[0][pn3Face[f][1]] + pfIn[0][pn3Face[f][2]];
+            vect[0][1] = pfIn[1][pn3Face[f][0]] + pfIn[1][pn3Face[f][1]] + pfIn[1][pn3Face[f][2]];
+            vect[0][2] = pfIn[2][pn3Face[f][0]] + pfIn[2][pn3Face[f][1]] + pfIn[2][pn3Face[f][2]];
+            vect[0][0] = vect[0][0]/3.0f - pfIn[0][i];
+            vect[0][1] = vect[0][1]/3.0f - pfIn[1][i];
+            vect[0][2] = vect[0][2]/3.0f - pfIn[2][i];
+            fTmp1 = vect[0][0]*pfNormal[0][f] + vect[0][1]*pfNormal[1][f] + vect[0][2]*pfNormal[2][f];
+            if(bZOnly)
+                vect[1][2] = vect[1][2] + pfNormal[2][f] * fTmp1;
+            else
+            {
+                vect[1][0] = vect[1][0] + pfNormal[0][f] * fTmp1;
+                vect[1][1] = vect[1][1] + pfNormal[1][f] * fTmp1;
+                vect[1][2] = vect[1][2] + pfNormal[2][f] * fTmp1;
+            }
+        }
+        nNum = RING_SIZE(*tRing, i);
+        pfOut[0][i] = pfIn[0][i];
+        pfOut[1][i] = pfIn[1][i];
+        pfOut[2][i] = pfIn[2][i];
+        if (nNum!=0)
+        {
+            if(!bZOnly)
+            {
+                pfOut[0][i] = pfIn[0][i] + vect[1][0]/nNum;
+                pfOut[1][i] = pfIn[1][i] + vect[1][1]/nNum;
+            }
+            pfOut[2][i] = pfIn[2][i] + vect[1][2]/nNum;
+        }
     }
 }
 
-void ComputeNormal(bool bProduced)
+#ifdef MDENOISE_AVX2
+// Eight faces (vertices) are handled at once, one per lane; the lanes step
+// through their rings together and lanes with shorter rings are masked.
+__attribute__((target("avx2")))
+static int MaxRingSizeAVX2(__m256i vNum)
 {
-    int i, j;
-    FVECTOR3 vect[3];
-    float fArea;
-   
-    if(bProduced)
+    __m128i v = _mm_max_epi32(_mm256_castsi256_si128(vNum), _mm256_extracti128_si256(vNum, 1));
+    v = _mm_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+    v = _mm_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("avx2")))
+static void NormalKernelAVX2(struct RingList* ring, float* const pfIn[3], float fSigma, float* const pfOut[3], int nFrom, int nTo)
+{
+    int i, k, nMax;
+    const __m256 vSigma = _mm256_set1_ps(fSigma);
+    const __m256 vZero = _mm256_setzero_ps();
+
+    for(k=nFrom; k+8<=nTo; k+=8)
     {
-        if(m_pf3VertexNormalP != NULL)
-            delete []m_pf3VertexNormalP;
-        if(m_pf3FaceNormalP != NULL)
-            delete []m_pf3FaceNormalP;
+        __m256i vStart = _mm256_loadu_si256((const __m256i*)(ring->pnStart+k));
+        __m256i vNum = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(ring->pnStart+k+1)), vStart);
+        __m256 kx = _mm256_loadu_ps(pfIn[0]+k);
+        __m256 ky = _mm256_loadu_ps(pfIn[1]+k);
+        __m256 kz = _mm256_loadu_ps(pfIn[2]+k);
+        __m256 sx = vZero, sy = vZero, sz = vZero;
+
+        nMax = MaxRingSizeAVX2(vNum);
+        for(i=0; i<nMax; i++)
+        {
+            __m256i vI = _mm256_set1_epi32(i);
+            __m256i vMask = _mm256_cmpgt_epi32(vNum, vI);
+            __m256i vJ = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), ring->pnIndex, _mm256_add_epi32(vStart, vI), vMask, 4);
+            __m256 jx = _mm256_i32gather_ps(pfIn[0], vJ, 4);
+            __m256 jy = _mm256_i32gather_ps(pfIn[1], vJ, 4);
+            __m256 jz = _mm256_i32gather_ps(pfIn[2], vJ, 4);
+            __m256 t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(jx, kx), _mm256_mul_ps(jy, ky)), _mm256_mul_ps(jz, kz));
+            t = _mm256_sub_ps(t, vSigma);
+            __m256 vUse = _mm256_and_ps(_mm256_cmp_ps(t, vZero, _CMP_GT_OQ), _mm256_castsi256_ps(vMask));
+            __m256 w = _mm256_mul_ps(t, t);
+            sx = _mm256_blendv_ps(sx, _mm256_add_ps(sx, _mm256_mul_ps(jx, w)), vUse);
+            sy = _mm256_blendv_ps(sy, _mm256_add_ps(sy, _mm256_mul_ps(jy, w)), vUse);
+            sz = _mm256_blendv_ps(sz, _mm256_add_ps(sz, _mm256_mul_ps(jz, w)), vUse);
+        }
+        __m256 vLen = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)));
+        __m256 vNonZero = _mm256_cmp_ps(vLen, vZero, _CMP_NEQ_OQ);
+        _mm256_storeu_ps(pfOut[0]+k, _mm256_blendv_ps(sx, _mm256_div_ps(sx, vLen), vNonZero));
+        _mm256_storeu_ps(pfOut[1]+k, _mm256_blendv_ps(sy, _mm256_div_ps(sy, vLen), vNonZero));
+        _mm256_storeu_ps(pfOut[2]+k, _mm256_blendv_ps(sz, _mm256_div_ps(sz, vLen), vNonZero));
+    }
+    NormalKernelScalar(ring, pfIn, fSigma, pfOut, k, nTo);
+}
 
-        m_pf3VertexNormalP = new FVECTOR3[m_nNumVertexP];
-        m_pf3FaceNormalP = new FVECTOR3[m_nNumFaceP];
-       
-        for (i=0;i<m_nNumVertexP;i++)
+__attribute__((target("avx2")))
+static void VertexKernelAVX2(struct RingList* tRing, NVECTOR3* pn3Face, float* const pfNormal[3], float* const pfIn[3], float* const pfOut[3], bool bZOnly, int nFrom, int nTo)
+{
+    int i, k, nMax;
+    const int* pnFace = (const int*)pn3Face;
+    const __m256 vZero = _mm256_setzero_ps();
+    const __m256 vThree = _mm256_set1_ps(3.0f);
+
+    for(k=nFrom; k+8<=nTo; k+=8)
+    {
+        __m256i vStart = _mm256_loadu_si256((const __m256i*)(tRing->pnStart+k));
+        __m256i vNum = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(tRing->pnStart+k+1)), vStart);
+        __m256 px = _mm256_loadu_ps(pfIn[0]+k);
+        __m256 py = _mm256_loadu_ps(pfIn[1]+k);
+        __m256 pz = _mm256_loadu_ps(pfIn[2]+k);
+        __m256 sx = vZero, sy = vZero, sz = vZero;
+
+        nMax = MaxRingSizeAVX2(vNum);
+        for(i=0; i<nMax; i++)
         {
-            VEC3_ZERO(m_pf3VertexNormalP[i]);
+            __m256i vI = _mm256_set1_epi32(i);
+            __m256i vMask = _mm256_cmpgt_epi32(vNum, vI);
+            __m256i vF = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), tRing->pnIndex, _mm256_add_epi32(vStart, vI), vMask, 4);
+            __m256i vF3 = _mm256_add_epi32(vF, _mm256_add_epi32(vF, vF));
+            __m256i v0 = _mm256_i32gather_epi32(pnFace, vF3, 4);
+            __m256i v1 = _mm256_i32gather_epi32(pnFace+1, vF3, 4);
+            __m256i v2 = _mm256_i32gather_epi32(pnFace+2, vF3, 4);
+            __m256 cx = _mm256_add_ps(_mm256_add_ps(_mm256_i32gather_ps(pfIn[0], v0, 4), _mm256_i32gather_ps(pfIn[0], v1, 4)), _mm256_i32gather_ps(pfIn[0], v2, 4));
+            __m256 cy = _mm256_add_ps(_mm256_add_ps(_mm256_i32gather_ps(pfIn[1], v0, 4), _mm256_i32gather_ps(pfIn[1], v1, 4)), _mm256_i32gather_ps(pfIn[1], v2, 4));
+            __m256 cz = _mm256_add_ps(_mm256_add_ps(_mm256_i32gather_ps(pfIn[2], v0, 4), _mm256_i32gather_ps(pfIn[2], v1, 4)), _mm256_i32gather_ps(pfIn[2], v2, 4));
+            cx = _mm256_sub_ps(_mm256_div_ps(cx, vThree), px);
+            cy = _mm256_sub_ps(_mm256_div_ps(cy, vThree), py);
+            cz = _mm256_sub_ps(_mm256_div_ps(cz, vThree), pz);
+            __m256 nx = _mm256_i32gather_ps(pfNormal[0], vF, 4);
+            __m256 ny = _mm256_i32gather_ps(pfNormal[1], vF, 4);
+            __m256 nz = _mm256_i32gather_ps(pfNormal[2], vF, 4);
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, nx), _mm256_mul_ps(cy, ny)), _mm256_mul_ps(cz, nz));
+            __m256 vUse = _mm256_castsi256_ps(vMask);
+            if(!bZOnly)
+            {
+                sx = _mm256_blendv_ps(sx, _mm256_add_ps(sx, _mm256_mul_ps(nx, d)), vUse);
+                sy = _mm256_blendv_ps(sy, _mm256_add_ps(sy, _mm256_mul_ps(ny, d)), vUse);
+            }
+            sz = _mm256_blendv_ps(sz, _mm256_add_ps(sz, _mm256_mul_ps(nz, d)), vUse);
         }
-        for (i=0;i<m_nNumFaceP;i++) // compute each triangle normal and vertex normal
+        __m256 vN = _mm256_cvtepi32_ps(vNum);
+        __m256 vMove = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vNum, _mm256_setzero_si256()));
+        if(!bZOnly)
         {
-            VEC3_V_OP_V(vect[0],m_pf3VertexP[m_pn3FaceP[i][1]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
-            VEC3_V_OP_V(vect[1],m_pf3VertexP[m_pn3FaceP[i][2]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
-            CROSSPROD3(vect[2],vect[0],vect[1]);
-            fArea = sqrt(DOTPROD3(vect[2], vect[2]))/2.0f; // Area of the face
-            V3Normalize(vect[2]);
-            VEC3_ASN_OP(m_pf3FaceNormalP[i],=,vect[2]);
-            for (j=0;j<3;j++)
+            px = _mm256_blendv_ps(px, _mm256_add_ps(px, _mm256_div_ps(sx, vN)), vMove);
+            py = _mm256_blendv_ps(py, _mm256_add_ps(py, _mm256_div_ps(sy, vN)), vMove);
+        }
+        pz = _mm256_blendv_ps(pz, _mm256_add_ps(pz, _mm256_div_ps(sz, vN)), vMove);
+        _mm256_storeu_ps(pfOut[0]+k, px);
+        _mm256_storeu_ps(pfOut[1]+k, py);
+        _mm256_storeu_ps(pfOut[2]+k, pz);
+    }
+    VertexKernelScalar(tRing, pn3Face, pfNormal, pfIn, pfOut, bZOnly, k, nTo);
+}
+#endif // MDENOISE_AVX2
+
+#ifdef MDENOISE_NEON
+// Four faces (vertices) per lane group; NEON has no gather, so the
+// neighbour values are collected lane by lane.
+static void NormalKernelNEON(struct RingList* ring, float* const pfIn[3], float fSigma, float* const pfOut[3], int nFrom, int nTo)
+{
+    int i, k, l, j, nMax;
+    int32_t nNum[4];
+    float fJ[3][4];
+    const float32x4_t vSigma = vdupq_n_f32(fSigma);
+    const float32x4_t vZero = vdupq_n_f32(0.0f);
+
+    for(k=nFrom; k+4<=nTo; k+=4)
+    {
+        float32x4_t kx = vld1q_f32(pfIn[0]+k);
+        float32x4_t ky = vld1q_f32(pfIn[1]+k);
+        float32x4_t kz = vld1q_f32(pfIn[2]+k);
+        float32x4_t sx = vZero, sy = vZero, sz = vZero;
+
+        nMax = 0;
+        for(l=0; l<4; l++)
+        {
+            nNum[l] = RING_SIZE(*ring, k+l);
+            nMax = (nNum[l]>nMax) ? nNum[l] : nMax;
+        }
+        int32x4_t vNum = vld1q_s32(nNum);
+        for(i=0; i<nMax; i++)
+        {
+            for(l=0; l<4; l++)
             {
-                VEC3_V_OP_V_OP_S(m_pf3VertexNormalP[m_pn3FaceP[i][j]], \
-                    m_pf3VertexNormalP[m_pn3FaceP[i][j]], +, vect[2], *, fArea);
+                j = (i<nNum[l]) ? ring->pnIndex[ring->pnStart[k+l]+i] : 0;
+                fJ[0][l] = pfIn[0][j];
+                fJ[1][l] = pfIn[1][j];
+                fJ[2][l] = pfIn[2][j];
             }
+            float32x4_t jx = vld1q_f32(fJ[0]);
+            float32x4_t jy = vld1q_f32(fJ[1]);
+            float32x4_t jz = vld1q_f32(fJ[2]);
+            uint32x4_t vMask = vcgtq_s32(vNum, vdupq_n_s32(i));
+            float32x4_t t = vaddq_f32(vaddq_f32(vmulq_f32(jx, kx), vmulq_f32(jy, ky)), vmulq_f32(jz, kz));
+            t = vsubq_f32(t, vSigma);
+            uint32x4_t vUse = vandq_u32(vcgtq_f32(t, vZero), vMask);
+            float32x4_t w = vmulq_f32(t, t);
+            sx = vbslq_f32(vUse, vaddq_f32(sx, vmulq_f32(jx, w)), sx);
+            sy = vbslq_f32(vUse, vaddq_f32(sy, vmulq_f32(jy, w)), sy);
+            sz = vbslq_f32(vUse, vaddq_f32(sz, vmulq_f32(jz, w)), sz);
         }
-        for (i=0;i<m_nNumVertexP;i++)
-            V3Normalize(m_pf3VertexNormalP[i]);
+        float32x4_t vLen = vsqrtq_f32(vaddq_f32(vaddq_f32(vmulq_f32(sx, sx), vmulq_f32(sy, sy)), vmulq_f32(sz, sz)));
+        uint32x4_t vNonZero = vmvnq_u32(vceqq_f32(vLen, vZero));
+        vst1q_f32(pfOut[0]+k, vbslq_f32(vNonZero, vdivq_f32(sx, vLen), sx));
+        vst1q_f32(pfOut[1]+k, vbslq_f32(vNonZero, vdivq_f32(sy, vLen), sy));
+        vst1q_f32(pfOut[2]+k, vbslq_f32(vNonZero, vdivq_f32(sz, vLen), sz));
     }
-    else
-    {   
-        if(m_pf3VertexNormal != NULL)
-            delete []m_pf3VertexNormal;
-        if(m_pf3FaceNormal != NULL)
-            delete []m_pf3FaceNormal;
+    NormalKernelScalar(ring, pfIn, fSigma, pfOut, k, nTo);
+}
 
-        m_pf3VertexNormal = new FVECTOR3[m_nNumVertex];
-        m_pf3FaceNormal = new FVECTOR3[m_nNumFace];
-       
-        for (i=0;i<m_nNumVertex;i++)
+static void VertexKernelNEON(struct RingList* tRing, NVECTOR3* pn3Face, float* const pfNormal[3], float* const pfIn[3], float* const pfOut[3], bool bZOnly, int nFrom, int nTo)
+{
+    int i, k, l, m, f, nMax;
+    int32_t nNum[4];
+    float fC[3][4], fN[3][4];
+    const float32x4_t vZero = vdupq_n_f32(0.0f);
+    const float32x4_t vThree = vdupq_n_f32(3.0f);
+
+    for(k=nFrom; k+4<=nTo; k+=4)
+    {
+        float32x4_t px = vld1q_f32(pfIn[0]+k);
+        float32x4_t py = vld1q_f32(pfIn[1]+k);
+        float32x4_t pz = vld1q_f32(pfIn[2]+k);
+        float32x4_t sx = vZero, sy = vZero, sz = vZero;
+
+        nMax = 0;
+        for(l=0; l<4; l++)
         {
-            VEC3_ZERO(m_pf3VertexNormal[i]);
+            nNum[l] = RING_SIZE(*tRing, k+l);
+            nMax = (nNum[l]>nMax) ? nNum[l] : nMax;
         }
-        for (i=0;i<m_nNumFace;i++) // compute each triangle normal and vertex normal
+        int32x4_t vNum = vld1q_s32(nNum);
+        for(i=0; i<nMax; i++)
         {
-            VEC3_V_OP_V(vect[0],m_pf3Vertex[m_pn3Face[i][1]],-,m_pf3Vertex[m_pn3Face[i][0]]);
-            VEC3_V_OP_V(vect[1],m_pf3Vertex[m_pn3Face[i][2]],-,m_pf3Vertex[m_pn3Face[i][0]]);
-            CROSSPROD3(vect[2],vect[0],vect[1]);
-            fArea = sqrt(DOTPROD3(vect[2], vect[2]))/2.0f; // Area of the face
-            V3Normalize(vect[2]);
-            VEC3_ASN_OP(m_pf3FaceNormal[i],=,vect[2]);
-            for (j=0;j<3;j++)
+            for(l=0; l<4; l++)
             {
-                VEC3_V_OP_V_OP_S(m_pf3VertexNormal[m_pn3Face[i][j]], \
-                    m_pf3VertexNormal[m_pn3Face[i][j]], +, vect[2], *, fArea);
+                f = (i<nNum[l]) ? tRing->pnIndex[tRing->pnStart[k+l]+i] : 0;
+                for(m=0; m<3; m++)
+                {
+                    fC[m][l] = pfIn[m][pn3Face[f][0]] + pfIn[m][pn3Face[f][1]] + pfIn[m][pn3Face[f][2]];
+                    fN[m][l] = pfNormal[m][f];
+                }
+            }
+            float32x4_t cx = vsubq_f32(vdivq_f32(vld1q_f32(fC[0]), vThree), px);
+            float32x4_t cy = vsubq_f32(vdivq_f32(vld1q_f32(fC[1]), vThree), py);
+            float32x4_t cz = vsubq_f32(vdivq_f32(vld1q_f32(fC[2]), vThree), pz);
+            float32x4_t nx = vld1q_f32(fN[0]);
+            float32x4_t ny = vld1q_f32(fN[1]);
+            float32x4_t nz = vld1q_f32(fN[2]);
+            float32x4_t d = vaddq_f32(vaddq_f32(vmulq_f32(cx, nx), vmulq_f32(cy, ny)), vmulq_f32(cz, nz));
+            uint32x4_t vUse = vcgtq_s32(vNum, vdupq_n_s32(i));
+            if(!bZOnly)
+            {
+                sx = vbslq_f32(vUse, vaddq_f32(sx, vmulq_f32(nx, d)), sx);
+                sy = vbslq_f32(vUse, vaddq_f32(sy, vmulq_f32(ny, d)), sy);
             }
+            sz = vbslq_f32(vUse, vaddq_f32(sz, vmulq_f32(nz, d)), sz);
         }
-        for (i=0;i<m_nNumVertex;i++)
-            V3Normalize(m_pf3VertexNormal[i]);
+        float32x4_t vN = vcvtq_f32_s32(vNum);
+        uint32x4_t vMove = vcgtq_s32(vNum, vdupq_n_s32(0));
+        if(!bZOnly)
+        {
+            px = vbslq_f32(vMove, vaddq_f32(px, vdivq_f32(sx, vN)), px);
+            py = vbslq_f32(vMove, vaddq_f32(py, vdivq_f32(sy, vN)), py);
+        }
+        pz = vbslq_f32(vMove, vaddq_f32(pz, vdivq_f32(sz, vN)), pz);
+        vst1q_f32(pfOut[0]+k, px);
+        vst1q_f32(pfOut[1]+k, py);
+        vst1q_f32(pfOut[2]+k, pz);
+    }
+    VertexKernelScalar(tRing, pn3Face, pfNormal, pfIn, pfOut, bZOnly, k, nTo);
+}
+#endif // MDENOISE_NEON
+
+// Picks the fastest kernels the CPU supports.
+const char* SelectKernels(void)
+{
+    static std::once_flag flag;
+
+    std::call_once(flag, [] {
+        g_pfnNormalKernel = NormalKernelScalar;
+        g_pfnVertexKernel = VertexKernelScalar;
+        g_pszKernel = "scalar";
+#ifdef MDENOISE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            g_pfnNormalKernel = NormalKernelAVX2;
+            g_pfnVertexKernel = VertexKernelAVX2;
+            g_pszKernel = "AVX2";
+        }
+#endif
+#ifdef MDENOISE_NEON
+        g_pfnNormalKernel = NormalKernelNEON;
+        g_pfnVertexKernel = VertexKernelNEON;
+        g_pszKernel = "NEON";
+#endif
+    });
+    return g_pszKernel;
+}
+
+// Splits an FVECTOR3 array into separate x, y and z arrays and back.
+void CDenoiser::SoAFromAoS(float* const pf[3], FVECTOR3* pf3, int nNum)
+{
+    ParallelFor(0, nNum, [&](int nFrom, int nTo) {
+        for(int i=nFrom; i<nTo; i++)
+        {
+            pf[0][i] = pf3[i][0];
+            pf[1][i] = pf3[i][1];
+            pf[2][i] = pf3[i][2];
+        }
+    });
+}
+
+void CDenoiser::SoAToAoS(float* const pf[3], FVECTOR3* pf3, int nNum)
+{
+    ParallelFor(0, nNum, [&](int nFrom, int nTo) {
+        for(int i=nFrom; i<nTo; i++)
+        {
+            pf3[i][0] = pf[0][i];
+            pf3[i][1] = pf[1][i];
+            pf3[i][2] = pf[2][i];
+        }
+    });
+}
+
+// Normal updating on the structure-of-arrays layout; the result is left
+// in m_pf3FaceNormalP.
+void CDenoiser::NormalFilterSoA(struct RingList* ttRing, float fSigma, int nIterations)
+{
+    int i;
+    float *pfIn[3], *pfOut[3], *pfTmp;
+
+    SelectKernels();
+    for(i=0; i<3; i++)
+    {
+        pfIn[i] = new float[m_nNumFaceP];
+        pfOut[i] = new float[m_nNumFaceP];
+    }
+    SoAFromAoS(pfIn, m_pf3FaceNormalP, m_nNumFaceP);
+    for(; (m_nNormalPasses<nIterations) && !m_bNormalConverged; m_nNormalPasses++)
+    {
+        ParallelFor(0, m_nNumFaceP, [&](int nFrom, int nTo) {
+            g_pfnNormalKernel(ttRing, pfIn, fSigma, pfOut, nFrom, nTo);
+        });
+        if (m_fNormalTol>=0)
+            m_bNormalConverged = NormalConverged(ParallelMax(0, m_nNumFaceP, [&](int nFrom, int nTo) {
+                float f = 0;
+                for(int k=nFrom; k<nTo; k++)
+                {
+                    float d0 = pfOut[0][k]-pfIn[0][k], d1 = pfOut[1][k]-pfIn[1][k], d2 = pfOut[2][k]-pfIn[2][k];
+                    f = FMAX(f, d0*d0+d1*d1+d2*d2);
+                }
+                return f;
+            }));
+        for(i=0; i<3; i++)
+        {
+            pfTmp = pfIn[i];
+            pfIn[i] = pfOut[i];
+            pfOut[i] = pfTmp;
+        }
+    }
+    SoAToAoS(pfIn, m_pf3FaceNormalP, m_nNumFaceP);
+    for(i=0; i<3; i++)
+    {
+        delete []pfIn[i];
+        delete []pfOut[i];
+    }
+}
+
+// Jacobi vertex updating on the structure-of-arrays layout; the result is
+// left in m_pf3VertexP.
+void CDenoiser::VertexUpdateSoA(struct RingList* tRing, int nVIterations)
+{
+    int i, m;
+    bool bConverged = FALSE;
+    float *pfNormal[3], *pfIn[3], *pfOut[3], *pfTmp;
+
+    SelectKernels();
+    for(i=0; i<3; i++)
+    {
+        pfNormal[i] = new float[m_nNumFaceP];
+        pfIn[i] = new float[m_nNumVertexP];
+        pfOut[i] = new float[m_nNumVertexP];
+    }
+    SoAFromAoS(pfNormal, m_pf3FaceNormalP, m_nNumFaceP);
+    SoAFromAoS(pfIn, m_pf3VertexP, m_nNumVertexP);
+    for(m=0; (m<nVIterations) && !bConverged; m++)
+    {
+        ParallelFor(0, m_nNumVertexP, [&](int nFrom, int nTo) {
+            g_pfnVertexKernel(tRing, m_pn3Face, pfNormal, pfIn, pfOut, m_bZOnly, nFrom, nTo);
+        });
+        if (m_fVertexTol>=0)
+            bConverged = VertexConverged(ParallelMax(0, m_nNumVertexP, [&](int nFrom, int nTo) {
+                float f = 0, d[3];
+                for(int k=nFrom; k<nTo; k++)
+                {
+                    d[0] = pfOut[0][k]-pfIn[0][k];
+                    d[1] = pfOut[1][k]-pfIn[1][k];
+                    d[2] = pfOut[2][k]-pfIn[2][k];
+                    f = FMAX(f, DOTPROD3(d, d));
+                }
+                return f;
+            }));
+        for(i=0; i<3; i++)
+        {
+            pfTmp = pfIn[i];
+            pfIn[i] = pfOut[i];
+            pfOut[i] = pfTmp;
+        }
+    }
+    m_nVertexPasses = m;
+    SoAToAoS(pfIn, m_pf3VertexP, m_nNumVertexP);
+    for(i=0; i<3; i++)
+    {
+        delete []pfNormal[i];
+        delete []pfIn[i];
+        delete []pfOut[i];
+    }
+}
+
+// OpenCL backend (-x), built with MDENOISE_OPENCL. The adjacency of the
+// mesh is uploaded once per model, and each run uploads the normals and
+// positions, runs all the normal and vertex passes on the device and reads
+// back the filtered normals and the positions. The kernels follow
+// NormalKernelScalar and VertexKernelScalar on arrays of n x, then n y,
+// then n z values; the vertices are updated simultaneously, as with -u.
+// The device may contract or reorder the float operations, so the result
+// matches -u on the CPU to within 1e-5 of the model size, not bit for bit.
+#ifdef MDENOISE_OPENCL
+static const char* g_pszGpuSource =
+"__kernel void NormalPass(__global const int* pnStart, __global const int* pnIndex,\n"
+"    __global const float* pfIn, __global float* pfOut, float fSigma, int nNum)\n"
+"{\n"
+"    int i, j, k = get_global_id(0);\n"
+"    float t, fLen, x = 0, y = 0, z = 0;\n"
+"    if (k >= nNum)\n"
+"        return;\n"
+"    for (i=pnStart[k]; i<pnStart[k+1]; i++)\n"
+"    {\n"
+"        j = pnIndex[i];\n"
+"        t = pfIn[j]*pfIn[k] + pfIn[nNum+j]*pfIn[nNum+k] + pfIn[2*nNum+j]*pfIn[2*nNum+k] - fSigma;\n"
+"        if (t > 0)\n"
+"        {\n"
+"            x = x + pfIn[j]*(t*t);\n"
+"            y = y + pfIn[nNum+j]*(t*t);\n"
+"            z = z + pfIn[2*nNum+j]*(t*t);\n"
+"        }\n"
+"    }\n"
+"    fLen = sqrt(x*x + y*y + z*z);\n"
+"    if (fLen != 0)\n"
+"    {\n"
+"        x = x/fLen;\n"
+"        y = y/fLen;\n"
+"        z = z/fLen;\n"
+"    }\n"
+"    pfOut[k] = x;\n"
+"    pfOut[nNum+k] = y;\n"
+"    pfOut[2*nNum+k] = z;\n"
+"}\n"
+"__kernel void VertexPass(__global const int* pnStart, __global const int* pnIndex,\n"
+"    __global const int* pnFace, __global const float* pfNormal, int nFace,\n"
+"    __global const float* pfIn, __global float* pfOut, int bZOnly, int nNum)\n"
+"{\n"
+"    int i = get_global_id(0), j, f, a, b, c, n;\n"
+"    float x, y, z, t, dx = 0, dy = 0, dz = 0;\n"
+"    if (i >= nNum)\n"
+"        return;\n"
+"    for (j=pnStart[i]; j<pnStart[i+1]; j++)\n"
+"    {\n"
+"        f = pnIndex[j];\n"
+"        a = pnFace[3*f];\n"
+"        b = pnFace[3*f+1];\n"
+"        c = pnFace[3*f+2];\n"
+"        x = (pfIn[a] + pfIn[b] + pfIn[c])/3.0f - pfIn[i];\n"
+"        y = (pfIn[nNum+a] + pfIn[nNum+b] + pfIn[nNum+c])/3.0f - pfIn[nNum+i];\n"
+"        z = (pfIn[2*nNum+a] + pfIn[2*nNum+b] + pfIn[2*nNum+c])/3.0f - pfIn[2*nNum+i];\n"
+"        t = x*pfNormal[f] + y*pfNormal[nFace+f] + z*pfNormal[2*nFace+f];\n"
+"        if (!bZOnly)\n"
+"        {\n"
+"            dx = dx + pfNormal[f]*t;\n"
+"            dy = dy + pfNormal[nFace+f]*t;\n"
+"        }\n"
+"        dz = dz + pfNormal[2*nFace+f]*t;\n"
+"    }\n"
+"    n = pnStart[i+1]-pnStart[i];\n"
+"    pfOut[i] = pfIn[i];\n"
+"    pfOut[nNum+i] = pfIn[nNum+i];\n"
+"    pfOut[2*nNum+i] = pfIn[2*nNum+i];\n"
+"    if (n != 0)\n"
+"    {\n"
+"        if (!bZOnly)\n"
+"        {\n"
+"            pfOut[i] = pfIn[i] + dx/n;\n"
+"            pfOut[nNum+i] = pfIn[nNum+i] + dy/n;\n"
+"        }\n"
+"        pfOut[2*nNum+i] = pfIn[2*nNum+i] + dz/n;\n"
+"    }\n"
+"}\n";
+
+// The device, its compiled kernels and the buffers of the current model
+struct GpuContext {
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kNormal;
+  cl_kernel kVertex;
+  struct RingList* ttRing;    /* face ring of the uploaded adjacency, NULL for none */
+  cl_mem memTStart, memTIndex; /* face ring */
+  cl_mem memVStart, memVIndex; /* triangles of each vertex */
+  cl_mem memFace;
+  cl_mem memNormal[2];
+  cl_mem memVertex[2];
+};
+
+static void GpuCheck(cl_int nErr, const char* pszWhat)
+{
+    if (nErr != CL_SUCCESS)
+    {
+        fprintf(stderr,"\nError OpenCL:  %s failed (%d).\n", pszWhat, (int)nErr);
+        exit(1);
     }
 }
 
-void V3Normalize(FVECTOR3 v)
+static cl_mem GpuBuffer(struct GpuContext* gpu, cl_mem_flags nFlags, size_t nSize, void* pData)
+{
+    cl_int nErr;
+    cl_mem mem = clCreateBuffer(gpu->context, nFlags, nSize, pData, &nErr);
+
+    GpuCheck(nErr, "clCreateBuffer");
+    return mem;
+}
+
+static void GpuFreeBuffers(struct GpuContext* gpu)
 {
-    float len;
-    len=sqrt(DOTPROD3(v,v));
-    if (len!=0.0)
+    cl_mem *pMem[] = {&gpu->memTStart, &gpu->memTIndex, &gpu->memVStart, &gpu->memVIndex, &gpu->memFace,
+        &gpu->memNormal[0], &gpu->memNormal[1], &gpu->memVertex[0], &gpu->memVertex[1]};
+
+    for (size_t i=0; i<sizeof(pMem)/sizeof(pMem[0]); i++)
     {
-        v[0]=v[0]/len;
-        v[1]=v[1]/len;
-        v[2]=v[2]/len;
+        if (*pMem[i] != NULL)
+            clReleaseMemObject(*pMem[i]);
+        *pMem[i] = NULL;
     }
+    gpu->ttRing = NULL;
 }
 
-void MeshDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations)
+// Opens the first GPU of any platform and builds the kernels for it, or
+// returns NULL when there is none.
+static struct GpuContext* GpuOpen(void)
 {
-    int **ttRing; //store the list of triangle neighbours of a triangle
+    cl_platform_id pPlatform[8];
+    cl_device_id device = NULL;
+    cl_uint i, nPlatforms = 0;
+    cl_int nErr;
+    char szName[256];
+    struct GpuContext* gpu;
+
+    if ((clGetPlatformIDs(8, pPlatform, &nPlatforms) != CL_SUCCESS) || (nPlatforms == 0))
+        return NULL;
+    for (i=0; (i<nPlatforms) && (i<8) && (device==NULL); i++)
+        if (clGetDeviceIDs(pPlatform[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS)
+            device = NULL;
+    if (device == NULL)
+        return NULL;
+
+    gpu = (struct GpuContext *)MyMalloc(sizeof(struct GpuContext));
+    memset(gpu, 0, sizeof(struct GpuContext));
+    gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &nErr);
+    GpuCheck(nErr, "clCreateContext");
+    gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &nErr);
+    GpuCheck(nErr, "clCreateCommandQueue");
+    gpu->program = clCreateProgramWithSource(gpu->context, 1, &g_pszGpuSource, NULL, &nErr);
+    GpuCheck(nErr, "clCreateProgramWithSource");
+    GpuCheck(clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL), "clBuildProgram");
+    gpu->kNormal = clCreateKernel(gpu->program, "NormalPass", &nErr);
+    GpuCheck(nErr, "clCreateKernel");
+    gpu->kVertex = clCreateKernel(gpu->program, "VertexPass", &nErr);
+    GpuCheck(nErr, "clCreateKernel");
+
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(szName), szName, NULL) == CL_SUCCESS)
+        printf("OpenCL device: %s\n", szName);
+    return gpu;
+}
 
-    FVECTOR3 *Vertex;
-    FVECTOR3 *TNormal;
+void GpuClose(struct GpuContext* gpu)
+{
+    if (gpu == NULL)
+        return;
+    GpuFreeBuffers(gpu);
+    clReleaseKernel(gpu->kNormal);
+    clReleaseKernel(gpu->kVertex);
+    clReleaseProgram(gpu->program);
+    clReleaseCommandQueue(gpu->queue);
+    clReleaseContext(gpu->context);
+    free(gpu);
+}
 
-    int i,k,m;
-    float tmp3;
+void GpuRelease(struct GpuContext* gpu)
+{
+    if (gpu != NULL)
+        GpuFreeBuffers(gpu);
+}
 
-    if (m_nNumFace == 0)
-        return;
+// Runs kernel k over nNum work items, rounded up to whole groups of 64.
+static void GpuRun(struct GpuContext* gpu, cl_kernel k, int nNum)
+{
+    size_t nGlobal = ((size_t)nNum+63)/64*64, nLocal = 64;
 
-    delete []m_pf3VertexP;
-    delete []m_pf3VertexNormalP;
-    delete []m_pf3FaceNormalP;
-    ComputeVRing1V(); //find the neighbouring vertices of each vertex
-    ComputeVRing1T();     //find the neighbouring triangles of each vertex
+    GpuCheck(clEnqueueNDRangeKernel(gpu->queue, k, 1, NULL, &nGlobal, &nLocal, 0, NULL, NULL), "clEnqueueNDRangeKernel");
+}
 
-    //find out the neighbouring triangles of each triangle
-    if (bNeighbourCV)
-    {
-        ComputeTRing1TCV();
-        ttRing = m_ppnTRing1TCV;
-        for (k=0; k<m_nNumFace; k++)
-        {
-            ttRing[k] = m_ppnTRing1TCV[k];       
-        }
-    }
-    else
+// Sets up the device for the mesh with face ring ttRing, uploading its
+// adjacency unless the device already has it. Returns FALSE when there is
+// no GPU, after which the CPU paths are used.
+bool CDenoiser::GpuOpenModel(struct RingList* ttRing)
+{
+    int i;
+    int *pnFace;
+
+    if (m_pGpu == NULL)
     {
-        ComputeTRing1TCE();
-        ttRing = m_ppnTRing1TCE;
-        for (k=0; k<m_nNumFace; k++)
+        m_pGpu = GpuOpen();
+        if (m_pGpu == NULL)
         {
-            ttRing[k] = m_ppnTRing1TCE[k];       
+            printf("Warning: no OpenCL GPU was found, the CPU is used.\n");
+            return FALSE;
         }
     }
+    if (m_pGpu->ttRing == ttRing)
+        return TRUE;
 
-    //begin filter
-    m_nNumVertexP = m_nNumVertex;
-    m_nNumFaceP = m_nNumFace;
-    m_pf3VertexP = new FVECTOR3[m_nNumVertexP];
-    m_pf3FaceNormalP = new FVECTOR3[m_nNumFaceP];
-    m_pf3VertexNormalP = new FVECTOR3[m_nNumVertexP];
-    Vertex = new FVECTOR3[m_nNumVertexP];
-    TNormal = new FVECTOR3[m_nNumFace];
-    for(i=0; i<m_nNumFace; i++)
+    GpuFreeBuffers(m_pGpu);
+    pnFace = (int *)MyMalloc(3*m_nNumFace*sizeof(int));
+    for (i=0; i<m_nNumFace; i++)
     {
-        VEC3_ASN_OP(m_pf3FaceNormalP[i], =, m_pf3FaceNormal[i]);
+        pnFace[3*i] = m_pn3Face[i][0];
+        pnFace[3*i+1] = m_pn3Face[i][1];
+        pnFace[3*i+2] = m_pn3Face[i][2];
     }
-    for(i=0; i<m_nNumVertex; i++)
+    m_pGpu->memTStart = GpuBuffer(m_pGpu, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, (m_nNumFace+1)*sizeof(int), ttRing->pnStart);
+    m_pGpu->memTIndex = GpuBuffer(m_pGpu, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, (ttRing->pnStart[m_nNumFace]+1)*sizeof(int), ttRing->pnIndex);
+    m_pGpu->memVStart = GpuBuffer(m_pGpu, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, (m_nNumVertex+1)*sizeof(int), m_VRing1T.pnStart);
+    m_pGpu->memVIndex = GpuBuffer(m_pGpu, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, (m_VRing1T.pnStart[m_nNumVertex]+1)*sizeof(int), m_VRing1T.pnIndex);
+    m_pGpu->memFace = GpuBuffer(m_pGpu, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR, 3*m_nNumFace*sizeof(int), pnFace);
+    free(pnFace);
+    for (i=0; i<2; i++)
     {
-        VEC3_ASN_OP(m_pf3VertexP[i], =, m_pf3Vertex[i]);
+        m_pGpu->memNormal[i] = GpuBuffer(m_pGpu, CL_MEM_READ_WRITE, 3*m_nNumFace*sizeof(float), NULL);
+        m_pGpu->memVertex[i] = GpuBuffer(m_pGpu, CL_MEM_READ_WRITE, 3*m_nNumVertex*sizeof(float), NULL);
     }
+    m_pGpu->ttRing = ttRing;
+    return TRUE;
+}
 
-    for(i=0; i<m_nNumVertex; i++)
+// Normal passes from m_nNormalPasses up to nIterations on the device; the
+// filtered normals are left on it for GpuVertexUpdate.
+void CDenoiser::GpuNormalFilter(float fSigma, int nIterations)
+{
+    int n;
+    float *pfBuf = (float *)MyMalloc(3*m_nNumFace*sizeof(float));
+    float *pf[3] = {pfBuf, pfBuf+m_nNumFace, pfBuf+2*m_nNumFace};
+    cl_kernel k = m_pGpu->kNormal;
+
+    SoAFromAoS(pf, m_pf3FaceNormalP, m_nNumFace);
+    GpuCheck(clEnqueueWriteBuffer(m_pGpu->queue, m_pGpu->memNormal[0], CL_TRUE, 0, 3*m_nNumFace*sizeof(float), pfBuf, 0, NULL, NULL), "clEnqueueWriteBuffer");
+    GpuCheck(clSetKernelArg(k, 0, sizeof(cl_mem), &m_pGpu->memTStart), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 1, sizeof(cl_mem), &m_pGpu->memTIndex), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 4, sizeof(float), &fSigma), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 5, sizeof(int), &m_nNumFace), "clSetKernelArg");
+    for (n=0; m_nNormalPasses<nIterations; m_nNormalPasses++, n^=1)
     {
-        VEC3_ASN_OP(Vertex[i], =, m_pf3VertexP[i]);
+        GpuCheck(clSetKernelArg(k, 2, sizeof(cl_mem), &m_pGpu->memNormal[n]), "clSetKernelArg");
+        GpuCheck(clSetKernelArg(k, 3, sizeof(cl_mem), &m_pGpu->memNormal[n^1]), "clSetKernelArg");
+        GpuRun(m_pGpu, k, m_nNumFace);
     }
-
-    for(m=0; m<nIterations; m++)
+    if (n)
     {
-        //initialization
-        for(i=0; i<m_nNumFace; i++)
-        {
-            VEC3_ASN_OP(TNormal[i], =, m_pf3FaceNormalP[i]);
-        }
-
-        //modify triangle normal
-        for(k=0; k<m_nNumFace; k++)
-        {
-            VEC3_ZERO(m_pf3FaceNormalP[k]);
-            for(i=1; i<ttRing[k][0]+1; i++)
-            {
-                tmp3 = DOTPROD3(TNormal[ttRing[k][i]],TNormal[k])-fSigma;
-                if( tmp3 > 0.0)
-                {
-                    VEC3_V_OP_V_OP_S(m_pf3FaceNormalP[k],m_pf3FaceNormalP[k], +, TNormal[ttRing[k][i]], *, tmp3*tmp3);
-                }
-            }
-            V3Normalize(m_pf3FaceNormalP[k]);
-        }
-        for(k=0; k<m_nNumFace; k++)
-        {
-            VEC3_ASN_OP(TNormal[k], =, m_pf3FaceNormalP[k]);
-        }
+        cl_mem mem = m_pGpu->memNormal[0];
+        m_pGpu->memNormal[0] = m_pGpu->memNormal[1];
+        m_pGpu->memNormal[1] = mem;
     }
+    GpuCheck(clEnqueueReadBuffer(m_pGpu->queue, m_pGpu->memNormal[0], CL_TRUE, 0, 3*m_nNumFace*sizeof(float), pfBuf, 0, NULL, NULL), "clEnqueueReadBuffer");
+    SoAToAoS(pf, m_pf3FaceNormalP, m_nNumFace);
+    free(pfBuf);
+}
 
-    //modify vertex coordinates
-    VertexUpdate(m_ppnVRing1T, nVIterations);
-    //m_L2Error = L2Error();
+// nVIterations vertex passes on the device from the normals GpuNormalFilter
+// left there.
+void CDenoiser::GpuVertexUpdate(int nVIterations)
+{
+    int n, m, bZOnly = m_bZOnly;
+    float *pfBuf = (float *)MyMalloc(3*m_nNumVertex*sizeof(float));
+    float *pf[3] = {pfBuf, pfBuf+m_nNumVertex, pfBuf+2*m_nNumVertex};
+    cl_kernel k = m_pGpu->kVertex;
+
+    SoAFromAoS(pf, m_pf3VertexP, m_nNumVertex);
+    GpuCheck(clEnqueueWriteBuffer(m_pGpu->queue, m_pGpu->memVertex[0], CL_TRUE, 0, 3*m_nNumVertex*sizeof(float), pfBuf, 0, NULL, NULL), "clEnqueueWriteBuffer");
+    GpuCheck(clSetKernelArg(k, 0, sizeof(cl_mem), &m_pGpu->memVStart), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 1, sizeof(cl_mem), &m_pGpu->memVIndex), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 2, sizeof(cl_mem), &m_pGpu->memFace), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 3, sizeof(cl_mem), &m_pGpu->memNormal[0]), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 4, sizeof(int), &m_nNumFace), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 7, sizeof(int), &bZOnly), "clSetKernelArg");
+    GpuCheck(clSetKernelArg(k, 8, sizeof(int), &m_nNumVertex), "clSetKernelArg");
+    for (n=0, m=0; m<nVIterations; m++, n^=1)
+    {
+        GpuCheck(clSetKernelArg(k, 5, sizeof(cl_mem), &m_pGpu->memVertex[n]), "clSetKernelArg");
+        GpuCheck(clSetKernelArg(k, 6, sizeof(cl_mem), &m_pGpu->memVertex[n^1]), "clSetKernelArg");
+        GpuRun(m_pGpu, k, m_nNumVertex);
+    }
+    m_nVertexPasses = m;
+    GpuCheck(clEnqueueReadBuffer(m_pGpu->queue, m_pGpu->memVertex[n], CL_TRUE, 0, 3*m_nNumVertex*sizeof(float), pfBuf, 0, NULL, NULL), "clEnqueueReadBuffer");
+    SoAToAoS(pf, m_pf3VertexP, m_nNumVertex);
+    free(pfBuf);
+}
+#endif
 
-    delete []Vertex;
-    delete []TNormal;
+// Records the residual of a normal updating iteration from the largest
+// squared change of a face normal, 2*(1-cos) of the angle it turned by, and
+// tells if it is within the tolerance.
+bool CDenoiser::NormalConverged(float fMaxChange2)
+{
+    float fAngle = float(2.0*asin(std::min(1.0, sqrt((double)fMaxChange2)/2.0))*180.0/PI);
 
-    return;
+    m_vNormalResidual.push_back(fAngle);
+    return fAngle <= m_fNormalTol;
 }
 
-void ComputeVRing1V(void)
+// Records the residual of a vertex updating iteration from the largest
+// squared move of a vertex, and tells if it is within the tolerance. The
+// model is scaled, so the move is given back in the units of the input.
+bool CDenoiser::VertexConverged(float fMaxMove2)
 {
-    int i,j,k;
-    int tmp0, tmp1, tmp2;
+    float fMove = sqrt(fMaxMove2)*m_fScale;
 
-    if(m_ppnVRing1V != NULL)
-        return;
-
-    m_ppnVRing1V=(int **)MyMalloc(m_nNumVertex*sizeof(int *));
+    m_vVertexResidual.push_back(fMove);
+    return fMove <= m_fVertexTol;
+}
 
-    for (i=0;i<m_nNumVertex;i++) {
-        m_ppnVRing1V[i]=(int *)MyMalloc(6*sizeof(int));
-        m_ppnVRing1V[i][0]=0; // m_ppnVRing1V[i][0] stores the number of vertex neighbours
-    }
+void CDenoiser::ReportConvergence(void)
+{
+    size_t i;
 
-    for (k=0; k<m_nNumFace; k++)
+    printf("Normal updating: %d iterations",m_nNormalPasses);
+    if (!m_vNormalResidual.empty())
     {
-        for (i=0;i<3;i++)
-        {
-            tmp0=m_pn3Face[k][i];
-            tmp2=m_pn3Face[k][(i+2)%3];
-            for (j=1;j<m_ppnVRing1V[tmp0][0]+1;j++)
-                if (m_ppnVRing1V[tmp0][j] == tmp2)
-                    break;
-            if (j==m_ppnVRing1V[tmp0][0]+1)
-            {
-                m_ppnVRing1V[tmp0][j]=tmp2;
-                m_ppnVRing1V[tmp0][0] += 1;
-                if (!(m_ppnVRing1V[tmp0][0]%5))
-                    m_ppnVRing1V[tmp0] = (int *)MyRealloc(m_ppnVRing1V[tmp0],(m_ppnVRing1V[tmp0][0]+6)*sizeof(int));
-            }
-            tmp1=m_pn3Face[k][(i+1)%3];
-            for (j=1;j<m_ppnVRing1V[tmp0][0]+1;j++)
-                if (m_ppnVRing1V[tmp0][j] == tmp1)
-                    break;
-            if (j==m_ppnVRing1V[tmp0][0]+1)
-            {
-                m_ppnVRing1V[tmp0][j]=tmp1;
-                m_ppnVRing1V[tmp0][0] += 1;
-                if (!(m_ppnVRing1V[tmp0][0]%5))
-                    m_ppnVRing1V[tmp0] = (int *)MyRealloc(m_ppnVRing1V[tmp0],(m_ppnVRing1V[tmp0][0]+6)*sizeof(int));
-            }   
-        }
+        printf(", largest turn of a normal (degrees):");
+        for (i=0; i<m_vNormalResidual.size(); i++)
+            printf(" %g",m_vNormalResidual[i]);
     }
-    for (i=0;i<m_nNumVertex;i++) {
-        m_ppnVRing1V[i]=(int *)MyRealloc(m_ppnVRing1V[i],(m_ppnVRing1V[i][0]+1)*sizeof(int));
+    printf("\nVertex updating: %d iterations",m_nVertexPasses);
+    if (!m_vVertexResidual.empty())
+    {
+        printf(", largest move of a vertex:");
+        for (i=0; i<m_vVertexResidual.size(); i++)
+            printf(" %g",m_vVertexResidual[i]);
     }
+    printf("\n");
 }
 
-void ComputeVRing1T(void)
+// Buffered text output. The numbers are converted with std::to_chars, which
+// gives the same digits as printf("%.*f"), into a large buffer that is
+// written with fwrite; the headers may still be written with fprintf before.
+// A full buffer is written on a thread of its own while the numbers after it
+// go into a second one, and OutClose returns when everything is written.
+void OutOpen(struct OutBuffer* ob, FILE* fp, int nPrecision)
 {
-        int i,k;
-    int tmp;
-
-    if(m_ppnVRing1T != NULL)
-        return;
-
-    m_ppnVRing1T=(int **)MyMalloc(m_nNumVertex*sizeof(int *));
-    for (i=0;i<m_nNumVertex;i++) {
-        m_ppnVRing1T[i]=(int *)MyMalloc(6*sizeof(int));
-        m_ppnVRing1T[i][0]=0; // m_ppnVRing1T[i][0] stores the number of triangle neighbours
-    }
+    ob->fp = fp;
+    ob->nPrecision = nPrecision;
+    ob->pBuf = (char *)MyMalloc(OUT_BLOCK+OUT_SLACK);
+    ob->nLen = 0;
+    ob->pBack = NULL;
+    ob->pWriter = NULL;
+}
 
-    for (k=0; k<m_nNumFace; k++)
+// Waits for the block that is being written.
+static void OutWait(struct OutBuffer* ob)
+{
+    if (ob->pWriter!=NULL)
     {
-        for (i=0;i<3;i++)
-        {
-            tmp = m_pn3Face[k][i]; //the vertex incident to the k-th triangle
-            m_ppnVRing1T[tmp][0] += 1;
-            m_ppnVRing1T[tmp][m_ppnVRing1T[tmp][0]]=k;
-            if (!(m_ppnVRing1T[tmp][0]%5))
-            {
-                m_ppnVRing1T[tmp] = (int *)MyRealloc(m_ppnVRing1T[tmp],(m_ppnVRing1T[tmp][0]+6)*sizeof(int));
-            }
-        }
-    }
-    for (i=0;i<m_nNumVertex;i++) {
-        m_ppnVRing1T[i]=(int *)MyRealloc(m_ppnVRing1T[i],(m_ppnVRing1T[i][0]+1)*sizeof(int));
+        ob->pWriter->join();
+        delete ob->pWriter;
+        ob->pWriter = NULL;
     }
 }
 
-void ComputeTRing1TCV(void)
+void OutFlush(struct OutBuffer* ob)
 {
-    int i,j,k;
-    int tmp,tmp0,tmp1,tmp2;
-
-    if(m_ppnTRing1TCV != NULL)
-        return;
+    char *p;
+    size_t n = ob->nLen;
+
+    OutWait(ob);
+    if (ob->pBack==NULL)
+        ob->pBack = (char *)MyMalloc(OUT_BLOCK+OUT_SLACK);
+    p = ob->pBack;
+    ob->pBack = ob->pBuf;
+    ob->pBuf = p;
+    ob->nLen = 0;
+    p = ob->pBack;
+    ob->pWriter = new std::thread([ob, p, n]{ fwrite(p, 1, n, ob->fp); });
+}
 
-    m_ppnTRing1TCV=(int **)MyMalloc(m_nNumFace*sizeof(int *));
-    for (k=0; k<m_nNumFace; k++)
-    {
-        tmp0 = m_pn3Face[k][0]; 
-        tmp1 = m_pn3Face[k][1];
-        tmp2 = m_pn3Face[k][2];
-        tmp = m_ppnVRing1T[tmp0][0] + m_ppnVRing1T[tmp1][0] +  m_ppnVRing1T[tmp2][0];
-        m_ppnTRing1TCV[k] =(int *)MyMalloc(tmp*sizeof(int));
-       
-        m_ppnTRing1TCV[k][0] = m_ppnVRing1T[tmp0][0];
-        for (i=1; i<m_ppnVRing1T[tmp0][0]+1; i++)
-        {
-            m_ppnTRing1TCV[k][i] = m_ppnVRing1T[tmp0][i];
-        }
+void OutClose(struct OutBuffer* ob)
+{
+    OutWait(ob);
+    fwrite(ob->pBuf, 1, ob->nLen, ob->fp);
+    free(ob->pBuf);
+    free(ob->pBack);
+    ob->pBuf = ob->pBack = NULL;
+}
 
-        for (i=1; i<m_ppnVRing1T[tmp1][0]+1; i++)
-        {
-            if((m_pn3Face[m_ppnVRing1T[tmp1][i]][0] != tmp0) && (m_pn3Face[m_ppnVRing1T[tmp1][i]][1] != tmp0)\
-                && (m_pn3Face[m_ppnVRing1T[tmp1][i]][2] != tmp0))
-            {
-                ++m_ppnTRing1TCV[k][0];
-                m_ppnTRing1TCV[k][m_ppnTRing1TCV[k][0]]= m_ppnVRing1T[tmp1][i];
-            }
-            else
-            {
-                for(j=1; j<m_ppnTRing1TCV[k][0]+1; j++)
-                {
-                    if(m_ppnTRing1TCV[k][j]==m_ppnVRing1T[tmp1][i])
-                    {
-                        break;
-                    }
-                }
-            }
-        }
+void OutNumber(struct OutBuffer* ob, double v)
+{
+    std::to_chars_result r;
 
-        for (i=1; i<m_ppnVRing1T[tmp2][0]+1; i++)
-        {
-            if((m_pn3Face[m_ppnVRing1T[tmp2][i]][0] != tmp0) && (m_pn3Face[m_ppnVRing1T[tmp2][i]][1] != tmp0)\
-                && (m_pn3Face[m_ppnVRing1T[tmp2][i]][2] != tmp0) && (m_pn3Face[m_ppnVRing1T[tmp2][i]][0] != tmp1)\
-                && (m_pn3Face[m_ppnVRing1T[tmp2][i]][1] != tmp1) && (m_pn3Face[m_ppnVRing1T[tmp2][i]][2] != tmp1))
-            {
-                ++m_ppnTRing1TCV[k][0];
-                m_ppnTRing1TCV[k][m_ppnTRing1TCV[k][0]]= m_ppnVRing1T[tmp2][i];
-            }
-            else
-            {
-                for(j=1; j<m_ppnTRing1TCV[k][0]+1; j++)
-                {
-                    if(m_ppnTRing1TCV[k][j]==m_ppnVRing1T[tmp2][i])
-                    {
-                        break;
-                    }
-                }
-            }
-        }
-    }
-    for (i=0;i<m_nNumFace;i++) {
-        m_ppnTRing1TCV[i]=(int *)MyRealloc(m_ppnTRing1TCV[i],(m_ppnTRing1TCV[i][0]+1)*sizeof(int));
-    }
+    if (ob->nLen>OUT_BLOCK)
+        OutFlush(ob);
+    if (ob->nPrecision<0)
+        r = std::to_chars(ob->pBuf+ob->nLen, ob->pBuf+OUT_BLOCK+OUT_SLACK, v, std::chars_format::fixed);
+    else
+        r = std::to_chars(ob->pBuf+ob->nLen, ob->pBuf+OUT_BLOCK+OUT_SLACK, v, std::chars_format::fixed, ob->nPrecision);
+    ob->nLen = r.ptr-ob->pBuf;
 }
 
-void ComputeTRing1TCE(void)
+// The shortest form of a float is shorter than that of the same double.
+void OutNumber(struct OutBuffer* ob, float v)
 {
-    int i,k;
-    int tmp,tmp0,tmp1,tmp2;
+    std::to_chars_result r;
 
-    if(m_ppnTRing1TCE != NULL)
-        return;
+    if (ob->nLen>OUT_BLOCK)
+        OutFlush(ob);
+    if (ob->nPrecision<0)
+        r = std::to_chars(ob->pBuf+ob->nLen, ob->pBuf+OUT_BLOCK+OUT_SLACK, v, std::chars_format::fixed);
+    else
+        r = std::to_chars(ob->pBuf+ob->nLen, ob->pBuf+OUT_BLOCK+OUT_SLACK, v, std::chars_format::fixed, ob->nPrecision);
+    ob->nLen = r.ptr-ob->pBuf;
+}
 
-    m_ppnTRing1TCE=(int **)MyMalloc(m_nNumFace*sizeof(int *));
-    for (k=0; k<m_nNumFace; k++)
-    {
-        tmp0 = m_pn3Face[k][0]; 
-        tmp1 = m_pn3Face[k][1];
-        tmp2 = m_pn3Face[k][2];
+void OutNumber(struct OutBuffer* ob, int v)
+{
+    if (ob->nLen>OUT_BLOCK)
+        OutFlush(ob);
+    ob->nLen = std::to_chars(ob->pBuf+ob->nLen, ob->pBuf+OUT_BLOCK+OUT_SLACK, v).ptr-ob->pBuf;
+}
 
-        m_ppnTRing1TCE[k] = (int *)MyMalloc(5*sizeof(int));
+// Appends a short string (at most OUT_SLACK/2 characters).
+void OutText(struct OutBuffer* ob, const char* s)
+{
+    if (ob->nLen>OUT_BLOCK)
+        OutFlush(ob);
+    while (*s)
+        ob->pBuf[ob->nLen++] = *s++;
+}
 
-        tmp = 0;
-        for (i=1; i<m_ppnVRing1T[tmp0][0]+1; i++)
-        {
-            if ((m_pn3Face[m_ppnVRing1T[tmp0][i]][0] == tmp1)||(m_pn3Face[m_ppnVRing1T[tmp0][i]][0] == tmp2)||\
-                    (m_pn3Face[m_ppnVRing1T[tmp0][i]][1] == tmp1)||(m_pn3Face[m_ppnVRing1T[tmp0][i]][1] == tmp2)||\
-                    (m_pn3Face[m_ppnVRing1T[tmp0][i]][2] == tmp1)||(m_pn3Face[m_ppnVRing1T[tmp0][i]][2] == tmp2))
-            {
-                tmp++;
-                if (tmp>4)
-                {
-                    tmp--;
-                    break;
-                }
-                m_ppnTRing1TCE[k][tmp] = m_ppnVRing1T[tmp0][i];
-            }
-        }
+// Appends n bytes (at most OUT_SLACK).
+void OutBytes(struct OutBuffer* ob, const void* p, size_t n)
+{
+    if (ob->nLen>OUT_BLOCK)
+        OutFlush(ob);
+    memcpy(ob->pBuf+ob->nLen, p, n);
+    ob->nLen += n;
+}
 
-        for (i=1; i<m_ppnVRing1T[tmp1][0]+1; i++)
+// Appends nWords 4-byte words (floats or ints) in little-endian order. Long
+// arrays on a little-endian host are written straight from memory.
+void OutWords(struct OutBuffer* ob, const void* p, size_t nWords)
+{
+    const int nOne = 1;
+    bool bLittle = (*(const unsigned char *)&nOne==1);
+    const unsigned char *c = (const unsigned char *)p;
+    unsigned char *q;
+    size_t i;
+
+    if (bLittle && (4*nWords>OUT_SLACK))
+    {
+        OutFlush(ob);
+        OutWait(ob);
+        fwrite(p, 4, nWords, ob->fp);
+        return;
+    }
+    for (i=0; i<nWords; i++, c+=4)
+    {
+        if (ob->nLen>OUT_BLOCK)
+            OutFlush(ob);
+        q = (unsigned char *)ob->pBuf+ob->nLen;
+        if (bLittle)
+            memcpy(q, c, 4);
+        else
         {
-            if ((m_pn3Face[m_ppnVRing1T[tmp1][i]][0] == tmp1)&&\
-                ((m_pn3Face[m_ppnVRing1T[tmp1][i]][1] == tmp2)||(m_pn3Face[m_ppnVRing1T[tmp1][i]][2] == tmp2)))
-            {
-                tmp++;
-                if (tmp>4)
-                {
-                    tmp--;
-                    break;
-                }
-                m_ppnTRing1TCE[k][tmp] = m_ppnVRing1T[tmp1][i];
-                break;   
-            }
-            else if((m_pn3Face[m_ppnVRing1T[tmp1][i]][0] == tmp2)&&\
-                ((m_pn3Face[m_ppnVRing1T[tmp1][i]][1] == tmp1)||(m_pn3Face[m_ppnVRing1T[tmp1][i]][2] == tmp1)))
-            {
-                tmp++;
-                if (tmp>4)
-                {
-                    tmp--;
-                    break;
-                }
-                m_ppnTRing1TCE[k][tmp] = m_ppnVRing1T[tmp1][i];
-                break;   
-            }
-            else if((m_pn3Face[m_ppnVRing1T[tmp1][i]][1] == tmp2)&&(m_pn3Face[m_ppnVRing1T[tmp1][i]][2] == tmp1))
-            {
-                tmp++;
-                if (tmp>4)
-                {
-                    tmp--;
-                    break;
-                }
-                m_ppnTRing1TCE[k][tmp] = m_ppnVRing1T[tmp1][i];
-                break;   
-            }
-            else if((m_pn3Face[m_ppnVRing1T[tmp1][i]][1] == tmp1)&&\
-                (m_pn3Face[m_ppnVRing1T[tmp1][i]][2] == tmp2)&&(m_pn3Face[m_ppnVRing1T[tmp1][i]][0] != tmp0))
-            {
-                tmp++;
-                if (tmp>4)
-                {
-                    tmp--;
-                    break;
-                }
-                m_ppnTRing1TCE[k][tmp] = m_ppnVRing1T[tmp1][i];
-                break;   
-            }
+            q[0] = c[3]; q[1] = c[2]; q[2] = c[1]; q[3] = c[0];
         }
-        m_ppnTRing1TCE[k][0] = tmp;
+        ob->nLen += 4;
     }
 }
 
-void VertexUpdate(int** tRing, int nVIterations)
+// Writes "x y z\n".
+void OutVertex(struct OutBuffer* ob, FVECTOR3 v)
 {
-    int i, j, m;
-    int nTmp0, nTmp1, nTmp2;
-    float fTmp1;
-
-    FVECTOR3 vect[3];
-   
-    for(m=0; m<nVIterations; m++)
-    {   
+    OutNumber(ob, v[0]);
+    OutText(ob, " ");
+    OutNumber(ob, v[1]);
+    OutText(ob, " ");
+    OutNumber(ob, v[2]);
+    OutText(ob, "\n");
+}
 
-        for(i=0; i<m_nNumVertex; i++)
-        {
-            VEC3_ZERO(vect[1]);
-            for(j=1; j<tRing[i][0]+1; j++)
-            {
-                nTmp0 = m_pn3Face[tRing[i][j]][0]; // the vertex number of triangle tRing[i][j]
-                nTmp1 = m_pn3Face[tRing[i][j]][1];
-                nTmp2 = m_pn3Face[tRing[i][j]][2];
-                VEC3_V_OP_V_OP_V(vect[0], m_pf3VertexP[nTmp0],+, m_pf3VertexP[nTmp1],+, m_pf3VertexP[nTmp2]);
-                VEC3_V_OP_S(vect[0], vect[0], /, 3.0); //vect[0] is the centr of the triangle.
-                VEC3_V_OP_V(vect[0], vect[0], -, m_pf3VertexP[i]); //vect[0] is now vector PC.
-                fTmp1 = DOTPROD3(vect[0], m_pf3FaceNormalP[tRing[i][j]]);
-				if(m_bZOnly)
-					vect[1][2] = vect[1][2] + m_pf3FaceNormalP[tRing[i][j]][2] * fTmp1;
-				else
-					VEC3_V_OP_V_OP_S(vect[1], vect[1], +, m_pf3FaceNormalP[tRing[i][j]],*, fTmp1);                   
-            }
-            if (tRing[i][0]!=0)
-            {
-				if(m_bZOnly)
-					m_pf3VertexP[i][2] = m_pf3VertexP[i][2] + vect[1][2]/tRing[i][0];
-				else
-					VEC3_V_OP_V_OP_S(m_pf3VertexP[i], m_pf3VertexP[i],+, vect[1], /, tRing[i][0]);
-            }
-        }
-    }
-    ComputeNormal(TRUE);
+// Writes the prefix and then "a b c\n" with nBase added to the indices.
+void OutFace(struct OutBuffer* ob, const char* pszPrefix, NVECTOR3 f, int nBase)
+{
+    OutText(ob, pszPrefix);
+    OutNumber(ob, f[0]+nBase);
+    OutText(ob, " ");
+    OutNumber(ob, f[1]+nBase);
+    OutText(ob, " ");
+    OutNumber(ob, f[2]+nBase);
+    OutText(ob, "\n");
 }
 
-void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header)
+void CDenoiser::SaveData(FILE * fp, int nfileext, struct ESRIHeader* header)
 {
+    if (m_pnVertexOrder != NULL)
+        RestoreOrder();
+
     for (int i=0;i<m_nNumVertexP;i++)
     {
         VEC3_V_OP_V_OP_S(m_pf3VertexP[i],m_f3Centre,+, m_pf3VertexP[i],*, m_fScale);
@@ -2150,14 +8165,14 @@ void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header)
         SavePLY2(fp);
         break;
 
-/*    case FILE_SMF:
-        SaveSMF(fp);
-        break;
-
     case FILE_STL:
         SaveSTL(fp);
         break;
 
+/*    case FILE_SMF:
+        SaveSMF(fp);
+        break;
+
     case FILE_WRL:
         SaveWRL(fp);
         break;
@@ -2167,7 +8182,19 @@ void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header)
         break;
 
 	case FILE_ESRI:
-        SaveESRI(fp, header);
+        if (m_Mosaic.ncols>0)
+        {
+            // only the cells of the tile itself
+            SaveESRIHeader(fp, header);
+            if (m_bGrid)
+                SaveGridRows(fp, &m_Mosaic, m_nMosaicHalo, m_nMosaicHalo+header->nrows, m_nMosaicHalo, m_nMosaicHalo+header->ncols);
+            else
+                SaveESRIRows(fp, &m_Mosaic, m_nMosaicHalo, m_nMosaicHalo+header->nrows, m_nMosaicHalo, m_nMosaicHalo+header->ncols);
+        }
+        else if (m_bGrid)
+            SaveGrid(fp, header);
+        else
+            SaveESRI(fp, header);
         break;
 
     default:
@@ -2176,45 +8203,56 @@ void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header)
     }
 }
 
-void SaveOBJ(FILE * fp)
+void CDenoiser::SaveOBJ(FILE * fp)
 {
     int i;
+    struct OutBuffer ob;
 
     fprintf(fp,"# The denoised result.\n");
 
+    OutOpen(&ob, fp, m_nPrecision);
     for (i=0;i<m_nNumVertexP;i++)
     {
-        fprintf(fp,"v %f %f %f\n", m_pf3VertexP[i][0], m_pf3VertexP[i][1], m_pf3VertexP[i][2]);
+        OutText(&ob, "v ");
+        OutVertex(&ob, m_pf3VertexP[i]);
     }
     for (i=0;i<m_nNumFaceP;i++)
     {
-        fprintf(fp,"f %d %d %d\n", m_pn3FaceP[i][0]+1, m_pn3FaceP[i][1]+1, m_pn3FaceP[i][2]+1);
+        OutFace(&ob, "f ", m_pn3FaceP[i], 1);
     }
+    OutClose(&ob);
 }
 
-void SaveOFF(FILE * fp)
+void CDenoiser::SaveOFF(FILE * fp)
 {
     int i;
+    struct OutBuffer ob;
 
     fprintf(fp,"OFF\n");
     fprintf(fp,"%d %d %d\n",m_nNumVertexP,m_nNumFaceP, 0);
 
+    OutOpen(&ob, fp, m_nPrecision);
     for (i=0;i<m_nNumVertexP;i++)
     {
-        fprintf(fp,"%f %f %f\n", m_pf3VertexP[i][0], m_pf3VertexP[i][1], m_pf3VertexP[i][2]);
+        OutVertex(&ob, m_pf3VertexP[i]);
     }
     for (i=0;i<m_nNumFaceP;i++)
     {
-        fprintf(fp,"3 %d %d %d\n", m_pn3FaceP[i][0], m_pn3FaceP[i][1], m_pn3FaceP[i][2]);
+        OutFace(&ob, "3 ", m_pn3FaceP[i], 0);
     }
+    OutClose(&ob);
 }
 
-void SavePLY(FILE * fp)
+void CDenoiser::SavePLY(FILE * fp)
 {
     int i;
+    struct OutBuffer ob;
 
     fprintf(fp,"ply\n");
-    fprintf(fp,"format ascii 1.0\n");
+    if (m_nOutFormat==PLY_BLITTLE)
+        fprintf(fp,"format binary_little_endian 1.0\n");
+    else
+        fprintf(fp,"format ascii 1.0\n");
     fprintf(fp,"comment The denoised result.\n");
     fprintf(fp,"element vertex %d\n", m_nNumVertexP);
     fprintf(fp,"property float x\n");
@@ -2224,80 +8262,167 @@ void SavePLY(FILE * fp)
     fprintf(fp,"property list uchar int vertex_indices\n");
     fprintf(fp,"end_header\n");
 
+    OutOpen(&ob, fp, m_nPrecision);
+    if (m_nOutFormat==PLY_BLITTLE)
+    {
+        unsigned char nCount = 3;
+        OutWords(&ob, m_pf3VertexP, 3*(size_t)m_nNumVertexP);
+        for (i=0;i<m_nNumFaceP;i++)
+        {
+            OutBytes(&ob, &nCount, 1);
+            OutWords(&ob, m_pn3FaceP[i], 3);
+        }
+        OutClose(&ob);
+        return;
+    }
     for (i=0;i<m_nNumVertexP;i++)
     {
-        fprintf(fp,"%f %f %f\n", m_pf3VertexP[i][0], m_pf3VertexP[i][1], m_pf3VertexP[i][2]);
+        OutVertex(&ob, m_pf3VertexP[i]);
     }
     for (i=0;i<m_nNumFaceP;i++)
     {
-        fprintf(fp,"3 %d %d %d\n", m_pn3FaceP[i][0], m_pn3FaceP[i][1], m_pn3FaceP[i][2]);
+        OutFace(&ob, "3 ", m_pn3FaceP[i], 0);
     }
+    OutClose(&ob);
 }
 
-void SavePLY2(FILE * fp)
+void CDenoiser::SavePLY2(FILE * fp)
 {
     int i;
+    struct OutBuffer ob;
 
     fprintf(fp,"%d\n",m_nNumVertexP);
     fprintf(fp,"%d\n",m_nNumFaceP);
 
+    OutOpen(&ob, fp, m_nPrecision);
     for (i=0;i<m_nNumVertexP;i++)
     {
-        fprintf(fp,"%f %f %f\n", m_pf3VertexP[i][0], m_pf3VertexP[i][1], m_pf3VertexP[i][2]);
+        OutVertex(&ob, m_pf3VertexP[i]);
+    }
+    for (i=0;i<m_nNumFaceP;i++)
+    {
+        OutFace(&ob, "3 ", m_pn3FaceP[i], 0);
+    }
+    OutClose(&ob);
+}
+
+void CDenoiser::SaveSTL(FILE * fp)
+{
+    int i, j;
+    struct OutBuffer ob;
+    FVECTOR3 vect[3];
+    char szHeader[80];
+    unsigned char pnAttr[2] = {0, 0};
+
+    OutOpen(&ob, fp, m_nPrecision);
+    if (m_nOutFormat!=PLY_BLITTLE)
+        OutText(&ob, "solid mdenoise\n");
+    else
+    {
+        memset(szHeader, 0, sizeof(szHeader));
+        strcpy(szHeader, "binary STL: the denoised result.");
+        OutBytes(&ob, szHeader, sizeof(szHeader));
+        OutWords(&ob, &m_nNumFaceP, 1);
     }
     for (i=0;i<m_nNumFaceP;i++)
     {
-        fprintf(fp,"3 %d %d %d\n", m_pn3FaceP[i][0], m_pn3FaceP[i][1], m_pn3FaceP[i][2]);
+        VEC3_V_OP_V(vect[0],m_pf3VertexP[m_pn3FaceP[i][1]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
+        VEC3_V_OP_V(vect[1],m_pf3VertexP[m_pn3FaceP[i][2]],-,m_pf3VertexP[m_pn3FaceP[i][0]]);
+        CROSSPROD3(vect[2],vect[0],vect[1]);
+        V3Normalize(vect[2]);
+        if (m_nOutFormat==PLY_BLITTLE)
+        {
+            OutWords(&ob, vect[2], 3);
+            for (j=0;j<3;j++)
+                OutWords(&ob, m_pf3VertexP[m_pn3FaceP[i][j]], 3);
+            OutBytes(&ob, pnAttr, 2);
+            continue;
+        }
+        OutText(&ob, "facet normal ");
+        OutVertex(&ob, vect[2]);
+        OutText(&ob, "outer loop\n");
+        for (j=0;j<3;j++)
+        {
+            OutText(&ob, "vertex ");
+            OutVertex(&ob, m_pf3VertexP[m_pn3FaceP[i][j]]);
+        }
+        OutText(&ob, "endloop\nendfacet\n");
     }
+    if (m_nOutFormat!=PLY_BLITTLE)
+        OutText(&ob, "endsolid mdenoise\n");
+    OutClose(&ob);
 }
 
-void SaveXYZ(FILE * fp)
+void CDenoiser::SaveXYZ(FILE * fp)
 {
     int i;
+    struct OutBuffer ob;
     //fprintf(fp,"%d\n",m_nNumVertexP);
 
+    OutOpen(&ob, fp, m_nPrecision);
     for (i=0;i<m_nNumVertexP;i++)
     {
-        fprintf(fp,"%f %f %f\n", m_pf3VertexP[i][0], m_pf3VertexP[i][1], m_pf3VertexP[i][2]);
+        OutVertex(&ob, m_pf3VertexP[i]);
     }
+    OutClose(&ob);
 }
 
-void SaveESRI(FILE * fp, ESRIHeader* header)
+void CDenoiser::SaveESRI(FILE * fp, ESRIHeader* header)
+{
+    SaveESRIHeader(fp, header);
+    SaveESRIRows(fp, header, 0, header->nrows);
+}
+
+void CDenoiser::SaveESRIHeader(FILE * fp, ESRIHeader* header)
 {
-    int i,j,k,nTotal;
     fprintf(fp,"ncols          %d\n",header->ncols);
     fprintf(fp,"nrows          %d\n",header->nrows);
     fprintf(fp,"xllcorner      %lf\n",header->xllcorner);
     fprintf(fp,"yllcorner      %lf\n",header->yllcorner);
     fprintf(fp,"cellsize       %lf\n",header->cellsize);
+	if(header->isnodata)
+		fprintf(fp,"NODATA_value   %lf\n",header->nodata_value);
+}
 
+// Writes rows nFirst to nLast-1 of the grid described by header, columns
+// nFirstCol to nLastCol-1 of them (-1: to the last one).
+void CDenoiser::SaveESRIRows(FILE * fp, ESRIHeader* header, int nFirst, int nLast, int nFirstCol, int nLastCol)
+{
+    int i,j,k,nTotal;
+    struct OutBuffer ob;
+
+	if (nLastCol<0)
+		nLastCol = header->ncols;
 	nTotal = header->nrows*header->ncols;
+	OutOpen(&ob, fp, m_nPrecision);
 	if(header->isnodata){
-		fprintf(fp,"NODATA_value   %lf\n",header->nodata_value);
-		for(i=0;i<header->nrows;i++)
+		for(i=nFirst;i<nLast;i++)
 		{
-			for(j=0;j<header->ncols;j++){
+			for(j=nFirstCol;j<nLastCol;j++){
 				k = j+i*header->ncols;
 				k = header->index[k];
 				if(k==nTotal){
-					fprintf(fp,"%lf ", header->nodata_value);
+					OutNumber(&ob, header->nodata_value);
 				}else{
-					fprintf(fp,"%lf ", m_pf3VertexP[k][2]);
+					OutNumber(&ob, m_pf3VertexP[k][2]);
 				}
+				OutText(&ob, " ");
 			}
-			fprintf(fp,"\n");
+			OutText(&ob, "\n");
 		}
 	}
 	else{
-		for(i=0;i<header->nrows;i++)
+		for(i=nFirst;i<nLast;i++)
 		{
-			for(j=0;j<header->ncols;j++){
+			for(j=nFirstCol;j<nLastCol;j++){
 				k = j+i*header->ncols;
-				fprintf(fp,"%lf ", m_pf3VertexP[k][2]);
+				OutNumber(&ob, m_pf3VertexP[k][2]);
+				OutText(&ob, " ");
 			}
-			fprintf(fp,"\n");
+			OutText(&ob, "\n");
 		}
 	}
+	OutClose(&ob);
 }
 
 void options(char *progname)
@@ -2310,9 +8435,75 @@ void options(char *progname)
     printf("     -o char[]  Output file\n");
     printf("     -a         Adds edges and vertices to generate high-quality triangle mesh\n");
     printf("                Only functions when the input is .xyz file\n");
-    printf("     -z         Only z-direction position is updated\n\n");
+    printf("     -y int     Tiles per side: .xyz points are triangulated as int x int tiles in parallel,\n");
+    printf("                each with a border of neighbouring points (Default: 1, in one piece)\n");
+    printf("     -z         Only z-direction position is updated\n");
+    printf("     -c float   Normal updating stops when no face normal turns by more than this many\n");
+    printf("                degrees in an iteration (Default: all iterations are run)\n");
+    printf("     -d float   Vertex updating stops when no vertex moves by more than this distance\n");
+    printf("                in an iteration (Default: all iterations are run)\n");
+    printf("     -w a[,d]   Worklist mode: a face normal is filtered again only while a neighbour\n");
+    printf("                turns by more than a degrees, and a vertex is moved again only while a\n");
+    printf("                neighbour moves by more than d (Default: all elements, every iteration)\n");
+    printf("     -m int     Multiresolution: the normals are first filtered on int coarser models,\n");
+    printf("                each clustering the vertices of the last in cubes of twice its mean\n");
+    printf("                edge length; a finer level runs a quarter of the n1 passes from the\n");
+    printf("                normals of the coarser one (Default: 0, the model only)\n");
+    printf("     -l char[]  Previous output: incremental mode, only the vertices within n1+n2+2 rings\n");
+    printf("                of the changed ones are computed again. Changed are the vertices in the\n");
+    printf("                -k box and, for .asc files, the points whose nodata state differs\n");
+    printf("     -k list    Box of the changed vertices, xmin,ymin,xmax,ymax[,zmin,zmax]; map\n");
+    printf("                coordinates of the cell centres for .asc files\n");
+    printf("     -u         Vertices are updated simultaneously (Jacobi), which gives the same\n");
+    printf("                result for any number of threads (Default: in place, Gauss-Seidel)\n");
+    printf("     -s         Structure-of-arrays layout with SIMD kernels chosen for the CPU\n");
+    printf("                (AVX2, NEON); vertex updating uses them together with -u\n");
+    printf("     -r         Reorders vertices and faces along a Morton curve for cache locality;\n");
+    printf("                the output keeps the input order\n");
+    printf("     -b int     Rows per band: .asc grids are read, denoised and written band by\n");
+    printf("                band, each with a halo of n1+n2+2 rows; the next band is read\n");
+    printf("                and the last written while one is denoised (Default: whole grid)\n");
+    printf("     -g         Implicit grid engine for .asc files: only heights, nodata flags and\n");
+    printf("                cell diagonals are stored, neighbourhoods follow from (row, col)\n");
+    printf("     -q         Compact storage for the grid engine, implies -g: face normals are kept\n");
+    printf("                in a 2x16-bit octahedral encoding, a third of their float size\n");
+    printf("     -x         GPU backend (builds with MDENOISE_OPENCL): all normal and vertex passes\n");
+    printf("                run on the device, the vertices updated simultaneously as with -u\n");
+    printf("     -h         Huge pages for the vertex, face, normal and ring buffers of a job,\n");
+    printf("                which are carved from one block sized from the model (Default: off)\n");
+    printf("     -j int     Number of worker threads, Default value: 1\n");
+    printf("     -p int     Decimals of the output coordinates, Default value: 6; a negative value\n");
+    printf("                writes the shortest decimals that read back to the same number\n");
+    printf("     -f char[]  Output format, ascii or binary (little-endian .ply, .stl). Default: binary\n");
+    printf("                for .stl files, ascii for the others\n");
+    printf("     --cache    Binary cache: the scaled model, its normals and neighbourhoods are saved as\n");
+    printf("                <input>.mdc and mapped by later runs on the same input and options\n");
+    printf("     --cache-dir char[]\n");
+    printf("                Directory of the cache files, implies --cache (Default: next to the input)\n");
+    printf("     --stats char[]\n");
+    printf("                Run report: wall and CPU seconds and peak memory of each phase, mesh\n");
+    printf("                counts, ring sizes, iterations and bytes read and written, as JSON\n");
+    printf("     --mosaic files\n");
+    printf("                Mosaic of .asc tiles, given as with --batch: each grid is denoised\n");
+    printf("                with a halo of n1+n2+2 cells read from the tiles around it, and its\n");
+    printf("                own cells written, so that the tiles match along their edges up to\n");
+    printf("                the rounding of their own scaling\n");
+    printf("     --batch files\n");
+    printf("                Batch mode: the files, the files matching a quoted pattern such as\n");
+    printf("                \"*.asc\", or the files listed one per line in @list are denoised\n");
+    printf("                once each; one tile is read while the last is filtered and the one\n");
+    printf("                before it written. Output names are as without -o; a pattern skips\n");
+    printf("                files named as outputs, such as <name>_V_0.40_20_50.asc\n");
+    printf("     --out-dir char[]\n");
+    printf("                Directory of the batch outputs (Default: next to each input)\n");
+    printf("     --bench list\n");
+    printf("                Benchmark: synthetic noisy meshes and grids of about this many faces are\n");
+    printf("                written, read, denoised and saved, timing each phase on the wall clock\n");
+    printf("                with its faces per second; no input file is needed\n");
+    printf("     Lists of up to 16 values such as -t 0.3,0.4 -n 5,10,20 run a parameter sweep: the model\n");
+    printf("     is read once and each combination is saved as <output>_V_0.40_20_50 and so on\n\n");
     printf("Supported input type: .gts, .obj, .off, .ply, .ply2, .smf, .stl, .wrl, .xyz, and .asc\n");
-    printf("Supported output type: .obj, .off, .ply, .ply2, .xyz, and .asc\n");
+    printf("Supported output type: .obj, .off, .ply, .ply2, .stl, .xyz, and .asc\n");
     printf("Default file extension: .off\n\n");
     printf("Examples:\n");
     printf("%s -i cylinderN02.ply2\n",progname);
@@ -2321,6 +8512,10 @@ void options(char *progname)
     printf("%s -i FandiskNI02-05 -o FandiskDN.ply\n",progname);
     printf("%s -i Terrain.xyz -o TerrainP -z -n 1\n",progname);
     printf("%s -i my_dem_utm.asc -o my_dem_utmP -n 4\n",progname);
+    printf("%s -i FandiskNI02-05 -t 0.3,0.5 -n 5,10,20 -o FandiskDN\n",progname);
+    printf("%s --batch \"*.asc\" --out-dir denoised -n 4 -j 8\n",progname);
+    printf("%s -i my_dem_utm.asc -o my_dem_utmP -n 20 -m 2 -u\n",progname);
+    printf("%s --bench 1000000,10000000 -j 8\n",progname);
 
    exit(-1);
 }
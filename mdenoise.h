@@ -27,46 +27,20 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <functional>
+#include <vector>
+#include <thread>
 #include "defs.h"
 
-// Original Mesh 
-int			m_nNumVertex;
-int			m_nNumFace;
-FVECTOR3*	m_pf3Vertex;
-NVECTOR3*	m_pn3Face;
-FVECTOR3*	m_pf3FaceNormal;
-FVECTOR3*	m_pf3VertexNormal;
-int**		m_ppnVRing1V; //1-Ring neighbouring vertices of each vertex  
-int**		m_ppnVRing1T; //1-Ring neighbouring triangles of each vertex 
-int**		m_ppnTRing1TCV; //1-Ring neighbouring triangles with common vertex of each triangle 
-int**		m_ppnTRing1TCE; //1-Ring neighbouring triangles with common edge of each triangle 
-
-//Scale parameter
-float		m_fScale;
-float		m_f3Centre[3];
-
-// Produced Mesh 
-int			m_nNumVertexP;
-int			m_nNumFaceP;
-FVECTOR3*	m_pf3VertexP;
-NVECTOR3*	m_pn3FaceP;
-FVECTOR3*	m_pf3FaceNormalP;
-FVECTOR3*	m_pf3VertexNormalP;
-
-//Operation Parameters
-bool m_bNeighbourCV;
-float m_fSigma;
-int m_nIterations;
-int m_nVIterations;
-
-//Add vertices in triangulation 
-bool m_bAddVertices;
-//Only z-direction position is updated
-bool m_bZOnly;
-
 //lowercase comparison of strings
 int strcicmp(const char *string1, const char *string2);
 
+//comma separated option values of a parameter sweep
+#define SWEEP_MAX 16          /* values per option */
+int ScanList(const char* pszList, float* pfValue, int nMax);
+int ScanList(const char* pszList, int* pnValue, int nMax);
+void WarnList(const char* pszOption, const char* pszList, int nNum, int nMax);
+
 // Header file for ESRI
 struct ESRIHeader {
   int ncols;                  /* number of columns */
@@ -76,46 +50,467 @@ struct ESRIHeader {
   double cellsize;            /* length of one side of a square cell */
   double nodata_value;        /* value for missing data */
   bool isnodata;              /* the header has nodata_value line */
+  int nfirst;                 /* number of grid values read with the header */
+  double first[2];            /* grid values read with the header */
   int * index;
 };
 
 
-// File Operations
+// Worker Threads
+void RunParallel(int nThreads, int nBegin, int nEnd, const std::function<void(int, int)>& func);
+
+// Per-job Arena: the buffers of a job are carved from one block, each
+// aligned to ARENA_ALIGN bytes, and the block is released in one go. A buffer
+// that does not fit comes from MyMalloc, and ArenaFree frees only those.
+#define ARENA_ALIGN		64
+#define ARENA_HUGE_PAGE	(2*1024*1024)
+struct Arena {
+  char* pBase;                /* the block, NULL before ArenaInit */
+  size_t nSize;               /* bytes in the block */
+  size_t nUsed;               /* bytes handed out */
+  bool bMapped;               /* the block was mapped with mmap */
+};
+void ArenaInit(struct Arena* arena, size_t nSize, bool bHuge);
+void* ArenaAlloc(struct Arena* arena, size_t nSize);
+void ArenaFree(struct Arena* arena, void* p);
+void ArenaRelease(struct Arena* arena);
+
+// Binary Cache: the scaled model, its normals, the ESRI index and the edges and
+// rings of a run, each section aligned to ARENA_ALIGN bytes, so that a later
+// run maps the file read-only as the arena of its job. A section of 0 bytes
+// is not stored. Each section has a checksum, so that a damaged one is found
+// before it is used.
+#define CACHE_MAGIC		"MDNCACHE"
+#define CACHE_VERSION	2
+#define CACHE_SECTIONS	19
+#define CACHE_REORDER	1	/* -r */
+#define CACHE_ADDVERTICES	2	/* -a */
+struct CacheHeader {
+  char szMagic[8];            /* CACHE_MAGIC */
+  int nVersion;               /* CACHE_VERSION */
+  int nByteOrder;             /* 0x01020304 as written */
+  long long nInputSize;       /* size of the input file */
+  long long nInputTime;       /* modification time of the input file */
+  int nFileType;              /* FILE_OFF, ... */
+  int nOptions;               /* CACHE_REORDER, CACHE_ADDVERTICES */
+  int nTiles;                 /* -y, for .xyz files */
+  int nNumVertex;
+  int nNumFace;
+  int nNumEdge;
+  int nNumBoundaryEdge;
+  int nNumNonManifoldEdge;
+  float fScale;
+  float f3Centre[3];
+  struct ESRIHeader esri;     /* for .asc files, without index */
+  long long pnSection[CACHE_SECTIONS][2]; /* offset and bytes of each section */
+  unsigned long long pnChecksum[CACHE_SECTIONS]; /* CacheChecksum of each section */
+};
+
+// Bulk Text Input
+#define TEXT_BLOCK (1<<24)    /* bytes read at a time */
+#define IS_SEPARATOR(c) (((c)==' ')||((c)=='\n')||((c)=='\r')||((c)=='\t')||((c)==',')||((c)=='\v')||((c)=='\f'))
+struct TextBuffer {
+  FILE* fp;
+  char* pBuf;
+  size_t nSize;               /* size of pBuf */
+  size_t nPos;                /* first byte not used yet */
+  size_t nLen;                /* bytes in pBuf */
+  bool bEOF;                  /* the file has been read to the end */
+  int nFills;                 /* blocks read so far */
+  char* pAhead;               /* the next block, read by pReader while pBuf is parsed */
+  size_t nAheadPos;           /* first byte of pAhead not taken yet */
+  size_t nAheadLen;           /* bytes in pAhead */
+  bool bAheadEOF;             /* pAhead holds the end of the file */
+  std::thread* pReader;
+};
+// nDouble doubles, then nFloat floats, then nInt groups of nIntGroup integers
+// whose first one (the vertex count of a face) is not stored.
+struct NumberBlock {
+  int nDouble;
+  double* pdDouble;
+  int nFloat;
+  float* pfFloat;
+  int nInt;
+  int* pnInt;
+  int nIntGroup;
+};
+void TextOpen(struct TextBuffer* tb, FILE* fp);
+void TextClose(struct TextBuffer* tb);
+void TextFill(struct TextBuffer* tb);
+bool TextGetLine(struct TextBuffer* tb, const char** ppLine, const char** ppEnd);
+const char* ScanNumber(const char* p, const char* pEnd, double* v);
+const char* ScanNumber(const char* p, const char* pEnd, float* v);
+const char* ScanNumber(const char* p, const char* pEnd, int* v);
+bool ParseNumberBlock(const char* p, const char* pEnd, struct NumberBlock* nb, int nFirst, int* pnNum, const char** ppLast);
+bool ParseNumberChunks(const char* p, const char* pEnd, struct NumberBlock* nb, int nFirst, int nThreads, int* pnNum, const char** ppLast);
+int TextReadNumbers(struct TextBuffer* tb, struct NumberBlock* nb, int nThreads);
+int ParseXYZLines(const char* p, const char* pEnd, FVECTOR3* pf3Vertex);
+int TextReadXYZ(struct TextBuffer* tb, FVECTOR3** ppf3Vertex, int nThreads);
+
+// Partitioned triangulation of .xyz points
+#define TILE_HALO 8           /* border first put around a tile, in mean point spacings */
+
+// Buffered Text Output
+#define OUT_BLOCK (1<<20)     /* bytes written at a time */
+#define OUT_SLACK 1024        /* room for one number or string past OUT_BLOCK */
+struct OutBuffer {
+  FILE* fp;
+  char* pBuf;
+  size_t nLen;                /* bytes in pBuf */
+  int nPrecision;             /* decimals of the numbers, negative for the shortest */
+  char* pBack;                /* the last full block, written by pWriter while pBuf is filled */
+  std::thread* pWriter;
+};
+void OutOpen(struct OutBuffer* ob, FILE* fp, int nPrecision);
+void OutFlush(struct OutBuffer* ob);
+void OutClose(struct OutBuffer* ob);
+void OutNumber(struct OutBuffer* ob, double v);
+void OutNumber(struct OutBuffer* ob, float v);
+void OutNumber(struct OutBuffer* ob, int v);
+void OutText(struct OutBuffer* ob, const char* s);
+void OutBytes(struct OutBuffer* ob, const void* p, size_t n);
+void OutWords(struct OutBuffer* ob, const void* p, size_t nWords);
+void OutVertex(struct OutBuffer* ob, FVECTOR3 v);
+void OutFace(struct OutBuffer* ob, const char* pszPrefix, NVECTOR3 f, int nBase);
+
+// Implicit grid model: the point (i,j) of the grid is (pfX[i], pfY[j], pfZ[k])
+// with k = j+i*ncols. Face s of the cell with top-left point k is 2*k+s.
+struct GridModel {
+  int nrows;
+  int ncols;
+  float* pfX;                 /* scaled x of each row */
+  float* pfY;                 /* scaled y of each column */
+  float* pfZ;                 /* scaled heights */
+  unsigned char* pnFlag;      /* GRID_NODATA of each point, GRID_DIAG of each cell */
+  void* pNormal;              /* face normals: a FVECTOR3 each, or two shorts each in */
+                              /* octahedral encoding with compact storage (-q) */
+  float* pfZ0;                /* heights as built, kept for a parameter sweep */
+};
+
+// File Types
 int FindInputExt(char* pPath);
 int FindOutputExt(char* pPath);
 
-int ReadData(FILE * fp, int nfileext, struct ESRIHeader* header);
-void ReadGTS(FILE* fp);
-void ReadOBJ(FILE* fp);
-void ReadOFF(FILE* fp);
-void ReadPLY(FILE* fp);
-void ReadPLY2(FILE* fp);
-void ReadSMF(FILE* fp);
-void ReadSTL(FILE* fp);
-void ReadWRL(FILE* fp);
-void ReadXYZ(FILE* fp);
-void ReadESRI(FILE* fp, struct ESRIHeader* header);
-
-void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header);
-void SaveOBJ(FILE * fp);
-void SaveOFF(FILE * fp);
-void SavePLY(FILE * fp);
-void SavePLY2(FILE * fp);
-void SaveXYZ(FILE * fp);
-void SaveESRI(FILE * fp, struct ESRIHeader* header);
-
-// Preprocessing Operations
-void ScalingBox(void);
+// Preprocessing Helpers
+unsigned long long MortonCode(FVECTOR3 v);
+void PermuteArray(void* pData, size_t nSize, int* pnOrder, int nNum);
 void V3Normalize(FVECTOR3 v);
-void ComputeNormal(bool bProduced);
-void ComputeVRing1V(void);
-void ComputeVRing1T(void);
-void ComputeTRing1TCV(void);
-void ComputeTRing1TCE(void);
-
-// Main Operations
-void MeshDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations);
-void VertexUpdate(int** tRing, int nVIterations);
+void OctEncode(const FVECTOR3 v, short* pnOct);
+void OctDecode(const short* pnOct, FVECTOR3 v);
+void RingAllocIndex(struct RingList* ring, int nNum, struct Arena* arena = NULL);
+void FreeRing(struct RingList* ring, struct Arena* arena = NULL);
+int NextWorklist(struct RingList* ring, int* pnList, int nList, const unsigned char* pnChanged, unsigned char* pnQueued, int* pnNext);
+
+// Structure-of-arrays Kernels
+typedef void (*NORMALKERNEL)(struct RingList* ring, float* const pfIn[3], float fSigma, float* const pfOut[3], int nFrom, int nTo);
+typedef void (*VERTEXKERNEL)(struct RingList* tRing, NVECTOR3* pn3Face, float* const pfNormal[3], float* const pfIn[3], float* const pfOut[3], bool bZOnly, int nFrom, int nTo);
+const char* SelectKernels(void);
+void NormalKernelScalar(struct RingList* ring, float* const pfIn[3], float fSigma, float* const pfOut[3], int nFrom, int nTo);
+void VertexKernelScalar(struct RingList* tRing, NVECTOR3* pn3Face, float* const pfNormal[3], float* const pfIn[3], float* const pfOut[3], bool bZOnly, int nFrom, int nTo);
+
+// OpenCL Backend, built with MDENOISE_OPENCL
+struct GpuContext;
+void GpuClose(struct GpuContext* gpu);
+void GpuRelease(struct GpuContext* gpu);
+
+// Parameters of the in-memory entry points of CDenoiser
+struct DenoiseParams {
+  bool bNeighbourCV;          /* common vertex (TRUE) or common edge neighbourhood */
+  float fSigma;               /* threshold, within (0,1) */
+  int nIterations;            /* iterations for normal updating */
+  int nVIterations;           /* iterations for vertex updating */
+  bool bZOnly;                /* only the z-direction position is updated */
+  bool bJacobi;               /* vertices are updated simultaneously */
+  bool bSoA;                  /* structure-of-arrays layout with SIMD kernels */
+  int nThreads;               /* worker threads */
+  float fNormalTol;           /* normal updating stops when no normal turns more (degrees), negative: off */
+  float fVertexTol;           /* vertex updating stops when no vertex moves more, negative: off */
+  float fWorkNormalTol;       /* worklist normal filtering, see CDenoiser::m_fWorkNormalTol */
+  float fWorkVertexTol;       /* worklist vertex updating, see CDenoiser::m_fWorkVertexTol */
+  bool bHugePages;            /* the arena of the job is mapped with huge pages */
+  bool bCompact;              /* grid engine face normals in 2x16-bit octahedral encoding */
+  bool bGpu;                  /* normal and vertex passes on an OpenCL GPU (MDENOISE_OPENCL) */
+  int nLevels;                /* coarser models that start the normal filter, see CDenoiser::m_nLevels */
+
+  DenoiseParams() : bNeighbourCV(TRUE), fSigma(0.4f), nIterations(20), nVIterations(50),
+    bZOnly(FALSE), bJacobi(FALSE), bSoA(FALSE), nThreads(1), fNormalTol(-1), fVertexTol(-1),
+    fWorkNormalTol(-1), fWorkVertexTol(-1), bHugePages(FALSE),
+    bCompact(FALSE), bGpu(FALSE), nLevels(0) {}
+};
+
+// The state of one denoising job. Separate objects may be used on different
+// threads at the same time; the command line program uses one of them.
+class CDenoiser
+{
+public:
+    CDenoiser();
+    ~CDenoiser();
+
+    // In-memory entry points: the caller's arrays are used as the model and
+    // the denoised positions are written back to them.
+    int Denoise(FVECTOR3* pf3Vertex, int nNumVertex, NVECTOR3* pn3Face, int nNumFace, const DenoiseParams& params);
+    int DenoiseGrid(double* pdValue, struct ESRIHeader* header, const DenoiseParams& params);
+    void SetParams(const DenoiseParams& params);
+
+    // Original Mesh
+    int			m_nNumVertex;
+    int			m_nNumFace;
+    FVECTOR3*	m_pf3Vertex;
+    NVECTOR3*	m_pn3Face;
+    FVECTOR3*	m_pf3FaceNormal;
+    FVECTOR3*	m_pf3VertexNormal;
+    RingList	m_VRing1V; //1-Ring neighbouring vertices of each vertex
+    RingList	m_VRing1T; //1-Ring neighbouring triangles of each vertex
+    RingList	m_TRing1TCV; //1-Ring neighbouring triangles with common vertex of each triangle
+    RingList	m_TRing1TCE; //1-Ring neighbouring triangles with common edge of each triangle
+    int			m_nNumEdge;
+    int			m_nNumBoundaryEdge; //edges of one triangle
+    int			m_nNumNonManifoldEdge; //edges of more than two triangles
+    int*		m_pnEdgeVertex; //the two vertices of each edge, lower index first
+    NVECTOR3*	m_pn3FaceEdge; //edge j of a triangle joins its vertices j and (j+1)%3
+    RingList	m_EdgeT; //triangles of each edge, in ascending order
+    int			m_nModelAlloc; //MODEL_NEW, MODEL_MALLOC, MODEL_CALLER or MODEL_ARENA
+
+    //Scale parameter
+    float		m_fScale;
+    float		m_f3Centre[3];
+
+    // Produced Mesh
+    int			m_nNumVertexP;
+    int			m_nNumFaceP;
+    FVECTOR3*	m_pf3VertexP;
+    NVECTOR3*	m_pn3FaceP;
+    FVECTOR3*	m_pf3FaceNormalP;
+    FVECTOR3*	m_pf3VertexNormalP;
+
+    //Operation Parameters
+    bool m_bNeighbourCV;
+    float m_fSigma;
+    int m_nIterations;
+    int m_nVIterations;
+
+    //Add vertices in triangulation
+    bool m_bAddVertices;
+    //Tiles per side for triangulating .xyz points in parallel (1: whole cloud)
+    int m_nTiles;
+    //Only z-direction position is updated
+    bool m_bZOnly;
+    //Vertices are updated from the positions of the previous iteration (Jacobi)
+    bool m_bJacobi;
+
+    //Structure-of-arrays layout with SIMD kernels
+    bool m_bSoA;
+
+    //Vertices and faces are reordered for locality; original index of each element
+    bool m_bReorder;
+    int*		m_pnVertexOrder;
+    int*		m_pnFaceOrder;
+
+    //Rows per band for out-of-core processing of .asc grids (0: whole grid)
+    int m_nBandRows;
+
+    //Mosaic of .asc tiles: the tile is read with a halo of m_nMosaicHalo cells
+    //(0: n1+n2+2) from the tiles of m_vMosaic around it, whose malloc'd names
+    //the denoiser frees. m_Mosaic is that window, with the tile at row and
+    //column m_nMosaicHalo
+    std::vector<char*> m_vMosaic;
+    int m_nMosaicHalo;
+    struct ESRIHeader m_Mosaic;
+    int m_nMosaicTiles;         // tiles that gave halo cells
+
+    //Domain of this process in the MPI build (MDENOISE_MPI): grid rows
+    //m_nDomainFirst to m_nDomainLast-1, read in the window m_Domain from row
+    //m_nDomainWin with the ghost rows around them; the first vertex of each
+    //window row and the first face of each window cell row, and the ends
+    int m_nDomainFirst;
+    int m_nDomainLast;
+    int m_nDomainWin;
+    struct ESRIHeader m_Domain;
+    std::vector<int> m_vDomainVertex;
+    std::vector<int> m_vDomainFace;
+    //Called, when set, after each normal pass with the face normals and after
+    //each vertex pass with the positions, to bring the ghost elements up to date
+    std::function<void(FVECTOR3*)> m_fnFaceGhosts;
+    std::function<void(FVECTOR3*)> m_fnVertexGhosts;
+
+    //Implicit grid engine for .asc input
+    bool m_bGrid;
+    GridModel m_Grid;
+    //Compact grid storage: face normals in 2x16-bit octahedral encoding
+    bool m_bCompact;
+
+    //Number of worker threads
+    int m_nThreads;
+
+    //OpenCL backend for the normal and vertex passes of the mesh
+    bool m_bGpu;
+    struct GpuContext* m_pGpu;
+
+    //Vertex, face, normal and ring buffers of the job, sized from the counts
+    //by ReserveArena and released by FreeModel
+    Arena m_Arena;
+    bool m_bHugePages;
+    //The arena block is kept by FreeModel and used again by the next model that fits
+    bool m_bKeepArena;
+    //Sections read from the binary cache, one bit each, 0 when the model was read from the input
+    unsigned int m_nCacheSections;
+
+    //Decimals of the output coordinates, negative for the shortest round trip
+    int m_nPrecision;
+
+    //Output format: PLY_ASCII, PLY_BLITTLE (binary), or 0 for the default of the file type
+    int m_nOutFormat;
+
+    //Parameter sweep: the filtered normals of the last run are kept, and a
+    //run with the same neighbourhood and threshold continues from them
+    bool m_bKeepNormals;
+    FVECTOR3*	m_pf3KeptNormal;
+    bool m_bKeptCV;
+    float m_fKeptSigma;
+    int m_nKeptIterations;      // -1: nothing kept
+    bool m_bKeptConverged;
+    std::vector<float> m_vKeptResidual;
+
+    //Convergence tolerances, negative to run all iterations: the largest turn of a
+    //face normal in degrees, and the largest vertex move in model units, per iteration
+    float m_fNormalTol;
+    float m_fVertexTol;
+    //Iterations used by the last run and the residual of each, in the same units
+    int m_nNormalPasses;
+    int m_nVertexPasses;
+    bool m_bNormalConverged;
+    std::vector<float> m_vNormalResidual;
+    std::vector<float> m_vVertexResidual;
+
+    //Worklist mode, negative for off: an element is updated again only while a
+    //neighbour changes by more than these from one iteration to the next, a
+    //face normal in degrees and a vertex in model units
+    float m_fWorkNormalTol;
+    float m_fWorkVertexTol;
+    //Multiresolution, 0 for off: the face normals are first filtered on m_nLevels
+    //coarser models, each made by clustering the vertices of the one before, and
+    //a level then runs a quarter of the normal passes from the normals of the next
+    int m_nLevels;
+    //A coarse model of multiresolution, whose clusters may share an edge among
+    //more than two faces without a warning
+    bool m_bCoarseModel;
+    //Face and vertex updates done by the last run
+    long long m_nNormalUpdates;
+    long long m_nVertexUpdates;
+    //Wall-clock seconds of the ring builders, the normal filter and vertex updating in the last run
+    double m_dRingTime;
+    double m_dNormalTime;
+    double m_dVertexTime;
+
+    // Worker Threads
+    void ParallelFor(int nBegin, int nEnd, const std::function<void(int, int)>& func);
+    float ParallelMax(int nBegin, int nEnd, const std::function<float(int, int)>& func);
+
+    // File Operations
+    int ReadData(FILE * fp, int nfileext, struct ESRIHeader* header);
+    void ReadGTS(FILE* fp);
+    void ReadOBJ(FILE* fp);
+    void ReadOFF(FILE* fp);
+    void ReadPLY(FILE* fp);
+    void ReadPLY2(FILE* fp);
+    void ReadSMF(FILE* fp);
+    void ReadSTL(FILE* fp);
+    void ReadWRL(FILE* fp);
+    void ReadXYZ(FILE* fp);
+    bool TriangulateTiles(void);
+    void ReadESRI(FILE* fp, struct ESRIHeader* header);
+    void ReadESRIMosaic(FILE* fp, struct ESRIHeader* header);
+    bool MosaicCopy(FILE* fp, struct ESRIHeader* header, struct ESRIHeader* tile, double* pdWindow);
+    void ReadESRIHeader(FILE* fp, struct ESRIHeader* header);
+    void ReadESRIValues(FILE* fp, struct ESRIHeader* header, double* value, int nNum);
+    void BuildESRIMesh(struct ESRIHeader* header, double* value, int nRowOffset);
+    bool TextReadMesh(FILE* fp);
+    void InitModel(void);
+    void InitScaledModel(void);
+    void InitProducedModel(void);
+    void ReserveArena(void);
+    void FreeModel(void);
+    bool CacheKey(const char* pszInput, int nfileext, struct CacheHeader* ch);
+    void CacheSections(void** ppData[CACHE_SECTIONS], long long pnBytes[CACHE_SECTIONS], struct ESRIHeader* header);
+    bool ReadCache(const char* pszCache, const char* pszInput, int nfileext, struct ESRIHeader* header);
+    void SaveCache(const char* pszCache, const char* pszInput, int nfileext, struct ESRIHeader* header);
+
+    void SaveData(FILE * fp, int nfileext, struct ESRIHeader* header);
+    void SaveOBJ(FILE * fp);
+    void SaveOFF(FILE * fp);
+    void SavePLY(FILE * fp);
+    void SavePLY2(FILE * fp);
+    void SaveSTL(FILE * fp);
+    void SaveXYZ(FILE * fp);
+    void SaveESRI(FILE * fp, struct ESRIHeader* header);
+    void SaveESRIHeader(FILE * fp, struct ESRIHeader* header);
+    void SaveESRIRows(FILE * fp, struct ESRIHeader* header, int nFirst, int nLast, int nFirstCol = 0, int nLastCol = -1);
+    void DenoiseESRIBands(FILE* fpIn, FILE* fpOut, struct ESRIHeader* header);
+    int ReadESRIDomain(FILE* fp, struct ESRIHeader* header);
+    void DomainExchange(FVECTOR3* pf3, const std::vector<int>& vRow);
+    bool SaveESRIDomain(const char* pszOut, struct ESRIHeader* header);
+
+    // Implicit Grid Operations
+    void ReadGrid(FILE* fp, struct ESRIHeader* header);
+    void BuildGrid(struct ESRIHeader* header, double* value, int nRowOffset);
+    void FreeGrid(void);
+    int GridCellFaces(int c, NVECTOR3* pn3Tri);
+    int GridVertexFaces(int p, int* pnFace, NVECTOR3* pn3Point);
+    int GridFaceRing(NVECTOR3 pnTri, bool bNeighbourCV, int* pnRing);
+    void GridPoint(int p, const float* pfZ, FVECTOR3 v);
+    void GridGetNormal(const void* pNormal, int k, FVECTOR3 v);
+    void GridSetNormal(void* pNormal, int k, const FVECTOR3 v);
+    void GridForCells(const std::function<void(int)>& f);
+    void GridDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations);
+    void GridVertexUpdate(int nVIterations);
+    float GridVertexMove(int p, const float* pfZ);
+    void SaveGrid(FILE * fp, struct ESRIHeader* header);
+    void SaveGridRows(FILE * fp, struct ESRIHeader* header, int nFirst, int nLast, int nFirstCol = 0, int nLastCol = -1);
+
+    // Preprocessing Operations
+    void ScalingBox(void);
+    void ModelBox(float box[2][3]);
+    void ScaleToBox(float box[2][3]);
+    void ReorderMesh(void);
+    void RestoreOrder(void);
+    void ComputeNormal(bool bProduced);
+    void ComputeEdges(void);
+    void ComputeVRing1V(void);
+    void ComputeVRing1T(void);
+    void ComputeTRing1TCV(void);
+    void ComputeTRing1TCE(void);
+
+    // Incremental Operations
+    bool ReadPrevious(FILE* fp, int nfileext, struct ESRIHeader* header, FVECTOR3* pf3Prev, unsigned char* pnSeed);
+    void SeedBox(const float* pfBox, int nBox, int nfileext, struct ESRIHeader* header, unsigned char* pnSeed);
+    int DenoiseRegion(const unsigned char* pnSeed, FVECTOR3* pf3Prev, bool bNeighbourCV, float fSigma, int nIterations, int nVIterations);
+
+    // Main Operations
+    void MeshDenoise(bool bNeighbourCV, float fSigma, int nIterations, int nVIterations);
+    bool CoarseNormals(bool bNeighbourCV, float fSigma, int nIterations);
+    void VertexUpdate(struct RingList* tRing, int nVIterations);
+    template <bool ZONLY> void VertexMove(struct RingList* tRing, int i, FVECTOR3* pf3Vertex, FVECTOR3 f3Result);
+    template <bool ZONLY> float VertexPass(struct RingList* tRing, bool bMove);
+    void SoAFromAoS(float* const pf[3], FVECTOR3* pf3, int nNum);
+    void SoAToAoS(float* const pf[3], FVECTOR3* pf3, int nNum);
+    void NormalFilterSoA(struct RingList* ttRing, float fSigma, int nIterations);
+    void VertexUpdateSoA(struct RingList* tRing, int nVIterations);
+    void FaceFilter(struct RingList* ttRing, FVECTOR3* TNormal, float fSigma, int k);
+    void NormalFilterActive(struct RingList* ttRing, float fSigma, int nIterations);
+    void VertexUpdateActive(struct RingList* tRing, int nVIterations);
+    bool GpuOpenModel(struct RingList* ttRing);
+    void GpuNormalFilter(float fSigma, int nIterations);
+    void GpuVertexUpdate(int nVIterations);
+
+    // Convergence
+    bool NormalConverged(float fMaxChange2);
+    bool VertexConverged(float fMaxMove2);
+    void ReportConvergence(void);
+};
+
+// Benchmark on synthetic models of the given numbers of faces
+double WallClock(void);
+void RunBenchmark(CDenoiser* denoiser, const int* pnFaces, int nSizes);
 
 // Command Line Options
 void options(char *progname);
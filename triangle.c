@@ -642,17 +642,28 @@ struct memorypool {
 
 
 /* Global constants.                                                         */
+/*                                                                           */
+/* They and the random number seed are kept per thread, so that separate     */
+/*   meshes can be triangulated on several threads at the same time.         */
+
+#if defined(__cplusplus) && (__cplusplus >= 201103L)
+#define TRITHREAD thread_local
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define TRITHREAD _Thread_local
+#else
+#define TRITHREAD
+#endif
 
-REAL splitter;       /* Used to split REAL factors for exact multiplication. */
-REAL epsilon;                             /* Floating-point machine epsilon. */
-REAL resulterrbound;
-REAL ccwerrboundA, ccwerrboundB, ccwerrboundC;
-REAL iccerrboundA, iccerrboundB, iccerrboundC;
-REAL o3derrboundA, o3derrboundB, o3derrboundC;
+TRITHREAD REAL splitter;       /* Used to split REAL factors for exact multiplication. */
+TRITHREAD REAL epsilon;                             /* Floating-point machine epsilon. */
+TRITHREAD REAL resulterrbound;
+TRITHREAD REAL ccwerrboundA, ccwerrboundB, ccwerrboundC;
+TRITHREAD REAL iccerrboundA, iccerrboundB, iccerrboundC;
+TRITHREAD REAL o3derrboundA, o3derrboundB, o3derrboundC;
 
 /* Random number seed is not constant, but I've made it global anyway.       */
 
-unsigned long randomseed;                     /* Current random number seed. */
+TRITHREAD unsigned long randomseed;                     /* Current random number seed. */
 
 
 /* Mesh data structure.  Triangle operates on only one mesh, but the mesh    */